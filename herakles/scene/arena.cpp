@@ -0,0 +1,66 @@
+/*
+ * Copyright 2017 Renato Utsch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "herakles/scene/arena.hpp"
+
+#include <algorithm>
+
+#include <glog/logging.h>
+
+namespace hk {
+
+void *Arena::allocateBlock(size_t size) {
+  const size_t numElements =
+      (size + sizeof(std::max_align_t) - 1) / sizeof(std::max_align_t);
+  // Not value-initialized, so that pages are only touched when used.
+  std::unique_ptr<std::max_align_t[]> block(new std::max_align_t[numElements]);
+  void *data = block.get();
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  blocks_.push_back(std::move(block));
+  bytesAllocated_ += numElements * sizeof(std::max_align_t);
+  return data;
+}
+
+size_t Arena::bytesAllocated() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return bytesAllocated_;
+}
+
+void Arena::clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  blocks_ = std::vector<std::unique_ptr<std::max_align_t[]>>();
+  bytesAllocated_ = 0;
+}
+
+void *ArenaAllocator::allocate(size_t size, size_t alignment) {
+  CHECK_EQ(alignment & (alignment - 1), 0u)
+      << "Alignment must be a power of two.";
+
+  uintptr_t begin = (current_ + alignment - 1) & ~(alignment - 1);
+  if (!current_ || begin + size > end_) {
+    // Requests bigger than a block get a block of their own.
+    const size_t blockSize = std::max(arena_.blockSize(), size + alignment);
+    current_ = reinterpret_cast<uintptr_t>(arena_.allocateBlock(blockSize));
+    end_ = current_ + blockSize;
+    begin = (current_ + alignment - 1) & ~(alignment - 1);
+  }
+
+  current_ = begin + size;
+  return reinterpret_cast<void *>(begin);
+}
+
+}  // namespace hk
@@ -0,0 +1,117 @@
+/*
+ * Copyright 2017 Renato Utsch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HERAKLES_HERAKLES_SCENE_ARENA_HPP
+#define HERAKLES_HERAKLES_SCENE_ARENA_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace hk {
+
+/**
+ * Memory arena shared by the threads of a build.
+ *
+ * Memory is handed out in big blocks to ArenaAllocators, which carve objects
+ * out of them without any locking. Nothing is freed until the arena is
+ * destroyed, so only trivially destructible objects can live in it.
+ */
+class Arena {
+ public:
+  /**
+   * Creates the arena.
+   * @param blockSize Size in bytes of the blocks handed out to allocators.
+   */
+  explicit Arena(size_t blockSize = 1 << 16) : blockSize_(blockSize) {}
+
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+
+  /// Returns the default size of the blocks.
+  size_t blockSize() const { return blockSize_; }
+
+  /**
+   * Returns a new block of at least the given size, aligned to
+   * alignof(std::max_align_t). Thread-safe.
+   */
+  void *allocateBlock(size_t size);
+
+  /// Returns the total size in bytes of the blocks allocated so far.
+  size_t bytesAllocated() const;
+
+  /// Frees every block. Objects allocated from the arena become invalid, and
+  /// so do its allocators, which have to be recreated to reuse the arena.
+  void clear();
+
+ private:
+  const size_t blockSize_;
+
+  mutable std::mutex mutex_;
+  std::vector<std::unique_ptr<std::max_align_t[]>> blocks_;
+  size_t bytesAllocated_ = 0;
+};
+
+/**
+ * Allocates objects from the blocks of an Arena.
+ * Not thread-safe: each task allocating in parallel must use its own
+ * allocator. The unused end of the current block is wasted when the
+ * allocator is destroyed, so allocators should be long-lived.
+ */
+class ArenaAllocator {
+ public:
+  explicit ArenaAllocator(Arena &arena) : arena_(arena) {}
+
+  ArenaAllocator(const ArenaAllocator &) = delete;
+  ArenaAllocator &operator=(const ArenaAllocator &) = delete;
+
+  /// Returns the arena the memory comes from.
+  Arena &arena() const { return arena_; }
+
+  /// Returns uninitialized memory with the given size and alignment.
+  void *allocate(size_t size, size_t alignment);
+
+  /// Constructs an object in the arena.
+  template <typename T, typename... Args>
+  T *create(Args &&... args) {
+    static_assert(std::is_trivially_destructible<T>::value,
+                  "Objects in the arena are never destroyed.");
+    return new (allocate(sizeof(T), alignof(T)))
+        T(std::forward<Args>(args)...);
+  }
+
+  /// Returns an uninitialized array of n elements in the arena.
+  template <typename T>
+  T *allocateArray(size_t n) {
+    static_assert(std::is_trivially_destructible<T>::value,
+                  "Objects in the arena are never destroyed.");
+    return static_cast<T *>(allocate(n * sizeof(T), alignof(T)));
+  }
+
+ private:
+  Arena &arena_;
+  uintptr_t current_ = 0;
+  uintptr_t end_ = 0;
+};
+
+}  // namespace hk
+
+#endif  // !HERAKLES_HERAKLES_SCENE_ARENA_HPP
@@ -0,0 +1,136 @@
+/*
+ * Copyright 2017 Renato Utsch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "herakles/scene/arena.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace {
+using ::hk::Arena;
+using ::hk::ArenaAllocator;
+
+/// Returns if any two of the [begin, end) ranges overlap.
+bool overlap(std::vector<std::pair<uintptr_t, uintptr_t>> ranges) {
+  std::sort(ranges.begin(), ranges.end());
+  for (size_t i = 1; i < ranges.size(); ++i) {
+    if (ranges[i].first < ranges[i - 1].second) return true;
+  }
+  return false;
+}
+
+TEST(ArenaTest, AlignsAllocations) {
+  Arena arena(256);
+  ArenaAllocator allocator(arena);
+  std::vector<std::pair<uintptr_t, uintptr_t>> ranges;
+  for (size_t i = 0; i < 200; ++i) {
+    const size_t alignment = size_t(1) << (i % 7);
+    const size_t size = 1 + i % 13;
+    const auto begin =
+        reinterpret_cast<uintptr_t>(allocator.allocate(size, alignment));
+    EXPECT_EQ(0u, begin % alignment) << "alignment " << alignment;
+    ranges.emplace_back(begin, begin + size);
+  }
+  EXPECT_FALSE(overlap(ranges));
+
+  const auto *value = allocator.create<double>(1.5);
+  EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(value) % alignof(double));
+  EXPECT_EQ(1.5, *value);
+}
+
+TEST(ArenaTest, RollsOverToNewBlocks) {
+  Arena arena(1024);
+  ArenaAllocator allocator(arena);
+  EXPECT_EQ(0u, arena.bytesAllocated());
+
+  // Allocations fill the current block before taking a new one.
+  const auto first = reinterpret_cast<uintptr_t>(allocator.allocate(512, 8));
+  const size_t oneBlock = arena.bytesAllocated();
+  EXPECT_GE(oneBlock, 1024u);
+  const auto second = reinterpret_cast<uintptr_t>(allocator.allocate(256, 8));
+  EXPECT_EQ(first + 512, second);
+  EXPECT_EQ(oneBlock, arena.bytesAllocated());
+
+  allocator.allocate(512, 8);
+  EXPECT_EQ(2 * oneBlock, arena.bytesAllocated());
+
+  // Requests bigger than a block get a block of their own.
+  auto *big = static_cast<char *>(allocator.allocate(10000, 64));
+  EXPECT_GE(arena.bytesAllocated(), 2 * oneBlock + 10000);
+  EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(big) % 64);
+  memset(big, 0xAB, 10000);
+}
+
+TEST(ArenaTest, ClearFreesTheBlocksForReuse) {
+  Arena arena(1024);
+  {
+    ArenaAllocator allocator(arena);
+    for (int i = 0; i < 10; ++i) allocator.allocateArray<int>(100);
+    EXPECT_GT(arena.bytesAllocated(), 0u);
+  }
+
+  arena.clear();
+  EXPECT_EQ(0u, arena.bytesAllocated());
+
+  ArenaAllocator allocator(arena);
+  int *values = allocator.allocateArray<int>(100);
+  for (int i = 0; i < 100; ++i) values[i] = i;
+  EXPECT_EQ(99, values[99]);
+  EXPECT_GE(arena.bytesAllocated(), 100 * sizeof(int));
+  EXPECT_LT(arena.bytesAllocated(), 2048u);
+}
+
+TEST(ArenaTest, AllocatorsOfDifferentThreadsDontOverlap) {
+  Arena arena(4096);
+  const int numThreads = 4;
+  const int numArrays = 1000;
+  std::vector<std::vector<std::pair<uintptr_t, uintptr_t>>> ranges(
+      numThreads);
+  std::vector<std::vector<int *>> arrays(numThreads);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < numThreads; ++t) {
+    threads.emplace_back([&, t]() {
+      ArenaAllocator allocator(arena);
+      for (int i = 0; i < numArrays; ++i) {
+        const size_t size = 1 + i % 17;
+        int *array = allocator.allocateArray<int>(size);
+        std::fill(array, array + size, t);
+        arrays[t].push_back(array);
+        const auto begin = reinterpret_cast<uintptr_t>(array);
+        ranges[t].emplace_back(begin, begin + size * sizeof(int));
+      }
+    });
+  }
+  for (auto &thread : threads) thread.join();
+
+  std::vector<std::pair<uintptr_t, uintptr_t>> allRanges;
+  for (int t = 0; t < numThreads; ++t) {
+    allRanges.insert(allRanges.end(), ranges[t].begin(), ranges[t].end());
+    for (int i = 0; i < numArrays; ++i) {
+      const size_t size = 1 + i % 17;
+      ASSERT_EQ(size_t(size),
+                size_t(std::count(arrays[t][i], arrays[t][i] + size, t)));
+    }
+  }
+  EXPECT_FALSE(overlap(allRanges));
+}
+
+}  // namespace
@@ -18,28 +18,146 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <deque>
+#include <functional>
+#include <limits>
 #include <memory>
-#include <stack>
-#include <tuple>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 
 #include <glog/logging.h>
 
+#include "herakles/scene/arena.hpp"
+#include "herakles/scene/morton.hpp"
+#include "herakles/scene/simd_bounds.hpp"
+#include "herakles/scene/task_pool.hpp"
+
 namespace {
+using hk::Arena;
+using hk::ArenaAllocator;
+using hk::BVHBuildMethod;
+using hk::BVHBuildOptions;
+using hk::BVHData;
 using hk::BVHNode;
+using hk::BVHNodeLayout;
+using hk::BVHSphereMeshID;
 using hk::BVHTriangle;
+using hk::BVHTriangleMeshIDMask;
+using hk::BVHTrianglePairBit;
+using hk::BVHTrianglePairShift;
 using hk::Bounds3f;
+using hk::MortonEncoder;
+using hk::SIMDBounds3f;
+using hk::SIMDBucketMapper;
+using hk::SIMDPoint3f;
+using hk::TaskGroup;
+using hk::TaskPool;
+using hk::numSpheres;
+using hk::sphereBounds;
 using hk::scene::Scene;
 
+// Parallel build constants. These only depend on the number of triangles in a
+// node, never on the number of threads, so the built BVH is deterministic.
+/// Nodes with at least this many triangles are binned and partitioned in
+/// parallel.
+constexpr size_t ParallelBinningThreshold = 1 << 16;
+
+/// Nodes with at least this many triangles build their children as separate
+/// tasks.
+constexpr size_t ParallelSubtreeThreshold = 1 << 12;
+
+/// Number of triangles processed by each task of a parallel loop.
+constexpr size_t ParallelGrainSize = 1 << 14;
+
+/**
+ * Node allocators of the threads of a pool, all of them carving from the same
+ * arena. Subtree tasks allocate from the allocator of the thread that runs
+ * them, so that they fill the current block of that thread instead of each
+ * starting a new one.
+ */
+class ThreadAllocators {
+ public:
+  ThreadAllocators(const TaskPool &pool, Arena &arena)
+      : pool_(pool), arena_(arena) {
+    for (size_t i = 1; i < pool.numThreads(); ++i) {
+      workerAllocators_.push_back(std::make_unique<ArenaAllocator>(arena));
+    }
+  }
+
+  /**
+   * Returns the allocator of the calling thread. Every thread that isn't a
+   * worker of the pool has index 0, such as the one that created this object
+   * or one that runs tasks while it waits for a task group of a worker, so
+   * those threads get an allocator each, looked up by their ID.
+   */
+  ArenaAllocator &current() {
+    const size_t index = pool_.currentThreadIndex();
+    if (index) return *workerAllocators_[index - 1];
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto &allocator = otherAllocators_[std::this_thread::get_id()];
+    if (!allocator) allocator = std::make_unique<ArenaAllocator>(arena_);
+    return *allocator;
+  }
+
+ private:
+  const TaskPool &pool_;
+  Arena &arena_;
+  std::vector<std::unique_ptr<ArenaAllocator>> workerAllocators_;
+
+  std::mutex mutex_;
+  std::unordered_map<std::thread::id, std::unique_ptr<ArenaAllocator>>
+      otherAllocators_;
+};
+
+/**
+ * Tracks the memory held by the big arrays of a build, to report its peak.
+ * Thread-safe.
+ */
+class MemoryTracker {
+ public:
+  /// Records that the given number of bytes were allocated.
+  void allocate(size_t bytes) {
+    const size_t current = current_ += bytes;
+    size_t peak = peak_;
+    while (current > peak && !peak_.compare_exchange_weak(peak, current)) {
+    }
+  }
+
+  /// Records that the given number of bytes were freed.
+  void release(size_t bytes) { current_ -= bytes; }
+
+  /// Returns the maximum number of bytes allocated at the same time.
+  size_t peak() const { return peak_; }
+
+ private:
+  std::atomic<size_t> current_{0};
+  std::atomic<size_t> peak_{0};
+};
+
+/**
+ * Returns the number of bytes allocated by the vector.
+ */
+template <typename T>
+size_t vectorBytes_(const std::vector<T> &vector) {
+  return vector.capacity() * sizeof(T);
+}
+
 /**
  * Pointer-based representation of a node of the BVH.
  * Used to build the BVH, and later converted to the array representation.
+ * Allocated in an Arena, so it must stay trivially destructible.
  */
 struct BVHBuildNode {
   /// Bounding box of the node.
   Bounds3f bounds;
 
   /// Children of the node. Nullptr if is a leaf node.
-  std::array<std::unique_ptr<BVHBuildNode>, 2> children;
+  std::array<BVHBuildNode *, 2> children;
 
   /// Number of triangles in the leaf node. If 0, is an internal node.
   uint16_t numTriangles;
@@ -50,13 +168,21 @@ struct BVHBuildNode {
   /// Offset into the triangles array for the first triangle of the leaf node.
   uint32_t trianglesOffset;
 
+  /// Triangles of the leaf node, only used by the SBVH builder. A SBVH leaf
+  /// can't reference a range of the shared refs, as the refs of a node are
+  /// copied into its children. Allocated in the same arena as the node, and
+  /// gathered once the whole tree is built.
+  const uint32_t *leafTriangles = nullptr;
+
+  /// SAH cost of the subtree, only used by the treelet optimizer.
+  float cost = 0.0f;
+
   /**
    * Builds an internal BVH node enclosing the two given leaf nodes.
    */
-  BVHBuildNode(uint16_t splitAxis, std::unique_ptr<BVHBuildNode> &&leaf1,
-               std::unique_ptr<BVHBuildNode> &&leaf2)
+  BVHBuildNode(uint16_t splitAxis, BVHBuildNode *leaf1, BVHBuildNode *leaf2)
       : bounds(leaf1->bounds + leaf2->bounds),
-        children({{std::move(leaf1), std::move(leaf2)}}),
+        children({{leaf1, leaf2}}),
         numTriangles(0),
         splitAxis(splitAxis),
         trianglesOffset(0) {}
@@ -74,33 +200,94 @@ struct BVHBuildNode {
 };
 
 /**
- * Information about the BVH triangles.
+ * References to the triangles being partitioned by the builder.
+ * Stored as separate arrays so that each pass only streams the data it needs,
+ * and so that bounds can be accumulated with SIMD instructions. Centroids are
+ * derived from the bounds when needed instead of stored, which keeps each
+ * reference at 36 bytes, all of them swapped in place while partitioning.
  */
-struct BVHTriangleInfo {
-  /// Index of the triangle in the triangles vector.
-  size_t index;
+struct BVHTriangleRefs {
+  /// Index of each triangle in the triangles vector.
+  std::vector<uint32_t> indices;
 
-  /// Bounding box of the triangle.
-  Bounds3f bounds;
+  /// Bounding box of each triangle.
+  std::vector<SIMDBounds3f> bounds;
+
+  explicit BVHTriangleRefs(size_t size) : indices(size), bounds(size) {}
+
+  /// Returns the centroid of the bounding box of the reference.
+  SIMDPoint3f centroid(size_t i) const { return bounds[i].centroid(); }
 
-  /// Centroid of the triangle.
-  glm::vec3 centroid;
+  /// Appends a reference to the triangle with the given bounds.
+  void add(uint32_t index, const SIMDBounds3f &triangleBounds) {
+    indices.push_back(index);
+    bounds.push_back(triangleBounds);
+  }
+
+  /// Swaps the references at the given positions.
+  void swap(size_t a, size_t b) {
+    std::swap(indices[a], indices[b]);
+    std::swap(bounds[a], bounds[b]);
+  }
 
-  BVHTriangleInfo(size_t index, const Bounds3f &bounds)
-      : index(index),
-        bounds(bounds),
-        centroid(bounds.minPoint * 0.5f + bounds.maxPoint * 0.5f) {}
+  /// Returns the number of bytes allocated by the references.
+  size_t bytes() const { return vectorBytes_(indices) + vectorBytes_(bounds); }
 };
 
 /**
- * Builds the vector of triangles of the scene.
+ * Returns the pair bits of BVHTriangle::meshID for the triangles that begin at
+ * the given positions of the indices array, or -1 if they don't share exactly
+ * one edge.
+ */
+int pairCode_(const Scene *scene, uint32_t first, uint32_t second) {
+  const auto *indices = scene->indices();
+  int code = 0, numUnshared = 0;
+  uint32_t sharedVertices = 0;
+  for (int v = 0; v < 3; ++v) {
+    int vertex = 3;
+    for (int u = 0; u < 3; ++u) {
+      if (indices->Get(second + v) == indices->Get(first + u)) vertex = u;
+    }
+    if (vertex == 3) {
+      ++numUnshared;
+    } else {
+      sharedVertices |= 1u << vertex;
+    }
+    code |= vertex << (2 * v);
+  }
+
+  // Degenerate triangles might share the same vertex twice, so two different
+  // vertices must be shared.
+  const bool sharesEdge =
+      numUnshared == 1 && (sharedVertices & (sharedVertices - 1));
+  return sharesEdge ? code : -1;
+}
+
+/**
+ * Builds the vector of triangles of the meshes in [firstMesh, lastMesh). If
+ * pairTriangles is true, each triangle that shares an edge with the next one
+ * of its mesh is paired with it.
  */
-std::vector<BVHTriangle> buildTriangles_(const Scene *scene) {
+std::vector<BVHTriangle> buildTriangles_(const Scene *scene, size_t firstMesh,
+                                         size_t lastMesh, bool pairTriangles) {
   std::vector<BVHTriangle> triangles;
-  for (size_t i = 0; i < scene->meshes()->size(); ++i) {
+  for (size_t i = firstMesh; i < lastMesh; ++i) {
     const auto *mesh = scene->meshes()->Get(i);
+    CHECK(!pairTriangles || i <= BVHTriangleMeshIDMask)
+        << "Too many meshes to pair triangles.";
+    CHECK_LT(i, BVHSphereMeshID) << "Too many meshes.";
     for (size_t j = mesh->begin(); j < mesh->end(); j += 3) {
-      triangles.emplace_back(i, j);
+      const int code = pairTriangles && j + 6 <= mesh->end()
+                           ? pairCode_(scene, j, j + 3)
+                           : -1;
+      if (code < 0) {
+        triangles.emplace_back(i, j);
+        continue;
+      }
+
+      triangles.emplace_back(
+          i | BVHTrianglePairBit | uint32_t(code) << BVHTrianglePairShift, j);
+      j += 3;
     }
   }
 
@@ -115,255 +302,1897 @@ glm::vec3 toVec3_(const hk::scene::vec4 *vec) {
 }
 
 /**
- * Returns the bounding box of a triangle.
+ * Vertices of a triangle.
  */
-Bounds3f triangleBounds_(const Scene *scene, const BVHTriangle &triangle) {
-  const auto *p0 =
-      scene->vertices()->Get(scene->indices()->Get(triangle.begin));
-  const auto *p1 =
-      scene->vertices()->Get(scene->indices()->Get(triangle.begin + 1));
-  const auto *p2 =
-      scene->vertices()->Get(scene->indices()->Get(triangle.begin + 2));
+using TriangleVertices = std::array<glm::vec3, 3>;
 
-  return Bounds3f(toVec3_(p0), toVec3_(p1)) + toVec3_(p2);
+/**
+ * Returns the vertices of a triangle.
+ */
+TriangleVertices triangleVertices_(const Scene *scene,
+                                   const BVHTriangle &triangle) {
+  TriangleVertices vertices;
+  for (int i = 0; i < 3; ++i) {
+    vertices[i] = toVec3_(
+        scene->vertices()->Get(scene->indices()->Get(triangle.begin + i)));
+  }
+  return vertices;
 }
 
 /**
- * Returns a vector of BVHTriangleInfos, in the same order as the triangles.
+ * Returns the bounding box of a triangle, of both triangles of a pair or of a
+ * sphere.
  */
-std::vector<BVHTriangleInfo> buildTriangleInfos_(
-    const Scene *scene, const std::vector<BVHTriangle> &triangles) {
-  std::vector<BVHTriangleInfo> triangleInfos;
-  triangleInfos.reserve(triangles.size());
+Bounds3f triangleBounds_(const Scene *scene, const BVHTriangle &triangle) {
+  if (isSphere(triangle)) return sphereBounds(scene, triangle.begin);
 
-  for (size_t i = 0; i < triangles.size(); ++i) {
-    triangleInfos.emplace_back(i, triangleBounds_(scene, triangles[i]));
+  const auto vertices = triangleVertices_(scene, triangle);
+  Bounds3f bounds = Bounds3f(vertices[0], vertices[1]) + vertices[2];
+  if (isTrianglePair(triangle)) {
+    for (const auto &vertex :
+         triangleVertices_(scene, BVHTriangle(0, triangle.begin + 3))) {
+      bounds += vertex;
+    }
   }
-  return triangleInfos;
+  return bounds;
 }
 
+/// Returns the bounding box of the i-th primitive of a BVH.
+using PrimitiveBounds = std::function<Bounds3f(size_t)>;
+
 /**
- * Builds a leaf node with the given data.
+ * Returns the references to the primitives, in the same order as the
+ * primitives.
+ */
+BVHTriangleRefs buildRefs_(TaskPool &pool, size_t numPrimitives,
+                           const PrimitiveBounds &primitiveBounds) {
+  BVHTriangleRefs refs(numPrimitives);
+
+  pool.parallelFor(0, numPrimitives, ParallelGrainSize,
+                   [&](size_t begin, size_t end) {
+                     for (size_t i = begin; i < end; ++i) {
+                       refs.indices[i] = i;
+                       refs.bounds[i] = SIMDBounds3f(primitiveBounds(i));
+                     }
+                   });
+  return refs;
+}
+
+/**
+ * Bounds of the triangles of a node and of their centroids.
  */
-std::unique_ptr<BVHBuildNode> buildLeafNode(
-    const std::vector<BVHTriangle> &triangles,
-    const std::vector<BVHTriangleInfo> &triangleInfos, const Bounds3f &bounds,
-    size_t start, size_t end, size_t numTriangles,
-    std::vector<BVHTriangle> &orderedTriangles) {
-  const size_t triangleOffset = orderedTriangles.size();
-  for (size_t i = start; i < end; ++i) {
-    orderedTriangles.push_back(triangles[triangleInfos[i].index]);
+struct NodeBounds {
+  SIMDBounds3f bounds;
+  SIMDBounds3f centroidBounds;
+};
+
+/**
+ * Returns the bounds of the triangles and the bounds of the triangle centroids
+ * in the given range, computed in parallel.
+ * Only needed for the root, as children bounds are found while splitting.
+ */
+NodeBounds rangeBounds_(TaskPool &pool, const BVHTriangleRefs &refs,
+                        size_t start, size_t end) {
+  std::vector<NodeBounds> chunkBounds(
+      TaskPool::numChunks(start, end, ParallelGrainSize));
+  pool.parallelFor(start, end, ParallelGrainSize,
+                   [&](size_t begin, size_t end) {
+                     auto &bounds =
+                         chunkBounds[(begin - start) / ParallelGrainSize];
+                     for (size_t i = begin; i < end; ++i) {
+                       bounds.bounds += refs.bounds[i];
+                       bounds.centroidBounds += refs.centroid(i);
+                     }
+                   });
+
+  NodeBounds bounds;
+  for (const auto &chunk : chunkBounds) {
+    bounds.bounds += chunk.bounds;
+    bounds.centroidBounds += chunk.centroidBounds;
   }
+  return bounds;
+}
 
-  return std::make_unique<BVHBuildNode>(bounds, numTriangles,
-                                        (uint32_t)triangleOffset);
+/**
+ * Builds a leaf node with the given data.
+ * The leaf references the triangles in [start, start + numTriangles) of the
+ * triangle references, which are gathered into the ordered triangles once the
+ * whole tree is built.
+ */
+BVHBuildNode *buildLeafNode(ArenaAllocator &allocator, const Bounds3f &bounds,
+                            size_t start, size_t numTriangles) {
+  return allocator.create<BVHBuildNode>(bounds, numTriangles,
+                                        (uint32_t)start);
 }
 
 /**
- * Partitions BVH primitives into equally-sized subsets.
+ * Splits a node with two triangles by ordering them along dim.
  * @param dim The dimension along which triangles are being partitioned.
  * @param start Start of the range to split.
- * @param end One after end of the range to split.
- * @param triangleInfos Vector to be partitioned in-place.
+ * @param refs References to be partitioned in-place.
+ * @param childBounds Set to the bounds of each child.
  * Returns the split point.
  */
-size_t equallySizedSplit_(int dim, size_t start, size_t end,
-                          std::vector<BVHTriangleInfo> &triangleInfos) {
-  // Partition primitives using equally-sized subsets.
-  const size_t mid = (start + end) / 2;
-  std::nth_element(&triangleInfos[start], &triangleInfos[mid],
-                   &triangleInfos[end - 1] + 1,
-                   [dim](const BVHTriangleInfo &a, const BVHTriangleInfo &b) {
-                     return a.centroid[dim] < b.centroid[dim];
-                   });
-  return mid;
+size_t splitPair_(int dim, size_t start, BVHTriangleRefs &refs,
+                  NodeBounds childBounds[2]) {
+  if (refs.centroid(start + 1)[dim] < refs.centroid(start)[dim]) {
+    refs.swap(start, start + 1);
+  }
+  for (size_t i = 0; i < 2; ++i) {
+    childBounds[i].bounds = refs.bounds[start + i];
+    childBounds[i].centroidBounds = SIMDBounds3f();
+    childBounds[i].centroidBounds += refs.centroid(start + i);
+  }
+  return start + 1;
 }
 
 // SAH constants.
-constexpr size_t NumBuckets = 12;
-constexpr size_t MaxTrianglesInNode = 1;
-const float IntersectionCost = 1.0f;
-const float TraversalCost = 1.0f;
+constexpr size_t MaxNumBuckets = 256;
 
 /**
- * Buckets for approximate SAH.
+ * Bucket for approximate SAH.
  */
 struct BucketInfo {
-  int count = 0;
-  Bounds3f bounds;
+  SIMDBounds3f bounds;
+  uint32_t count = 0;
+
+  BucketInfo &operator+=(const BucketInfo &other) {
+    bounds += other.bounds;
+    count += other.count;
+    return *this;
+  }
 };
 
 /**
- * Partitions BVH primitives by following the Surface Area Heuristic (SAH).
- * @param dim The dimension along which triangles are being partitioned.
- * @param start Start of the range to split.
- * @param end One after end of the range to split.
- * @param numTriangles Number of triangles in the range.
- * @param bounds Bounds of all primitives in the node.
- * @param centroidBounds Bounds of the centroids.
- * @param triangleInfos Vector to be partitioned in-place.
- * @return the split point, or 0 if is to just create a leaf node with the
- * node's triangles.
+ * Buckets of a node along all three axes: numBuckets buckets for the x axis,
+ * followed by the ones of the y axis and then the ones of the z axis.
  */
-size_t sahSplit_(int dim, size_t start, size_t end, size_t numTriangles,
-                 const Bounds3f &bounds, const Bounds3f &centroidBounds,
-                 std::vector<BVHTriangleInfo> &triangleInfos) {
-  // Initialize buckets.
-  BucketInfo buckets[NumBuckets];
-  for (size_t i = start; i < end; ++i) {
-    size_t b =
-        NumBuckets * centroidBounds.offset(triangleInfos[i].centroid)[dim];
-    if (b == NumBuckets) b = NumBuckets - 1;
-    CHECK_GE(b, 0);
-    CHECK_LT(b, NumBuckets);
+using Buckets = std::vector<BucketInfo>;
 
-    ++buckets[b].count;
-    buckets[b].bounds += triangleInfos[i].bounds;
+/**
+ * Bins the triangles in [start, end) into the buckets of all three axes in a
+ * single pass. Bins in parallel if the range is big enough.
+ */
+Buckets binTriangles_(TaskPool &pool, const SIMDBucketMapper &mapper,
+                      size_t numBuckets, const BVHTriangleRefs &refs,
+                      size_t start, size_t end) {
+  const auto bin = [&](size_t begin, size_t end) {
+    Buckets buckets(3 * numBuckets);
+    BucketInfo *xBuckets = &buckets[0];
+    BucketInfo *yBuckets = &buckets[numBuckets];
+    BucketInfo *zBuckets = &buckets[2 * numBuckets];
+
+    int32_t b[4];
+    for (size_t i = begin; i < end; ++i) {
+      const SIMDBounds3f &bounds = refs.bounds[i];
+      mapper.map(bounds.centroid(), b);
+      ++xBuckets[b[0]].count;
+      ++yBuckets[b[1]].count;
+      ++zBuckets[b[2]].count;
+      xBuckets[b[0]].bounds += bounds;
+      yBuckets[b[1]].bounds += bounds;
+      zBuckets[b[2]].bounds += bounds;
+    }
+    return buckets;
+  };
+
+  if (end - start < ParallelBinningThreshold) {
+    return bin(start, end);
   }
 
-  // Compute cost for splitting after each bucket.
-  float cost[NumBuckets - 1];
-  for (size_t i = 0; i < NumBuckets - 1; ++i) {
-    Bounds3f b0, b1;
-    int count0 = 0, count1 = 1;
-    for (size_t j = 0; j <= i; ++j) {
-      b0 += buckets[j].bounds;
-      count0 += buckets[j].count;
+  std::vector<Buckets> chunkBuckets(
+      TaskPool::numChunks(start, end, ParallelGrainSize));
+  pool.parallelFor(start, end, ParallelGrainSize,
+                   [&](size_t begin, size_t end) {
+                     chunkBuckets[(begin - start) / ParallelGrainSize] =
+                         bin(begin, end);
+                   });
+
+  Buckets buckets(3 * numBuckets);
+  for (const auto &chunk : chunkBuckets) {
+    for (size_t i = 0; i < buckets.size(); ++i) {
+      buckets[i] += chunk[i];
     }
-    for (size_t j = i + 1; j < NumBuckets; ++j) {
-      b1 += buckets[j].bounds;
-      count1 += buckets[j].count;
+  }
+  return buckets;
+}
+
+/**
+ * A split of a node chosen by the SAH.
+ */
+struct SAHSplit {
+  /// Axis of the split, or -1 if there's no valid split.
+  int axis = -1;
+
+  /// Last bucket that goes to the first child.
+  int32_t bucket = 0;
+
+  /// Sum of the surface area of each child times its number of triangles.
+  float weightedArea = std::numeric_limits<float>::infinity();
+};
+
+/**
+ * Finds the split with the minimum SAH cost among all buckets of all axes.
+ * Each axis is evaluated with a prefix sweep that accumulates the first
+ * child's bounds and a suffix sweep that accumulates the second child's, so
+ * the whole evaluation is linear in the number of buckets.
+ */
+SAHSplit findSAHSplit_(const Buckets &buckets, size_t numBuckets) {
+  SAHSplit best;
+  std::array<float, MaxNumBuckets> firstWeightedAreas;
+  std::array<uint32_t, MaxNumBuckets> firstCounts;
+
+  for (int axis = 0; axis < 3; ++axis) {
+    const BucketInfo *axisBuckets = &buckets[axis * numBuckets];
+
+    BucketInfo first;
+    for (size_t i = 0; i < numBuckets - 1; ++i) {
+      first += axisBuckets[i];
+      firstCounts[i] = first.count;
+      firstWeightedAreas[i] =
+          first.count ? first.count * first.bounds.surfaceArea() : 0.0f;
     }
 
-    cost[i] = TraversalCost +
-              (count0 * b0.surfaceArea() + count1 * b1.surfaceArea()) /
-                  bounds.surfaceArea();
+    BucketInfo second;
+    for (size_t i = numBuckets - 1; i > 0; --i) {
+      second += axisBuckets[i];
+      if (!firstCounts[i - 1] || !second.count) continue;
+
+      const float weightedArea = firstWeightedAreas[i - 1] +
+                                 second.count * second.bounds.surfaceArea();
+      if (weightedArea < best.weightedArea) {
+        best.axis = axis;
+        best.bucket = i - 1;
+        best.weightedArea = weightedArea;
+      }
+    }
   }
 
-  // Find bucket to split that minimizes SAH metric.
-  float minCost = cost[0];
-  size_t minCostSplitBucket = 0;
-  for (size_t i = 1; i < NumBuckets - 1; ++i) {
-    if (cost[i] < minCost) {
-      minCost = cost[i];
-      minCostSplitBucket = i;
+  return best;
+}
+
+/**
+ * Partitions the references in [start, end) in place with swaps from both
+ * ends, so that the ones in the first child of the split come first.
+ */
+size_t serialPartition_(const SIMDBucketMapper &mapper, const SAHSplit &split,
+                        size_t start, size_t end, BVHTriangleRefs &refs,
+                        SIMDBounds3f childCentroidBounds[2]) {
+  const auto inFirstChild = [&](const SIMDPoint3f &centroid) {
+    return mapper.map(centroid, split.axis) <= split.bucket;
+  };
+
+  size_t first = start, last = end;
+  while (true) {
+    for (; first < last; ++first) {
+      const SIMDPoint3f centroid = refs.centroid(first);
+      if (!inFirstChild(centroid)) break;
+      childCentroidBounds[0] += centroid;
     }
+    for (; first < last; --last) {
+      const SIMDPoint3f centroid = refs.centroid(last - 1);
+      if (inFirstChild(centroid)) break;
+      childCentroidBounds[1] += centroid;
+    }
+    if (first == last) return first;
+
+    refs.swap(first, last - 1);
+    childCentroidBounds[0] += refs.centroid(first++);
+    childCentroidBounds[1] += refs.centroid(--last);
+  }
+}
+
+/**
+ * Partitions the references in [start, end) in parallel. A first pass finds
+ * the child of each reference and counts the ones of the first child, which
+ * gives the split point, and a second one finds the references on the wrong
+ * side of it, which are then swapped pairwise. The order of the references
+ * differs from the one of serialPartition_(), but doesn't depend on the
+ * number of threads.
+ */
+size_t parallelPartition_(TaskPool &pool, const SIMDBucketMapper &mapper,
+                          const SAHSplit &split, size_t start, size_t end,
+                          BVHTriangleRefs &refs,
+                          SIMDBounds3f childCentroidBounds[2]) {
+  const size_t numChunks = TaskPool::numChunks(start, end, ParallelGrainSize);
+  const auto chunkIndex = [&](size_t begin) {
+    return (begin - start) / ParallelGrainSize;
+  };
+
+  struct ChunkCounts {
+    size_t numFirst = 0;
+    SIMDBounds3f centroidBounds[2];
+  };
+  std::vector<ChunkCounts> chunkCounts(numChunks);
+  std::vector<uint8_t> inFirstChild(end - start);
+  pool.parallelFor(start, end, ParallelGrainSize,
+                   [&](size_t begin, size_t end) {
+                     ChunkCounts &counts = chunkCounts[chunkIndex(begin)];
+                     for (size_t i = begin; i < end; ++i) {
+                       const SIMDPoint3f centroid = refs.centroid(i);
+                       const bool first =
+                           mapper.map(centroid, split.axis) <= split.bucket;
+                       inFirstChild[i - start] = first;
+                       counts.numFirst += first ? 1 : 0;
+                       counts.centroidBounds[first ? 0 : 1] += centroid;
+                     }
+                   });
+  size_t splitPoint = start;
+  for (const auto &counts : chunkCounts) {
+    splitPoint += counts.numFirst;
+    childCentroidBounds[0] += counts.centroidBounds[0];
+    childCentroidBounds[1] += counts.centroidBounds[1];
+  }
+
+  // The chunks are in order, so the misplaced references before the split
+  // point come first, and there are as many of them as after it.
+  std::vector<std::vector<uint32_t>> chunkMisplaced(numChunks);
+  pool.parallelFor(start, end, ParallelGrainSize,
+                   [&](size_t begin, size_t end) {
+                     auto &misplaced = chunkMisplaced[chunkIndex(begin)];
+                     for (size_t i = begin; i < end; ++i) {
+                       if ((i < splitPoint) != bool(inFirstChild[i - start])) {
+                         misplaced.push_back(uint32_t(i));
+                       }
+                     }
+                   });
+  std::vector<uint32_t> misplaced;
+  for (const auto &chunk : chunkMisplaced) {
+    misplaced.insert(misplaced.end(), chunk.begin(), chunk.end());
   }
 
-  // Either create leaf ndoe or split primitives at selected SAH bucket.
-  const float leafCost = IntersectionCost * numTriangles;
-  if (numTriangles > MaxTrianglesInNode || minCost < leafCost) {
-    BVHTriangleInfo *pMid = std::partition(
-        &triangleInfos[start], &triangleInfos[end - 1] + 1,
-        [=](const BVHTriangleInfo &pi) {
-          size_t b = NumBuckets * centroidBounds.offset(pi.centroid)[dim];
-          if (b == NumBuckets) b = NumBuckets - 1;
-          CHECK_GE(b, 0);
-          CHECK_LT(b, NumBuckets);
-          return b <= minCostSplitBucket;
-        });
-    return pMid - &triangleInfos[0];
+  const size_t numSwaps = misplaced.size() / 2;
+  pool.parallelFor(0, numSwaps, ParallelGrainSize,
+                   [&](size_t begin, size_t end) {
+                     for (size_t i = begin; i < end; ++i) {
+                       refs.swap(misplaced[i], misplaced[numSwaps + i]);
+                     }
+                   });
+  return splitPoint;
+}
+
+/**
+ * Partitions the references in [start, end) so that the ones in the first
+ * child of the split come first. Partitions in parallel if the range is big
+ * enough.
+ * @param childCentroidBounds Set to the centroid bounds of each child.
+ * @return the split point.
+ */
+size_t partition_(TaskPool &pool, const SIMDBucketMapper &mapper,
+                  const SAHSplit &split, size_t start, size_t end,
+                  BVHTriangleRefs &refs, SIMDBounds3f childCentroidBounds[2]) {
+  if (end - start < ParallelBinningThreshold) {
+    return serialPartition_(mapper, split, start, end, refs,
+                            childCentroidBounds);
   }
+  return parallelPartition_(pool, mapper, split, start, end, refs,
+                            childCentroidBounds);
+}
+
+/**
+ * Returns if a node is better off as a leaf than split into children with the
+ * given weighted area, by the cost model of the options.
+ */
+bool prefersLeaf_(const BVHBuildOptions &options, size_t numTriangles,
+                  float area, float weightedArea) {
+  const float cost =
+      options.traversalCost +
+      options.intersectionCost * (area > 0.0f ? weightedArea / area : 0.0f);
+  const float leafCost = options.intersectionCost * numTriangles;
+  return numTriangles <= options.maxTrianglesInNode && cost >= leafCost;
+}
 
-  return 0;
+/**
+ * Returns the bounds of each child of the split, which are the union of the
+ * buckets on each side.
+ */
+std::array<SIMDBounds3f, 2> splitChildBounds_(const Buckets &buckets,
+                                              size_t numBuckets,
+                                              const SAHSplit &split) {
+  std::array<SIMDBounds3f, 2> childBounds;
+  const BucketInfo *axisBuckets = &buckets[split.axis * numBuckets];
+  for (size_t i = 0; i < numBuckets; ++i) {
+    childBounds[(int32_t)i <= split.bucket ? 0 : 1] += axisBuckets[i].bounds;
+  }
+  return childBounds;
+}
+
+/**
+ * Partitions BVH primitives by following the Surface Area Heuristic (SAH).
+ * @param pool Pool used to bin big nodes in parallel.
+ * @param options Options of the build.
+ * @param start Start of the range to split.
+ * @param end One after end of the range to split.
+ * @param nodeBounds Bounds of the node's triangles and their centroids.
+ * @param refs References to be partitioned in-place.
+ * @param splitAxis Set to the axis of the split, if there's one.
+ * @param childBounds Set to the bounds of each child, if there's a split.
+ * @return the split point, or 0 if is to just create a leaf node with the
+ * node's triangles.
+ */
+size_t sahSplit_(TaskPool &pool, const BVHBuildOptions &options,
+                 size_t start, size_t end, const NodeBounds &nodeBounds,
+                 BVHTriangleRefs &refs, int &splitAxis,
+                 NodeBounds childBounds[2]) {
+  // Small nodes don't have enough triangles to fill many buckets.
+  const size_t numTriangles = end - start;
+  const size_t numBuckets = std::min(options.numBuckets, numTriangles);
+
+  const SIMDBucketMapper mapper(nodeBounds.centroidBounds.toBounds3f(),
+                                numBuckets);
+  const Buckets buckets =
+      binTriangles_(pool, mapper, numBuckets, refs, start, end);
+  const SAHSplit split = findSAHSplit_(buckets, numBuckets);
+  if (split.axis < 0) return 0;
+
+  // Either create leaf node or split primitives at selected SAH bucket.
+  if (prefersLeaf_(options, numTriangles, nodeBounds.bounds.surfaceArea(),
+                   split.weightedArea)) {
+    return 0;
+  }
+
+  const auto splitBounds = splitChildBounds_(buckets, numBuckets, split);
+  childBounds[0].bounds = splitBounds[0];
+  childBounds[1].bounds = splitBounds[1];
+
+  SIMDBounds3f childCentroidBounds[2];
+  const size_t splitPoint =
+      partition_(pool, mapper, split, start, end, refs, childCentroidBounds);
+  childBounds[0].centroidBounds = childCentroidBounds[0];
+  childBounds[1].centroidBounds = childCentroidBounds[1];
+  splitAxis = split.axis;
+  return splitPoint;
 }
 
 /**
  * Builds a BVH tree using the Surface Area Heuristic.
- * @param triangles Triangles in the scene.
- * @param triangleInfos Vector of the same size of triangles
+ * Children of big nodes are built in parallel as separate tasks. Each subtree
+ * only depends on its own range of refs, so the result is the same regardless
+ * of the number of threads in the pool.
+ * @param pool Pool used to build the tree in parallel.
+ * @param options Options of the build.
+ * @param allocators Allocators of the nodes, one per thread of the pool.
+ * @param refs References to the triangles, partitioned in-place so that
+ *   leaves reference contiguous ranges.
+ * @param start Start of the range to build.
+ * @param end One after end of the range to build.
+ * @param nodeBounds Bounds of the triangles in the range and their centroids.
+ * @param totalNodes Incremented by the number of nodes in the subtree.
  */
-std::unique_ptr<BVHBuildNode> SAHBuild_(
-    const std::vector<BVHTriangle> &triangles,
-    std::vector<BVHTriangleInfo> &triangleInfos, size_t start, size_t end,
-    size_t &totalNodes, std::vector<BVHTriangle> &orderedTriangles) {
+BVHBuildNode *SAHBuild_(TaskPool &pool, const BVHBuildOptions &options,
+                        ThreadAllocators &allocators, BVHTriangleRefs &refs,
+                        size_t start, size_t end, const NodeBounds &nodeBounds,
+                        size_t &totalNodes) {
   CHECK_LT(start, end);
   ++totalNodes;
+  ArenaAllocator &allocator = allocators.current();
 
-  // Bounds of all primitives in the BVH node.
-  Bounds3f bounds;
-  for (size_t i = start; i < end; ++i) {
-    bounds += triangleInfos[i].bounds;
-  }
+  const Bounds3f bounds = nodeBounds.bounds.toBounds3f();
+  const Bounds3f centroidBounds = nodeBounds.centroidBounds.toBounds3f();
 
   // If only one triangle, return a leaf node.
   const size_t numTriangles = end - start;
   if (numTriangles == 1) {
-    return buildLeafNode(triangles, triangleInfos, bounds, start, end,
-                         numTriangles, orderedTriangles);
+    return buildLeafNode(allocator, bounds, start, numTriangles);
   }
 
-  // Compute bound of primitive centroids, choose split dimension.
-  Bounds3f centroidBounds;
-  for (size_t i = start; i < end; ++i) {
-    centroidBounds += triangleInfos[i].centroid;
-  }
-  const int dim = centroidBounds.maximumExtentAxis();
-
   // If centroids are on the same position, return a leaf node.
   // Partitioning further doesn't produce good results.
+  int dim = centroidBounds.maximumExtentAxis();
   if (centroidBounds.maxPoint[dim] == centroidBounds.minPoint[dim]) {
-    return buildLeafNode(triangles, triangleInfos, bounds, start, end,
-                         numTriangles, orderedTriangles);
+    return buildLeafNode(allocator, bounds, start, numTriangles);
   }
 
   size_t splitPoint;
+  NodeBounds childBounds[2];
   if (numTriangles <= 2) {
-    splitPoint = equallySizedSplit_(dim, start, end, triangleInfos);
+    splitPoint = splitPair_(dim, start, refs, childBounds);
+    if (prefersLeaf_(options, numTriangles, bounds.surfaceArea(),
+                     childBounds[0].bounds.surfaceArea() +
+                         childBounds[1].bounds.surfaceArea())) {
+      return buildLeafNode(allocator, bounds, start, numTriangles);
+    }
   } else {
-    splitPoint = sahSplit_(dim, start, end, numTriangles, bounds,
-                           centroidBounds, triangleInfos);
+    splitPoint = sahSplit_(pool, options, start, end, nodeBounds, refs, dim,
+                           childBounds);
     if (!splitPoint) {
-      return buildLeafNode(triangles, triangleInfos, bounds, start, end,
-                           numTriangles, orderedTriangles);
+      return buildLeafNode(allocator, bounds, start, numTriangles);
     }
   }
 
-  return std::make_unique<BVHBuildNode>(
-      dim,
-      SAHBuild_(triangles, triangleInfos, start, splitPoint, totalNodes,
-                orderedTriangles),
-      SAHBuild_(triangles, triangleInfos, splitPoint, end, totalNodes,
-                orderedTriangles));
+  BVHBuildNode *firstChild, *secondChild;
+  if (numTriangles >= ParallelSubtreeThreshold && pool.numThreads() > 1) {
+    size_t firstChildNodes = 0;
+    TaskGroup group(pool);
+    group.run([&]() {
+      firstChild = SAHBuild_(pool, options, allocators, refs, start,
+                             splitPoint, childBounds[0], firstChildNodes);
+    });
+    secondChild = SAHBuild_(pool, options, allocators, refs, splitPoint, end,
+                            childBounds[1], totalNodes);
+    group.wait();
+    totalNodes += firstChildNodes;
+  } else {
+    firstChild = SAHBuild_(pool, options, allocators, refs, start,
+                           splitPoint, childBounds[0], totalNodes);
+    secondChild = SAHBuild_(pool, options, allocators, refs, splitPoint, end,
+                            childBounds[1], totalNodes);
+  }
+
+  return allocator.create<BVHBuildNode>(dim, firstChild, secondChild);
 }
 
 /**
- * Flattens the BVH so that it can be uploaded to the GPU.
+ * Gathers the triangles in the order they are referenced by the leaves.
+ * There might be more refs than triangles if the builder duplicated some.
  */
-std::vector<BVHNode> flattenBVH_(const BVHBuildNode &root, size_t numNodes) {
-  std::vector<BVHNode> nodes(numNodes);
-  std::stack<std::tuple<const BVHBuildNode &, BVHNode *>> s;
+std::vector<BVHTriangle> orderTriangles_(
+    TaskPool &pool, const std::vector<BVHTriangle> &triangles,
+    const BVHTriangleRefs &refs) {
+  std::vector<BVHTriangle> orderedTriangles(refs.indices.size(),
+                                            BVHTriangle(0, 0));
+  pool.parallelFor(0, refs.indices.size(), ParallelGrainSize,
+                   [&](size_t begin, size_t end) {
+                     for (size_t i = begin; i < end; ++i) {
+                       orderedTriangles[i] = triangles[refs.indices[i]];
+                     }
+                   });
+  return orderedTriangles;
+}
 
-  s.emplace(root, nullptr);
-  for (size_t offset = 0; !s.empty(); ++offset) {
-    const auto[node, parentPtr] = s.top();
-    s.pop();
+/**
+ * Writes everything but the second child offset of a build node to its flat
+ * node.
+ */
+void writeFlatNode_(const BVHBuildNode &node, BVHNode &linearNode) {
+  linearNode.minPoint = node.bounds.minPoint;
+  linearNode.maxPoint = node.bounds.maxPoint;
+  linearNode.numTriangles = node.numTriangles;
+  if (node.numTriangles > 0) {
+    linearNode.splitAxis = 0;
+    linearNode.trianglesOffset = node.trianglesOffset;
+  } else {
+    linearNode.splitAxis = node.splitAxis;
+  }
+}
 
-    auto &linearNode = nodes[offset];
-    linearNode.minPoint = node.bounds.minPoint;
-    linearNode.maxPoint = node.bounds.maxPoint;
-    linearNode.numTriangles = node.numTriangles;
+/**
+ * Flattens the subtree into nodes in depth-first order, so that it can be
+ * uploaded to the GPU. The first child of each node goes right after it.
+ * @param node Root of the subtree.
+ * @param offset Position of the subtree's root in nodes.
+ * @param nodes Array where the nodes are written to, already big enough for
+ *   the whole tree.
+ * @return the offset right after the last node of the subtree.
+ */
+size_t flattenBVH_(const BVHBuildNode &node, size_t offset,
+                   std::vector<BVHNode> &nodes) {
+  BVHNode &linearNode = nodes[offset];
+  writeFlatNode_(node, linearNode);
+  if (node.numTriangles > 0) return offset + 1;
 
-    if (node.numTriangles > 0) {
-      linearNode.trianglesOffset = node.trianglesOffset;
-    } else {
-      linearNode.splitAxis = node.splitAxis;
+  linearNode.secondChildOffset =
+      flattenBVH_(*node.children[0], offset + 1, nodes);
+  return flattenBVH_(*node.children[1], linearNode.secondChildOffset, nodes);
+}
+
+/// Minimum number of nodes of each cluster of the clustered layout. 8 nodes
+/// are four 64 byte cache lines.
+constexpr size_t ClusterSize = 8;
+
+/**
+ * Flattens the tree into nodes in the clustered layout. As every node is
+ * followed by its first child, the tree is made of chains of first children
+ * whose order is free. Each cluster emits the chains breadth-first until it
+ * has ClusterSize nodes, and the subtrees of the chains left out become
+ * clusters of their own, in order. The second children of the top nodes of a
+ * subtree are then close to them instead of after their first subtrees.
+ * @param root Root of the tree.
+ * @param nodes Array where the nodes are written to, already big enough for
+ *   the whole tree.
+ */
+void flattenClusteredBVH_(const BVHBuildNode &root,
+                          std::vector<BVHNode> &nodes) {
+  /// A chain of first children, and the node whose second child it is.
+  struct Chain {
+    const BVHBuildNode *root;
+    size_t parentOffset;
+  };
+  constexpr size_t NoParent = std::numeric_limits<size_t>::max();
+
+  std::vector<Chain> clusters = {{&root, NoParent}};
+  std::deque<Chain> chains;
+  std::vector<Chain> leftOut;
+  size_t offset = 0;
+  while (!clusters.empty()) {
+    chains.push_back(clusters.back());
+    clusters.pop_back();
 
-      // Add second child first and first child afterwards, because first child
-      // will go right after the parent in the linear BVH.
-      s.emplace(*node.children[1], &linearNode);
-      s.emplace(*node.children[0], nullptr);
+    size_t clusterSize = 0;
+    while (!chains.empty()) {
+      const Chain chain = chains.front();
+      chains.pop_front();
+      if (clusterSize >= ClusterSize) {
+        leftOut.push_back(chain);
+        continue;
+      }
+
+      if (chain.parentOffset != NoParent) {
+        nodes[chain.parentOffset].secondChildOffset = offset;
+      }
+      for (const BVHBuildNode *node = chain.root;; node = node->children[0]) {
+        writeFlatNode_(*node, nodes[offset]);
+        ++clusterSize;
+        if (node->numTriangles > 0) {
+          ++offset;
+          break;
+        }
+        chains.push_back({node->children[1], offset++});
+      }
     }
 
-    // If parentPtr is available, we're the second child. Save our offset.
-    if (parentPtr) {
-      parentPtr->secondChildOffset = offset;
+    // The clusters are a stack, so push the left out chains in reverse to
+    // emit them in order.
+    clusters.insert(clusters.end(), leftOut.rbegin(), leftOut.rend());
+    leftOut.clear();
+  }
+}
+
+/**
+ * Flattens the tree into nodes in the given layout.
+ */
+void flattenBVH_(const BVHBuildNode &root, BVHNodeLayout layout,
+                 std::vector<BVHNode> &nodes) {
+  switch (layout) {
+    case BVHNodeLayout::DepthFirst:
+      flattenBVH_(root, 0, nodes);
+      break;
+    case BVHNodeLayout::Clustered:
+      flattenClusteredBVH_(root, nodes);
+      break;
+  }
+}
+
+/**
+ * Builds the subtree of the triangles in [start, end) of a Linear BVH.
+ * Triangles are sorted by their Morton codes, and each node is split at the
+ * highest bit in which the codes of its triangles differ, or in the middle if
+ * all codes are equal. Every leaf has a single triangle, so a subtree with n
+ * triangles always has 2n - 1 nodes and the nodes can be written straight
+ * into their final position in the flat array.
+ * @param pool Pool used to build the tree in parallel.
+ * @param codes Sorted Morton codes of the triangles.
+ * @param bounds Bounds of the triangles, in the same order as codes.
+ * @param start Start of the range to build.
+ * @param end One after end of the range to build.
+ * @param nodeOffset Position of the subtree's root in nodes.
+ * @param nodes Array where the nodes are written to.
+ * @return the bounds of the subtree.
+ */
+SIMDBounds3f LBVHBuild_(TaskPool &pool, const std::vector<uint64_t> &codes,
+                        const std::vector<SIMDBounds3f> &bounds, size_t start,
+                        size_t end, size_t nodeOffset,
+                        std::vector<BVHNode> &nodes) {
+  BVHNode &node = nodes[nodeOffset];
+  if (end - start == 1) {
+    node.minPoint = bounds[start].minPoint();
+    node.maxPoint = bounds[start].maxPoint();
+    node.numTriangles = 1;
+    node.splitAxis = 0;
+    node.trianglesOffset = start;
+    return bounds[start];
+  }
+
+  size_t splitPoint;
+  const int bit = hk::highestDifferingBit(codes[start], codes[end - 1]);
+  if (bit < 0) {
+    splitPoint = start + (end - start) / 2;
+    node.splitAxis = 0;
+  } else {
+    // All codes in the range share the bits above bit, so the ones with bit
+    // set are all after the ones without it.
+    const uint64_t mask = uint64_t(1) << bit;
+    splitPoint = std::partition_point(
+                     codes.begin() + start, codes.begin() + end,
+                     [mask](uint64_t code) { return !(code & mask); }) -
+                 codes.begin();
+    node.splitAxis = MortonEncoder::bitAxis(bit);
+  }
+
+  const size_t firstChildOffset = nodeOffset + 1;
+  const size_t secondChildOffset = nodeOffset + 2 * (splitPoint - start);
+  SIMDBounds3f firstBounds, secondBounds;
+  if (end - start >= ParallelSubtreeThreshold && pool.numThreads() > 1) {
+    TaskGroup group(pool);
+    group.run([&]() {
+      firstBounds = LBVHBuild_(pool, codes, bounds, start, splitPoint,
+                               firstChildOffset, nodes);
+    });
+    secondBounds = LBVHBuild_(pool, codes, bounds, splitPoint, end,
+                              secondChildOffset, nodes);
+    group.wait();
+  } else {
+    firstBounds = LBVHBuild_(pool, codes, bounds, start, splitPoint,
+                             firstChildOffset, nodes);
+    secondBounds = LBVHBuild_(pool, codes, bounds, splitPoint, end,
+                              secondChildOffset, nodes);
+  }
+
+  firstBounds += secondBounds;
+  node.minPoint = firstBounds.minPoint();
+  node.maxPoint = firstBounds.maxPoint();
+  node.numTriangles = 0;
+  node.secondChildOffset = secondChildOffset;
+  return firstBounds;
+}
+
+/**
+ * Triangles sorted by the Morton codes of their centroids.
+ */
+struct MortonSortedTriangles {
+  /// Sorted Morton codes.
+  std::vector<uint64_t> codes;
+
+  /// Bounds of the triangles, in the same order as codes.
+  std::vector<SIMDBounds3f> bounds;
+};
+
+/**
+ * Sorts the refs by the Morton codes of their centroids. Only the indices of
+ * the refs are sorted, and the sorted bounds are returned instead.
+ */
+MortonSortedTriangles sortByMortonCodes_(TaskPool &pool,
+                                         BVHTriangleRefs &refs) {
+  const size_t numTriangles = refs.indices.size();
+  const MortonEncoder encoder(
+      rangeBounds_(pool, refs, 0, numTriangles).centroidBounds.toBounds3f());
+
+  MortonSortedTriangles sorted;
+  sorted.codes.resize(numTriangles);
+  pool.parallelFor(0, numTriangles, ParallelGrainSize,
+                   [&](size_t begin, size_t end) {
+                     for (size_t i = begin; i < end; ++i) {
+                       const SIMDPoint3f c = refs.centroid(i);
+                       sorted.codes[i] =
+                           encoder.encode(glm::vec3(c[0], c[1], c[2]));
+                     }
+                   });
+  hk::sortMortonCodes(pool, sorted.codes, refs.indices);
+
+  sorted.bounds.resize(numTriangles);
+  pool.parallelFor(0, numTriangles, ParallelGrainSize,
+                   [&](size_t begin, size_t end) {
+                     for (size_t i = begin; i < end; ++i) {
+                       sorted.bounds[i] = refs.bounds[refs.indices[i]];
+                     }
+                   });
+  return sorted;
+}
+
+/**
+ * Builds a Linear BVH, sorting the refs in the order of its leaves.
+ */
+std::vector<BVHNode> buildLBVH_(TaskPool &pool, MemoryTracker &memory,
+                                BVHTriangleRefs &refs) {
+  const size_t numTriangles = refs.indices.size();
+  const auto sorted = sortByMortonCodes_(pool, refs);
+  const size_t sortedBytes =
+      vectorBytes_(sorted.codes) + vectorBytes_(sorted.bounds);
+  memory.allocate(sortedBytes);
+
+  std::vector<BVHNode> nodes(2 * numTriangles - 1);
+  memory.allocate(vectorBytes_(nodes));
+  LBVHBuild_(pool, sorted.codes, sorted.bounds, 0, numTriangles, 0, nodes);
+  memory.release(sortedBytes);
+  return nodes;
+}
+
+// HLBVH constants.
+/// Average number of triangles the HLBVH aims to put in each treelet.
+constexpr size_t HLBVHTreeletSize = 4;
+
+/// Number of treelets built by each task.
+constexpr size_t HLBVHTreeletGrainSize = 16;
+
+/**
+ * Returns the number of most significant Morton code bits shared by the
+ * triangles of a treelet. Is a multiple of 3, so that the treelets are the
+ * cells of a uniform grid, with about numTriangles / HLBVHTreeletSize cells.
+ * A fixed number of bits made every treelet of small scenes a single triangle,
+ * which turned the HLBVH into a slower SAH build.
+ */
+int hlbvhTreeletBits_(size_t numTriangles) {
+  const double numCells =
+      std::max(1.0, (double)numTriangles / HLBVHTreeletSize);
+  const int bitsPerAxis = (int)std::lround(std::log2(numCells) / 3.0);
+  return 3 * std::min(std::max(bitsPerAxis, 1), hk::MortonBitsPerAxis);
+}
+
+/**
+ * A subtree of the HLBVH built with the LBVH algorithm.
+ */
+struct HLBVHTreelet {
+  /// Nodes of the treelet. Second child offsets are relative to the treelet's
+  /// root.
+  std::vector<BVHNode> nodes;
+
+  /// Bounds of the treelet.
+  SIMDBounds3f bounds;
+};
+
+/**
+ * Appends the nodes of a balanced tree over the treelets referenced by
+ * treeletIndices[begin, end) to nodes. The SAH top level might leave more
+ * than one treelet in a leaf if their centroids are too close to be split.
+ */
+void flattenHLBVHTreelets_(const std::vector<HLBVHTreelet> &treelets,
+                           const std::vector<uint32_t> &treeletIndices,
+                           size_t begin, size_t end,
+                           std::vector<BVHNode> &nodes) {
+  if (end - begin == 1) {
+    const auto &treelet = treelets[treeletIndices[begin]];
+    const uint32_t treeletOffset = nodes.size();
+    nodes.insert(nodes.end(), treelet.nodes.begin(), treelet.nodes.end());
+    for (size_t i = treeletOffset; i < nodes.size(); ++i) {
+      if (!nodes[i].numTriangles) {
+        nodes[i].secondChildOffset += treeletOffset;
+      }
+    }
+    return;
+  }
+
+  SIMDBounds3f bounds;
+  for (size_t i = begin; i < end; ++i) {
+    bounds += treelets[treeletIndices[i]].bounds;
+  }
+
+  const size_t offset = nodes.size();
+  const size_t middle = begin + (end - begin) / 2;
+  BVHNode node = BVHNode();
+  node.minPoint = bounds.minPoint();
+  node.maxPoint = bounds.maxPoint();
+  nodes.push_back(node);
+  flattenHLBVHTreelets_(treelets, treeletIndices, begin, middle, nodes);
+  nodes[offset].secondChildOffset = nodes.size();
+  flattenHLBVHTreelets_(treelets, treeletIndices, middle, end, nodes);
+}
+
+/**
+ * Appends the nodes of the SAH top level of the HLBVH to nodes, replacing its
+ * leaves by the treelets they reference.
+ */
+void flattenHLBVH_(const BVHBuildNode &node,
+                   const std::vector<HLBVHTreelet> &treelets,
+                   const std::vector<uint32_t> &treeletIndices,
+                   std::vector<BVHNode> &nodes) {
+  if (node.numTriangles) {
+    flattenHLBVHTreelets_(treelets, treeletIndices, node.trianglesOffset,
+                          node.trianglesOffset + node.numTriangles, nodes);
+    return;
+  }
+
+  const size_t offset = nodes.size();
+  BVHNode linearNode = BVHNode();
+  linearNode.minPoint = node.bounds.minPoint;
+  linearNode.maxPoint = node.bounds.maxPoint;
+  linearNode.splitAxis = node.splitAxis;
+  nodes.push_back(linearNode);
+  flattenHLBVH_(*node.children[0], treelets, treeletIndices, nodes);
+  nodes[offset].secondChildOffset = nodes.size();
+  flattenHLBVH_(*node.children[1], treelets, treeletIndices, nodes);
+}
+
+/**
+ * Builds a Hierarchical Linear BVH, sorting the refs in the order of its
+ * leaves.
+ * Triangles are clustered into treelets of triangles whose Morton codes share
+ * the same most significant bits. Treelets are built in parallel with the
+ * LBVH algorithm, and their roots are then joined with the SAH builder. As
+ * the top levels are the ones most traversed, this gets close to the
+ * traversal performance of a full SAH build at close to the cost of a LBVH.
+ */
+std::vector<BVHNode> buildHLBVH_(TaskPool &pool,
+                                 const BVHBuildOptions &options,
+                                 ThreadAllocators &allocators,
+                                 MemoryTracker &memory,
+                                 BVHTriangleRefs &refs) {
+  const size_t numTriangles = refs.indices.size();
+  const auto sorted = sortByMortonCodes_(pool, refs);
+  const size_t sortedBytes =
+      vectorBytes_(sorted.codes) + vectorBytes_(sorted.bounds);
+  memory.allocate(sortedBytes);
+
+  const int treeletShift =
+      hk::MortonCodeBits - hlbvhTreeletBits_(numTriangles);
+  std::vector<size_t> treeletStarts = {0};
+  for (size_t i = 1; i < numTriangles; ++i) {
+    if (sorted.codes[i] >> treeletShift !=
+        sorted.codes[i - 1] >> treeletShift) {
+      treeletStarts.push_back(i);
     }
   }
+  treeletStarts.push_back(numTriangles);
 
+  const size_t numTreelets = treeletStarts.size() - 1;
+  std::vector<HLBVHTreelet> treelets(numTreelets);
+  pool.parallelFor(
+      0, numTreelets, HLBVHTreeletGrainSize, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+          const size_t first = treeletStarts[i];
+          const size_t last = treeletStarts[i + 1];
+          auto &treelet = treelets[i];
+          treelet.nodes.resize(2 * (last - first) - 1);
+          treelet.bounds = LBVHBuild_(pool, sorted.codes, sorted.bounds,
+                                      first, last, 0, treelet.nodes);
+        }
+      });
+
+  // Every treelet has 2n - 1 nodes for its n triangles.
+  const size_t treeletBytes =
+      (2 * numTriangles - numTreelets) * sizeof(BVHNode);
+  memory.allocate(treeletBytes);
+
+  // Build the top level with each treelet as a single primitive.
+  BVHTriangleRefs treeletRefs(numTreelets);
+  NodeBounds rootBounds;
+  for (size_t i = 0; i < numTreelets; ++i) {
+    treeletRefs.indices[i] = i;
+    treeletRefs.bounds[i] = treelets[i].bounds;
+    rootBounds.bounds += treeletRefs.bounds[i];
+    rootBounds.centroidBounds += treeletRefs.centroid(i);
+  }
+
+  // Treelets are never grouped into leaves, as they can't be intersected
+  // together.
+  BVHBuildOptions topLevelOptions = options;
+  topLevelOptions.maxTrianglesInNode = 1;
+  size_t numTopNodes = 0;
+  const auto *root = SAHBuild_(pool, topLevelOptions, allocators,
+                               treeletRefs, 0, numTreelets, rootBounds,
+                               numTopNodes);
+
+  std::vector<BVHNode> nodes;
+  nodes.reserve(2 * numTriangles - 1);
+  memory.allocate(vectorBytes_(nodes));
+  flattenHLBVH_(*root, treelets, treeletRefs.indices, nodes);
+  memory.release(sortedBytes + treeletBytes);
   return nodes;
 }
 
+/**
+ * Builds a BVH with the Surface Area Heuristic, partitioning the refs in the
+ * order of its leaves.
+ * @param totalNodes Set to the number of nodes in the tree.
+ * @return the root of the tree, allocated with allocators.
+ */
+BVHBuildNode *buildSAH_(TaskPool &pool, const BVHBuildOptions &options,
+                        ThreadAllocators &allocators, BVHTriangleRefs &refs,
+                        size_t &totalNodes) {
+  const size_t numTriangles = refs.indices.size();
+  const auto rootBounds = rangeBounds_(pool, refs, 0, numTriangles);
+  return SAHBuild_(pool, options, allocators, refs, 0, numTriangles,
+                   rootBounds, totalNodes);
+}
+
+// SBVH constants.
+/// Spatial splits are only evaluated for nodes whose best object split has
+/// children that overlap by at least this fraction of the root's surface area.
+constexpr float SBVHMinOverlapRatio = 1e-5f;
+
+/**
+ * Returns the intersection of the bounds, which is empty if they don't
+ * overlap.
+ */
+Bounds3f intersectBounds_(const Bounds3f &a, const Bounds3f &b) {
+  Bounds3f intersection;
+  for (int axis = 0; axis < 3; ++axis) {
+    intersection.minPoint[axis] = std::max(a.minPoint[axis], b.minPoint[axis]);
+    intersection.maxPoint[axis] = std::min(a.maxPoint[axis], b.maxPoint[axis]);
+  }
+  return intersection;
+}
+
+/**
+ * Returns if the bounds don't contain any point.
+ */
+bool isEmpty_(const Bounds3f &bounds) {
+  return bounds.minPoint.x > bounds.maxPoint.x ||
+         bounds.minPoint.y > bounds.maxPoint.y ||
+         bounds.minPoint.z > bounds.maxPoint.z;
+}
+
+/**
+ * Returns the bounds of the part of the triangle between the minPlane and
+ * maxPlane planes of the axis, intersected with the bounds of the reference
+ * being clipped. Empty if the triangle doesn't cross the planes.
+ */
+Bounds3f clipTriangle_(const TriangleVertices &vertices, int axis,
+                       float minPlane, float maxPlane,
+                       const Bounds3f &refBounds) {
+  Bounds3f clipped;
+  for (int i = 0; i < 3; ++i) {
+    const glm::vec3 &a = vertices[i];
+    const glm::vec3 &b = vertices[(i + 1) % 3];
+    if (a[axis] >= minPlane && a[axis] <= maxPlane) {
+      clipped += a;
+    }
+
+    // Add the points where the edge crosses each plane.
+    for (const float plane : {minPlane, maxPlane}) {
+      if ((a[axis] < plane && b[axis] > plane) ||
+          (a[axis] > plane && b[axis] < plane)) {
+        glm::vec3 p = a + (b - a) * ((plane - a[axis]) / (b[axis] - a[axis]));
+        p[axis] = plane;
+        clipped += p;
+      }
+    }
+  }
+  return intersectBounds_(clipped, refBounds);
+}
+
+/**
+ * Maps positions to the spatial bins of a node, which evenly divide the
+ * node's bounds along each axis.
+ */
+class SpatialBinMapper {
+ public:
+  SpatialBinMapper(const Bounds3f &bounds, size_t numBins)
+      : origin_(bounds.minPoint), maxBin_(numBins - 1) {
+    binSize_ = bounds.diagonal() / (float)numBins;
+  }
+
+  /// Returns the bin of the position along the axis.
+  int32_t map(float position, int axis) const {
+    if (binSize_[axis] <= 0.0f) return 0;
+    const int32_t bin = (position - origin_[axis]) / binSize_[axis];
+    return std::min(std::max(bin, 0), maxBin_);
+  }
+
+  /// Returns the plane between bin - 1 and bin along the axis.
+  float plane(int32_t bin, int axis) const {
+    return origin_[axis] + bin * binSize_[axis];
+  }
+
+ private:
+  glm::vec3 origin_;
+  glm::vec3 binSize_;
+  int32_t maxBin_;
+};
+
+/**
+ * Spatial bin of the SBVH. Holds the bounds of the references clipped to the
+ * bin, and how many references start and end in the bin.
+ */
+struct SpatialBin {
+  Bounds3f bounds;
+  uint32_t entries = 0;
+  uint32_t exits = 0;
+
+  SpatialBin &operator+=(const SpatialBin &other) {
+    bounds += other.bounds;
+    entries += other.entries;
+    exits += other.exits;
+    return *this;
+  }
+};
+
+/**
+ * Spatial bins of a node, in the same layout as Buckets.
+ */
+using SpatialBins = std::vector<SpatialBin>;
+
+/**
+ * Clips the references into the spatial bins of all three axes in a single
+ * pass. Bins in parallel if there are enough references.
+ */
+SpatialBins binSpatially_(TaskPool &pool, const Scene *scene,
+                          const std::vector<BVHTriangle> &triangles,
+                          const SpatialBinMapper &mapper, size_t numBins,
+                          const BVHTriangleRefs &refs) {
+  const auto bin = [&](size_t begin, size_t end) {
+    SpatialBins bins(3 * numBins);
+    for (size_t i = begin; i < end; ++i) {
+      const Bounds3f refBounds = refs.bounds[i].toBounds3f();
+      const auto vertices =
+          triangleVertices_(scene, triangles[refs.indices[i]]);
+
+      for (int axis = 0; axis < 3; ++axis) {
+        SpatialBin *axisBins = &bins[axis * numBins];
+        const int32_t first = mapper.map(refBounds.minPoint[axis], axis);
+        const int32_t last = mapper.map(refBounds.maxPoint[axis], axis);
+        ++axisBins[first].entries;
+        ++axisBins[last].exits;
+        if (first == last) {
+          axisBins[first].bounds += refBounds;
+          continue;
+        }
+
+        for (int32_t b = first; b <= last; ++b) {
+          const Bounds3f clipped =
+              clipTriangle_(vertices, axis, mapper.plane(b, axis),
+                            mapper.plane(b + 1, axis), refBounds);
+          if (!isEmpty_(clipped)) {
+            axisBins[b].bounds += clipped;
+          }
+        }
+      }
+    }
+    return bins;
+  };
+
+  const size_t numRefs = refs.indices.size();
+  if (numRefs < ParallelBinningThreshold) {
+    return bin(0, numRefs);
+  }
+
+  std::vector<SpatialBins> chunkBins(
+      TaskPool::numChunks(0, numRefs, ParallelGrainSize));
+  pool.parallelFor(0, numRefs, ParallelGrainSize,
+                   [&](size_t begin, size_t end) {
+                     chunkBins[begin / ParallelGrainSize] = bin(begin, end);
+                   });
+
+  SpatialBins bins(3 * numBins);
+  for (const auto &chunk : chunkBins) {
+    for (size_t i = 0; i < bins.size(); ++i) {
+      bins[i] += chunk[i];
+    }
+  }
+  return bins;
+}
+
+/**
+ * A spatial split of a node chosen by the SAH.
+ */
+struct SpatialSplit {
+  /// Axis of the split, or -1 if there's no valid split.
+  int axis = -1;
+
+  /// First bin that goes to the second child.
+  int32_t bin = 0;
+
+  /// Sum of the surface area of each child times its number of references.
+  float weightedArea = std::numeric_limits<float>::infinity();
+};
+
+/**
+ * Finds the spatial split with the minimum SAH cost among all bins of all
+ * axes, with the same sweeps as findSAHSplit_(). References that start and
+ * end in different sides of the split are counted in both children.
+ * @param maxDuplicates Splits that add more references than this are skipped.
+ */
+SpatialSplit findSpatialSplit_(const SpatialBins &bins, size_t numBins,
+                               size_t numRefs, size_t maxDuplicates) {
+  SpatialSplit best;
+  std::array<float, MaxNumBuckets> firstWeightedAreas;
+  std::array<uint32_t, MaxNumBuckets> firstCounts;
+
+  for (int axis = 0; axis < 3; ++axis) {
+    const SpatialBin *axisBins = &bins[axis * numBins];
+
+    SpatialBin first;
+    for (size_t i = 0; i < numBins - 1; ++i) {
+      first += axisBins[i];
+      firstCounts[i] = first.entries;
+      firstWeightedAreas[i] =
+          first.entries ? first.entries * first.bounds.surfaceArea() : 0.0f;
+    }
+
+    SpatialBin second;
+    for (size_t i = numBins - 1; i > 0; --i) {
+      second += axisBins[i];
+      const size_t firstCount = firstCounts[i - 1];
+      const size_t secondCount = second.exits;
+
+      // Both children must have fewer references than the node, or the build
+      // might never finish.
+      if (!firstCount || !secondCount || firstCount >= numRefs ||
+          secondCount >= numRefs ||
+          firstCount + secondCount - numRefs > maxDuplicates) {
+        continue;
+      }
+
+      const float weightedArea = firstWeightedAreas[i - 1] +
+                                 secondCount * second.bounds.surfaceArea();
+      if (weightedArea < best.weightedArea) {
+        best.axis = axis;
+        best.bin = i;
+        best.weightedArea = weightedArea;
+      }
+    }
+  }
+
+  return best;
+}
+
+/**
+ * Distributes the references between the children of a spatial split.
+ * References that start and end on different sides of the split are clipped
+ * by the split plane and go to both children.
+ * @param childRefs Set to the references of each child.
+ * @param childBounds Set to the bounds of each child.
+ */
+void spatialPartition_(const Scene *scene,
+                       const std::vector<BVHTriangle> &triangles,
+                       const SpatialBinMapper &mapper,
+                       const SpatialSplit &split, const BVHTriangleRefs &refs,
+                       std::array<BVHTriangleRefs, 2> &childRefs,
+                       NodeBounds childBounds[2]) {
+  const int axis = split.axis;
+  const float plane = mapper.plane(split.bin, axis);
+  const auto addRef = [&](int child, uint32_t index, const Bounds3f &bounds) {
+    const SIMDBounds3f refBounds(bounds);
+    childRefs[child].add(index, refBounds);
+    childBounds[child].bounds += refBounds;
+    childBounds[child].centroidBounds += refBounds.centroid();
+  };
+
+  for (size_t i = 0; i < refs.indices.size(); ++i) {
+    const uint32_t index = refs.indices[i];
+    const Bounds3f refBounds = refs.bounds[i].toBounds3f();
+    if (mapper.map(refBounds.maxPoint[axis], axis) < split.bin) {
+      addRef(0, index, refBounds);
+      continue;
+    }
+    if (mapper.map(refBounds.minPoint[axis], axis) >= split.bin) {
+      addRef(1, index, refBounds);
+      continue;
+    }
+
+    const auto vertices = triangleVertices_(scene, triangles[index]);
+    const Bounds3f first = clipTriangle_(
+        vertices, axis, refBounds.minPoint[axis], plane, refBounds);
+    const Bounds3f second = clipTriangle_(
+        vertices, axis, plane, refBounds.maxPoint[axis], refBounds);
+    if (isEmpty_(first) && isEmpty_(second)) {
+      // Only happens due to rounding. Never lose a triangle.
+      addRef(0, index, refBounds);
+      continue;
+    }
+    if (!isEmpty_(first)) addRef(0, index, first);
+    if (!isEmpty_(second)) addRef(1, index, second);
+  }
+}
+
+/**
+ * Returns a copy of the references in [start, end).
+ */
+BVHTriangleRefs copyRefs_(const BVHTriangleRefs &refs, size_t start,
+                          size_t end) {
+  BVHTriangleRefs copy(0);
+  copy.indices.assign(refs.indices.begin() + start,
+                      refs.indices.begin() + end);
+  copy.bounds.assign(refs.bounds.begin() + start, refs.bounds.begin() + end);
+  return copy;
+}
+
+/**
+ * Data shared by every node of a SBVH build.
+ */
+struct SBVHBuildContext {
+  TaskPool &pool;
+  const BVHBuildOptions &options;
+  const Scene *scene;
+  const std::vector<BVHTriangle> &triangles;
+
+  /// Tracks the references owned by the nodes being built.
+  MemoryTracker &memory;
+
+  /// Surface area of the root, to which the overlap of children is compared.
+  float rootArea;
+};
+
+/**
+ * Builds a SBVH tree. Each node owns its references, which are copied into
+ * its children, so that a reference split by a spatial split can go to both of
+ * them. Children of big nodes are built in parallel as separate tasks. The
+ * duplication budget of a node only depends on its references, so the result
+ * is the same regardless of the number of threads in the pool.
+ * @param context Data shared by the whole build.
+ * @param allocators Allocators of the nodes and of the leaves' triangles, one
+ *   per thread of the pool.
+ * @param refs References of the node. Released before building the children.
+ * @param nodeBounds Bounds of the references and their centroids.
+ * @param maxDuplicates Maximum number of references the subtree may add.
+ * @param totalNodes Incremented by the number of nodes in the subtree.
+ */
+BVHBuildNode *SBVHBuild_(const SBVHBuildContext &context,
+                         ThreadAllocators &allocators, BVHTriangleRefs &&refs,
+                         const NodeBounds &nodeBounds, size_t maxDuplicates,
+                         size_t &totalNodes) {
+  ArenaAllocator &allocator = allocators.current();
+  const size_t numRefs = refs.indices.size();
+  CHECK_GT(numRefs, 0u);
+  ++totalNodes;
+
+  const Bounds3f bounds = nodeBounds.bounds.toBounds3f();
+  const Bounds3f centroidBounds = nodeBounds.centroidBounds.toBounds3f();
+  const auto releaseRefs = [&]() {
+    context.memory.release(refs.bytes());
+    refs = BVHTriangleRefs(0);
+  };
+  const auto buildLeaf = [&]() {
+    auto *leaf = buildLeafNode(allocator, bounds, 0, numRefs);
+    auto *leafTriangles = allocator.allocateArray<uint32_t>(numRefs);
+    std::copy(refs.indices.begin(), refs.indices.end(), leafTriangles);
+    leaf->leafTriangles = leafTriangles;
+    releaseRefs();
+    return leaf;
+  };
+
+  // If only one reference, or if centroids are on the same position, return
+  // a leaf node.
+  int dim = centroidBounds.maximumExtentAxis();
+  if (numRefs == 1 ||
+      centroidBounds.maxPoint[dim] == centroidBounds.minPoint[dim]) {
+    return buildLeaf();
+  }
+
+  std::array<BVHTriangleRefs, 2> childRefs = {
+      {BVHTriangleRefs(0), BVHTriangleRefs(0)}};
+  NodeBounds childBounds[2];
+  const auto splitRefsAt = [&](size_t splitPoint) {
+    childRefs[0] = copyRefs_(refs, 0, splitPoint);
+    childRefs[1] = copyRefs_(refs, splitPoint, numRefs);
+  };
+
+  const auto &options = context.options;
+  if (numRefs == 2) {
+    const size_t splitPoint = splitPair_(dim, 0, refs, childBounds);
+    if (prefersLeaf_(options, numRefs, bounds.surfaceArea(),
+                     childBounds[0].bounds.surfaceArea() +
+                         childBounds[1].bounds.surfaceArea())) {
+      return buildLeaf();
+    }
+    splitRefsAt(splitPoint);
+  } else {
+    const size_t numBuckets = std::min(options.numBuckets, numRefs);
+    const SIMDBucketMapper mapper(centroidBounds, numBuckets);
+    const Buckets buckets =
+        binTriangles_(context.pool, mapper, numBuckets, refs, 0, numRefs);
+    const SAHSplit objectSplit = findSAHSplit_(buckets, numBuckets);
+
+    // Spatial splits only help if the children of the object split overlap.
+    bool trySpatialSplit = maxDuplicates > 0;
+    if (trySpatialSplit && objectSplit.axis >= 0) {
+      const auto objectBounds =
+          splitChildBounds_(buckets, numBuckets, objectSplit);
+      const Bounds3f overlap = intersectBounds_(objectBounds[0].toBounds3f(),
+                                                objectBounds[1].toBounds3f());
+      trySpatialSplit =
+          !isEmpty_(overlap) &&
+          overlap.surfaceArea() > SBVHMinOverlapRatio * context.rootArea;
+    }
+
+    const SpatialBinMapper spatialMapper(bounds, options.numBuckets);
+    SpatialSplit spatialSplit;
+    if (trySpatialSplit) {
+      const SpatialBins bins =
+          binSpatially_(context.pool, context.scene, context.triangles,
+                        spatialMapper, options.numBuckets, refs);
+      spatialSplit = findSpatialSplit_(bins, options.numBuckets, numRefs,
+                                       maxDuplicates);
+    }
+
+    if ((objectSplit.axis < 0 && spatialSplit.axis < 0) ||
+        prefersLeaf_(options, numRefs, bounds.surfaceArea(),
+                     std::min(objectSplit.weightedArea,
+                              spatialSplit.weightedArea))) {
+      return buildLeaf();
+    }
+
+    if (spatialSplit.weightedArea < objectSplit.weightedArea) {
+      spatialPartition_(context.scene, context.triangles, spatialMapper,
+                        spatialSplit, refs, childRefs, childBounds);
+      dim = spatialSplit.axis;
+    }
+
+    // Otherwise, or if rounding left a child of the spatial split empty, use
+    // the object split.
+    if (childRefs[0].indices.empty() || childRefs[1].indices.empty()) {
+      if (objectSplit.axis < 0) {
+        return buildLeaf();
+      }
+
+      const auto splitBounds =
+          splitChildBounds_(buckets, numBuckets, objectSplit);
+      SIMDBounds3f childCentroidBounds[2];
+      splitRefsAt(partition_(context.pool, mapper, objectSplit, 0, numRefs,
+                             refs, childCentroidBounds));
+      for (int i = 0; i < 2; ++i) {
+        childBounds[i].bounds = splitBounds[i];
+        childBounds[i].centroidBounds = childCentroidBounds[i];
+      }
+      dim = objectSplit.axis;
+    }
+  }
+  context.memory.allocate(childRefs[0].bytes() + childRefs[1].bytes());
+  releaseRefs();
+
+  // Share the remaining budget between the children by their size.
+  const size_t numChildRefs =
+      childRefs[0].indices.size() + childRefs[1].indices.size();
+  const size_t remainingDuplicates =
+      maxDuplicates - std::min(maxDuplicates, numChildRefs - numRefs);
+  const size_t firstMaxDuplicates =
+      remainingDuplicates * childRefs[0].indices.size() / numChildRefs;
+  const size_t secondMaxDuplicates = remainingDuplicates - firstMaxDuplicates;
+
+  BVHBuildNode *firstChild, *secondChild;
+  if (numRefs >= ParallelSubtreeThreshold && context.pool.numThreads() > 1) {
+    size_t firstChildNodes = 0;
+    TaskGroup group(context.pool);
+    group.run([&]() {
+      firstChild = SBVHBuild_(context, allocators, std::move(childRefs[0]),
+                              childBounds[0], firstMaxDuplicates,
+                              firstChildNodes);
+    });
+    secondChild = SBVHBuild_(context, allocators, std::move(childRefs[1]),
+                             childBounds[1], secondMaxDuplicates, totalNodes);
+    group.wait();
+    totalNodes += firstChildNodes;
+  } else {
+    firstChild = SBVHBuild_(context, allocators, std::move(childRefs[0]),
+                            childBounds[0], firstMaxDuplicates, totalNodes);
+    secondChild = SBVHBuild_(context, allocators, std::move(childRefs[1]),
+                             childBounds[1], secondMaxDuplicates, totalNodes);
+  }
+
+  return allocator.create<BVHBuildNode>(dim, firstChild, secondChild);
+}
+
+/**
+ * Appends the triangles of the leaves of the SBVH to indices in depth-first
+ * order, setting the offset of each leaf to the start of its triangles.
+ */
+void gatherSBVHLeaves_(BVHBuildNode &node, std::vector<uint32_t> &indices) {
+  if (node.numTriangles) {
+    node.trianglesOffset = indices.size();
+    indices.insert(indices.end(), node.leafTriangles,
+                   node.leafTriangles + node.numTriangles);
+    node.leafTriangles = nullptr;
+    return;
+  }
+
+  gatherSBVHLeaves_(*node.children[0], indices);
+  gatherSBVHLeaves_(*node.children[1], indices);
+}
+
+/**
+ * Builds a Spatial split BVH, replacing the refs by the ones referenced by its
+ * leaves, in order. A triangle might be referenced by more than one leaf.
+ * Each node picks the cheapest of the binned SAH object split and of a
+ * spatial split, which clips the triangles against the planes between evenly
+ * sized bins and splits the ones crossing the chosen plane between both
+ * children. Spatial splits are only tried where the children of the object
+ * split overlap, and the number of references they add is capped by the
+ * spatial split budget, which each node shares with its children.
+ * @param totalNodes Set to the number of nodes in the tree.
+ * @return the root of the tree, allocated with allocators.
+ */
+BVHBuildNode *buildSBVH_(TaskPool &pool, const BVHBuildOptions &options,
+                         ThreadAllocators &allocators, MemoryTracker &memory,
+                         const Scene *scene,
+                         const std::vector<BVHTriangle> &triangles,
+                         BVHTriangleRefs &refs, size_t &totalNodes) {
+  const size_t numTriangles = refs.indices.size();
+  const auto rootBounds = rangeBounds_(pool, refs, 0, numTriangles);
+  const SBVHBuildContext context = {pool, options, scene, triangles, memory,
+                                    rootBounds.bounds.surfaceArea()};
+  const size_t maxDuplicates = options.spatialSplitBudget * numTriangles;
+
+  auto *root = SBVHBuild_(context, allocators, std::move(refs), rootBounds,
+                          maxDuplicates, totalNodes);
+
+  refs = BVHTriangleRefs(0);
+  refs.indices.reserve(numTriangles + maxDuplicates);
+  memory.allocate(refs.bytes());
+  gatherSBVHLeaves_(*root, refs.indices);
+  return root;
+}
+
+// Treelet optimization constants.
+/// Maximum number of leaves of a treelet. The optimal topology of a treelet
+/// is found over all 2^n subsets of its leaves, so this can't be much bigger.
+constexpr size_t MaxTreeletLeaves = 7;
+
+/// Subtrees up to this depth are optimized as separate tasks.
+constexpr size_t TreeletParallelDepth = 8;
+
+/**
+ * Returns the SAH cost of a node whose children have the given costs, not
+ * normalized by the area of the root.
+ */
+float internalNodeCost_(const BVHBuildOptions &options, float area,
+                        float firstChildCost, float secondChildCost) {
+  return options.traversalCost * area + firstChildCost + secondChildCost;
+}
+
+/**
+ * Returns the SAH cost of a leaf node, not normalized by the area of the root.
+ */
+float leafNodeCost_(const BVHBuildOptions &options, const BVHBuildNode &leaf) {
+  return options.intersectionCost * leaf.numTriangles *
+         leaf.bounds.surfaceArea();
+}
+
+/**
+ * Sets the cost of every node of the subtree.
+ */
+void computeCosts_(const BVHBuildOptions &options, BVHBuildNode &node) {
+  if (node.numTriangles) {
+    node.cost = leafNodeCost_(options, node);
+    return;
+  }
+
+  computeCosts_(options, *node.children[0]);
+  computeCosts_(options, *node.children[1]);
+  node.cost = internalNodeCost_(options, node.bounds.surfaceArea(),
+                                node.children[0]->cost,
+                                node.children[1]->cost);
+}
+
+/**
+ * Converts a flat BVH back to its pointer-based representation, for the
+ * builders that write the flat BVH directly.
+ * Leaves keep their triangle offsets, so the triangles don't change.
+ * @param allocator Allocator of the nodes.
+ * @param nodes The flat BVH.
+ * @param offset Offset of the root of the subtree to convert.
+ */
+BVHBuildNode *unflattenBVH_(ArenaAllocator &allocator,
+                            const std::vector<BVHNode> &nodes, size_t offset) {
+  const BVHNode &node = nodes[offset];
+  if (node.numTriangles) {
+    return allocator.create<BVHBuildNode>(
+        Bounds3f(node.minPoint, node.maxPoint), node.numTriangles,
+        node.trianglesOffset);
+  }
+
+  auto *firstChild = unflattenBVH_(allocator, nodes, offset + 1);
+  auto *secondChild = unflattenBVH_(allocator, nodes, node.secondChildOffset);
+  return allocator.create<BVHBuildNode>(node.splitAxis, firstChild,
+                                        secondChild);
+}
+
+/**
+ * Returns the index of the lowest bit set in a non-zero mask.
+ */
+int lowestBit_(uint32_t mask) {
+  int bit = 0;
+  while (!(mask & (1u << bit))) ++bit;
+  return bit;
+}
+
+/**
+ * Sets the children of an internal node and updates its bounds, cost and
+ * split axis. The child whose centroid is lower along the split axis goes
+ * first, as traversal expects.
+ */
+void setChildren_(const BVHBuildOptions &options, BVHBuildNode &node,
+                  BVHBuildNode *first, BVHBuildNode *second) {
+  const glm::vec3 offset = (second->bounds.minPoint + second->bounds.maxPoint) -
+                           (first->bounds.minPoint + first->bounds.maxPoint);
+  const glm::vec3 distance = glm::abs(offset);
+  int axis = 2;
+  if (distance.x >= distance.y && distance.x >= distance.z) {
+    axis = 0;
+  } else if (distance.y >= distance.z) {
+    axis = 1;
+  }
+  if (offset[axis] < 0.0f) std::swap(first, second);
+
+  node.bounds = first->bounds + second->bounds;
+  node.cost = internalNodeCost_(options, node.bounds.surfaceArea(),
+                                first->cost, second->cost);
+  node.splitAxis = axis;
+  node.children[0] = first;
+  node.children[1] = second;
+}
+
+/**
+ * Topology of a treelet with the minimum SAH cost, found by dynamic
+ * programming over all subsets of its leaves.
+ */
+class TreeletTopology {
+ public:
+  /**
+   * Finds the optimal topology of the treelet with the given leaves.
+   */
+  TreeletTopology(const BVHBuildOptions &options,
+                  const std::vector<BVHBuildNode *> &leaves) {
+    const uint32_t numSubsets = 1u << leaves.size();
+    for (size_t i = 0; i < leaves.size(); ++i) {
+      bounds_[1u << i] = leaves[i]->bounds;
+      costs_[1u << i] = leaves[i]->cost;
+    }
+
+    // Subsets of a subset are smaller numbers, so are already solved.
+    for (uint32_t subset = 1; subset < numSubsets; ++subset) {
+      const uint32_t rest = subset & (subset - 1);
+      if (!rest) continue;
+
+      bounds_[subset] = bounds_[rest] + bounds_[subset & ~rest];
+      float bestCost = std::numeric_limits<float>::infinity();
+
+      // Only partitions with the lowest leaf in the first part, as the other
+      // ones are the same partitions with the parts swapped.
+      const uint32_t lowestLeaf = subset & ~rest;
+      for (uint32_t part = rest; ; part = (part - 1) & rest) {
+        const uint32_t first = part | lowestLeaf;
+        const uint32_t second = subset & ~first;
+        if (second && costs_[first] + costs_[second] < bestCost) {
+          bestCost = costs_[first] + costs_[second];
+          partitions_[subset] = first;
+        }
+        if (!part) break;
+      }
+      costs_[subset] =
+          options.traversalCost * bounds_[subset].surfaceArea() + bestCost;
+    }
+  }
+
+  /// Returns the minimum cost of the treelet.
+  float cost(uint32_t subset) const { return costs_[subset]; }
+
+  /// Returns the leaves of the first child of the subtree with the given
+  /// leaves.
+  uint32_t partition(uint32_t subset) const { return partitions_[subset]; }
+
+ private:
+  static constexpr size_t NumSubsets = 1 << MaxTreeletLeaves;
+  std::array<Bounds3f, NumSubsets> bounds_;
+  std::array<float, NumSubsets> costs_;
+  std::array<uint32_t, NumSubsets> partitions_;
+};
+
+/**
+ * Rebuilds the subtree of the treelet with the given leaves, following the
+ * optimal topology and reusing the treelet's internal nodes.
+ */
+void assembleTreelet_(const BVHBuildOptions &options,
+                      const TreeletTopology &topology, uint32_t subset,
+                      const std::vector<BVHBuildNode *> &leaves,
+                      std::vector<BVHBuildNode *> &internals,
+                      BVHBuildNode &node) {
+  std::array<BVHBuildNode *, 2> children;
+  const uint32_t first = topology.partition(subset);
+  const uint32_t parts[2] = {first, subset & ~first};
+  for (int i = 0; i < 2; ++i) {
+    if (!(parts[i] & (parts[i] - 1))) {
+      children[i] = leaves[lowestBit_(parts[i])];
+      continue;
+    }
+
+    children[i] = internals.back();
+    internals.pop_back();
+    assembleTreelet_(options, topology, parts[i], leaves, internals,
+                     *children[i]);
+  }
+  setChildren_(options, node, children[0], children[1]);
+}
+
+/**
+ * Restructures the treelet rooted at the internal node into the topology
+ * with the minimum SAH cost.
+ * The treelet grows from the node's children by repeatedly replacing the
+ * internal leaf with the biggest surface area by its children, as that's the
+ * one whose topology matters the most.
+ */
+void optimizeTreelet_(const BVHBuildOptions &options, BVHBuildNode &root) {
+  std::vector<BVHBuildNode *> leaves = {root.children[0], root.children[1]};
+  std::vector<BVHBuildNode *> internals;
+  while (leaves.size() < MaxTreeletLeaves) {
+    int biggest = -1;
+    float biggestArea = -1.0f;
+    for (size_t i = 0; i < leaves.size(); ++i) {
+      const float area = leaves[i]->bounds.surfaceArea();
+      if (!leaves[i]->numTriangles && area > biggestArea) {
+        biggest = i;
+        biggestArea = area;
+      }
+    }
+    if (biggest < 0) break;
+
+    auto *internal = leaves[biggest];
+    leaves[biggest] = internal->children[0];
+    leaves.push_back(internal->children[1]);
+    internals.push_back(internal);
+  }
+
+  const TreeletTopology topology(options, leaves);
+  assembleTreelet_(options, topology, (1u << leaves.size()) - 1, leaves,
+                   internals, root);
+}
+
+/**
+ * Optimizes the treelets of every internal node of the subtree, bottom-up,
+ * so that the treelet of a node is formed from already optimized subtrees.
+ * Children of the top nodes are optimized in parallel as separate tasks. The
+ * treelets of different subtrees never overlap, so the result is the same
+ * regardless of the number of threads in the pool.
+ */
+void optimizeTreelets_(TaskPool &pool, const BVHBuildOptions &options,
+                       BVHBuildNode &node, size_t depth) {
+  if (node.numTriangles) return;
+
+  if (depth < TreeletParallelDepth && pool.numThreads() > 1) {
+    TaskGroup group(pool);
+    group.run([&]() {
+      optimizeTreelets_(pool, options, *node.children[0], depth + 1);
+    });
+    optimizeTreelets_(pool, options, *node.children[1], depth + 1);
+    group.wait();
+  } else {
+    optimizeTreelets_(pool, options, *node.children[0], depth + 1);
+    optimizeTreelets_(pool, options, *node.children[1], depth + 1);
+  }
+  optimizeTreelet_(options, node);
+}
+
+/**
+ * Restructures the finished BVH for a lower SAH cost, in the spirit of TRBVH
+ * (Karras and Aila, 2013): each internal node, bottom-up, finds the optimal
+ * topology of a treelet of up to MaxTreeletLeaves subtrees below it.
+ * @param options Options of the build, with the cost model and the number of
+ *   times the whole tree is optimized.
+ * @param root Root of the BVH, restructured in place. Its nodes are reused,
+ *   and leaves keep their triangles.
+ */
+void optimizeBVH_(TaskPool &pool, const BVHBuildOptions &options,
+                  BVHBuildNode &root) {
+  computeCosts_(options, root);
+  const float initialCost = root.cost;
+  for (size_t i = 0; i < options.treeletOptimizationPasses; ++i) {
+    optimizeTreelets_(pool, options, root, 0);
+  }
+
+  VLOG(1) << "Treelet optimization reduced the SAH cost by "
+          << 100.0f * (1.0f - root.cost / initialCost) << "%";
+}
+
+/**
+ * Returns the name of the build method.
+ */
+const char *methodName_(BVHBuildMethod method) {
+  switch (method) {
+    case BVHBuildMethod::SAH:
+      return "SAH";
+    case BVHBuildMethod::LBVH:
+      return "LBVH";
+    case BVHBuildMethod::HLBVH:
+      return "HLBVH";
+    case BVHBuildMethod::SBVH:
+      return "SBVH";
+  }
+  return "unknown";
+}
+
+/**
+ * Builds a BVH over the given primitives.
+ * @param scene The scene of the triangles. Only used by the SBVH, which falls
+ *   back to the SAH without it.
+ * @param triangles The primitives, returned in BVHData::triangles in the order
+ *   the leaves reference them.
+ * @param logStats If is to log the build time and memory with LOG(INFO)
+ *   instead of VLOG(2).
+ * @param primitiveBounds Returns the bounds of each primitive.
+ */
+BVHData buildBVH_(TaskPool &pool, const BVHBuildOptions &options,
+                  const Scene *scene,
+                  const std::vector<BVHTriangle> &triangles, bool logStats,
+                  const PrimitiveBounds &primitiveBounds) {
+  const auto startTime = std::chrono::steady_clock::now();
+
+  CHECK_GE(options.numBuckets, 2);
+  CHECK_LE(options.numBuckets, MaxNumBuckets);
+  CHECK_GE(options.spatialSplitBudget, 0.0f);
+  CHECK_GE(options.maxTrianglesInNode, 1u);
+  CHECK_LE(options.maxTrianglesInNode, 0xFFFFu);
+  CHECK_GT(options.intersectionCost, 0.0f);
+  CHECK_GE(options.traversalCost, 0.0f);
+
+  auto phaseStartTime = startTime;
+  const auto endPhase = [&]() {
+    const auto now = std::chrono::steady_clock::now();
+    const std::chrono::duration<double> seconds = now - phaseStartTime;
+    phaseStartTime = now;
+    return seconds.count();
+  };
+
+  MemoryTracker memory;
+  auto refs = buildRefs_(pool, triangles.size(), primitiveBounds);
+  memory.allocate(vectorBytes_(triangles) + refs.bytes());
+  const double refsSeconds = endPhase();
+
+  // The SAH-based builders allocate their nodes in the arena, and their trees
+  // are only flattened once, after being optimized. The arena only grows, so
+  // it's tracked once it's done growing.
+  Arena arena;
+  ThreadAllocators allocators(pool, arena);
+  size_t arenaBytes = 0;
+  const auto trackArena = [&]() {
+    memory.allocate(arena.bytesAllocated() - arenaBytes);
+    arenaBytes = arena.bytesAllocated();
+  };
+
+  BVHBuildNode *root = nullptr;
+  size_t numNodes = 0;
+  std::vector<BVHNode> nodes;
+  // Spatial splits need the vertices of single triangles.
+  const BVHBuildMethod method =
+      (!scene || options.pairTriangles || numSpheres(scene)) &&
+              options.method == BVHBuildMethod::SBVH
+          ? BVHBuildMethod::SAH
+          : options.method;
+  switch (method) {
+    case BVHBuildMethod::SAH:
+      root = buildSAH_(pool, options, allocators, refs, numNodes);
+      break;
+    case BVHBuildMethod::LBVH:
+      nodes = buildLBVH_(pool, memory, refs);
+      break;
+    case BVHBuildMethod::HLBVH:
+      nodes = buildHLBVH_(pool, options, allocators, memory, refs);
+      break;
+    case BVHBuildMethod::SBVH:
+      root = buildSBVH_(pool, options, allocators, memory, scene, triangles,
+                        refs, numNodes);
+      break;
+  }
+  trackArena();
+  const double buildSeconds = endPhase();
+
+  // Only the indices of the refs are needed from now on.
+  memory.release(vectorBytes_(refs.bounds));
+  refs.bounds = std::vector<SIMDBounds3f>();
+
+  // The builders that write the flat BVH directly use the depth-first layout.
+  if (options.treeletOptimizationPasses ||
+      options.nodeLayout != BVHNodeLayout::DepthFirst) {
+    if (!root) {
+      root = unflattenBVH_(allocators.current(), nodes, 0);
+      numNodes = nodes.size();
+      memory.release(vectorBytes_(nodes));
+      nodes = std::vector<BVHNode>();
+      trackArena();
+    }
+    if (options.treeletOptimizationPasses) {
+      optimizeBVH_(pool, options, *root);
+    }
+  }
+  const double optimizeSeconds = endPhase();
+
+  if (root) {
+    nodes.resize(numNodes);
+    memory.allocate(vectorBytes_(nodes));
+    flattenBVH_(*root, options.nodeLayout, nodes);
+    memory.release(arenaBytes);
+    arena.clear();
+  }
+  auto orderedTriangles = orderTriangles_(pool, triangles, refs);
+  memory.allocate(vectorBytes_(orderedTriangles));
+  const double finalizeSeconds = endPhase();
+
+  const std::chrono::duration<double> seconds =
+      std::chrono::steady_clock::now() - startTime;
+  LOG_IF(INFO, logStats || VLOG_IS_ON(2))
+      << "Built " << methodName_(method) << " BVH with " << nodes.size()
+      << " nodes and " << orderedTriangles.size()
+      << " triangle references for " << triangles.size() << " triangles in "
+      << seconds.count() << "s using " << pool.numThreads() << " threads ("
+      << triangles.size() / seconds.count() << " triangles/s)";
+  LOG_IF(INFO, logStats || VLOG_IS_ON(2))
+      << "BVH build breakdown: " << refsSeconds << "s references, "
+      << buildSeconds << "s tree, " << optimizeSeconds
+      << "s treelet optimization, " << finalizeSeconds
+      << "s flattening and ordering. Peak memory: "
+      << memory.peak() / double(1 << 20) << " MiB, of which "
+      << arenaBytes / double(1 << 20) << " MiB of build nodes";
+
+  return {std::move(nodes), std::move(orderedTriangles)};
+}
+
 }  // namespace
 
 std::ostream &operator<<(std::ostream &out, const glm::vec3 &v) {
@@ -373,19 +2202,52 @@ std::ostream &operator<<(std::ostream &out, const glm::vec3 &v) {
 
 namespace hk {
 
-BVHData buildBVH(const Scene *scene) {
-  const auto triangles = buildTriangles_(scene);
-  auto triangleInfos = buildTriangleInfos_(scene, triangles);
+Bounds3f sphereBounds(const Scene *scene, uint32_t sphereID) {
+  CHECK_LT(sphereID, numSpheres(scene)) << "Invalid sphereID.";
+  const auto *sphere = scene->spheres()->Get(sphereID);
+  const glm::vec3 center(sphere->center().x(), sphere->center().y(),
+                         sphere->center().z());
+  const glm::vec3 radius(sphere->radius());
+  return Bounds3f(center - radius, center + radius);
+}
 
-  std::vector<BVHTriangle> orderedTriangles;
-  orderedTriangles.reserve(triangles.size());
+BVHData buildBVH(const Scene *scene, const BVHBuildOptions &options) {
+  TaskPool pool(options.numThreads);
+  auto triangles = buildTriangles_(scene, 0, scene->meshes()->size(),
+                                   options.pairTriangles);
+  for (size_t i = 0; i < numSpheres(scene); ++i) {
+    triangles.emplace_back(BVHSphereMeshID, i);
+  }
+  if (options.pairTriangles) {
+    const size_t numPairs =
+        std::count_if(triangles.begin(), triangles.end(), isTrianglePair);
+    LOG(INFO) << "Paired " << 2 * numPairs << " of "
+              << triangles.size() + numPairs << " triangles";
+  }
+  return buildBVH_(pool, options, scene, triangles, true, [&](size_t i) {
+    return triangleBounds_(scene, triangles[i]);
+  });
+}
 
-  size_t totalNodes = 0;
-  const auto root = SAHBuild_(triangles, triangleInfos, 0, triangles.size(),
-                              totalNodes, orderedTriangles);
-  auto flattenedBVH = flattenBVH_(*root, totalNodes);
+BVHData buildMeshBVH(TaskPool &pool, const Scene *scene, uint32_t meshID,
+                     const BVHBuildOptions &options) {
+  CHECK_LT(meshID, scene->meshes()->size());
+  const auto triangles =
+      buildTriangles_(scene, meshID, meshID + 1, options.pairTriangles);
+  return buildBVH_(pool, options, scene, triangles, false, [&](size_t i) {
+    return triangleBounds_(scene, triangles[i]);
+  });
+}
 
-  return {std::move(flattenedBVH), std::move(orderedTriangles)};
+BVHData buildBoundsBVH(TaskPool &pool, const std::vector<Bounds3f> &bounds,
+                       const BVHBuildOptions &options) {
+  std::vector<BVHTriangle> primitives;
+  primitives.reserve(bounds.size());
+  for (size_t i = 0; i < bounds.size(); ++i) {
+    primitives.emplace_back(0, i);
+  }
+  return buildBVH_(pool, options, nullptr, primitives, false,
+                   [&](size_t i) { return bounds[i]; });
 }
 
 }  // namespace hk
@@ -17,6 +17,7 @@
 #ifndef HERAKLES_HERAKLES_SCENE_BVH_HPP
 #define HERAKLES_HERAKLES_SCENE_BVH_HPP
 
+#include <cstddef>
 #include <cstdint>
 #include <utility>
 #include <vector>
@@ -25,11 +26,18 @@
 
 #include "herakles/scene/bounds.hpp"
 #include "herakles/scene/scene_generated.h"
+#include "herakles/scene/task_pool.hpp"
 
 namespace hk {
 
 /**
  * Representation of a triangle used in the BVH.
+ * If the BVH pairs triangles, it might also be a pair of triangles of the same
+ * mesh that share an edge: the triangle at begin and the one right after it in
+ * the indices array. Pairs are marked in the high bits of meshID, so use
+ * isTrianglePair() and triangleMeshID() to read it.
+ * It might also be an analytic sphere, if its meshID is BVHSphereMeshID, in
+ * which case begin is the index of the sphere in the Scene spheres array.
  */
 struct BVHTriangle {
   /// ID of this triangle's mesh.
@@ -41,6 +49,46 @@ struct BVHTriangle {
   BVHTriangle(uint32_t meshID, uint32_t begin) : meshID(meshID), begin(begin) {}
 };
 
+/// Bit of BVHTriangle::meshID set if the BVHTriangle is a pair of triangles.
+constexpr uint32_t BVHTrianglePairBit = 0x80000000u;
+
+/// Bits of BVHTriangle::meshID that store the mesh ID of a pair.
+constexpr uint32_t BVHTriangleMeshIDMask = 0x01FFFFFFu;
+
+/// Shift of the 6 bits of BVHTriangle::meshID that store, 2 bits for each
+/// vertex of the second triangle of a pair, which vertex of the pair it is: 0
+/// to 2 for the vertices it shares with the first triangle and 3 for the one
+/// it doesn't share.
+constexpr int BVHTrianglePairShift = 25;
+
+/// BVHTriangle::meshID of the spheres. Has no pair bits, so it is never a
+/// pair.
+constexpr uint32_t BVHSphereMeshID = 0x7FFFFFFFu;
+
+/// Returns if the BVHTriangle is an analytic sphere.
+inline bool isSphere(const BVHTriangle &triangle) {
+  return triangle.meshID == BVHSphereMeshID;
+}
+
+/// Returns the number of spheres of the scene.
+inline size_t numSpheres(const hk::scene::Scene *scene) {
+  return scene->spheres() ? scene->spheres()->size() : 0;
+}
+
+/// Returns the bounding box of the sphere with the given ID.
+Bounds3f sphereBounds(const hk::scene::Scene *scene, uint32_t sphereID);
+
+/// Returns if the BVHTriangle is a pair of triangles.
+inline bool isTrianglePair(const BVHTriangle &triangle) {
+  return triangle.meshID & BVHTrianglePairBit;
+}
+
+/// Returns the mesh ID of the BVHTriangle, without the bits of a pair.
+inline uint32_t triangleMeshID(const BVHTriangle &triangle) {
+  return isTrianglePair(triangle) ? triangle.meshID & BVHTriangleMeshIDMask
+                                  : triangle.meshID;
+}
+
 /**
  * A node of the BVH represented as an element in an array.
  * This struct has exactly 256bits, and is packed so that every component is
@@ -80,17 +128,132 @@ struct BVHNode {
 struct BVHData {
   std::vector<BVHNode> nodes;
 
+  /// Triangles in the order they are referenced by the leaves. A SBVH might
+  /// have more than one copy of a triangle, each in a different leaf.
   std::vector<BVHTriangle> triangles;
 
   BVHData(std::vector<BVHNode> &&nodes, std::vector<BVHTriangle> &&triangles)
-      : nodes(nodes), triangles(triangles) {}
+      : nodes(std::move(nodes)), triangles(std::move(triangles)) {}
+};
+
+/// Algorithms that can be used to build the BVH.
+enum class BVHBuildMethod {
+  /// Binned Surface Area Heuristic. Slower to build, but produces the trees
+  /// that are the fastest to traverse.
+  SAH,
+
+  /// Linear BVH that splits triangles sorted by the Morton codes of their
+  /// centroids. Much faster to build, at the cost of slower traversal.
+  LBVH,
+
+  /// Hierarchical LBVH: treelets of nearby triangles are built with the LBVH
+  /// algorithm and joined with the SAH. Builds almost as fast as the LBVH
+  /// while traversing almost as fast as the SAH.
+  HLBVH,
+
+  /// Spatial split BVH: the SAH, but triangles that overlap both children of
+  /// a node may be split between them. Slowest to build and uses more memory,
+  /// but traverses fastest in scenes with big or long triangles.
+  SBVH,
+};
+
+/// Order of the nodes of a binary BVH in memory. Every layout keeps the first
+/// child of each node right after it and its children after it, so they are
+/// all traversed the same way.
+enum class BVHNodeLayout {
+  /// Depth-first order: the second child of a node goes after the whole
+  /// subtree of its first child.
+  DepthFirst,
+
+  /// The top nodes of every subtree are grouped in small clusters, so that
+  /// the second children of nodes near the root are close to them.
+  Clustered,
+};
+
+/// Options that control how the BVH is built.
+struct BVHBuildOptions {
+  /// Algorithm used to build the BVH.
+  BVHBuildMethod method = BVHBuildMethod::SAH;
+
+  /// Number of threads used to build the BVH. If 0, uses the number of
+  /// hardware threads. The built BVH is the same for any number of threads.
+  size_t numThreads = 0;
+
+  /// Number of SAH buckets along each axis. Split candidates are evaluated
+  /// in a single sweep, so more buckets are cheap and may improve the tree.
+  /// Must be between 2 and 256.
+  size_t numBuckets = 12;
+
+  /// Maximum number of triangles in the leaves the SAH-based builders create
+  /// when a leaf is cheaper than a split. Nodes whose triangle centroids are
+  /// all on the same position can't be split and might have more. The LBVH
+  /// always has a single triangle per leaf. Must be between 1 and 65535.
+  size_t maxTrianglesInNode = 1;
+
+  /// Cost of intersecting a ray with a triangle in the SAH cost model.
+  float intersectionCost = 1.0f;
+
+  /// Cost of traversing a node in the SAH cost model. Only its ratio to
+  /// intersectionCost affects the tree.
+  float traversalCost = 1.0f;
+
+  /// Maximum number of triangle references the SBVH may add by splitting
+  /// triangles, relative to the number of triangles in the scene. Each added
+  /// reference is a duplicated BVHTriangle in BVHData::triangles.
+  float spatialSplitBudget = 0.3f;
+
+  /// Number of treelet restructuring passes run over the finished tree. Each
+  /// pass finds the topology with the minimum SAH cost for small treelets of
+  /// every node, trading build time for faster traversal. 0 disables it.
+  size_t treeletOptimizationPasses = 0;
+
+  /// Order of the nodes in memory. Doesn't change the tree.
+  BVHNodeLayout nodeLayout = BVHNodeLayout::DepthFirst;
+
+  /// If is to pair the consecutive triangles of each mesh that share an edge
+  /// into a single BVHTriangle, like the two triangles of a quad, so that
+  /// quad-dominant meshes have close to half the BVH triangles and leaves.
+  /// The SBVH can't split pairs, so the SAH is used instead of it.
+  bool pairTriangles = false;
 };
 
 /**
  * Builds a Bounding Volume Hierarchy from the given scene.
+ * @param scene The scene whose triangles and spheres will be in the BVH. The
+ *   SBVH can't split spheres, so the SAH is used instead of it in scenes with
+ *   spheres.
+ * @param options Options that control how the BVH is built.
  * @return a pair containing the BVH tree vector and the BVH triangle vector.
  */
-BVHData buildBVH(const hk::scene::Scene *scene);
+BVHData buildBVH(const hk::scene::Scene *scene,
+                 const BVHBuildOptions &options = {});
+
+/**
+ * Builds a BVH over the triangles of a single mesh, in the mesh's own space.
+ * Used for the bottom levels of a two-level BVH. Doesn't log the build, as
+ * scenes might have many meshes.
+ * @param pool The pool that runs the build. Many meshes can be built at once
+ *   in the same pool.
+ * @param scene The scene of the mesh.
+ * @param meshID ID of the mesh in the Scene meshes array.
+ * @param options Options that control how the BVH is built.
+ * @return the BVH of the mesh. Its triangles are ordered as in buildBVH().
+ */
+BVHData buildMeshBVH(TaskPool &pool, const hk::scene::Scene *scene,
+                     uint32_t meshID, const BVHBuildOptions &options = {});
+
+/**
+ * Builds a BVH over arbitrary primitives, given by their bounding boxes, like
+ * the instances of a two-level BVH. The SBVH can't split the primitives, so
+ * the SAH is used instead of it.
+ * @param pool The pool that runs the build.
+ * @param bounds The bounding box of each primitive.
+ * @param options Options that control how the BVH is built.
+ * @return the BVH. The begin of each of its BVHTriangle is the index of the
+ *   primitive in the bounds vector, and its meshID is always 0.
+ */
+BVHData buildBoundsBVH(TaskPool &pool, const std::vector<Bounds3f> &bounds,
+                       const BVHBuildOptions &options = {});
 
 }  // namespace hk
 
@@ -0,0 +1,399 @@
+/*
+ * Copyright 2017 Renato Utsch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "herakles/scene/bvh_cache.hpp"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+
+#include <glog/logging.h>
+
+namespace hk {
+namespace {
+using hk::scene::Scene;
+
+/// Identifies .hksbvh files.
+constexpr char CacheMagic[4] = {'H', 'K', 'B', '1'};
+
+/// Version of the cache format. Must be increased whenever the layout of the
+/// file, of BVHNode or of BVHTriangle changes, or the builders change the BVHs
+/// they build for the same options.
+constexpr uint32_t CacheVersion = 4;
+
+// 64-bit FNV-1a constants.
+constexpr uint64_t FNVOffsetBasis = 14695981039346656037ull;
+constexpr uint64_t FNVPrime = 1099511628211ull;
+
+/**
+ * Header of a .hksbvh file, followed by the nodes and then by the triangles.
+ */
+struct CacheHeader {
+  char magic[4];
+  uint32_t version;
+
+  /// Hash of the scene geometry, or of the mesh geometry for mesh caches.
+  uint64_t geometryHash;
+
+  // Build options that change the BVH.
+  uint32_t method;
+  uint32_t numBuckets;
+  uint32_t maxTrianglesInNode;
+  uint32_t treeletOptimizationPasses;
+  float intersectionCost;
+  float traversalCost;
+  float spatialSplitBudget;
+  uint32_t nodeLayout;
+  uint32_t pairTriangles;
+
+  /// Sizes of BVHNode and BVHTriangle, as a safety check.
+  uint16_t nodeSize;
+  uint16_t triangleSize;
+
+  uint64_t numNodes;
+  uint64_t numTriangles;
+
+  /// Hash of the nodes and triangles that follow the header, so that a
+  /// corrupted file is never uploaded and traversed.
+  uint64_t payloadHash;
+};
+static_assert(sizeof(CacheHeader) == 80, "CacheHeader must have no padding.");
+
+/**
+ * Hashes the bytes with a variant of FNV-1a that consumes 64 bits at a time,
+ * folding the high half of the state into the low half after each step so
+ * that every bit of the input affects the whole hash.
+ */
+uint64_t hashBytes_(const void *data, size_t size, uint64_t hash) {
+  const auto *bytes = static_cast<const uint8_t *>(data);
+  size_t i = 0;
+  for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, bytes + i, sizeof(word));
+    hash = (hash ^ word) * FNVPrime;
+    hash ^= hash >> 32;
+  }
+  for (; i < size; ++i) {
+    hash = (hash ^ bytes[i]) * FNVPrime;
+  }
+  return hash;
+}
+
+/// Hashes a single value.
+template <typename T>
+uint64_t hashValue_(const T &value, uint64_t hash) {
+  return hashBytes_(&value, sizeof(value), hash);
+}
+
+/// Hashes the nodes and triangles of the BVH, as stored in a cache file.
+uint64_t hashPayload_(const BVHData &bvh) {
+  uint64_t hash = hashBytes_(bvh.nodes.data(),
+                             bvh.nodes.size() * sizeof(BVHNode),
+                             FNVOffsetBasis);
+  return hashBytes_(bvh.triangles.data(),
+                    bvh.triangles.size() * sizeof(BVHTriangle), hash);
+}
+
+/// Result of reading a cache file.
+enum class CacheRead {
+  Hit,
+  Missing,
+  Stale,
+  Corrupted,
+};
+
+/**
+ * Returns the header of the cache of the given geometry hash and options,
+ * without the number of nodes and triangles and the payload hash.
+ */
+CacheHeader cacheHeader_(uint64_t geometryHash,
+                         const BVHBuildOptions &options) {
+  CacheHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CacheMagic, sizeof(CacheMagic));
+  header.version = CacheVersion;
+  header.geometryHash = geometryHash;
+  header.method = static_cast<uint32_t>(options.method);
+  header.numBuckets = options.numBuckets;
+  header.maxTrianglesInNode = options.maxTrianglesInNode;
+  header.treeletOptimizationPasses = options.treeletOptimizationPasses;
+  header.intersectionCost = options.intersectionCost;
+  header.traversalCost = options.traversalCost;
+  header.spatialSplitBudget = options.spatialSplitBudget;
+  header.nodeLayout = static_cast<uint32_t>(options.nodeLayout);
+  header.pairTriangles = options.pairTriangles;
+  header.nodeSize = sizeof(BVHNode);
+  header.triangleSize = sizeof(BVHTriangle);
+  return header;
+}
+
+/// Writes the array to the file. Returns if all of it was written.
+template <typename T>
+bool writeArray_(FILE *file, const T *data, size_t size) {
+  return fwrite(data, sizeof(T), size, file) == size;
+}
+
+/**
+ * Writes the header and the BVH to the file, through a temporary file that
+ * is renamed over it.
+ * @return if the file was written.
+ */
+bool writeCache_(const std::string &filename, CacheHeader header,
+                 const BVHData &bvh) {
+  header.numNodes = bvh.nodes.size();
+  header.numTriangles = bvh.triangles.size();
+  header.payloadHash = hashPayload_(bvh);
+
+  // mkstemp() creates a file that no other thread or process writes to, even
+  // when they write the same cache at the same time.
+  std::string temporaryFilename = filename + ".XXXXXX";
+  const int fd = mkstemp(&temporaryFilename[0]);
+  if (fd < 0) {
+    LOG(WARNING) << "Couldn't create a temporary file for the BVH cache "
+                 << filename;
+    return false;
+  }
+
+  // mkstemp() only lets the owner read the file.
+  fchmod(fd, 0644);
+  FILE *file = fdopen(fd, "wb");
+  if (!file) close(fd);
+  bool written = file && writeArray_(file, &header, 1) &&
+                 writeArray_(file, bvh.nodes.data(), bvh.nodes.size()) &&
+                 writeArray_(file, bvh.triangles.data(), bvh.triangles.size());
+  if (file && fclose(file)) written = false;
+  if (!written) {
+    LOG(WARNING) << "Couldn't write the BVH cache " << temporaryFilename;
+    std::remove(temporaryFilename.c_str());
+    return false;
+  }
+
+  // rename() atomically replaces any previous cache, so readers always see
+  // either the old or the new one.
+  if (std::rename(temporaryFilename.c_str(), filename.c_str())) {
+    LOG(WARNING) << "Couldn't rename the BVH cache to " << filename;
+    std::remove(temporaryFilename.c_str());
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Reads a BVH written by writeCache_() with the expected header. Logs why
+ * corrupted files are ignored.
+ */
+CacheRead readCache_(const std::string &filename, const CacheHeader &expected,
+                     BVHData &bvh) {
+  std::ifstream file(filename, std::ios::binary | std::ios::ate);
+  if (!file.is_open()) return CacheRead::Missing;
+  const uint64_t fileSize = file.tellg();
+  file.seekg(0, std::ios::beg);
+
+  CacheHeader header;
+  if (fileSize < sizeof(header) ||
+      !file.read(reinterpret_cast<char *>(&header), sizeof(header))) {
+    LOG(WARNING) << "Ignoring truncated BVH cache " << filename;
+    return CacheRead::Corrupted;
+  }
+
+  // Compare everything but the sizes and hash of the arrays.
+  CacheHeader expectedSizes = expected;
+  expectedSizes.numNodes = header.numNodes;
+  expectedSizes.numTriangles = header.numTriangles;
+  expectedSizes.payloadHash = header.payloadHash;
+  if (memcmp(&header, &expectedSizes, sizeof(header))) return CacheRead::Stale;
+
+  if (fileSize != sizeof(header) + header.numNodes * sizeof(BVHNode) +
+                      header.numTriangles * sizeof(BVHTriangle)) {
+    LOG(WARNING) << "Ignoring BVH cache " << filename << " of the wrong size";
+    return CacheRead::Corrupted;
+  }
+
+  std::vector<BVHNode> nodes(header.numNodes);
+  std::vector<BVHTriangle> triangles(header.numTriangles, BVHTriangle(0, 0));
+  if (!file.read(reinterpret_cast<char *>(nodes.data()),
+                 nodes.size() * sizeof(BVHNode)) ||
+      !file.read(reinterpret_cast<char *>(triangles.data()),
+                 triangles.size() * sizeof(BVHTriangle))) {
+    LOG(WARNING) << "Couldn't read the BVH cache " << filename;
+    return CacheRead::Corrupted;
+  }
+
+  BVHData cached(std::move(nodes), std::move(triangles));
+  if (hashPayload_(cached) != header.payloadHash) {
+    LOG(WARNING) << "Ignoring corrupted BVH cache " << filename;
+    return CacheRead::Corrupted;
+  }
+
+  bvh = std::move(cached);
+  return CacheRead::Hit;
+}
+
+/**
+ * Returns the file of the mesh cache directory that stores the BVH of the
+ * given mesh header. The name is a hash of the whole header, so that BVHs
+ * built with different options coexist.
+ */
+std::string meshCacheFilename_(const std::string &directory,
+                               const CacheHeader &header) {
+  std::ostringstream filename;
+  filename << directory << "/" << std::hex << std::setw(16)
+           << std::setfill('0')
+           << hashBytes_(&header, sizeof(header), FNVOffsetBasis)
+           << ".hksbvh";
+  return filename.str();
+}
+
+}  // namespace
+
+uint64_t hashSceneGeometry(const Scene *scene) {
+  uint64_t hash = FNVOffsetBasis;
+  const auto *meshes = scene->meshes();
+  hash = hashValue_(uint64_t(meshes ? meshes->size() : 0), hash);
+  if (meshes) {
+    for (size_t i = 0; i < meshes->size(); ++i) {
+      const auto *mesh = meshes->Get(i);
+      hash = hashValue_(mesh->begin(), hash);
+      hash = hashValue_(mesh->end(), hash);
+    }
+  }
+
+  const auto *indices = scene->indices();
+  hash = hashValue_(uint64_t(indices ? indices->size() : 0), hash);
+  if (indices) {
+    hash = hashBytes_(indices->Data(), indices->size() * sizeof(uint32_t),
+                      hash);
+  }
+
+  const auto *vertices = scene->vertices();
+  hash = hashValue_(uint64_t(vertices ? vertices->size() : 0), hash);
+  if (vertices) {
+    hash = hashBytes_(vertices->Data(),
+                      vertices->size() * sizeof(hk::scene::vec4), hash);
+  }
+
+  // Scenes without spheres keep the hash they had before spheres existed.
+  const auto *spheres = scene->spheres();
+  if (spheres && spheres->size()) {
+    hash = hashValue_(uint64_t(spheres->size()), hash);
+    for (size_t i = 0; i < spheres->size(); ++i) {
+      const auto *sphere = spheres->Get(i);
+      hash = hashValue_(sphere->center().x(), hash);
+      hash = hashValue_(sphere->center().y(), hash);
+      hash = hashValue_(sphere->center().z(), hash);
+      hash = hashValue_(sphere->radius(), hash);
+    }
+  }
+  return hash;
+}
+
+bool saveBVHCache(const std::string &filename, const Scene *scene,
+                  const BVHBuildOptions &options, const BVHData &bvh) {
+  if (!writeCache_(filename, cacheHeader_(hashSceneGeometry(scene), options),
+                   bvh)) {
+    return false;
+  }
+
+  LOG(INFO) << "Wrote the BVH cache " << filename << " with "
+            << bvh.nodes.size() << " nodes and " << bvh.triangles.size()
+            << " triangles";
+  return true;
+}
+
+bool loadBVHCache(const std::string &filename, const Scene *scene,
+                  const BVHBuildOptions &options, BVHData &bvh) {
+  const CacheHeader expected =
+      cacheHeader_(hashSceneGeometry(scene), options);
+  switch (readCache_(filename, expected, bvh)) {
+    case CacheRead::Hit:
+      LOG(INFO) << "Loaded the BVH cache " << filename << " with "
+                << bvh.nodes.size() << " nodes and " << bvh.triangles.size()
+                << " triangles";
+      return true;
+    case CacheRead::Missing:
+      LOG(INFO) << "No BVH cache at " << filename;
+      return false;
+    case CacheRead::Stale:
+      LOG(INFO) << "Ignoring BVH cache " << filename
+                << " built for another scene, options or format";
+      return false;
+    case CacheRead::Corrupted:
+      return false;
+  }
+  return false;
+}
+
+uint64_t hashMeshGeometry(const Scene *scene, uint32_t meshID) {
+  const auto *mesh = scene->meshes()->Get(meshID);
+  const auto *indices = scene->indices();
+  const auto *vertices = scene->vertices();
+  uint64_t hash = FNVOffsetBasis;
+  hash = hashValue_(uint64_t(mesh->end() - mesh->begin()), hash);
+  for (uint32_t i = mesh->begin(); i < mesh->end(); ++i) {
+    hash = hashBytes_(vertices->Get(indices->Get(i)),
+                      sizeof(hk::scene::vec4), hash);
+  }
+  return hash;
+}
+
+bool saveMeshBVHCache(const std::string &directory, const Scene *scene,
+                      uint32_t meshID, const BVHBuildOptions &options,
+                      const BVHData &bvh) {
+  const CacheHeader header =
+      cacheHeader_(hashMeshGeometry(scene, meshID), options);
+
+  // Store the triangles relative to the mesh, so that any mesh with the same
+  // geometry can use them.
+  const uint32_t meshBegin = scene->meshes()->Get(meshID)->begin();
+  BVHData relative = bvh;
+  for (auto &triangle : relative.triangles) {
+    triangle.meshID = isTrianglePair(triangle)
+                          ? triangle.meshID & ~BVHTriangleMeshIDMask
+                          : 0;
+    triangle.begin -= meshBegin;
+  }
+
+  const std::string filename = meshCacheFilename_(directory, header);
+  if (!writeCache_(filename, header, relative)) return false;
+  VLOG(1) << "Wrote the BVH of mesh " << meshID << " to " << filename;
+  return true;
+}
+
+bool loadMeshBVHCache(const std::string &directory, const Scene *scene,
+                      uint32_t meshID, const BVHBuildOptions &options,
+                      BVHData &bvh) {
+  const CacheHeader expected =
+      cacheHeader_(hashMeshGeometry(scene, meshID), options);
+  const std::string filename = meshCacheFilename_(directory, expected);
+  if (readCache_(filename, expected, bvh) != CacheRead::Hit) return false;
+
+  const uint32_t meshBegin = scene->meshes()->Get(meshID)->begin();
+  for (auto &triangle : bvh.triangles) {
+    triangle.meshID |= meshID;
+    triangle.begin += meshBegin;
+  }
+  VLOG(1) << "Loaded the BVH of mesh " << meshID << " from " << filename;
+  return true;
+}
+
+}  // namespace hk
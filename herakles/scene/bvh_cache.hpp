@@ -0,0 +1,103 @@
+/*
+ * Copyright 2017 Renato Utsch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HERAKLES_HERAKLES_SCENE_BVH_CACHE_HPP
+#define HERAKLES_HERAKLES_SCENE_BVH_CACHE_HPP
+
+#include <cstdint>
+#include <string>
+
+#include "herakles/scene/bvh.hpp"
+#include "herakles/scene/scene_generated.h"
+
+namespace hk {
+
+/**
+ * Returns a hash of the parts of the scene its BVH depends on: the meshes'
+ * triangle ranges, the indices, the vertices and the spheres' bounds. Changing
+ * the camera, lights or materials keeps the hash.
+ */
+uint64_t hashSceneGeometry(const hk::scene::Scene *scene);
+
+/**
+ * Writes the BVH to a .hksbvh sidecar file, keyed by the hash of the scene
+ * geometry and by the build options. The nodes and triangles are stored
+ * exactly as they are uploaded to the GPU. The file is written to a
+ * temporary file first and then renamed, so a crash never leaves a truncated
+ * cache behind, and stores a hash of the nodes and triangles that loads
+ * verify.
+ * @param filename The cache file.
+ * @param scene The scene the BVH was built for.
+ * @param options Options the BVH was built with.
+ * @param bvh The BVH, as returned by buildBVH().
+ * @return if the file was written.
+ */
+bool saveBVHCache(const std::string &filename, const hk::scene::Scene *scene,
+                  const BVHBuildOptions &options, const BVHData &bvh);
+
+/**
+ * Reads a BVH written by saveBVHCache().
+ * @param filename The cache file.
+ * @param scene The scene whose BVH is wanted.
+ * @param options Options the BVH must have been built with. The number of
+ *   threads is ignored, as it doesn't change the BVH.
+ * @param bvh Set to the cached BVH on a hit.
+ * @return true on a hit, or false if the file doesn't exist, is corrupted or
+ *   was written for another scene geometry or other options.
+ */
+bool loadBVHCache(const std::string &filename, const hk::scene::Scene *scene,
+                  const BVHBuildOptions &options, BVHData &bvh);
+
+/**
+ * Returns a hash of the geometry of a mesh: the positions of the vertices of
+ * its triangles, in order. The hash doesn't depend on where the mesh is in the
+ * indices and vertices arrays, so it is kept when other meshes change.
+ */
+uint64_t hashMeshGeometry(const hk::scene::Scene *scene, uint32_t meshID);
+
+/**
+ * Writes the BVH of a single mesh to a content-addressed cache directory. The
+ * file is named after the hash of the mesh geometry and of the build options,
+ * so meshes with the same geometry share it, and caches of different options
+ * coexist.
+ * @param directory The cache directory, which must exist.
+ * @param scene The scene of the mesh.
+ * @param meshID The mesh the BVH was built for.
+ * @param options Options the BVH was built with.
+ * @param bvh The BVH, as returned by buildMeshBVH().
+ * @return if the file was written.
+ */
+bool saveMeshBVHCache(const std::string &directory,
+                      const hk::scene::Scene *scene, uint32_t meshID,
+                      const BVHBuildOptions &options, const BVHData &bvh);
+
+/**
+ * Reads the BVH of a mesh written by saveMeshBVHCache() for any mesh with the
+ * same geometry, and points its triangles to the given mesh.
+ * @param directory The cache directory.
+ * @param scene The scene of the mesh.
+ * @param meshID The mesh whose BVH is wanted.
+ * @param options Options the BVH must have been built with.
+ * @param bvh Set to the cached BVH on a hit.
+ * @return true on a hit, or false if there is no valid cache for the mesh.
+ */
+bool loadMeshBVHCache(const std::string &directory,
+                      const hk::scene::Scene *scene, uint32_t meshID,
+                      const BVHBuildOptions &options, BVHData &bvh);
+
+}  // namespace hk
+
+#endif  // !HERAKLES_HERAKLES_SCENE_BVH_CACHE_HPP
@@ -0,0 +1,229 @@
+/*
+ * Copyright 2017 Renato Utsch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "herakles/scene/bvh_cache.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "herakles/scene/random_scene.hpp"
+#include "herakles/scene/task_pool.hpp"
+
+namespace {
+using ::hk::BVHBuildMethod;
+using ::hk::BVHBuildOptions;
+using ::hk::BVHData;
+using ::hk::RandomScene;
+using ::hk::TaskPool;
+using ::hk::buildBVH;
+using ::hk::buildMeshBVH;
+using ::hk::hashMeshGeometry;
+using ::hk::hashSceneGeometry;
+using ::hk::loadBVHCache;
+using ::hk::loadMeshBVHCache;
+using ::hk::saveBVHCache;
+using ::hk::saveMeshBVHCache;
+
+/// Returns a cache filename for the test, removing any previous file.
+std::string cacheFilename(const std::string &name) {
+  const std::string filename = ::testing::TempDir() + name + ".hksbvh";
+  std::remove(filename.c_str());
+  return filename;
+}
+
+/**
+ * Scene with a random first mesh and a second mesh that has the same geometry
+ * in every scene, placed after the first one in the arrays.
+ */
+class TwoMeshScene {
+ public:
+  TwoMeshScene(size_t numFirstMeshTriangles, uint32_t seed) {
+    const RandomScene firstMesh(numFirstMeshTriangles, seed);
+    const RandomScene secondMesh(500);
+    std::vector<hk::scene::Mesh> meshes;
+    std::vector<uint32_t> indices;
+    std::vector<hk::scene::vec4> vertices;
+    for (const auto *mesh : {firstMesh.scene(), secondMesh.scene()}) {
+      const uint32_t begin = indices.size(), vertexOffset = vertices.size();
+      for (size_t i = 0; i < mesh->indices()->size(); ++i) {
+        indices.push_back(vertexOffset + mesh->indices()->Get(i));
+      }
+      for (size_t i = 0; i < mesh->vertices()->size(); ++i) {
+        vertices.push_back(*mesh->vertices()->Get(i));
+      }
+      meshes.emplace_back(begin, indices.size(), 0, -1);
+    }
+
+    const auto meshesOffset = builder_.CreateVectorOfStructs(meshes);
+    const auto indicesOffset = builder_.CreateVector(indices);
+    const auto verticesOffset = builder_.CreateVectorOfStructs(vertices);
+    hk::scene::FinishSceneBuffer(
+        builder_,
+        hk::scene::CreateScene(builder_, nullptr, false, nullptr, {}, {},
+                               meshesOffset, {}, indicesOffset,
+                               verticesOffset));
+  }
+
+  /// Returns the scene.
+  const hk::scene::Scene *scene() const {
+    return hk::scene::GetScene(builder_.GetBufferPointer());
+  }
+
+ private:
+  flatbuffers::FlatBufferBuilder builder_;
+};
+
+TEST(BVHCacheTest, LoadsTheSavedBVH) {
+  const RandomScene scene(1000);
+  BVHBuildOptions options;
+  options.method = BVHBuildMethod::SBVH;
+  const BVHData bvh = buildBVH(scene.scene(), options);
+  const std::string filename = cacheFilename("loads_the_saved_bvh");
+  ASSERT_TRUE(saveBVHCache(filename, scene.scene(), options, bvh));
+
+  // The number of threads doesn't change the BVH.
+  options.numThreads = 1;
+  BVHData cached({}, {});
+  ASSERT_TRUE(loadBVHCache(filename, scene.scene(), options, cached));
+  ASSERT_EQ(bvh.nodes.size(), cached.nodes.size());
+  ASSERT_EQ(bvh.triangles.size(), cached.triangles.size());
+  EXPECT_FALSE(memcmp(bvh.nodes.data(), cached.nodes.data(),
+                      bvh.nodes.size() * sizeof(bvh.nodes[0])));
+  EXPECT_FALSE(memcmp(bvh.triangles.data(), cached.triangles.data(),
+                      bvh.triangles.size() * sizeof(bvh.triangles[0])));
+}
+
+TEST(BVHCacheTest, MissesForOtherScenesOrOptions) {
+  const RandomScene scene(1000);
+  const BVHBuildOptions options;
+  const std::string filename = cacheFilename("misses");
+  ASSERT_TRUE(saveBVHCache(filename, scene.scene(), options,
+                           buildBVH(scene.scene(), options)));
+
+  BVHData cached({}, {});
+  const RandomScene otherScene(1000, 7);
+  EXPECT_NE(hashSceneGeometry(scene.scene()),
+            hashSceneGeometry(otherScene.scene()));
+  EXPECT_FALSE(loadBVHCache(filename, otherScene.scene(), options, cached));
+
+  BVHBuildOptions otherOptions;
+  otherOptions.maxTrianglesInNode = 4;
+  EXPECT_FALSE(loadBVHCache(filename, scene.scene(), otherOptions, cached));
+  EXPECT_TRUE(cached.nodes.empty());
+}
+
+TEST(BVHCacheTest, MissesForMissingOrTruncatedFiles) {
+  const RandomScene scene(1000);
+  const BVHBuildOptions options;
+  const std::string filename = cacheFilename("truncated");
+  BVHData cached({}, {});
+  EXPECT_FALSE(loadBVHCache(filename, scene.scene(), options, cached));
+
+  ASSERT_TRUE(saveBVHCache(filename, scene.scene(), options,
+                           buildBVH(scene.scene(), options)));
+  std::ifstream input(filename, std::ios::binary);
+  const std::string contents((std::istreambuf_iterator<char>(input)),
+                             std::istreambuf_iterator<char>());
+  input.close();
+  std::ofstream(filename, std::ios::binary | std::ios::trunc)
+      .write(contents.data(), contents.size() - 1);
+  EXPECT_FALSE(loadBVHCache(filename, scene.scene(), options, cached));
+}
+
+TEST(BVHCacheTest, ConcurrentWritersLeaveAValidCache) {
+  const RandomScene scene(1000);
+  const BVHBuildOptions options;
+  const BVHData bvh = buildBVH(scene.scene(), options);
+  const std::string filename = cacheFilename("concurrent");
+
+  std::vector<std::thread> writers;
+  for (int i = 0; i < 4; ++i) {
+    writers.emplace_back([&]() {
+      saveBVHCache(filename, scene.scene(), options, bvh);
+    });
+  }
+  for (auto &writer : writers) {
+    writer.join();
+  }
+
+  BVHData cached({}, {});
+  ASSERT_TRUE(loadBVHCache(filename, scene.scene(), options, cached));
+  EXPECT_EQ(bvh.nodes.size(), cached.nodes.size());
+}
+
+TEST(BVHCacheTest, MissesForCorruptedFiles) {
+  const RandomScene scene(1000);
+  const BVHBuildOptions options;
+  const std::string filename = cacheFilename("corrupted");
+  ASSERT_TRUE(saveBVHCache(filename, scene.scene(), options,
+                           buildBVH(scene.scene(), options)));
+
+  // Flip a bit of the payload, keeping the size of the file.
+  std::fstream file(filename,
+                    std::ios::binary | std::ios::in | std::ios::out);
+  file.seekg(0, std::ios::end);
+  const std::streamoff middle = file.tellg() / 2;
+  char byte;
+  file.seekg(middle);
+  file.get(byte);
+  file.seekp(middle);
+  file.put(byte ^ 1);
+  file.close();
+
+  BVHData cached({}, {});
+  EXPECT_FALSE(loadBVHCache(filename, scene.scene(), options, cached));
+  EXPECT_TRUE(cached.nodes.empty());
+}
+
+TEST(BVHCacheTest, SharesMeshBVHsByGeometry) {
+  const TwoMeshScene scene(100, 1), otherScene(300, 2);
+  EXPECT_NE(hashMeshGeometry(scene.scene(), 0),
+            hashMeshGeometry(otherScene.scene(), 0));
+  EXPECT_EQ(hashMeshGeometry(scene.scene(), 1),
+            hashMeshGeometry(otherScene.scene(), 1));
+
+  TaskPool pool;
+  const BVHBuildOptions options;
+  const std::string directory = ::testing::TempDir();
+  ASSERT_TRUE(saveMeshBVHCache(directory, scene.scene(), 1, options,
+                               buildMeshBVH(pool, scene.scene(), 1, options)));
+
+  // The second mesh moved in the arrays, but its geometry didn't change.
+  BVHData cached({}, {});
+  ASSERT_TRUE(
+      loadMeshBVHCache(directory, otherScene.scene(), 1, options, cached));
+  const BVHData bvh = buildMeshBVH(pool, otherScene.scene(), 1, options);
+  ASSERT_EQ(bvh.nodes.size(), cached.nodes.size());
+  ASSERT_EQ(bvh.triangles.size(), cached.triangles.size());
+  EXPECT_FALSE(memcmp(bvh.nodes.data(), cached.nodes.data(),
+                      bvh.nodes.size() * sizeof(bvh.nodes[0])));
+  EXPECT_FALSE(memcmp(bvh.triangles.data(), cached.triangles.data(),
+                      bvh.triangles.size() * sizeof(bvh.triangles[0])));
+
+  BVHBuildOptions otherOptions;
+  otherOptions.maxTrianglesInNode = 4;
+  EXPECT_FALSE(
+      loadMeshBVHCache(directory, otherScene.scene(), 1, otherOptions, cached));
+}
+
+}  // namespace
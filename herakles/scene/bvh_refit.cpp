@@ -0,0 +1,128 @@
+/*
+ * Copyright 2017 Renato Utsch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "herakles/scene/bvh_refit.hpp"
+
+#include <glog/logging.h>
+
+#include "herakles/scene/bounds.hpp"
+
+namespace hk {
+namespace {
+using hk::scene::Scene;
+
+/// Subtrees up to this depth are refitted as separate tasks.
+constexpr size_t RefitParallelDepth = 8;
+
+/**
+ * Returns the vertex at the given position of the indices array.
+ */
+glm::vec3 vertex_(const Scene *scene, uint32_t index) {
+  const auto *v = scene->vertices()->Get(scene->indices()->Get(index));
+  return glm::vec3(v->x(), v->y(), v->z());
+}
+
+/**
+ * Refits the subtree rooted at the given node.
+ * @return the new bounds of the subtree.
+ */
+Bounds3f refitNode_(TaskPool &pool, const Scene *scene, BVHData &bvh,
+                    size_t offset, size_t depth) {
+  BVHNode &node = bvh.nodes[offset];
+  Bounds3f bounds;
+  if (node.numTriangles) {
+    const size_t end = node.trianglesOffset + node.numTriangles;
+    for (size_t i = node.trianglesOffset; i < end; ++i) {
+      // Pairs also have the vertices of the triangle after the first one.
+      const auto &triangle = bvh.triangles[i];
+      if (isSphere(triangle)) {
+        bounds += sphereBounds(scene, triangle.begin);
+        continue;
+      }
+      const uint32_t numVertices = isTrianglePair(triangle) ? 6 : 3;
+      for (uint32_t v = 0; v < numVertices; ++v) {
+        bounds += vertex_(scene, triangle.begin + v);
+      }
+    }
+  } else if (depth < RefitParallelDepth && pool.numThreads() > 1) {
+    Bounds3f firstBounds;
+    TaskGroup group(pool);
+    group.run([&]() {
+      firstBounds = refitNode_(pool, scene, bvh, offset + 1, depth + 1);
+    });
+    bounds = refitNode_(pool, scene, bvh, node.secondChildOffset, depth + 1);
+    group.wait();
+    bounds += firstBounds;
+  } else {
+    bounds = refitNode_(pool, scene, bvh, offset + 1, depth + 1) +
+             refitNode_(pool, scene, bvh, node.secondChildOffset, depth + 1);
+  }
+
+  node.minPoint = bounds.minPoint;
+  node.maxPoint = bounds.maxPoint;
+  return bounds;
+}
+
+}  // namespace
+
+void refitBVH(TaskPool &pool, const Scene *scene, BVHData &bvh) {
+  CHECK(!bvh.nodes.empty()) << "Can't refit an empty BVH.";
+  refitNode_(pool, scene, bvh, 0, 0);
+}
+
+float computeSAHCost(const BVHData &bvh, const BVHBuildOptions &options) {
+  if (bvh.nodes.empty()) return 0.0f;
+
+  float cost = 0.0f;
+  for (const auto &node : bvh.nodes) {
+    const float area = Bounds3f(node.minPoint, node.maxPoint).surfaceArea();
+    cost += area * (node.numTriangles
+                        ? options.intersectionCost * node.numTriangles
+                        : options.traversalCost);
+  }
+
+  const auto &root = bvh.nodes[0];
+  const float rootArea = Bounds3f(root.minPoint, root.maxPoint).surfaceArea();
+  return rootArea > 0.0f ? cost / rootArea : 0.0f;
+}
+
+BVHRefitter::BVHRefitter(const Scene *scene, const BVHBuildOptions &options,
+                         float maxCostRatio)
+    : options_(options),
+      maxCostRatio_(maxCostRatio),
+      pool_(options.numThreads),
+      bvh_({}, {}) {
+  CHECK_GE(maxCostRatio, 1.0f);
+  rebuild_(scene);
+}
+
+bool BVHRefitter::update(const Scene *scene) {
+  refitBVH(pool_, scene, bvh_);
+  cost_ = computeSAHCost(bvh_, options_);
+  if (cost_ <= maxCostRatio_ * builtCost_) return false;
+
+  VLOG(1) << "Refitting raised the BVH SAH cost from " << builtCost_ << " to "
+          << cost_ << ", rebuilding it";
+  rebuild_(scene);
+  return true;
+}
+
+void BVHRefitter::rebuild_(const Scene *scene) {
+  bvh_ = buildBVH(scene, options_);
+  builtCost_ = cost_ = computeSAHCost(bvh_, options_);
+}
+
+}  // namespace hk
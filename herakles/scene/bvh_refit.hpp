@@ -0,0 +1,93 @@
+/*
+ * Copyright 2017 Renato Utsch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HERAKLES_HERAKLES_SCENE_BVH_REFIT_HPP
+#define HERAKLES_HERAKLES_SCENE_BVH_REFIT_HPP
+
+#include "herakles/scene/bvh.hpp"
+#include "herakles/scene/scene_generated.h"
+#include "herakles/scene/task_pool.hpp"
+
+namespace hk {
+
+/**
+ * Recomputes the bounds of every node of the BVH bottom-up from the current
+ * vertices of the scene. The topology and the triangles of the BVH don't
+ * change, so the scene must have the same meshes and indices as the one the
+ * BVH was built for, with only its vertices moved. Leaves of a SBVH get the
+ * bounds of their whole triangles, as the clipped bounds are lost.
+ * @param pool Pool used to refit the top subtrees in parallel.
+ * @param scene The scene with the moved vertices.
+ * @param bvh The BVH to refit.
+ */
+void refitBVH(TaskPool &pool, const hk::scene::Scene *scene, BVHData &bvh);
+
+/**
+ * Returns the SAH cost of the BVH with the cost model of the options,
+ * normalized by the surface area of its root: the expected cost of
+ * intersecting a ray that hits the root. Measures the quality of the BVH,
+ * which degrades as the BVH is refitted.
+ */
+float computeSAHCost(const BVHData &bvh, const BVHBuildOptions &options = {});
+
+/**
+ * Keeps the BVH of a scene whose vertices move up to date. The BVH is
+ * refitted while its quality holds, and rebuilt from scratch once refitting
+ * raised its SAH cost too much over the cost it had right after being built.
+ */
+class BVHRefitter {
+ public:
+  /**
+   * Builds the initial BVH.
+   * @param scene The scene.
+   * @param options Options used to build the BVH.
+   * @param maxCostRatio The BVH is rebuilt once its SAH cost is bigger than
+   *   this times the cost it had right after the last build.
+   */
+  BVHRefitter(const hk::scene::Scene *scene,
+              const BVHBuildOptions &options = {}, float maxCostRatio = 1.5f);
+
+  /**
+   * Updates the BVH to the current vertices of the scene.
+   * @return true if the BVH was rebuilt, which changes its topology and
+   *   triangles, or false if it was only refitted.
+   */
+  bool update(const hk::scene::Scene *scene);
+
+  /// Returns the current BVH.
+  const BVHData &bvh() const { return bvh_; }
+
+  /// Returns the SAH cost of the current BVH.
+  float cost() const { return cost_; }
+
+  /// Returns the SAH cost of the BVH right after it was last built.
+  float builtCost() const { return builtCost_; }
+
+ private:
+  /// Rebuilds the BVH from scratch.
+  void rebuild_(const hk::scene::Scene *scene);
+
+  const BVHBuildOptions options_;
+  const float maxCostRatio_;
+  TaskPool pool_;
+  BVHData bvh_;
+  float builtCost_ = 0.0f;
+  float cost_ = 0.0f;
+};
+
+}  // namespace hk
+
+#endif  // !HERAKLES_HERAKLES_SCENE_BVH_REFIT_HPP
@@ -0,0 +1,111 @@
+/*
+ * Copyright 2017 Renato Utsch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "herakles/scene/bvh_refit.hpp"
+
+#include <gtest/gtest.h>
+
+#include "herakles/scene/random_scene.hpp"
+
+namespace {
+using ::hk::BVHData;
+using ::hk::BVHRefitter;
+using ::hk::RandomScene;
+using ::hk::TaskPool;
+using ::hk::buildBVH;
+using ::hk::computeSAHCost;
+using ::hk::refitBVH;
+
+/// Checks that every node encloses its children, and every leaf the vertices
+/// of its triangles in the scene.
+void expectEnclosesScene(const hk::scene::Scene *scene, const BVHData &bvh) {
+  const auto encloses = [](const hk::BVHNode &node, const glm::vec3 &min,
+                           const glm::vec3 &max) {
+    for (int axis = 0; axis < 3; ++axis) {
+      if (node.minPoint[axis] > min[axis] || node.maxPoint[axis] < max[axis]) {
+        return false;
+      }
+    }
+    return true;
+  };
+
+  for (size_t i = 0; i < bvh.nodes.size(); ++i) {
+    const auto &node = bvh.nodes[i];
+    if (!node.numTriangles) {
+      for (const auto &child :
+           {bvh.nodes[i + 1], bvh.nodes[node.secondChildOffset]}) {
+        EXPECT_TRUE(encloses(node, child.minPoint, child.maxPoint));
+      }
+      continue;
+    }
+
+    for (size_t t = 0; t < node.numTriangles; ++t) {
+      const auto &triangle = bvh.triangles[node.trianglesOffset + t];
+      for (uint32_t v = 0; v < 3; ++v) {
+        const auto *vertex = scene->vertices()->Get(
+            scene->indices()->Get(triangle.begin + v));
+        const glm::vec3 p(vertex->x(), vertex->y(), vertex->z());
+        EXPECT_TRUE(encloses(node, p, p));
+      }
+    }
+  }
+}
+
+TEST(RefitBVHTest, KeepsBoundsOfUnchangedScene) {
+  const RandomScene scene(2000);
+  const BVHData bvh = buildBVH(scene.scene());
+  BVHData refitted = bvh;
+  TaskPool pool(4);
+  refitBVH(pool, scene.scene(), refitted);
+
+  ASSERT_EQ(bvh.nodes.size(), refitted.nodes.size());
+  for (size_t i = 0; i < bvh.nodes.size(); ++i) {
+    EXPECT_EQ(bvh.nodes[i].minPoint, refitted.nodes[i].minPoint);
+    EXPECT_EQ(bvh.nodes[i].maxPoint, refitted.nodes[i].maxPoint);
+  }
+  EXPECT_FLOAT_EQ(computeSAHCost(bvh), computeSAHCost(refitted));
+}
+
+TEST(RefitBVHTest, EnclosesMovedVertices) {
+  // Same meshes and indices, with every vertex somewhere else.
+  const RandomScene scene(2000);
+  const RandomScene movedScene(2000, 7);
+  BVHData bvh = buildBVH(scene.scene());
+  TaskPool pool(4);
+  refitBVH(pool, movedScene.scene(), bvh);
+
+  expectEnclosesScene(movedScene.scene(), bvh);
+  EXPECT_GT(computeSAHCost(bvh), computeSAHCost(buildBVH(movedScene.scene())));
+}
+
+TEST(BVHRefitterTest, RebuildsOnceTheCostDegrades) {
+  const RandomScene scene(2000);
+  const RandomScene slightlyMovedScene(2000, 42, 1.1f);
+  const RandomScene movedScene(2000, 7);
+  BVHRefitter refitter(scene.scene());
+  const float builtCost = refitter.builtCost();
+
+  EXPECT_FALSE(refitter.update(slightlyMovedScene.scene()));
+  EXPECT_EQ(builtCost, refitter.builtCost());
+  EXPECT_GT(refitter.cost(), builtCost);
+  expectEnclosesScene(slightlyMovedScene.scene(), refitter.bvh());
+
+  EXPECT_TRUE(refitter.update(movedScene.scene()));
+  EXPECT_EQ(refitter.builtCost(), refitter.cost());
+  expectEnclosesScene(movedScene.scene(), refitter.bvh());
+}
+
+}  // namespace
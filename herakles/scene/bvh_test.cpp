@@ -0,0 +1,271 @@
+/*
+ * Copyright 2017 Renato Utsch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "herakles/scene/bvh.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "herakles/scene/random_scene.hpp"
+#include "herakles/scene/simd_bounds.hpp"
+
+namespace {
+using ::hk::BVHBuildMethod;
+using ::hk::BVHBuildOptions;
+using ::hk::BVHData;
+using ::hk::BVHNodeLayout;
+using ::hk::RandomScene;
+using ::hk::buildBVH;
+
+/// Returns if both BVHs have exactly the same bytes.
+bool sameBytes(const BVHData &a, const BVHData &b) {
+  return a.nodes.size() == b.nodes.size() &&
+         a.triangles.size() == b.triangles.size() &&
+         !memcmp(a.nodes.data(), b.nodes.data(),
+                 a.nodes.size() * sizeof(a.nodes[0])) &&
+         !memcmp(a.triangles.data(), b.triangles.data(),
+                 a.triangles.size() * sizeof(a.triangles[0]));
+}
+
+/// Checks that every node encloses its children and triangles are unique.
+void expectValidBVH(const BVHData &bvh, size_t numTriangles) {
+  ASSERT_EQ(numTriangles, bvh.triangles.size());
+
+  std::vector<bool> seen(numTriangles * 3, false);
+  for (const auto &triangle : bvh.triangles) {
+    ASSERT_LT(triangle.begin, seen.size());
+    EXPECT_FALSE(seen[triangle.begin]);
+    seen[triangle.begin] = true;
+  }
+
+  size_t leafTriangles = 0;
+  for (size_t i = 0; i < bvh.nodes.size(); ++i) {
+    const auto &node = bvh.nodes[i];
+    if (node.numTriangles) {
+      leafTriangles += node.numTriangles;
+      EXPECT_LE(node.trianglesOffset + node.numTriangles, numTriangles);
+      continue;
+    }
+
+    ASSERT_LT(i + 1, bvh.nodes.size());
+    ASSERT_LT(node.secondChildOffset, bvh.nodes.size());
+    for (const auto &child :
+         {bvh.nodes[i + 1], bvh.nodes[node.secondChildOffset]}) {
+      for (int axis = 0; axis < 3; ++axis) {
+        EXPECT_LE(node.minPoint[axis], child.minPoint[axis]);
+        EXPECT_GE(node.maxPoint[axis], child.maxPoint[axis]);
+      }
+    }
+  }
+  EXPECT_EQ(numTriangles, leafTriangles);
+}
+
+/// Returns if the subtrees of both BVHs at the given offsets have the same
+/// nodes, wherever they are in memory.
+bool sameTree(const BVHData &a, size_t aOffset, const BVHData &b,
+              size_t bOffset) {
+  const auto &aNode = a.nodes[aOffset], &bNode = b.nodes[bOffset];
+  if (aNode.minPoint != bNode.minPoint || aNode.maxPoint != bNode.maxPoint ||
+      aNode.numTriangles != bNode.numTriangles) {
+    return false;
+  }
+  if (aNode.numTriangles) return aNode.trianglesOffset == bNode.trianglesOffset;
+  return aNode.splitAxis == bNode.splitAxis &&
+         sameTree(a, aOffset + 1, b, bOffset + 1) &&
+         sameTree(a, aNode.secondChildOffset, b, bNode.secondChildOffset);
+}
+
+/// Returns the SAH cost of the BVH, relative to the area of the root.
+float sahCost(const BVHData &bvh) {
+  float cost = 0.0f;
+  for (const auto &node : bvh.nodes) {
+    const glm::vec3 d = node.maxPoint - node.minPoint;
+    const float area = 2 * (d.x * d.y + d.x * d.z + d.y * d.z);
+    cost += area * (node.numTriangles ? node.numTriangles : 1);
+  }
+  const glm::vec3 d = bvh.nodes[0].maxPoint - bvh.nodes[0].minPoint;
+  return cost / (2 * (d.x * d.y + d.x * d.z + d.y * d.z));
+}
+
+TEST(BuildBVHTest, BuildsValidBVH) {
+  const RandomScene scene(1000);
+  expectValidBVH(buildBVH(scene.scene()), 1000);
+}
+
+TEST(BuildBVHTest, BuildsLeavesUpToMaxTrianglesInNode) {
+  const RandomScene scene(1000);
+  BVHBuildOptions options;
+  options.maxTrianglesInNode = 8;
+  options.traversalCost = 4.0f;
+
+  for (auto method : {BVHBuildMethod::SAH, BVHBuildMethod::SBVH}) {
+    options.method = method;
+    options.spatialSplitBudget = 0.0f;
+    const BVHData bvh = buildBVH(scene.scene(), options);
+    expectValidBVH(bvh, 1000);
+    EXPECT_LT(bvh.nodes.size(), 2 * 1000 - 1);
+
+    size_t maxLeafTriangles = 0;
+    for (const auto &node : bvh.nodes) {
+      maxLeafTriangles = std::max<size_t>(maxLeafTriangles, node.numTriangles);
+    }
+    EXPECT_GT(maxLeafTriangles, 1u);
+    EXPECT_LE(maxLeafTriangles, 8u);
+  }
+}
+
+TEST(BuildBVHTest, BuildsValidLBVH) {
+  const RandomScene scene(1000);
+  BVHBuildOptions options;
+  options.method = BVHBuildMethod::LBVH;
+
+  const BVHData bvh = buildBVH(scene.scene(), options);
+  expectValidBVH(bvh, 1000);
+  EXPECT_EQ(2 * 1000 - 1, bvh.nodes.size());
+}
+
+TEST(BuildBVHTest, BuildsValidHLBVH) {
+  const RandomScene scene(1000);
+  BVHBuildOptions options;
+  options.method = BVHBuildMethod::HLBVH;
+  expectValidBVH(buildBVH(scene.scene(), options), 1000);
+}
+
+TEST(BuildBVHTest, HLBVHCostIsBetweenLBVHAndSAH) {
+  const RandomScene scene(20000, 42, 5.0f);
+  BVHBuildOptions options;
+  options.method = BVHBuildMethod::LBVH;
+  const float lbvhCost = sahCost(buildBVH(scene.scene(), options));
+  options.method = BVHBuildMethod::HLBVH;
+  const float hlbvhCost = sahCost(buildBVH(scene.scene(), options));
+  options.method = BVHBuildMethod::SAH;
+  const float sahBuildCost = sahCost(buildBVH(scene.scene(), options));
+
+  EXPECT_LT(hlbvhCost, lbvhCost);
+  EXPECT_GT(hlbvhCost, sahBuildCost);
+}
+
+TEST(BuildBVHTest, BuildsValidSBVH) {
+  // Big triangles overlap a lot, so that spatial splits are worth it.
+  const RandomScene scene(1000, 42, 20.0f);
+  BVHBuildOptions options;
+  options.method = BVHBuildMethod::SBVH;
+  const BVHData bvh = buildBVH(scene.scene(), options);
+
+  // Every triangle is referenced at least once and at most the budget more.
+  EXPECT_GT(bvh.triangles.size(), 1000u);
+  EXPECT_LE(bvh.triangles.size(), 1000 * (1 + options.spatialSplitBudget));
+  std::vector<bool> seen(1000 * 3, false);
+  for (const auto &triangle : bvh.triangles) {
+    ASSERT_LT(triangle.begin, seen.size());
+    seen[triangle.begin] = true;
+  }
+  for (size_t i = 0; i < seen.size(); i += 3) {
+    EXPECT_TRUE(seen[i]) << "triangle " << i / 3 << " is missing";
+  }
+
+  // Without a budget, is a plain SAH BVH.
+  options.spatialSplitBudget = 0.0f;
+  expectValidBVH(buildBVH(scene.scene(), options), 1000);
+}
+
+TEST(BuildBVHTest, TreeletOptimizationReducesSAHCost) {
+  const RandomScene scene(20000);
+  BVHBuildOptions options;
+  options.method = BVHBuildMethod::LBVH;
+  const BVHData bvh = buildBVH(scene.scene(), options);
+
+  options.treeletOptimizationPasses = 2;
+  options.numThreads = 1;
+  const BVHData optimized = buildBVH(scene.scene(), options);
+  expectValidBVH(optimized, 20000);
+  EXPECT_EQ(bvh.nodes.size(), optimized.nodes.size());
+  EXPECT_LT(sahCost(optimized), 0.95f * sahCost(bvh));
+
+  options.numThreads = 8;
+  EXPECT_TRUE(sameBytes(optimized, buildBVH(scene.scene(), options)));
+}
+
+TEST(BuildBVHTest, IsDeterministicForAnyNumberOfThreads) {
+  // Big enough to go through the parallel binning, sorting and subtree paths.
+  const RandomScene scene(200000);
+
+  for (auto method : {BVHBuildMethod::SAH, BVHBuildMethod::LBVH,
+                      BVHBuildMethod::HLBVH, BVHBuildMethod::SBVH}) {
+    BVHBuildOptions options;
+    options.method = method;
+    options.numThreads = 1;
+    const BVHData expected = buildBVH(scene.scene(), options);
+    if (method != BVHBuildMethod::SBVH) {
+      expectValidBVH(expected, 200000);
+    }
+
+    for (size_t numThreads : {2, 3, 8}) {
+      options.numThreads = numThreads;
+      EXPECT_TRUE(sameBytes(expected, buildBVH(scene.scene(), options)))
+          << "method = " << (int)method << ", numThreads = " << numThreads;
+    }
+  }
+}
+
+TEST(BuildBVHTest, ClusteredLayoutKeepsTheTree) {
+  const RandomScene scene(20000);
+  for (auto method : {BVHBuildMethod::SAH, BVHBuildMethod::LBVH}) {
+    BVHBuildOptions options;
+    options.method = method;
+    const BVHData bvh = buildBVH(scene.scene(), options);
+    options.nodeLayout = BVHNodeLayout::Clustered;
+    const BVHData clustered = buildBVH(scene.scene(), options);
+    expectValidBVH(clustered, 20000);
+    EXPECT_EQ(bvh.nodes.size(), clustered.nodes.size());
+    EXPECT_TRUE(sameTree(bvh, 0, clustered, 0));
+    EXPECT_FALSE(sameBytes(bvh, clustered));
+
+    // Children are always after their parents.
+    for (size_t i = 0; i < clustered.nodes.size(); ++i) {
+      const auto &node = clustered.nodes[i];
+      if (!node.numTriangles) {
+        EXPECT_GT(node.secondChildOffset, i + 1);
+      }
+    }
+  }
+}
+
+TEST(SIMDBucketMapperTest, ClampsBucketsOfDegenerateExtents) {
+  const float denormal = std::numeric_limits<float>::denorm_min();
+  hk::Bounds3f bounds;
+  bounds += glm::vec3(0.0f, -1.0f, 5.0f);
+  bounds += glm::vec3(denormal, 1.0f, 5.0f);
+  const hk::SIMDBucketMapper mapper(bounds, 16);
+
+  for (const glm::vec3 &p :
+       {glm::vec3(denormal, 1.0f, 5.0f), glm::vec3(-1.0f, -2.0f, 4.0f),
+        glm::vec3(1.0f, 2.0f, 6.0f),
+        glm::vec3(std::numeric_limits<float>::quiet_NaN())}) {
+    int32_t buckets[4];
+    mapper.map(hk::SIMDPoint3f(p), buckets);
+    for (int axis = 0; axis < 3; ++axis) {
+      EXPECT_GE(buckets[axis], 0);
+      EXPECT_LT(buckets[axis], 16);
+    }
+  }
+}
+
+}  // namespace
@@ -0,0 +1,449 @@
+/*
+ * Copyright 2017 Renato Utsch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "herakles/scene/bvh_traversal.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+#include <vector>
+
+#include <glog/logging.h>
+
+namespace hk {
+namespace {
+using hk::scene::Scene;
+
+// Same constants as scene.glsl.
+const float Epsilon = 1e-7f;
+const float Infinity = 1e20f;
+const float Gamma3 = (3.0f * Epsilon) / (1.0f - 3.0f * Epsilon);
+
+/// Maximum depth of the traversal stack, same as intersection.glsl.
+constexpr int MaxStackSize = MaxBVHDepth + 1;
+
+/// Number of nodes of the short stack of the restart trail traversal, same as
+/// intersection.glsl.
+constexpr uint32_t ShortStackSize = 4;
+
+/// Returns the bit of the restart trail of the given depth. The deeper levels
+/// are in the lower bits, so that a finished level carries into its parent.
+/// The depth must be at most MaxBVHDepth.
+uint64_t trailLevel_(int depth) {
+  DCHECK_LE(depth, MaxBVHDepth);
+  return uint64_t(1) << (MaxBVHDepth - depth);
+}
+
+/**
+ * Returns the vertex at the given position of the indices array.
+ */
+glm::vec3 vertex_(const Scene *scene, uint32_t index) {
+  const auto *v = scene->vertices()->Get(scene->indices()->Get(index));
+  return glm::vec3(v->x(), v->y(), v->z());
+}
+
+/**
+ * Moller-Trumbore triangle intersection, same as intersectsTriangle().
+ */
+bool intersectsTriangle_(const Scene *scene, const Ray &ray, uint32_t begin,
+                         float &t) {
+  const glm::vec3 v0 = vertex_(scene, begin);
+  const glm::vec3 v0v1 = vertex_(scene, begin + 1) - v0;
+  const glm::vec3 v0v2 = vertex_(scene, begin + 2) - v0;
+  const glm::vec3 pvec = glm::cross(ray.direction, v0v2);
+  const float det = glm::dot(v0v1, pvec);
+
+  // Ray and triangle are parallel if det is close to 0.
+  if (std::abs(det) < Epsilon) return false;
+
+  const float invDet = 1.0f / det;
+  const glm::vec3 tvec = ray.origin - v0;
+  const float s = glm::dot(tvec, pvec) * invDet;
+  if (s <= -Epsilon || s >= 1.0f + Epsilon) return false;
+
+  const glm::vec3 qvec = glm::cross(tvec, v0v1);
+  const float u = glm::dot(ray.direction, qvec) * invDet;
+  if (u <= -Epsilon || s + u >= 1.0f + Epsilon) return false;
+
+  t = glm::dot(v0v2, qvec) * invDet;
+  return true;
+}
+
+/**
+ * Ray-sphere intersection, same as intersectsSphere(). Sets t to the closest
+ * root of the ray in front of its origin, if any.
+ */
+bool intersectsSphere_(const Scene *scene, const Ray &ray, uint32_t sphereID,
+                       float &t) {
+  const auto *sphere = scene->spheres()->Get(sphereID);
+  const glm::vec3 center(sphere->center().x(), sphere->center().y(),
+                         sphere->center().z());
+  const glm::vec3 oc = ray.origin - center;
+  const float a = glm::dot(ray.direction, ray.direction);
+  const float halfB = glm::dot(oc, ray.direction);
+
+  // The discriminant is computed from the distance between the center and
+  // the ray, which doesn't lose precision for small or far away spheres.
+  const glm::vec3 perpendicular = oc - (halfB / a) * ray.direction;
+  const float radius2 = sphere->radius() * sphere->radius();
+  const float discriminant =
+      a * (radius2 - glm::dot(perpendicular, perpendicular));
+  if (discriminant < 0.0f) return false;
+
+  // Stable roots. The far one is only hit if the ray starts inside the sphere.
+  const float c = glm::dot(oc, oc) - radius2;
+  const float q = -halfB - std::copysign(std::sqrt(discriminant), halfB);
+  const float t0 = c / q, t1 = q / a;
+  t = std::min(t0, t1);
+  if (t <= Epsilon) t = std::max(t0, t1);
+  return true;
+}
+
+/**
+ * Slab test, same as intersectsBoundingBox(). Sets tNear to the distance
+ * where the ray enters the box.
+ */
+bool intersectsBoundingBox_(float rayTMax, const glm::vec3 &minPoint,
+                            const glm::vec3 &maxPoint, const glm::vec3 &invDir,
+                            const glm::vec3 &origByDir, float &tNear) {
+  const glm::vec3 p0 = minPoint * invDir - origByDir;
+  const glm::vec3 p1 = maxPoint * invDir - origByDir;
+
+  float tMin = 0.0f, tMax = rayTMax;
+  for (int i = 0; i < 3; ++i) {
+    tMin = std::max(tMin, std::min(p0[i], p1[i]));
+    tMax = std::min(tMax, std::max(p0[i], p1[i]));
+  }
+
+  // Update tMax to ensure robust bounds intersection.
+  tMax *= 1.0f + 2.0f * Gamma3;
+  tNear = tMin;
+  return tMin <= tMax;
+}
+
+/**
+ * Intersects the triangles in [offset, offset + numTriangles), updating t and
+ * the hit if a closer intersection is found. Both triangles of a pair are
+ * intersected, and spheres are intersected analytically.
+ */
+bool intersectsTriangles_(const Scene *scene,
+                          const std::vector<BVHTriangle> &triangles,
+                          uint32_t offset, uint32_t numTriangles,
+                          const Ray &ray, float &t, BVHHit &hit) {
+  bool found = false;
+  for (uint32_t i = 0; i < numTriangles; ++i) {
+    const uint32_t triangle = offset + i;
+    if (isSphere(triangles[triangle])) {
+      float currT;
+      if (intersectsSphere_(scene, ray, triangles[triangle].begin, currT) &&
+          currT <= t - Epsilon && currT > Epsilon) {
+        found = true;
+        t = currT;
+        hit.t = currT;
+        hit.triangle = triangle;
+      }
+      continue;
+    }
+
+    const uint32_t end = triangles[triangle].begin +
+                         (isTrianglePair(triangles[triangle]) ? 6 : 3);
+    for (uint32_t begin = triangles[triangle].begin; begin < end;
+         begin += 3) {
+      float currT;
+      if (intersectsTriangle_(scene, ray, begin, currT) &&
+          currT <= t - Epsilon && currT > Epsilon) {
+        found = true;
+        t = currT;
+        hit.t = currT;
+        hit.triangle = triangle;
+      }
+    }
+  }
+  return found;
+}
+
+/// Returns the node as a BVH4Node.
+const BVH4Node &bvh4Node_(const BVH4Node &node) { return node; }
+BVH4Node bvh4Node_(const QuantizedBVH4Node &node) {
+  return dequantizeBVH4Node(node);
+}
+
+/**
+ * Traversal of 4-wide BVHs, for any node format.
+ */
+template <class BVH>
+bool intersectBVH4_(const Scene *scene, const BVH &bvh, const Ray &ray,
+                    BVHHit &hit) {
+  const glm::vec3 invDir = 1.0f / ray.direction;
+  const glm::vec3 origByDir = ray.origin * invDir;
+
+  bool found = false;
+  float t = Infinity;
+
+  uint32_t nodesToVisit[MaxStackSize];
+  int toVisitOffset = 0;
+  nodesToVisit[0] = 0;
+
+  while (toVisitOffset >= 0) {
+    const uint32_t currentNode = nodesToVisit[toVisitOffset--];
+    const BVH4Node &node = bvh4Node_(bvh.nodes[currentNode]);
+
+    // All the children are tested against the ray before any of them is
+    // visited, like intersectsChildBoundingBoxes().
+    bool hitsChild[BVH4Width];
+    float tNear[BVH4Width];
+    for (int i = 0; i < BVH4Width; ++i) {
+      hitsChild[i] =
+          node.childOffsets[i] != BVH4EmptyChild &&
+          intersectsBoundingBox_(
+              t, glm::vec3(node.minX[i], node.minY[i], node.minZ[i]),
+              glm::vec3(node.maxX[i], node.maxY[i], node.maxZ[i]), invDir,
+              origByDir, tNear[i]);
+    }
+
+    // Leaves are intersected right away, and the internal children that are
+    // hit are visited from the closest to the farthest.
+    uint32_t hitChildren[BVH4Width];
+    float hitDistances[BVH4Width];
+    int numHitChildren = 0;
+    for (int i = 0; i < BVH4Width; ++i) {
+      if (!hitsChild[i]) continue;
+
+      if (node.childNumTriangles[i] > 0) {
+        found |= intersectsTriangles_(scene, bvh.triangles,
+                                      node.childOffsets[i],
+                                      node.childNumTriangles[i], ray, t, hit);
+        continue;
+      }
+
+      // Insertion sort by distance.
+      int j = numHitChildren++;
+      for (; j > 0 && hitDistances[j - 1] > tNear[i]; --j) {
+        hitChildren[j] = hitChildren[j - 1];
+        hitDistances[j] = hitDistances[j - 1];
+      }
+      hitChildren[j] = node.childOffsets[i];
+      hitDistances[j] = tNear[i];
+    }
+
+    CHECK_LT(toVisitOffset + numHitChildren, MaxStackSize)
+        << "BVH is too deep.";
+    for (int i = numHitChildren - 1; i >= 0; --i) {
+      nodesToVisit[++toVisitOffset] = hitChildren[i];
+    }
+  }
+
+  return found;
+}
+
+/**
+ * Traversal of binary BVHs, starting at the given root node.
+ * @param intersectLeaf Called as intersectLeaf(node, t) for every leaf hit by
+ *   the ray. Must return if it found a closer intersection, updating t.
+ */
+template <typename LeafFunctor>
+bool intersectBinaryBVH_(const std::vector<BVHNode> &nodes, uint32_t rootNode,
+                         const Ray &ray, float &t,
+                         LeafFunctor &&intersectLeaf) {
+  const glm::vec3 invDir = 1.0f / ray.direction;
+  const glm::vec3 origByDir = ray.origin * invDir;
+
+  bool found = false;
+  uint32_t nodesToVisit[MaxStackSize];
+  int toVisitOffset = 0;
+  nodesToVisit[0] = rootNode;
+
+  while (toVisitOffset >= 0) {
+    const uint32_t currentNode = nodesToVisit[toVisitOffset--];
+    const BVHNode &node = nodes[currentNode];
+    float tNear;
+    if (!intersectsBoundingBox_(t, node.minPoint, node.maxPoint, invDir,
+                                origByDir, tNear)) {
+      continue;
+    }
+
+    if (node.numTriangles == 0) {
+      CHECK_LT(toVisitOffset + 2, MaxStackSize) << "BVH is too deep.";
+      if (invDir[node.splitAxis] < 0) {
+        nodesToVisit[++toVisitOffset] = currentNode + 1;
+        nodesToVisit[++toVisitOffset] = node.secondChildOffset;
+      } else {
+        nodesToVisit[++toVisitOffset] = node.secondChildOffset;
+        nodesToVisit[++toVisitOffset] = currentNode + 1;
+      }
+      continue;
+    }
+
+    found |= intersectLeaf(node, t);
+  }
+
+  return found;
+}
+
+}  // namespace
+
+int bvhDepth(const std::vector<BVHNode> &nodes, uint32_t root) {
+  CHECK_LT(root, nodes.size());
+
+  // Iterative, so that the degenerate BVHs this is meant to catch don't
+  // overflow the call stack.
+  int maxDepth = 0;
+  std::vector<std::pair<uint32_t, int>> toVisit = {{root, 0}};
+  while (!toVisit.empty()) {
+    const auto [index, depth] = toVisit.back();
+    toVisit.pop_back();
+    const BVHNode &node = nodes[index];
+    if (node.numTriangles > 0) {
+      maxDepth = std::max(maxDepth, depth);
+    } else {
+      toVisit.emplace_back(index + 1, depth + 1);
+      toVisit.emplace_back(node.secondChildOffset, depth + 1);
+    }
+  }
+  return maxDepth;
+}
+
+int bvhDepth(const std::vector<BVH4Node> &nodes) {
+  CHECK(!nodes.empty());
+
+  int maxDepth = 0;
+  std::vector<std::pair<uint32_t, int>> toVisit = {{0, 0}};
+  while (!toVisit.empty()) {
+    const auto [index, depth] = toVisit.back();
+    toVisit.pop_back();
+    maxDepth = std::max(maxDepth, depth);
+    const BVH4Node &node = nodes[index];
+    for (int i = 0; i < BVH4Width; ++i) {
+      if (node.childOffsets[i] != BVH4EmptyChild &&
+          node.childNumTriangles[i] == 0) {
+        toVisit.emplace_back(node.childOffsets[i], depth + 1);
+      }
+    }
+  }
+  return maxDepth;
+}
+
+bool intersectBVH(const Scene *scene, const BVHData &bvh, const Ray &ray,
+                  BVHHit &hit) {
+  float t = Infinity;
+  return intersectBinaryBVH_(
+      bvh.nodes, 0, ray, t, [&](const BVHNode &node, float &closestT) {
+        return intersectsTriangles_(scene, bvh.triangles, node.trianglesOffset,
+                                    node.numTriangles, ray, closestT, hit);
+      });
+}
+
+bool intersectBVHShortStack(const Scene *scene, const BVHData &bvh,
+                            const Ray &ray, BVHHit &hit) {
+  const glm::vec3 invDir = 1.0f / ray.direction;
+  const glm::vec3 origByDir = ray.origin * invDir;
+
+  bool found = false;
+  float t = Infinity;
+  uint64_t trail = 0;
+  int depth = 0;
+  uint32_t shortStack[ShortStackSize];
+  uint32_t stackTop = 0, stackSize = 0;
+  uint32_t currentNode = 0;
+  while (true) {
+    const BVHNode &node = bvh.nodes[currentNode];
+    float tNear;
+    if (intersectsBoundingBox_(t, node.minPoint, node.maxPoint, invDir,
+                               origByDir, tNear)) {
+      if (node.numTriangles == 0) {
+        // Same order as the stack traversal. The trail tells if the near
+        // child was already finished before a restart.
+        uint32_t nearChild = currentNode + 1;
+        uint32_t farChild = node.secondChildOffset;
+        if (invDir[node.splitAxis] < 0) std::swap(nearChild, farChild);
+        ++depth;
+        CHECK_LT(depth, MaxStackSize) << "BVH is too deep.";
+        if (trail & trailLevel_(depth)) {
+          currentNode = farChild;
+        } else {
+          currentNode = nearChild;
+          shortStack[stackTop++ % ShortStackSize] = farChild;
+          stackSize = std::min(stackSize + 1, ShortStackSize);
+        }
+        continue;
+      }
+
+      found |= intersectsTriangles_(scene, bvh.triangles,
+                                    node.trianglesOffset, node.numTriangles,
+                                    ray, t, hit);
+    }
+
+    // The subtree is finished, so the deepest level still on its near child
+    // moves on to its far child, and the traversal ends once the root is
+    // finished. The far child is on top of the short stack, unless it was
+    // dropped, in which case the traversal restarts from the root.
+    trail &= ~(trailLevel_(depth) - 1);
+    trail += trailLevel_(depth);
+    if (trail & trailLevel_(0)) break;
+    while (!(trail & trailLevel_(depth))) --depth;
+    if (stackSize) {
+      --stackSize;
+      currentNode = shortStack[--stackTop % ShortStackSize];
+    } else {
+      currentNode = 0;
+      depth = 0;
+    }
+  }
+
+  return found;
+}
+
+bool intersectBVH(const Scene *scene, const BVH4Data &bvh, const Ray &ray,
+                  BVHHit &hit) {
+  return intersectBVH4_(scene, bvh, ray, hit);
+}
+
+bool intersectBVH(const Scene *scene, const QuantizedBVH4Data &bvh,
+                  const Ray &ray, BVHHit &hit) {
+  return intersectBVH4_(scene, bvh, ray, hit);
+}
+
+bool intersectBVH(const Scene *scene, const TwoLevelBVHData &bvh,
+                  const Ray &ray, BVHHit &hit) {
+  float t = Infinity;
+  return intersectBinaryBVH_(
+      bvh.nodes, 0, ray, t, [&](const BVHNode &leaf, float &closestT) {
+        bool found = false;
+        for (uint32_t i = 0; i < leaf.numTriangles; ++i) {
+          const uint32_t instance = leaf.trianglesOffset + i;
+          const auto &worldToObject = bvh.instances[instance].worldToObject;
+          const Ray objectRay = {
+              glm::vec3(worldToObject * glm::vec4(ray.origin, 1.0f)),
+              glm::vec3(worldToObject * glm::vec4(ray.direction, 0.0f))};
+
+          // The object ray direction isn't normalized, so t is the same in
+          // both spaces.
+          if (intersectBinaryBVH_(
+                  bvh.nodes, bvh.instances[instance].rootNodeOffset, objectRay,
+                  closestT, [&](const BVHNode &node, float &objectT) {
+                    return intersectsTriangles_(
+                        scene, bvh.triangles, node.trianglesOffset,
+                        node.numTriangles, objectRay, objectT, hit);
+                  })) {
+            found = true;
+            hit.instance = instance;
+          }
+        }
+        return found;
+      });
+}
+
+}  // namespace hk
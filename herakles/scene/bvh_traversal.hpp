@@ -0,0 +1,148 @@
+/*
+ * Copyright 2017 Renato Utsch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HERAKLES_HERAKLES_SCENE_BVH_TRAVERSAL_HPP
+#define HERAKLES_HERAKLES_SCENE_BVH_TRAVERSAL_HPP
+
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "herakles/scene/bvh.hpp"
+#include "herakles/scene/scene_generated.h"
+#include "herakles/scene/two_level_bvh.hpp"
+#include "herakles/scene/wide_bvh.hpp"
+
+namespace hk {
+
+/// Maximum depth of the leaves of the binary BVHs the traversals support, with
+/// the root at depth 0. Deeper BVHs overflow the 64 entry traversal stacks
+/// and the 64 bit restart trail, here and in intersection.glsl.
+constexpr int MaxBVHDepth = 63;
+
+/// Maximum depth of the nodes of the 4-wide BVHs the traversals support, with
+/// the root at depth 0. Visiting a node pushes up to 4 children and each
+/// level above keeps up to 3, so 3 * 21 + 1 fills the 64 entry stacks.
+constexpr int MaxBVH4Depth = 21;
+
+/**
+ * A ray travelling through the scene.
+ */
+struct Ray {
+  glm::vec3 origin;
+  glm::vec3 direction;
+};
+
+/**
+ * Closest intersection of a ray with the triangles of a BVH.
+ */
+struct BVHHit {
+  /// Distance along the ray.
+  float t;
+
+  /// Index of the intersected triangle in the BVH triangles array.
+  uint32_t triangle;
+
+  /// Index of the intersected instance in the instances array. Only set by
+  /// the traversal of two-level BVHs.
+  uint32_t instance;
+};
+
+/**
+ * Returns the depth of the deepest leaf of the binary BVH rooted at the given
+ * node, with the root at depth 0.
+ * @param nodes The nodes of the BVH, with absolute second child offsets, like
+ *   the nodes of BVHData and TwoLevelBVHData.
+ * @param root Index of the root node. Must be a valid index into nodes.
+ * @return the depth, which has to be at most MaxBVHDepth to be traversed.
+ */
+int bvhDepth(const std::vector<BVHNode> &nodes, uint32_t root = 0);
+
+/**
+ * Returns the depth of the deepest node of the 4-wide BVH, with the root at
+ * depth 0. The leaves are children of the nodes, so they don't count.
+ * @return the depth, which has to be at most MaxBVH4Depth to be traversed.
+ */
+int bvhDepth(const std::vector<BVH4Node> &nodes);
+
+/**
+ * Finds the closest intersection of the ray with the triangles of the BVH.
+ * This is a CPU port of intersectsScene() from intersection.glsl, with the
+ * same traversal order and the same epsilons, used to validate and measure
+ * BVHs without a GPU.
+ * @param scene The scene the BVH was built from.
+ * @param bvh The BVH to traverse.
+ * @param ray The ray. Its direction doesn't have to be normalized.
+ * @param hit Set to the closest intersection, if any.
+ * @return if the ray intersects any triangle.
+ */
+bool intersectBVH(const hk::scene::Scene *scene, const BVHData &bvh,
+                  const Ray &ray, BVHHit &hit);
+
+/**
+ * Finds the closest intersection of the ray with the triangles of the BVH,
+ * like intersectBVH(), but with the restart trail traversal of
+ * intersectsScene() with HERAKLES_SHORT_STACK_TRAVERSAL. It only keeps the
+ * last few far children in a short stack, and restarts from the root when the
+ * stack runs out, using a bit per level to skip the finished subtrees.
+ * @param scene The scene the BVH was built from.
+ * @param bvh The BVH to traverse, at most MaxBVHDepth deep.
+ * @param ray The ray. Its direction doesn't have to be normalized.
+ * @param hit Set to the closest intersection, if any.
+ * @return if the ray intersects any triangle.
+ */
+bool intersectBVHShortStack(const hk::scene::Scene *scene, const BVHData &bvh,
+                            const Ray &ray, BVHHit &hit);
+
+/**
+ * Finds the closest intersection of the ray with the triangles of the 4-wide
+ * BVH. This is a CPU port of the BVH4 traversal of intersectsScene().
+ * @param scene The scene the BVH was built from.
+ * @param bvh The BVH to traverse.
+ * @param ray The ray. Its direction doesn't have to be normalized.
+ * @param hit Set to the closest intersection, if any.
+ * @return if the ray intersects any triangle.
+ */
+bool intersectBVH(const hk::scene::Scene *scene, const BVH4Data &bvh,
+                  const Ray &ray, BVHHit &hit);
+
+/**
+ * Finds the closest intersection of the ray with the triangles of the
+ * quantized 4-wide BVH. Same as the BVH4Data version, but decoding each node
+ * first.
+ */
+bool intersectBVH(const hk::scene::Scene *scene, const QuantizedBVH4Data &bvh,
+                  const Ray &ray, BVHHit &hit);
+
+/**
+ * Finds the closest intersection of the ray with the instances of the
+ * two-level BVH. This is a CPU port of the two-level traversal of
+ * intersectsScene(), where each instance transforms the ray into the space of
+ * its mesh's bottom-level BVH.
+ * @param scene The scene the BVH was built from.
+ * @param bvh The BVH to traverse.
+ * @param ray The ray, in world space. Its direction doesn't have to be
+ *   normalized.
+ * @param hit Set to the closest intersection, if any.
+ * @return if the ray intersects any instance.
+ */
+bool intersectBVH(const hk::scene::Scene *scene, const TwoLevelBVHData &bvh,
+                  const Ray &ray, BVHHit &hit);
+
+}  // namespace hk
+
+#endif  // !HERAKLES_HERAKLES_SCENE_BVH_TRAVERSAL_HPP
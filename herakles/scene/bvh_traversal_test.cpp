@@ -0,0 +1,340 @@
+/*
+ * Copyright 2017 Renato Utsch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "herakles/scene/bvh_traversal.hpp"
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "herakles/scene/random_scene.hpp"
+
+namespace {
+using ::hk::BVHBuildMethod;
+using ::hk::BVHBuildOptions;
+using ::hk::BVHData;
+using ::hk::BVHHit;
+using ::hk::RandomScene;
+using ::hk::Ray;
+using ::hk::buildBVH;
+using ::hk::collapseBVH4;
+using ::hk::intersectBVH;
+using ::hk::intersectBVHShortStack;
+using ::hk::isSphere;
+using ::hk::isTrianglePair;
+using ::hk::quantizeBVH4;
+using ::hk::triangleMeshID;
+
+/// Returns random rays starting inside the scene bounds. Half of them are
+/// aimed at vertices of the scene, so that many of them hit something.
+std::vector<Ray> randomRays(const hk::scene::Scene *scene, size_t numRays) {
+  std::mt19937 rng(7);
+  std::uniform_real_distribution<float> position(-100.0f, 100.0f);
+  std::uniform_real_distribution<float> direction(-1.0f, 1.0f);
+  std::uniform_int_distribution<uint32_t> vertex(
+      0, scene->vertices()->size() - 1);
+
+  std::vector<Ray> rays;
+  for (size_t i = 0; i < numRays; ++i) {
+    const glm::vec3 origin(position(rng), position(rng), position(rng));
+    if (i % 2) {
+      const auto *target = scene->vertices()->Get(vertex(rng));
+      rays.push_back(
+          {origin, glm::vec3(target->x(), target->y(), target->z()) - origin});
+    } else {
+      rays.push_back(
+          {origin, glm::vec3(direction(rng), direction(rng), direction(rng))});
+    }
+  }
+  return rays;
+}
+
+/// Scene with random quads, each made of two triangles that share a diagonal.
+class QuadScene {
+ public:
+  explicit QuadScene(size_t numQuads) {
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> position(-100.0f, 100.0f);
+    std::uniform_real_distribution<float> offset(-1.0f, 1.0f);
+
+    std::vector<hk::scene::vec4> vertices;
+    std::vector<uint32_t> indices;
+    for (size_t i = 0; i < numQuads; ++i) {
+      const uint32_t first = vertices.size();
+      const float x = position(rng), y = position(rng), z = position(rng);
+      for (int v = 0; v < 4; ++v) {
+        vertices.emplace_back(x + offset(rng), y + offset(rng),
+                              z + offset(rng), 1.0f);
+      }
+      for (uint32_t v : {0, 1, 2, 0, 2, 3}) indices.push_back(first + v);
+    }
+
+    const std::vector<hk::scene::Mesh> meshes = {
+        hk::scene::Mesh(0, indices.size(), 0, -1)};
+    const auto meshesOffset = builder_.CreateVectorOfStructs(meshes);
+    const auto indicesOffset = builder_.CreateVector(indices);
+    const auto verticesOffset = builder_.CreateVectorOfStructs(vertices);
+    hk::scene::FinishSceneBuffer(
+        builder_,
+        hk::scene::CreateScene(builder_, nullptr, false, nullptr, {}, {},
+                               meshesOffset, {}, indicesOffset,
+                               verticesOffset));
+  }
+
+  /// Returns the scene.
+  const hk::scene::Scene *scene() const {
+    return hk::scene::GetScene(builder_.GetBufferPointer());
+  }
+
+ private:
+  flatbuffers::FlatBufferBuilder builder_;
+};
+
+/// Scene with random spheres and a single triangle.
+class SphereScene {
+ public:
+  explicit SphereScene(size_t numSpheres) {
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> position(-100.0f, 100.0f);
+    std::uniform_real_distribution<float> radius(0.5f, 5.0f);
+
+    for (size_t i = 0; i < numSpheres; ++i) {
+      spheres_.emplace_back(
+          hk::scene::vec3(position(rng), position(rng), position(rng)),
+          radius(rng), 0, -1);
+    }
+
+    const std::vector<hk::scene::vec4> vertices = {
+        hk::scene::vec4(-1.0f, 0.0f, 0.0f, 1.0f),
+        hk::scene::vec4(1.0f, 0.0f, 0.0f, 1.0f),
+        hk::scene::vec4(0.0f, 1.0f, 0.0f, 1.0f)};
+    const std::vector<uint32_t> indices = {0, 1, 2};
+    const std::vector<hk::scene::Mesh> meshes = {
+        hk::scene::Mesh(0, indices.size(), 0, -1)};
+    const auto meshesOffset = builder_.CreateVectorOfStructs(meshes);
+    const auto indicesOffset = builder_.CreateVector(indices);
+    const auto verticesOffset = builder_.CreateVectorOfStructs(vertices);
+    const auto spheresOffset = builder_.CreateVectorOfStructs(spheres_);
+    hk::scene::FinishSceneBuffer(
+        builder_,
+        hk::scene::CreateScene(builder_, nullptr, false, nullptr, {}, {},
+                               meshesOffset, {}, indicesOffset,
+                               verticesOffset, {}, {}, {}, {},
+                               spheresOffset));
+  }
+
+  /// Returns the scene.
+  const hk::scene::Scene *scene() const {
+    return hk::scene::GetScene(builder_.GetBufferPointer());
+  }
+
+  /// Returns the spheres of the scene.
+  const std::vector<hk::scene::Sphere> &spheres() const { return spheres_; }
+
+ private:
+  std::vector<hk::scene::Sphere> spheres_;
+  flatbuffers::FlatBufferBuilder builder_;
+};
+
+/// BVH with every triangle in a single leaf, intersected by brute force.
+BVHData bruteForceBVH(const BVHData &bvh) {
+  hk::BVHNode root = bvh.nodes[0];
+  root.numTriangles = bvh.triangles.size();
+  root.trianglesOffset = 0;
+  return BVHData({root}, std::vector<hk::BVHTriangle>(bvh.triangles));
+}
+
+TEST(BVHDepthTest, FindsTheDeepestLeaf) {
+  // A comb: each interior node has a leaf as its second child, and the last
+  // one has leaves as both children.
+  const uint32_t numInterior = 3;
+  std::vector<hk::BVHNode> nodes(2 * numInterior + 1);
+  for (uint32_t i = 0; i < numInterior; ++i) {
+    nodes[i].numTriangles = 0;
+    nodes[i].secondChildOffset = numInterior + 1 + i;
+  }
+  for (uint32_t i = numInterior; i < nodes.size(); ++i) {
+    nodes[i].numTriangles = 1;
+  }
+
+  EXPECT_EQ(3, hk::bvhDepth(nodes));
+  EXPECT_EQ(1, hk::bvhDepth(nodes, numInterior - 1));
+  EXPECT_EQ(0, hk::bvhDepth(nodes, numInterior));
+}
+
+TEST(BVHDepthTest, FindsTheDeepestBVH4Node) {
+  // Node 0 has node 1 as its first child and node 2 as its third one, and
+  // node 2 has node 3 as its last child. The other children are leaves or
+  // empty.
+  std::vector<hk::BVH4Node> nodes(4);
+  for (auto &node : nodes) {
+    node.childOffsets = glm::uvec4(hk::BVH4EmptyChild);
+    node.childNumTriangles = glm::uvec4(0);
+  }
+  nodes[0].childOffsets = glm::uvec4(1, 0, 2, hk::BVH4EmptyChild);
+  nodes[0].childNumTriangles = glm::uvec4(0, 1, 0, 0);
+  nodes[1].childOffsets = glm::uvec4(1, 2, 3, 4);
+  nodes[1].childNumTriangles = glm::uvec4(1);
+  nodes[2].childOffsets[3] = 3;
+  nodes[3].childOffsets[0] = 5;
+  nodes[3].childNumTriangles[0] = 2;
+
+  EXPECT_EQ(2, hk::bvhDepth(nodes));
+}
+
+TEST(IntersectBVHTest, MatchesBruteForceForEveryBuildMethod) {
+  const RandomScene scene(2000);
+  const auto rays = randomRays(scene.scene(), 2000);
+
+  for (auto method : {BVHBuildMethod::SAH, BVHBuildMethod::LBVH,
+                      BVHBuildMethod::HLBVH, BVHBuildMethod::SBVH}) {
+    BVHBuildOptions options;
+    options.method = method;
+    const BVHData bvh = buildBVH(scene.scene(), options);
+    const BVHData expectedBVH = bruteForceBVH(bvh);
+
+    size_t numHits = 0;
+    for (const auto &ray : rays) {
+      BVHHit hit, expected;
+      const bool found = intersectBVH(scene.scene(), bvh, ray, hit);
+      ASSERT_EQ(intersectBVH(scene.scene(), expectedBVH, ray, expected),
+                found);
+      if (!found) continue;
+
+      ++numHits;
+      EXPECT_EQ(expectedBVH.triangles[expected.triangle].begin,
+                bvh.triangles[hit.triangle].begin);
+      EXPECT_FLOAT_EQ(expected.t, hit.t);
+    }
+
+    // Make sure the test isn't vacuous.
+    EXPECT_GT(numHits, 200u) << "method = " << (int)method;
+  }
+}
+
+TEST(IntersectBVHTest, ShortStackTraversalMatchesStackTraversal) {
+  const RandomScene scene(2000);
+  const auto rays = randomRays(scene.scene(), 2000);
+
+  // The trees are much deeper than the short stack, so most rays restart.
+  for (auto layout :
+       {hk::BVHNodeLayout::DepthFirst, hk::BVHNodeLayout::Clustered}) {
+    BVHBuildOptions options;
+    options.nodeLayout = layout;
+    const BVHData bvh = buildBVH(scene.scene(), options);
+
+    size_t numHits = 0;
+    for (const auto &ray : rays) {
+      BVHHit hit, expected;
+      const bool found = intersectBVH(scene.scene(), bvh, ray, expected);
+      ASSERT_EQ(found, intersectBVHShortStack(scene.scene(), bvh, ray, hit));
+      if (!found) continue;
+
+      ++numHits;
+      EXPECT_EQ(expected.triangle, hit.triangle);
+      EXPECT_FLOAT_EQ(expected.t, hit.t);
+    }
+    EXPECT_GT(numHits, 200u);
+  }
+}
+
+TEST(IntersectBVHTest, PairedBVHMatchesUnpairedBVH) {
+  const QuadScene scene(1000);
+  const auto rays = randomRays(scene.scene(), 2000);
+  const BVHData bvh = buildBVH(scene.scene());
+  BVHBuildOptions options;
+  options.pairTriangles = true;
+  const BVHData pairedBVH = buildBVH(scene.scene(), options);
+
+  // Every quad is a single pair.
+  ASSERT_EQ(1000u, pairedBVH.triangles.size());
+  for (const auto &triangle : pairedBVH.triangles) {
+    EXPECT_TRUE(isTrianglePair(triangle));
+    EXPECT_EQ(0u, triangleMeshID(triangle));
+  }
+
+  size_t numHits = 0;
+  for (const auto &ray : rays) {
+    BVHHit expected, hit;
+    const bool found = intersectBVH(scene.scene(), bvh, ray, expected);
+    ASSERT_EQ(found, intersectBVH(scene.scene(), pairedBVH, ray, hit));
+    if (!found) continue;
+
+    ++numHits;
+    EXPECT_FLOAT_EQ(expected.t, hit.t);
+  }
+  EXPECT_GT(numHits, 200u);
+}
+
+TEST(IntersectBVHTest, IntersectsSpheres) {
+  const SphereScene scene(500);
+  const BVHData bvh = buildBVH(scene.scene());
+  const BVHData expectedBVH = bruteForceBVH(bvh);
+  ASSERT_EQ(501u, bvh.triangles.size());
+  EXPECT_EQ(500, std::count_if(bvh.triangles.begin(), bvh.triangles.end(),
+                               [](const hk::BVHTriangle &triangle) {
+                                 return isSphere(triangle);
+                               }));
+
+  // The rays are aimed at the sphere centers, so they must hit something no
+  // farther than the surface of the sphere they are aimed at.
+  std::mt19937 rng(7);
+  std::uniform_real_distribution<float> position(-100.0f, 100.0f);
+  for (const auto &sphere : scene.spheres()) {
+    const glm::vec3 center(sphere.center().x(), sphere.center().y(),
+                           sphere.center().z());
+    const glm::vec3 origin(position(rng), position(rng), position(rng));
+    const float distance = glm::length(center - origin);
+    if (distance <= sphere.radius()) continue;
+    const Ray ray = {origin, (center - origin) / distance};
+
+    BVHHit hit, expected;
+    ASSERT_TRUE(intersectBVH(scene.scene(), bvh, ray, hit));
+    ASSERT_TRUE(intersectBVH(scene.scene(), expectedBVH, ray, expected));
+    EXPECT_EQ(expectedBVH.triangles[expected.triangle].begin,
+              bvh.triangles[hit.triangle].begin);
+    EXPECT_FLOAT_EQ(expected.t, hit.t);
+    EXPECT_LE(hit.t, (distance - sphere.radius()) * (1.0f + 1e-5f));
+  }
+}
+
+TEST(IntersectBVHTest, WideBVHsMatchBinaryBVH) {
+  const RandomScene scene(2000);
+  const auto rays = randomRays(scene.scene(), 2000);
+  const BVHData bvh = buildBVH(scene.scene());
+  const auto bvh4 = collapseBVH4(bvh);
+  const auto quantizedBVH4 = quantizeBVH4(bvh4);
+
+  for (const auto &ray : rays) {
+    BVHHit expected, hit, quantizedHit;
+    const bool found = intersectBVH(scene.scene(), bvh, ray, expected);
+    ASSERT_EQ(found, intersectBVH(scene.scene(), bvh4, ray, hit));
+    ASSERT_EQ(found,
+              intersectBVH(scene.scene(), quantizedBVH4, ray, quantizedHit));
+    if (!found) continue;
+
+    EXPECT_EQ(bvh.triangles[expected.triangle].begin,
+              bvh4.triangles[hit.triangle].begin);
+    EXPECT_EQ(bvh.triangles[expected.triangle].begin,
+              quantizedBVH4.triangles[quantizedHit.triangle].begin);
+    EXPECT_FLOAT_EQ(expected.t, hit.t);
+    EXPECT_FLOAT_EQ(expected.t, quantizedHit.t);
+  }
+}
+
+}  // namespace
@@ -0,0 +1,228 @@
+/*
+ * Copyright 2017 Renato Utsch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "herakles/scene/gpu_bvh_builder.hpp"
+
+#include <cstring>
+#include <vector>
+
+#include <glog/logging.h>
+
+#include "herakles/vulkan/allocator.hpp"
+#include "herakles/vulkan/descriptor_pool.hpp"
+#include "herakles/vulkan/descriptor_set.hpp"
+#include "herakles/vulkan/shader.hpp"
+
+namespace hk {
+namespace {
+using hk::scene::Scene;
+
+// Passes of the build. Must match lbvh.glsl.
+constexpr uint32_t InitPass = 0;
+constexpr uint32_t CentroidBoundsPass = 1;
+constexpr uint32_t MortonCodesPass = 2;
+constexpr uint32_t SortPass = 3;
+constexpr uint32_t HierarchyPass = 4;
+constexpr uint32_t BoundsPass = 5;
+constexpr uint32_t OutputPass = 6;
+
+/// Local size of lbvh.comp.
+constexpr uint32_t WorkGroupSize = 256;
+
+/// Size of LBVHBuildNode in std430.
+constexpr vk::DeviceSize BuildNodeSize = 64;
+
+/// Size of BVHNode and BVHTriangle in std430.
+constexpr vk::DeviceSize NodeSize = 32;
+constexpr vk::DeviceSize TriangleSize = 8;
+
+/// Number of bindings of lbvh.comp.
+constexpr size_t NumBindings = 11;
+
+/// Push constants of lbvh.comp.
+struct PushConstants {
+  uint32_t pass;
+  uint32_t numTriangles;
+  uint32_t numSortElements;
+  uint32_t sortBlockSize;
+  uint32_t sortCompareDistance;
+};
+
+/// Returns the smallest power of two >= n.
+uint32_t nextPowerOfTwo_(uint32_t n) {
+  uint32_t power = 1;
+  while (power < n) power <<= 1;
+  return power;
+}
+
+/// Returns the index of the first triangle of each mesh, plus the total number
+/// of triangles at the end.
+std::vector<uint32_t> meshTriangleOffsets_(const Scene *scene) {
+  std::vector<uint32_t> offsets;
+  offsets.reserve(scene->meshes()->size() + 1);
+
+  uint32_t offset = 0;
+  for (const auto *mesh : *scene->meshes()) {
+    offsets.push_back(offset);
+    offset += (mesh->end() - mesh->begin()) / 3;
+  }
+  offsets.push_back(offset);
+  return offsets;
+}
+
+/// Makes the writes of the previous pass visible to the next one.
+void passBarrier_(const vk::CommandBuffer &commandBuffer) {
+  const vk::MemoryBarrier barrier(
+      vk::AccessFlagBits::eShaderWrite,
+      vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite);
+  commandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader,
+                                vk::PipelineStageFlagBits::eComputeShader, {},
+                                1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+}  // namespace
+
+GPUBVHBuilder::GPUBVHBuilder(const Device &device,
+                             const std::string &shaderFilename)
+    : device_(device),
+      descriptorSetLayout_(createDescriptorSetLayout_()),
+      pipeline_(device, Shader(shaderFilename, "main", device),
+                descriptorSetLayout_,
+                vk::PushConstantRange(vk::ShaderStageFlagBits::eCompute, 0,
+                                      sizeof(PushConstants))) {}
+
+uint32_t GPUBVHBuilder::numTriangles(const Scene *scene) {
+  return meshTriangleOffsets_(scene).back();
+}
+
+vk::DeviceSize GPUBVHBuilder::nodeBufferSize(const Scene *scene) {
+  const vk::DeviceSize n = numTriangles(scene);
+  return n ? (2 * n - 1) * NodeSize : 0;
+}
+
+vk::DeviceSize GPUBVHBuilder::triangleBufferSize(const Scene *scene) {
+  return numTriangles(scene) * TriangleSize;
+}
+
+void GPUBVHBuilder::build(const Scene *scene, const Buffer &meshBuffer,
+                          const Buffer &indexBuffer, const Buffer &vertexBuffer,
+                          const Buffer &nodeBuffer,
+                          const Buffer &triangleBuffer) const {
+  const auto offsets = meshTriangleOffsets_(scene);
+  const uint32_t numTriangles = offsets.back();
+  CHECK_GT(numTriangles, 0u) << "Can't build the BVH of an empty scene.";
+  const uint32_t numNodes = 2 * numTriangles - 1;
+  const uint32_t numSortElements = nextPowerOfTwo_(numTriangles);
+
+  const uint32_t maxGroups =
+      device_.physicalDevice().vkPhysicalDeviceProperties().limits
+          .maxComputeWorkGroupCount[0];
+  CHECK_LE((numNodes + WorkGroupSize - 1) / WorkGroupSize, maxGroups)
+      << "Too many triangles to build the BVH on the GPU.";
+
+  const auto storageUsage = vk::BufferUsageFlagBits::eStorageBuffer;
+  Buffer offsetBuffer(device_, offsets.size() * sizeof(offsets[0]),
+                      storageUsage | vk::BufferUsageFlagBits::eTransferDst);
+  Buffer centroidBoundsBuffer(device_, 6 * sizeof(uint32_t), storageUsage);
+  Buffer sceneTriangleBuffer(device_, numTriangles * TriangleSize,
+                             storageUsage);
+  Buffer mortonCodeBuffer(device_, numSortElements * sizeof(uint32_t),
+                          storageUsage);
+  Buffer sortedIndexBuffer(device_, numSortElements * sizeof(uint32_t),
+                           storageUsage);
+  Buffer buildNodeBuffer(device_, numNodes * BuildNodeSize, storageUsage);
+  const auto scratchMemory = allocateMemory(
+      device_, vk::MemoryPropertyFlagBits::eDeviceLocal,
+      {offsetBuffer, centroidBoundsBuffer, sceneTriangleBuffer,
+       mortonCodeBuffer, sortedIndexBuffer, buildNodeBuffer});
+
+  oneTimeSetup(offsetBuffer, [&](const Buffer &stagingBuffer) {
+    stagingBuffer.mapMemory([&](void *data) {
+      memcpy(data, offsets.data(), stagingBuffer.requestedSize());
+    });
+
+    device_.submitOneTimeComputeCommands(
+        [&](const vk::CommandBuffer &commandBuffer) {
+          stagingBuffer.copyTo(commandBuffer, offsetBuffer);
+        });
+    device_.vkComputeQueue().waitIdle();
+  });
+
+  const auto bufferInfo = [](const Buffer &buffer) {
+    return vk::DescriptorBufferInfo(buffer.vkBuffer(), 0,
+                                    buffer.requestedSize());
+  };
+  const DescriptorPool descriptorPool(descriptorSetLayout_, 1);
+  const DescriptorSet descriptorSet(
+      descriptorPool,
+      {bufferInfo(nodeBuffer), bufferInfo(triangleBuffer),
+       bufferInfo(meshBuffer), bufferInfo(indexBuffer),
+       bufferInfo(vertexBuffer), bufferInfo(offsetBuffer),
+       bufferInfo(centroidBoundsBuffer), bufferInfo(sceneTriangleBuffer),
+       bufferInfo(mortonCodeBuffer), bufferInfo(sortedIndexBuffer),
+       bufferInfo(buildNodeBuffer)});
+
+  const auto recordBuild = [&](const vk::CommandBuffer &commandBuffer) {
+    commandBuffer.bindPipeline(vk::PipelineBindPoint::eCompute,
+                               pipeline_.vkPipeline());
+    commandBuffer.bindDescriptorSets(
+        vk::PipelineBindPoint::eCompute, pipeline_.vkPipelineLayout(), 0, 1,
+        &descriptorSet.vkDescriptorSet(), 0, nullptr);
+
+    PushConstants constants = {0, numTriangles, numSortElements, 0, 0};
+    const auto dispatch = [&](uint32_t pass, uint32_t numThreads) {
+      constants.pass = pass;
+      commandBuffer.pushConstants(pipeline_.vkPipelineLayout(),
+                                  vk::ShaderStageFlagBits::eCompute, 0,
+                                  sizeof(constants), &constants);
+      commandBuffer.dispatch((numThreads + WorkGroupSize - 1) / WorkGroupSize,
+                             1, 1);
+      passBarrier_(commandBuffer);
+    };
+
+    dispatch(InitPass, 1);
+    dispatch(CentroidBoundsPass, numTriangles);
+    dispatch(MortonCodesPass, numSortElements);
+    for (uint32_t k = 2; k <= numSortElements; k <<= 1) {
+      for (uint32_t j = k >> 1; j > 0; j >>= 1) {
+        constants.sortBlockSize = k;
+        constants.sortCompareDistance = j;
+        dispatch(SortPass, numSortElements);
+      }
+    }
+    if (numTriangles > 1) dispatch(HierarchyPass, numTriangles - 1);
+    dispatch(BoundsPass, numTriangles);
+    dispatch(OutputPass, numNodes);
+  };
+  device_.submitOneTimeComputeCommands(recordBuild);
+  device_.vkComputeQueue().waitIdle();
+
+  LOG(INFO) << "Built the BVH of " << numTriangles << " triangles on the GPU";
+}
+
+DescriptorSetLayout GPUBVHBuilder::createDescriptorSetLayout_() const {
+  std::vector<vk::DescriptorSetLayoutBinding> bindings(NumBindings);
+  for (size_t i = 0; i < NumBindings; ++i) {
+    bindings[i]
+        .setBinding(i)
+        .setDescriptorType(vk::DescriptorType::eStorageBuffer)
+        .setDescriptorCount(1);
+  }
+
+  return DescriptorSetLayout(device_, bindings);
+}
+
+}  // namespace hk
@@ -0,0 +1,83 @@
+/*
+ * Copyright 2017 Renato Utsch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HERAKLES_HERAKLES_SCENE_GPU_BVH_BUILDER_HPP
+#define HERAKLES_HERAKLES_SCENE_GPU_BVH_BUILDER_HPP
+
+#include <cstdint>
+#include <string>
+
+#include <vulkan/vulkan.hpp>
+
+#include "herakles/scene/scene_generated.h"
+#include "herakles/vulkan/buffer.hpp"
+#include "herakles/vulkan/descriptor_set_layout.hpp"
+#include "herakles/vulkan/device.hpp"
+#include "herakles/vulkan/pipeline.hpp"
+
+namespace hk {
+
+/**
+ * Builds a Linear BVH on the GPU with the lbvh.comp compute shader.
+ * The output has the same layout as hk::BVHData, and can be used directly by
+ * intersection.glsl, but isn't necessarily identical to the CPU LBVH, as the
+ * GPU uses 30-bit Morton codes.
+ */
+class GPUBVHBuilder {
+ public:
+  /**
+   * Creates the builder.
+   * @param device The device where the BVH will be built.
+   * @param shaderFilename The compiled lbvh.comp shader.
+   */
+  GPUBVHBuilder(const Device &device, const std::string &shaderFilename);
+
+  /// Returns the number of triangles in the scene.
+  static uint32_t numTriangles(const hk::scene::Scene *scene);
+
+  /// Returns the size in bytes of the BVH node buffer for the scene.
+  static vk::DeviceSize nodeBufferSize(const hk::scene::Scene *scene);
+
+  /// Returns the size in bytes of the BVH triangle buffer for the scene.
+  static vk::DeviceSize triangleBufferSize(const hk::scene::Scene *scene);
+
+  /**
+   * Builds the BVH of the scene. Blocks until the build finishes.
+   * @param scene The scene. Only its meshes are read on the CPU.
+   * @param meshBuffer Buffer with the scene meshes.
+   * @param indexBuffer Buffer with the scene indices.
+   * @param vertexBuffer Buffer with the scene vertices.
+   * @param nodeBuffer Output buffer of the BVH nodes, with at least
+   *   nodeBufferSize() bytes.
+   * @param triangleBuffer Output buffer of the BVH triangles, with at least
+   *   triangleBufferSize() bytes.
+   */
+  void build(const hk::scene::Scene *scene, const Buffer &meshBuffer,
+             const Buffer &indexBuffer, const Buffer &vertexBuffer,
+             const Buffer &nodeBuffer, const Buffer &triangleBuffer) const;
+
+ private:
+  /// Creates the layout of the lbvh.comp bindings.
+  DescriptorSetLayout createDescriptorSetLayout_() const;
+
+  const Device &device_;
+  DescriptorSetLayout descriptorSetLayout_;
+  Pipeline pipeline_;
+};
+
+}  // namespace hk
+
+#endif  // !HERAKLES_HERAKLES_SCENE_GPU_BVH_BUILDER_HPP
@@ -0,0 +1,213 @@
+/*
+ * Copyright 2017 Renato Utsch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "herakles/scene/gpu_bvh_refitter.hpp"
+
+#include <cstring>
+#include <vector>
+
+#include <glog/logging.h>
+
+#include "herakles/scene/bvh.hpp"
+#include "herakles/scene/bvh_refit.hpp"
+#include "herakles/scene/task_pool.hpp"
+#include "herakles/vulkan/allocator.hpp"
+#include "herakles/vulkan/descriptor_pool.hpp"
+#include "herakles/vulkan/descriptor_set.hpp"
+#include "herakles/vulkan/shader.hpp"
+
+namespace hk {
+namespace {
+using hk::scene::Scene;
+
+// Passes of the refit. Must match refit.comp.
+constexpr uint32_t ParentsPass = 0;
+constexpr uint32_t BoundsPass = 1;
+
+/// Local size of refit.comp.
+constexpr uint32_t WorkGroupSize = 256;
+
+/// Number of bindings of refit.comp.
+constexpr size_t NumBindings = 7;
+
+/// Push constants of refit.comp.
+struct PushConstants {
+  uint32_t pass;
+  uint32_t numNodes;
+};
+
+/// Makes the writes of the previous pass visible to the next one.
+void passBarrier_(const vk::CommandBuffer &commandBuffer) {
+  const vk::MemoryBarrier barrier(
+      vk::AccessFlagBits::eShaderWrite,
+      vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite);
+  commandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader,
+                                vk::PipelineStageFlagBits::eComputeShader, {},
+                                1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+/// Reads back the first elements of a device local buffer.
+template <typename T>
+std::vector<T> readBack_(const Device &device, const Buffer &buffer,
+                         size_t numElements) {
+  CHECK_LE(numElements * sizeof(T), buffer.requestedSize());
+  Buffer readBackBuffer(device, buffer.requestedSize(),
+                        vk::BufferUsageFlagBits::eTransferDst);
+  const auto memory =
+      allocateMemory(device,
+                     vk::MemoryPropertyFlagBits::eHostVisible |
+                         vk::MemoryPropertyFlagBits::eHostCoherent,
+                     {readBackBuffer});
+
+  device.submitOneTimeComputeCommands(
+      [&](const vk::CommandBuffer &commandBuffer) {
+        buffer.copyTo(commandBuffer, readBackBuffer);
+      });
+  device.vkComputeQueue().waitIdle();
+
+  std::vector<T> elements(numElements);
+  readBackBuffer.mapMemory([&](void *mapped) {
+    memcpy(elements.data(), mapped, numElements * sizeof(T));
+  });
+  return elements;
+}
+
+}  // namespace
+
+GPUBVHRefitter::GPUBVHRefitter(const Device &device,
+                               const std::string &shaderFilename,
+                               bool validate)
+    : device_(device),
+      validatesRefits_(validate),
+      descriptorSetLayout_(createDescriptorSetLayout_()),
+      pipeline_(device, Shader(shaderFilename, "main", device),
+                descriptorSetLayout_,
+                vk::PushConstantRange(vk::ShaderStageFlagBits::eCompute, 0,
+                                      sizeof(PushConstants))) {}
+
+void GPUBVHRefitter::refit(const Scene *scene, const Layout &layout,
+                           uint32_t numNodes, const Buffer &nodeBuffer,
+                           const Buffer &triangleBuffer,
+                           const Buffer &indexBuffer,
+                           const Buffer &vertexBuffer,
+                           const Buffer &sphereBuffer) const {
+  CHECK_GT(numNodes, 0u) << "Can't refit an empty BVH.";
+  CHECK_EQ(layout.width, 2) << "refit.comp only refits binary BVHs.";
+  CHECK(!layout.quantized) << "refit.comp can't refit quantized BVHs.";
+  CHECK(!layout.precomputedTriangles)
+      << "refit.comp only reads BVHTriangles, not precomputed triangles.";
+  CHECK(!layout.twoLevel)
+      << "refit.comp can't refit two-level BVHs, as their top-level leaves "
+         "reference instances instead of triangles.";
+  CHECK_GE(nodeBuffer.requestedSize(), numNodes * sizeof(BVHNode));
+  CHECK_GE(sphereBuffer.requestedSize(),
+           numSpheres(scene) * sizeof(hk::scene::Sphere));
+
+  const uint32_t maxGroups =
+      device_.physicalDevice().vkPhysicalDeviceProperties().limits
+          .maxComputeWorkGroupCount[0];
+  CHECK_LE((numNodes + WorkGroupSize - 1) / WorkGroupSize, maxGroups)
+      << "Too many nodes to refit the BVH on the GPU.";
+
+  const auto storageUsage = vk::BufferUsageFlagBits::eStorageBuffer;
+  Buffer parentBuffer(device_, numNodes * sizeof(uint32_t), storageUsage);
+  Buffer visitBuffer(device_, numNodes * sizeof(uint32_t), storageUsage);
+  const auto scratchMemory =
+      allocateMemory(device_, vk::MemoryPropertyFlagBits::eDeviceLocal,
+                     {parentBuffer, visitBuffer});
+
+  const auto bufferInfo = [](const Buffer &buffer) {
+    return vk::DescriptorBufferInfo(buffer.vkBuffer(), 0,
+                                    buffer.requestedSize());
+  };
+  const DescriptorPool descriptorPool(descriptorSetLayout_, 1);
+  const DescriptorSet descriptorSet(
+      descriptorPool,
+      {bufferInfo(nodeBuffer), bufferInfo(triangleBuffer),
+       bufferInfo(indexBuffer), bufferInfo(vertexBuffer),
+       bufferInfo(parentBuffer), bufferInfo(visitBuffer),
+       bufferInfo(sphereBuffer)});
+
+  const auto recordRefit = [&](const vk::CommandBuffer &commandBuffer) {
+    commandBuffer.bindPipeline(vk::PipelineBindPoint::eCompute,
+                               pipeline_.vkPipeline());
+    commandBuffer.bindDescriptorSets(
+        vk::PipelineBindPoint::eCompute, pipeline_.vkPipelineLayout(), 0, 1,
+        &descriptorSet.vkDescriptorSet(), 0, nullptr);
+
+    for (const uint32_t pass : {ParentsPass, BoundsPass}) {
+      const PushConstants constants = {pass, numNodes};
+      commandBuffer.pushConstants(pipeline_.vkPipelineLayout(),
+                                  vk::ShaderStageFlagBits::eCompute, 0,
+                                  sizeof(constants), &constants);
+      commandBuffer.dispatch((numNodes + WorkGroupSize - 1) / WorkGroupSize,
+                             1, 1);
+      passBarrier_(commandBuffer);
+    }
+  };
+  device_.submitOneTimeComputeCommands(recordRefit);
+  device_.vkComputeQueue().waitIdle();
+
+  VLOG(1) << "Refitted the BVH of " << numNodes << " nodes on the GPU";
+
+  if (validatesRefits_) {
+    validateRefit_(scene, numNodes, nodeBuffer, triangleBuffer);
+  }
+}
+
+DescriptorSetLayout GPUBVHRefitter::createDescriptorSetLayout_() const {
+  std::vector<vk::DescriptorSetLayoutBinding> bindings(NumBindings);
+  for (size_t i = 0; i < NumBindings; ++i) {
+    bindings[i]
+        .setBinding(i)
+        .setDescriptorType(vk::DescriptorType::eStorageBuffer)
+        .setDescriptorCount(1);
+  }
+
+  return DescriptorSetLayout(device_, bindings);
+}
+
+void GPUBVHRefitter::validateRefit_(const Scene *scene, uint32_t numNodes,
+                                    const Buffer &nodeBuffer,
+                                    const Buffer &triangleBuffer) const {
+  // The triangle buffer might be bigger than the BVH needs, so every triangle
+  // it can hold is read back. Only the ones referenced by leaves are used.
+  BVHData gpuBVH(readBack_<BVHNode>(device_, nodeBuffer, numNodes),
+                 readBack_<BVHTriangle>(
+                     device_, triangleBuffer,
+                     triangleBuffer.requestedSize() / sizeof(BVHTriangle)));
+  BVHData cpuBVH(std::vector<BVHNode>(gpuBVH.nodes),
+                 std::vector<BVHTriangle>(gpuBVH.triangles));
+  TaskPool pool;
+  refitBVH(pool, scene, cpuBVH);
+
+  // Both only take minimums and maximums of the same floats, so the bounds
+  // must match exactly.
+  size_t numMismatches = 0;
+  for (size_t i = 0; i < numNodes; ++i) {
+    if (gpuBVH.nodes[i].minPoint != cpuBVH.nodes[i].minPoint ||
+        gpuBVH.nodes[i].maxPoint != cpuBVH.nodes[i].maxPoint) {
+      ++numMismatches;
+    }
+  }
+
+  CHECK_EQ(numMismatches, 0u)
+      << "GPU BVH refit validation failed: " << numMismatches << " of "
+      << numNodes << " nodes have other bounds than the CPU refit";
+  VLOG(1) << "GPU BVH refit validated with " << numNodes << " nodes";
+}
+
+}  // namespace hk
@@ -0,0 +1,117 @@
+/*
+ * Copyright 2017 Renato Utsch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HERAKLES_HERAKLES_SCENE_GPU_BVH_REFITTER_HPP
+#define HERAKLES_HERAKLES_SCENE_GPU_BVH_REFITTER_HPP
+
+#include <cstdint>
+#include <string>
+
+#include <vulkan/vulkan.hpp>
+
+#include "herakles/scene/scene_generated.h"
+#include "herakles/vulkan/buffer.hpp"
+#include "herakles/vulkan/descriptor_set_layout.hpp"
+#include "herakles/vulkan/device.hpp"
+#include "herakles/vulkan/pipeline.hpp"
+
+namespace hk {
+
+/// If GPUBVHRefitter validates every refit by default, which builds without
+/// NDEBUG do.
+#ifdef NDEBUG
+constexpr bool GPUBVHRefitterValidates = false;
+#else
+constexpr bool GPUBVHRefitterValidates = true;
+#endif
+
+/**
+ * Refits a binary BVH on the GPU with the refit.comp compute shader, the GPU
+ * counterpart of hk::refitBVH(). Works on the node buffer as used by
+ * intersection.glsl, whether it was built on the CPU or on the GPU, as the
+ * parents of the nodes are found on the GPU. Leaves with spheres are bounded
+ * by the current spheres, as on the CPU.
+ */
+class GPUBVHRefitter {
+ public:
+  /**
+   * How the BVH is stored in the buffers. refit.comp only reads single-level
+   * binary BVHs whose leaves reference BVHTriangles, so refit() rejects every
+   * other layout instead of writing garbage bounds.
+   */
+  struct Layout {
+    /// Number of children of each node.
+    int width = 2;
+
+    /// If the nodes are quantized.
+    bool quantized = false;
+
+    /// If the triangles are stored as PrecomputedTriangles.
+    bool precomputedTriangles = false;
+
+    /// If it is a two-level BVH, whose top-level leaves reference instances.
+    bool twoLevel = false;
+  };
+
+  /**
+   * Creates the refitter.
+   * @param device The device where the BVH lives.
+   * @param shaderFilename The compiled refit.comp shader.
+   * @param validate If every refit is read back and compared with the bounds
+   *   hk::refitBVH() computes on the CPU.
+   */
+  GPUBVHRefitter(const Device &device, const std::string &shaderFilename,
+                 bool validate = GPUBVHRefitterValidates);
+
+  /**
+   * Refits the BVH to the current vertices. Blocks until the refit finishes.
+   * @param scene The scene with the moved vertices and spheres, whose buffers
+   *   are given.
+   * @param layout Layout of the BVH in the buffers.
+   * @param numNodes Number of nodes of the BVH.
+   * @param nodeBuffer Buffer with the BVH nodes, whose bounds are updated.
+   *   Must also be a transfer source if the refits are validated.
+   * @param triangleBuffer Buffer with the BVH triangles. Must also be a
+   *   transfer source if the refits are validated.
+   * @param indexBuffer Buffer with the scene indices.
+   * @param vertexBuffer Buffer with the moved scene vertices.
+   * @param sphereBuffer Buffer with the moved scene spheres. Only read if the
+   *   BVH has spheres, but must not be empty.
+   */
+  void refit(const hk::scene::Scene *scene, const Layout &layout,
+             uint32_t numNodes, const Buffer &nodeBuffer,
+             const Buffer &triangleBuffer, const Buffer &indexBuffer,
+             const Buffer &vertexBuffer, const Buffer &sphereBuffer) const;
+
+ private:
+  /// Creates the layout of the refit.comp bindings.
+  DescriptorSetLayout createDescriptorSetLayout_() const;
+
+  /// Reads back the refitted BVH and CHECKs that its bounds are the ones
+  /// hk::refitBVH() computes from the same topology and triangles.
+  void validateRefit_(const hk::scene::Scene *scene, uint32_t numNodes,
+                      const Buffer &nodeBuffer,
+                      const Buffer &triangleBuffer) const;
+
+  const Device &device_;
+  const bool validatesRefits_;
+  DescriptorSetLayout descriptorSetLayout_;
+  Pipeline pipeline_;
+};
+
+}  // namespace hk
+
+#endif  // !HERAKLES_HERAKLES_SCENE_GPU_BVH_REFITTER_HPP
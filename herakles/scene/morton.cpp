@@ -0,0 +1,92 @@
+/*
+ * Copyright 2017 Renato Utsch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "herakles/scene/morton.hpp"
+
+#include <array>
+
+#include <glog/logging.h>
+
+namespace hk {
+namespace {
+
+/// Number of bits sorted by each radix sort pass.
+constexpr int RadixBits = 8;
+
+/// Number of different digits in a radix sort pass.
+constexpr size_t RadixSize = 1 << RadixBits;
+
+/// Number of codes processed by each task of the radix sort.
+constexpr size_t RadixGrainSize = 1 << 16;
+
+using Histogram = std::array<size_t, RadixSize>;
+
+/// Returns the digit of the code sorted by the pass with the given shift.
+size_t digit_(uint64_t code, int shift) {
+  return (code >> shift) & (RadixSize - 1);
+}
+
+}  // namespace
+
+void sortMortonCodes(TaskPool &pool, std::vector<uint64_t> &codes,
+                     std::vector<uint32_t> &values) {
+  CHECK_EQ(codes.size(), values.size());
+  const size_t size = codes.size();
+  const size_t numChunks = TaskPool::numChunks(0, size, RadixGrainSize);
+
+  std::vector<uint64_t> tmpCodes(size);
+  std::vector<uint32_t> tmpValues(size);
+  std::vector<Histogram> histograms(numChunks);
+
+  for (int shift = 0; shift < MortonCodeBits; shift += RadixBits) {
+    pool.parallelFor(0, size, RadixGrainSize, [&](size_t begin, size_t end) {
+      auto &histogram = histograms[begin / RadixGrainSize];
+      histogram.fill(0);
+      for (size_t i = begin; i < end; ++i) {
+        ++histogram[digit_(codes[i], shift)];
+      }
+    });
+
+    // Turn the histograms into the first output position of each digit of
+    // each chunk. Chunks write their codes in order, so the sort is stable.
+    size_t offset = 0;
+    bool sameDigit = false;
+    for (size_t d = 0; d < RadixSize; ++d) {
+      size_t digitCount = 0;
+      for (auto &histogram : histograms) {
+        const size_t count = histogram[d];
+        histogram[d] = offset;
+        offset += count;
+        digitCount += count;
+      }
+      sameDigit |= digitCount == size;
+    }
+    if (sameDigit) continue;
+
+    pool.parallelFor(0, size, RadixGrainSize, [&](size_t begin, size_t end) {
+      auto &positions = histograms[begin / RadixGrainSize];
+      for (size_t i = begin; i < end; ++i) {
+        const size_t position = positions[digit_(codes[i], shift)]++;
+        tmpCodes[position] = codes[i];
+        tmpValues[position] = values[i];
+      }
+    });
+    codes.swap(tmpCodes);
+    values.swap(tmpValues);
+  }
+}
+
+}  // namespace hk
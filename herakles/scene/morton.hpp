@@ -0,0 +1,116 @@
+/*
+ * Copyright 2017 Renato Utsch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HERAKLES_HERAKLES_SCENE_MORTON_HPP
+#define HERAKLES_HERAKLES_SCENE_MORTON_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "herakles/scene/bounds.hpp"
+#include "herakles/scene/task_pool.hpp"
+
+namespace hk {
+
+/// Number of bits each coordinate is quantized to in a Morton code.
+constexpr int MortonBitsPerAxis = 21;
+
+/// Number of bits of a Morton code.
+constexpr int MortonCodeBits = 3 * MortonBitsPerAxis;
+
+/**
+ * Encodes points into 63-bit Morton codes.
+ *
+ * Each coordinate is quantized to 21 bits inside the given bounds, and the
+ * bits are interleaved so that bit 3 * i + 2 - axis of the code is bit i of
+ * the given axis. Sorting points by their codes places them along a Z-order
+ * curve, so points close in the sorted order are also close in space.
+ */
+class MortonEncoder {
+ public:
+  /**
+   * Creates the encoder.
+   * @param bounds Bounds of the points that will be encoded.
+   */
+  explicit MortonEncoder(const Bounds3f &bounds) : origin_(bounds.minPoint) {
+    const float maxCoordinate = (1 << MortonBitsPerAxis) - 1;
+    for (int i = 0; i < 3; ++i) {
+      const float extent = bounds.maxPoint[i] - bounds.minPoint[i];
+      scale_[i] = extent > 0.0f ? maxCoordinate / extent : 0.0f;
+    }
+  }
+
+  /// Returns the Morton code of the given point. The point must be inside the
+  /// bounds given to the constructor.
+  uint64_t encode(const glm::vec3 &p) const {
+    const glm::vec3 q = (p - origin_) * scale_;
+    return (expandBits_(quantize_(q.x)) << 2) |
+           (expandBits_(quantize_(q.y)) << 1) | expandBits_(quantize_(q.z));
+  }
+
+  /// Returns the axis of the coordinate the given bit of a code belongs to.
+  static int bitAxis(int bit) { return 2 - bit % 3; }
+
+ private:
+  /// Clamps a scaled coordinate to the representable range.
+  static uint64_t quantize_(float v) {
+    return (uint64_t)std::min(std::max(v, 0.0f),
+                              (float)((1 << MortonBitsPerAxis) - 1));
+  }
+
+  /// Spreads the lower 21 bits of v so that there are two zero bits between
+  /// each of them.
+  static uint64_t expandBits_(uint64_t v) {
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffff;
+    v = (v | v << 16) & 0x1f0000ff0000ff;
+    v = (v | v << 8) & 0x100f00f00f00f00f;
+    v = (v | v << 4) & 0x10c30c30c30c30c3;
+    v = (v | v << 2) & 0x1249249249249249;
+    return v;
+  }
+
+  glm::vec3 origin_;
+  glm::vec3 scale_;
+};
+
+/**
+ * Returns the highest bit in which the two Morton codes differ, or -1 if the
+ * codes are equal.
+ */
+inline int highestDifferingBit(uint64_t a, uint64_t b) {
+  return a == b ? -1 : 63 - __builtin_clzll(a ^ b);
+}
+
+/**
+ * Sorts the Morton codes in ascending order with a parallel, stable LSD radix
+ * sort, applying the same permutation to values.
+ * Passes over digits that are equal in every code are skipped. The result
+ * doesn't depend on the number of threads in the pool.
+ * @param pool Pool used to sort in parallel.
+ * @param codes The Morton codes to sort.
+ * @param values Values associated with each code. Must have the same size as
+ *   codes.
+ */
+void sortMortonCodes(TaskPool &pool, std::vector<uint64_t> &codes,
+                     std::vector<uint32_t> &values);
+
+}  // namespace hk
+
+#endif  // !HERAKLES_HERAKLES_SCENE_MORTON_HPP
@@ -0,0 +1,116 @@
+/*
+ * Copyright 2017 Renato Utsch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "herakles/scene/morton.hpp"
+
+#include <algorithm>
+#include <numeric>
+#include <random>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace {
+using ::hk::Bounds3f;
+using ::hk::MortonEncoder;
+using ::hk::TaskPool;
+
+TEST(MortonEncoderTest, InterleavesTheBitsOfEachAxis) {
+  // Bounds where each quantized coordinate is the coordinate itself.
+  const float maxCoordinate = (1 << hk::MortonBitsPerAxis) - 1;
+  const MortonEncoder encoder(
+      Bounds3f(glm::vec3(0.0f), glm::vec3(maxCoordinate)));
+
+  EXPECT_EQ(0u, encoder.encode(glm::vec3(0.0f)));
+  EXPECT_EQ(0x7FFFFFFFFFFFFFFFu, encoder.encode(glm::vec3(maxCoordinate)));
+  EXPECT_EQ(0x4924924924924924u,
+            encoder.encode(glm::vec3(maxCoordinate, 0.0f, 0.0f)));
+  EXPECT_EQ(0x2492492492492492u,
+            encoder.encode(glm::vec3(0.0f, maxCoordinate, 0.0f)));
+  EXPECT_EQ(0x1249249249249249u,
+            encoder.encode(glm::vec3(0.0f, 0.0f, maxCoordinate)));
+
+  // x = 1 is bit 2, y = 2 is bit 4 and z = 3 is bits 0 and 3.
+  EXPECT_EQ(0b11101u, encoder.encode(glm::vec3(1.0f, 2.0f, 3.0f)));
+  EXPECT_EQ(0, MortonEncoder::bitAxis(2));
+  EXPECT_EQ(1, MortonEncoder::bitAxis(4));
+  EXPECT_EQ(2, MortonEncoder::bitAxis(3));
+}
+
+TEST(MortonEncoderTest, ClampsPointsToTheBounds) {
+  const MortonEncoder encoder(
+      Bounds3f(glm::vec3(-1.0f, 0.0f, 10.0f), glm::vec3(1.0f, 0.0f, 20.0f)));
+
+  // The flat y axis always quantizes to 0.
+  EXPECT_EQ(0u, encoder.encode(glm::vec3(-1.0f, 0.0f, 10.0f)));
+  EXPECT_EQ(0u, encoder.encode(glm::vec3(-5.0f, 3.0f, 0.0f)));
+  EXPECT_EQ(0x5B6DB6DB6DB6DB6Du,
+            encoder.encode(glm::vec3(5.0f, 3.0f, 30.0f)));
+}
+
+TEST(MortonTest, FindsTheHighestDifferingBit) {
+  EXPECT_EQ(-1, hk::highestDifferingBit(42, 42));
+  EXPECT_EQ(0, hk::highestDifferingBit(0, 1));
+  EXPECT_EQ(5, hk::highestDifferingBit(0b100000, 0b011111));
+  EXPECT_EQ(62, hk::highestDifferingBit(1ull << 62, 0));
+}
+
+TEST(MortonTest, SortsLikeAStableSort) {
+  // Few distinct codes, so that the stability is tested, spread over the
+  // low and high digits and enough of them to sort in parallel chunks.
+  std::mt19937_64 rng(42);
+  std::vector<uint64_t> distinctCodes(1000);
+  for (auto &code : distinctCodes) {
+    code = rng() & ((1ull << hk::MortonCodeBits) - 1);
+    if (code % 3 == 0) code &= 0xFFFF;
+  }
+  std::uniform_int_distribution<size_t> pick(0, distinctCodes.size() - 1);
+  std::vector<uint64_t> codes(300000);
+  for (auto &code : codes) code = distinctCodes[pick(rng)];
+
+  std::vector<uint32_t> expectedValues(codes.size());
+  std::iota(expectedValues.begin(), expectedValues.end(), 0);
+  std::stable_sort(
+      expectedValues.begin(), expectedValues.end(),
+      [&](uint32_t a, uint32_t b) { return codes[a] < codes[b]; });
+
+  for (size_t numThreads : {1, 4}) {
+    TaskPool pool(numThreads);
+    std::vector<uint64_t> sortedCodes = codes;
+    std::vector<uint32_t> values(codes.size());
+    std::iota(values.begin(), values.end(), 0);
+    hk::sortMortonCodes(pool, sortedCodes, values);
+
+    ASSERT_EQ(expectedValues, values) << numThreads << " threads";
+    for (size_t i = 0; i < codes.size(); ++i) {
+      ASSERT_EQ(codes[expectedValues[i]], sortedCodes[i]);
+    }
+  }
+}
+
+TEST(MortonTest, SortsCodesThatOnlyDifferInTheHighestDigit) {
+  TaskPool pool(2);
+  std::vector<uint64_t> codes = {3ull << 56, 1ull << 56, 2ull << 56, 0,
+                                 1ull << 56};
+  std::vector<uint32_t> values = {0, 1, 2, 3, 4};
+  hk::sortMortonCodes(pool, codes, values);
+  EXPECT_EQ((std::vector<uint64_t>{0, 1ull << 56, 1ull << 56, 2ull << 56,
+                                   3ull << 56}),
+            codes);
+  EXPECT_EQ((std::vector<uint32_t>{3, 1, 4, 2, 0}), values);
+}
+
+}  // namespace
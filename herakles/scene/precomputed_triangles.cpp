@@ -0,0 +1,75 @@
+/*
+ * Copyright 2017 Renato Utsch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "herakles/scene/precomputed_triangles.hpp"
+
+#include <glog/logging.h>
+
+namespace hk {
+namespace {
+using hk::scene::Scene;
+
+/**
+ * Returns the position of the vertex at the given position of the indices
+ * array.
+ */
+glm::vec3 vertex_(const Scene *scene, uint32_t index) {
+  const auto *v = scene->vertices()->Get(scene->indices()->Get(index));
+  return glm::vec3(v->x(), v->y(), v->z());
+}
+
+/**
+ * Packs the material and area light IDs of the mesh, in the format of
+ * PrecomputedTriangle::packedMaterialAndLight.
+ */
+uint32_t packMaterialAndLight_(const hk::scene::Mesh &mesh) {
+  CHECK_LE(mesh.materialID(), 0xFFFFu)
+      << "Too many materials to precompute the triangles.";
+  CHECK(mesh.areaLightID() >= -0x8000 && mesh.areaLightID() <= 0x7FFF)
+      << "Too many area lights to precompute the triangles.";
+  return mesh.materialID() | (uint32_t(mesh.areaLightID()) << 16);
+}
+
+}  // namespace
+
+std::vector<PrecomputedTriangle> precomputeTriangles(
+    const Scene *scene, const std::vector<BVHTriangle> &triangles) {
+  // The IDs are packed and checked once per mesh.
+  std::vector<uint32_t> packedMeshes(scene->meshes()->size());
+  for (size_t i = 0; i < packedMeshes.size(); ++i) {
+    packedMeshes[i] = packMaterialAndLight_(*scene->meshes()->Get(i));
+  }
+
+  std::vector<PrecomputedTriangle> precomputed(triangles.size());
+  for (size_t i = 0; i < triangles.size(); ++i) {
+    const auto &triangle = triangles[i];
+    CHECK(!isTrianglePair(triangle))
+        << "Triangle pairs can't be precomputed.";
+    CHECK(!isSphere(triangle)) << "Spheres can't be precomputed.";
+    CHECK_LT(triangle.meshID, packedMeshes.size())
+        << "BVH triangle with an invalid meshID.";
+    auto &out = precomputed[i];
+    out.v0 = vertex_(scene, triangle.begin);
+    out.meshID = triangle.meshID;
+    out.edge1 = vertex_(scene, triangle.begin + 1) - out.v0;
+    out.begin = triangle.begin;
+    out.edge2 = vertex_(scene, triangle.begin + 2) - out.v0;
+    out.packedMaterialAndLight = packedMeshes[triangle.meshID];
+  }
+  return precomputed;
+}
+
+}  // namespace hk
@@ -0,0 +1,74 @@
+/*
+ * Copyright 2017 Renato Utsch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HERAKLES_HERAKLES_SCENE_PRECOMPUTED_TRIANGLES_HPP
+#define HERAKLES_HERAKLES_SCENE_PRECOMPUTED_TRIANGLES_HPP
+
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "herakles/scene/bvh.hpp"
+#include "herakles/scene/scene_generated.h"
+
+namespace hk {
+
+/**
+ * A triangle gathered from the scene buffers, stored in the same order as the
+ * BVH triangles so that the triangles of a leaf are contiguous. Traversal
+ * reads it with a single load instead of going through the BVH triangle, the
+ * indices and the vertices, and the shading reads the material and area light
+ * from it instead of from the mesh.
+ * This struct has exactly 48 bytes, and matches PrecomputedTriangle in
+ * scene.glsl.
+ */
+struct PrecomputedTriangle {
+  /// First vertex of the triangle.
+  glm::vec3 v0;
+
+  /// ID of the triangle's mesh.
+  uint32_t meshID;
+
+  /// Second vertex minus the first one.
+  glm::vec3 edge1;
+
+  /// Beginning of the triangle in the indices array.
+  uint32_t begin;
+
+  /// Third vertex minus the first one.
+  glm::vec3 edge2;
+
+  /// Material ID of the mesh in the low 16 bits and its area light ID, as a
+  /// signed 16 bit integer, in the high 16 bits.
+  uint32_t packedMaterialAndLight;
+};
+
+static_assert(sizeof(PrecomputedTriangle) == 48,
+              "PrecomputedTriangle must match the std430 layout of "
+              "scene.glsl");
+
+/**
+ * Gathers the given BVH triangles from the scene, in the same order. Works
+ * with the triangles of any BVH of the scene, including the bottom levels of a
+ * two-level BVH, whose triangles are in the space of their meshes.
+ */
+std::vector<PrecomputedTriangle> precomputeTriangles(
+    const hk::scene::Scene *scene, const std::vector<BVHTriangle> &triangles);
+
+}  // namespace hk
+
+#endif  // !HERAKLES_HERAKLES_SCENE_PRECOMPUTED_TRIANGLES_HPP
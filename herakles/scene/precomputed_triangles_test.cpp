@@ -0,0 +1,61 @@
+/*
+ * Copyright 2017 Renato Utsch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "herakles/scene/precomputed_triangles.hpp"
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "herakles/scene/random_scene.hpp"
+
+namespace {
+using ::hk::BVHData;
+using ::hk::PrecomputedTriangle;
+using ::hk::RandomScene;
+using ::hk::buildBVH;
+using ::hk::precomputeTriangles;
+
+TEST(PrecomputedTrianglesTest, GathersTheTrianglesInBVHOrder) {
+  const RandomScene random(1000);
+  const auto *scene = random.scene();
+  const BVHData bvh = buildBVH(scene);
+  const std::vector<PrecomputedTriangle> precomputed =
+      precomputeTriangles(scene, bvh.triangles);
+
+  ASSERT_EQ(bvh.triangles.size(), precomputed.size());
+  for (size_t i = 0; i < precomputed.size(); ++i) {
+    const auto &triangle = precomputed[i];
+    EXPECT_EQ(bvh.triangles[i].meshID, triangle.meshID);
+    EXPECT_EQ(bvh.triangles[i].begin, triangle.begin);
+
+    const glm::vec3 vertices[3] = {triangle.v0,
+                                   triangle.v0 + triangle.edge1,
+                                   triangle.v0 + triangle.edge2};
+    for (uint32_t v = 0; v < 3; ++v) {
+      const auto *expected =
+          scene->vertices()->Get(scene->indices()->Get(triangle.begin + v));
+      EXPECT_NEAR(expected->x(), vertices[v].x, 1e-4f);
+      EXPECT_NEAR(expected->y(), vertices[v].y, 1e-4f);
+      EXPECT_NEAR(expected->z(), vertices[v].z, 1e-4f);
+    }
+
+    // Material 0 and area light -1.
+    EXPECT_EQ(0xFFFF0000u, triangle.packedMaterialAndLight);
+  }
+}
+
+}  // namespace
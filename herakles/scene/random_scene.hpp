@@ -0,0 +1,81 @@
+/*
+ * Copyright 2017 Renato Utsch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HERAKLES_HERAKLES_SCENE_RANDOM_SCENE_HPP
+#define HERAKLES_HERAKLES_SCENE_RANDOM_SCENE_HPP
+
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#include "herakles/scene/scene_generated.h"
+
+namespace hk {
+
+/**
+ * Scene with randomly placed triangles, used in tests.
+ * The scene lives while this object lives.
+ */
+class RandomScene {
+ public:
+  /**
+   * Creates the scene.
+   * @param numTriangles Number of triangles in the scene.
+   * @param seed Seed of the random number generator.
+   * @param triangleSize Maximum offset of each vertex from the triangle's
+   *   position, along each axis.
+   */
+  explicit RandomScene(size_t numTriangles, uint32_t seed = 42,
+                       float triangleSize = 1.0f) {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> position(-100.0f, 100.0f);
+    std::uniform_real_distribution<float> offset(-triangleSize, triangleSize);
+
+    std::vector<hk::scene::vec4> vertices;
+    std::vector<uint32_t> indices;
+    for (size_t i = 0; i < numTriangles; ++i) {
+      const float x = position(rng), y = position(rng), z = position(rng);
+      for (int v = 0; v < 3; ++v) {
+        indices.push_back(vertices.size());
+        vertices.emplace_back(x + offset(rng), y + offset(rng),
+                              z + offset(rng), 1.0f);
+      }
+    }
+
+    const std::vector<hk::scene::Mesh> meshes = {
+        hk::scene::Mesh(0, indices.size(), 0, -1)};
+    const auto meshesOffset = builder_.CreateVectorOfStructs(meshes);
+    const auto indicesOffset = builder_.CreateVector(indices);
+    const auto verticesOffset = builder_.CreateVectorOfStructs(vertices);
+    hk::scene::FinishSceneBuffer(
+        builder_,
+        hk::scene::CreateScene(builder_, nullptr, false, nullptr, {}, {},
+                               meshesOffset, {}, indicesOffset,
+                               verticesOffset));
+  }
+
+  /// Returns the scene.
+  const hk::scene::Scene *scene() const {
+    return hk::scene::GetScene(builder_.GetBufferPointer());
+  }
+
+ private:
+  flatbuffers::FlatBufferBuilder builder_;
+};
+
+}  // namespace hk
+
+#endif  // !HERAKLES_HERAKLES_SCENE_RANDOM_SCENE_HPP
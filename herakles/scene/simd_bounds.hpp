@@ -0,0 +1,210 @@
+/*
+ * Copyright 2017 Renato Utsch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HERAKLES_HERAKLES_SCENE_SIMD_BOUNDS_HPP
+#define HERAKLES_HERAKLES_SCENE_SIMD_BOUNDS_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <glm/glm.hpp>
+
+#include "herakles/scene/bounds.hpp"
+
+namespace hk {
+
+/**
+ * A 3D point padded to 4 floats so that it can be loaded into a SIMD register.
+ */
+struct alignas(16) SIMDPoint3f {
+  float data[4];
+
+  SIMDPoint3f() : data{0.0f, 0.0f, 0.0f, 0.0f} {}
+
+  explicit SIMDPoint3f(const glm::vec3 &p) : data{p.x, p.y, p.z, 0.0f} {}
+
+  /// Returns the component of the given axis.
+  float operator[](int axis) const { return data[axis]; }
+};
+
+/**
+ * Axis-aligned bounding box laid out for SIMD accumulation.
+ *
+ * The box is stored as the minimum point followed by the negated maximum
+ * point, each padded to 4 floats. The union of two boxes is then a single
+ * element-wise minimum over 8 floats: one instruction with AVX, two with SSE,
+ * or a scalar loop on other architectures.
+ */
+class alignas(32) SIMDBounds3f {
+ public:
+  /// Invalid empty bounds.
+  SIMDBounds3f() {
+    const float maxNum = std::numeric_limits<float>::max();
+    for (int i = 0; i < 3; ++i) {
+      data_[i] = maxNum;
+      data_[i + 4] = maxNum;
+    }
+    data_[3] = data_[7] = 0.0f;
+  }
+
+  /// Converts the given bounds.
+  explicit SIMDBounds3f(const Bounds3f &bounds) {
+    for (int i = 0; i < 3; ++i) {
+      data_[i] = bounds.minPoint[i];
+      data_[i + 4] = -bounds.maxPoint[i];
+    }
+    data_[3] = data_[7] = 0.0f;
+  }
+
+  /// Adds a bounding box to this one.
+  SIMDBounds3f &operator+=(const SIMDBounds3f &other) {
+#if defined(__AVX__)
+    _mm256_store_ps(data_, _mm256_min_ps(_mm256_load_ps(data_),
+                                         _mm256_load_ps(other.data_)));
+#elif defined(__SSE2__)
+    _mm_store_ps(data_,
+                 _mm_min_ps(_mm_load_ps(data_), _mm_load_ps(other.data_)));
+    _mm_store_ps(data_ + 4, _mm_min_ps(_mm_load_ps(data_ + 4),
+                                       _mm_load_ps(other.data_ + 4)));
+#else
+    for (int i = 0; i < 8; ++i) {
+      data_[i] = std::min(data_[i], other.data_[i]);
+    }
+#endif
+    return *this;
+  }
+
+  /// Adds a point to this bounding box.
+  SIMDBounds3f &operator+=(const SIMDPoint3f &p) {
+#if defined(__SSE2__)
+    const __m128 point = _mm_load_ps(p.data);
+    _mm_store_ps(data_, _mm_min_ps(_mm_load_ps(data_), point));
+    _mm_store_ps(data_ + 4,
+                 _mm_min_ps(_mm_load_ps(data_ + 4),
+                            _mm_sub_ps(_mm_setzero_ps(), point)));
+#else
+    for (int i = 0; i < 4; ++i) {
+      data_[i] = std::min(data_[i], p.data[i]);
+      data_[i + 4] = std::min(data_[i + 4], -p.data[i]);
+    }
+#endif
+    return *this;
+  }
+
+  /// Returns the minimum point of the bounding box.
+  glm::vec3 minPoint() const {
+    return glm::vec3(data_[0], data_[1], data_[2]);
+  }
+
+  /// Returns the maximum point of the bounding box.
+  glm::vec3 maxPoint() const {
+    return glm::vec3(-data_[4], -data_[5], -data_[6]);
+  }
+
+  /// Returns the centroid of the bounding box.
+  SIMDPoint3f centroid() const {
+    return SIMDPoint3f(minPoint() * 0.5f + maxPoint() * 0.5f);
+  }
+
+  /// Returns the surface area of the bounding box. Must not be empty.
+  float surfaceArea() const {
+    const float dx = -data_[4] - data_[0];
+    const float dy = -data_[5] - data_[1];
+    const float dz = -data_[6] - data_[2];
+    return 2.0f * (dx * dy + dx * dz + dy * dz);
+  }
+
+  /// Converts to the scalar bounds representation.
+  Bounds3f toBounds3f() const { return Bounds3f(minPoint(), maxPoint()); }
+
+ private:
+  float data_[8];
+};
+
+/**
+ * Maps points to SAH bucket indices along all three axes at once.
+ */
+class SIMDBucketMapper {
+ public:
+  /**
+   * Creates the mapper.
+   * @param centroidBounds Bounds of the points that will be mapped.
+   * @param numBuckets Number of buckets along each axis.
+   */
+  SIMDBucketMapper(const Bounds3f &centroidBounds, uint32_t numBuckets) {
+    for (int i = 0; i < 3; ++i) {
+      const float extent =
+          centroidBounds.maxPoint[i] - centroidBounds.minPoint[i];
+      origin_[i] = centroidBounds.minPoint[i];
+      // Denormal extents overflow the scale, which then maps every point to
+      // bucket 0 like an empty extent does.
+      const float scale = extent > 0.0f ? numBuckets / extent : 0.0f;
+      scale_[i] = std::isfinite(scale) ? scale : 0.0f;
+    }
+    origin_[3] = scale_[3] = 0.0f;
+    maxBucket_ = numBuckets - 1;
+  }
+
+  /**
+   * Writes the bucket of the point along each axis into buckets[0..2].
+   * The buckets are clamped to [0, numBuckets - 1], and NaN offsets map to
+   * bucket 0.
+   */
+  void map(const SIMDPoint3f &p, int32_t buckets[4]) const {
+#if defined(__SSE2__)
+    const __m128 offset = _mm_mul_ps(
+        _mm_sub_ps(_mm_load_ps(p.data), _mm_load_ps(origin_)),
+        _mm_load_ps(scale_));
+    // maxps returns its second operand if either one is NaN.
+    const __m128 clamped =
+        _mm_min_ps(_mm_max_ps(offset, _mm_setzero_ps()),
+                   _mm_set1_ps((float)maxBucket_));
+    _mm_storeu_si128((__m128i *)buckets, _mm_cvttps_epi32(clamped));
+#else
+    for (int i = 0; i < 4; ++i) {
+      // std::max returns its first operand if the second one is NaN.
+      const float offset = (p.data[i] - origin_[i]) * scale_[i];
+      buckets[i] = (int32_t)std::min(std::max(0.0f, offset),
+                                     (float)maxBucket_);
+    }
+#endif
+  }
+
+  /// Returns the bucket of the point along the given axis. Always matches the
+  /// buckets computed by map().
+  int32_t map(const SIMDPoint3f &p, int axis) const {
+    int32_t buckets[4];
+    map(p, buckets);
+    return buckets[axis];
+  }
+
+ private:
+  alignas(16) float origin_[4];
+  alignas(16) float scale_[4];
+  uint32_t maxBucket_;
+};
+
+}  // namespace hk
+
+#endif  // !HERAKLES_HERAKLES_SCENE_SIMD_BOUNDS_HPP
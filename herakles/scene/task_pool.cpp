@@ -0,0 +1,148 @@
+/*
+ * Copyright 2017 Renato Utsch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "herakles/scene/task_pool.hpp"
+
+#include <utility>
+
+namespace hk {
+namespace {
+
+/// Pool the current thread is a worker of, if any.
+thread_local const TaskPool *CurrentPool_ = nullptr;
+
+/// Queue index of the current thread in CurrentPool_.
+thread_local size_t CurrentQueueIndex_ = 0;
+
+}  // namespace
+
+TaskPool::TaskPool(size_t numThreads) {
+  if (!numThreads) {
+    numThreads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+  }
+
+  // Queue 0 is shared by every thread that isn't a worker of this pool.
+  for (size_t i = 0; i < numThreads; ++i) {
+    queues_.push_back(std::make_unique<Queue>());
+  }
+
+  for (size_t i = 1; i < numThreads; ++i) {
+    workers_.emplace_back([this, i]() { workerLoop_(i); });
+  }
+}
+
+TaskPool::~TaskPool() {
+  {
+    std::lock_guard<std::mutex> lock(sleepMutex_);
+    stop_ = true;
+  }
+  sleepCondition_.notify_all();
+
+  for (auto &worker : workers_) {
+    worker.join();
+  }
+}
+
+size_t TaskPool::currentThreadIndex() const {
+  return CurrentPool_ == this ? CurrentQueueIndex_ : 0;
+}
+
+void TaskPool::push_(std::function<void()> &&task) {
+  // Counted before the task is visible, so that the thread that runs it never
+  // decrements the count below the number of queued tasks.
+  {
+    std::lock_guard<std::mutex> lock(sleepMutex_);
+    ++pendingTasks_;
+  }
+
+  auto &queue = *queues_[currentThreadIndex()];
+  {
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.tasks.push_back(std::move(task));
+  }
+  sleepCondition_.notify_one();
+}
+
+bool TaskPool::tryRunOne_() {
+  const size_t queueIndex = currentThreadIndex();
+  std::function<void()> task;
+
+  // Own queue first, newest task first.
+  {
+    auto &queue = *queues_[queueIndex];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (!queue.tasks.empty()) {
+      task = std::move(queue.tasks.back());
+      queue.tasks.pop_back();
+    }
+  }
+
+  // Steal the oldest task from another queue.
+  for (size_t i = 1; !task && i < queues_.size(); ++i) {
+    auto &queue = *queues_[(queueIndex + i) % queues_.size()];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (!queue.tasks.empty()) {
+      task = std::move(queue.tasks.front());
+      queue.tasks.pop_front();
+    }
+  }
+
+  if (!task) return false;
+
+  --pendingTasks_;
+  task();
+  return true;
+}
+
+void TaskPool::workerLoop_(size_t queueIndex) {
+  CurrentPool_ = this;
+  CurrentQueueIndex_ = queueIndex;
+
+  while (true) {
+    if (tryRunOne_()) continue;
+
+    std::unique_lock<std::mutex> lock(sleepMutex_);
+    sleepCondition_.wait(lock, [this]() { return stop_ || pendingTasks_; });
+    if (stop_ && !pendingTasks_) return;
+  }
+}
+
+void TaskGroup::run(std::function<void()> task) {
+  ++pending_;
+  // The group may be destroyed as soon as its last task finishes, so the
+  // waiters are woken through the pool.
+  TaskPool &pool = pool_;
+  pool_.push_([this, &pool, task = std::move(task)]() {
+    task();
+    if (--pending_) return;
+    { std::lock_guard<std::mutex> lock(pool.sleepMutex_); }
+    pool.sleepCondition_.notify_all();
+  });
+}
+
+void TaskGroup::wait() {
+  while (pending_) {
+    if (pool_.tryRunOne_()) continue;
+
+    // Nothing to steal: sleep until the last task of the group finishes or
+    // another task is queued.
+    std::unique_lock<std::mutex> lock(pool_.sleepMutex_);
+    pool_.sleepCondition_.wait(
+        lock, [this]() { return !pending_ || pool_.pendingTasks_; });
+  }
+}
+
+}  // namespace hk
@@ -0,0 +1,163 @@
+/*
+ * Copyright 2017 Renato Utsch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HERAKLES_HERAKLES_SCENE_TASK_POOL_HPP
+#define HERAKLES_HERAKLES_SCENE_TASK_POOL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace hk {
+
+/**
+ * Work-stealing pool of worker threads used to run CPU-side tasks.
+ *
+ * Every worker owns a task queue. Tasks spawned from a worker are pushed to the
+ * back of its own queue and popped from there (depth-first), while idle
+ * workers steal from the front of the other queues (breadth-first), which
+ * tends to steal the largest pending pieces of work.
+ *
+ * The thread that waits for a TaskGroup also executes tasks while waiting, so a
+ * pool with a single thread runs everything inline on the calling thread.
+ */
+class TaskPool {
+ public:
+  /**
+   * Creates the pool.
+   * @param numThreads The total number of threads that will execute tasks,
+   *   including the thread that waits for them. If 0, uses the number of
+   *   hardware threads.
+   */
+  explicit TaskPool(size_t numThreads = 0);
+
+  TaskPool(const TaskPool &) = delete;
+  TaskPool &operator=(const TaskPool &) = delete;
+
+  /// Stops and joins all worker threads.
+  ~TaskPool();
+
+  /// Returns the total number of threads executing tasks.
+  size_t numThreads() const { return workers_.size() + 1; }
+
+  /**
+   * Runs functor(begin, end) over [first, last) split in chunks of at most
+   * grainSize elements, and only returns after all chunks were executed.
+   * The chunk boundaries only depend on first, last and grainSize, never on the
+   * number of threads, so per-chunk results can be reduced deterministically.
+   */
+  template <typename Functor>
+  void parallelFor(size_t first, size_t last, size_t grainSize,
+                   Functor &&functor);
+
+  /**
+   * Returns the number of chunks parallelFor() will split [first, last) into.
+   */
+  static size_t numChunks(size_t first, size_t last, size_t grainSize) {
+    return (last - first + grainSize - 1) / grainSize;
+  }
+
+  /**
+   * Returns the index in [0, numThreads()) of the calling thread, which is
+   * also the index of its queue. Threads that aren't workers of this pool
+   * share index 0.
+   */
+  size_t currentThreadIndex() const;
+
+ private:
+  friend class TaskGroup;
+
+  /// Queue of tasks owned by a single thread.
+  struct Queue {
+    std::mutex mutex;
+    std::deque<std::function<void()>> tasks;
+  };
+
+  /// Pushes a task into the queue of the current thread.
+  void push_(std::function<void()> &&task);
+
+  /// Pops a task from the current thread's queue or steals one from another
+  /// thread. Returns false if no tasks were available.
+  bool tryRunOne_();
+
+  /// Main loop of the worker threads.
+  void workerLoop_(size_t queueIndex);
+
+  std::vector<std::unique_ptr<Queue>> queues_;
+  std::vector<std::thread> workers_;
+
+  std::mutex sleepMutex_;
+  std::condition_variable sleepCondition_;
+  std::atomic<size_t> pendingTasks_{0};
+  bool stop_ = false;
+};
+
+/**
+ * A set of tasks run in a TaskPool that can be waited on.
+ */
+class TaskGroup {
+ public:
+  explicit TaskGroup(TaskPool &pool) : pool_(pool) {}
+
+  TaskGroup(const TaskGroup &) = delete;
+  TaskGroup &operator=(const TaskGroup &) = delete;
+
+  /// Waits for any pending tasks.
+  ~TaskGroup() { wait(); }
+
+  /// Schedules the given task to run in the pool.
+  void run(std::function<void()> task);
+
+  /// Waits until all tasks of this group have finished, executing pending
+  /// tasks of the pool in the meantime.
+  void wait();
+
+ private:
+  TaskPool &pool_;
+  std::atomic<size_t> pending_{0};
+};
+
+template <typename Functor>
+void TaskPool::parallelFor(size_t first, size_t last, size_t grainSize,
+                           Functor &&functor) {
+  if (first >= last) return;
+  grainSize = std::max<size_t>(grainSize, 1);
+
+  if (numThreads() == 1 || last - first <= grainSize) {
+    for (size_t begin = first; begin < last; begin += grainSize) {
+      functor(begin, std::min(begin + grainSize, last));
+    }
+    return;
+  }
+
+  TaskGroup group(*this);
+  for (size_t begin = first; begin < last; begin += grainSize) {
+    const size_t end = std::min(begin + grainSize, last);
+    group.run([&functor, begin, end]() { functor(begin, end); });
+  }
+  group.wait();
+}
+
+}  // namespace hk
+
+#endif  // !HERAKLES_HERAKLES_SCENE_TASK_POOL_HPP
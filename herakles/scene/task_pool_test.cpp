@@ -0,0 +1,139 @@
+/*
+ * Copyright 2017 Renato Utsch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "herakles/scene/task_pool.hpp"
+
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace {
+using ::hk::TaskGroup;
+using ::hk::TaskPool;
+
+TEST(TaskPoolTest, ParallelForRunsEveryIndexOnce) {
+  TaskPool pool(4);
+  for (const auto &range : std::vector<std::pair<size_t, size_t>>{
+           {0, 1000}, {7, 1000}, {5, 6}, {10, 10}, {3, 1}}) {
+    for (size_t grainSize : {1, 3, 64, 5000}) {
+      const size_t first = range.first, last = range.second;
+      std::vector<std::atomic<int>> counts(1000);
+      std::atomic<size_t> numChunks(0);
+      std::mutex mutex;
+      std::set<size_t> chunkBegins;
+      pool.parallelFor(first, last, grainSize, [&](size_t begin, size_t end) {
+        ASSERT_LT(begin, end);
+        ASSERT_LE(end - begin, grainSize);
+        ++numChunks;
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          chunkBegins.insert(begin);
+        }
+        for (size_t i = begin; i < end; ++i) ++counts[i];
+      });
+
+      for (size_t i = 0; i < counts.size(); ++i) {
+        EXPECT_EQ(i >= first && i < last ? 1 : 0, counts[i])
+            << "index " << i << " of [" << first << ", " << last
+            << ") with grain size " << grainSize;
+      }
+      if (first >= last) continue;
+
+      // The chunks only depend on the range and the grain size.
+      EXPECT_EQ(TaskPool::numChunks(first, last, grainSize), numChunks);
+      for (size_t begin : chunkBegins) {
+        EXPECT_EQ(0u, (begin - first) % grainSize);
+      }
+    }
+  }
+}
+
+TEST(TaskPoolTest, WaitsForNestedGroups) {
+  TaskPool pool(4);
+  std::atomic<int> numInnerTasks(0);
+  TaskGroup outer(pool);
+  for (int i = 0; i < 16; ++i) {
+    outer.run([&]() {
+      TaskGroup inner(pool);
+      for (int j = 0; j < 16; ++j) {
+        inner.run([&]() { ++numInnerTasks; });
+      }
+      inner.wait();
+    });
+  }
+  outer.wait();
+  EXPECT_EQ(16 * 16, numInnerTasks);
+}
+
+TEST(TaskPoolTest, WaitingThreadRunsTheTasksOfBusyWorkers) {
+  TaskPool pool(2);
+  std::atomic<bool> workerBusy(false), released(false);
+  std::thread::id helperThread;
+
+  // The only worker blocks until the other tasks of the group run, so they
+  // can only run on the thread that waits for the group.
+  TaskGroup group(pool);
+  group.run([&]() {
+    workerBusy = true;
+    while (!released) std::this_thread::yield();
+  });
+  while (!workerBusy) std::this_thread::yield();
+  group.run([&]() { helperThread = std::this_thread::get_id(); });
+  group.run([&]() { released = true; });
+  group.wait();
+
+  EXPECT_EQ(std::this_thread::get_id(), helperThread);
+}
+
+TEST(TaskPoolTest, SingleThreadPoolsRunInline) {
+  TaskPool pool(1);
+  std::vector<size_t> order;
+  pool.parallelFor(0, 5, 1, [&](size_t begin, size_t) {
+    EXPECT_EQ(0u, pool.currentThreadIndex());
+    order.push_back(begin);
+  });
+  EXPECT_EQ((std::vector<size_t>{0, 1, 2, 3, 4}), order);
+}
+
+TEST(TaskPoolTest, IndexesTheThreads) {
+  TaskPool pool(4);
+  EXPECT_EQ(4u, pool.numThreads());
+  EXPECT_EQ(0u, pool.currentThreadIndex());
+
+  // Threads outside the pool share index 0, also while they help it.
+  std::atomic<int> numOutOfRange(0);
+  std::thread other([&]() {
+    EXPECT_EQ(0u, pool.currentThreadIndex());
+    pool.parallelFor(0, 256, 1, [&](size_t, size_t) {
+      if (pool.currentThreadIndex() >= pool.numThreads()) ++numOutOfRange;
+    });
+  });
+  other.join();
+  EXPECT_EQ(0, numOutOfRange);
+
+  TaskPool otherPool(2);
+  pool.parallelFor(0, 64, 1, [&](size_t, size_t) {
+    if (otherPool.currentThreadIndex() != 0) ++numOutOfRange;
+  });
+  EXPECT_EQ(0, numOutOfRange);
+}
+
+}  // namespace
@@ -0,0 +1,223 @@
+/*
+ * Copyright 2017 Renato Utsch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "herakles/scene/two_level_bvh.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+
+#include <glog/logging.h>
+
+#include "herakles/scene/bounds.hpp"
+#include "herakles/scene/bvh_cache.hpp"
+#include "herakles/scene/task_pool.hpp"
+
+namespace hk {
+namespace {
+using hk::scene::Scene;
+
+/// Sentinel of meshes without a bottom-level BVH.
+constexpr uint32_t NoRootNode = 0xFFFFFFFFu;
+
+/// Number of instances processed by each task of a parallel loop.
+constexpr size_t InstanceGrainSize = 1 << 14;
+
+/**
+ * Converts a Flatbuffers vec4 to a glm::vec4.
+ */
+glm::vec4 toVec4_(const hk::scene::vec4 &vec) {
+  return glm::vec4(vec.x(), vec.y(), vec.z(), vec.w());
+}
+
+/**
+ * Returns the object to world matrix of the transform. The Flatbuffers
+ * matrix stores one column per vector, like GLSL.
+ */
+glm::mat4 objectToWorld_(const Scene *scene, uint32_t transformID) {
+  CHECK_LT(transformID, scene->transforms()->size())
+      << "Instance with an invalid transformID.";
+  const auto *transform = scene->transforms()->Get(transformID);
+  return glm::mat4(toVec4_(transform->a()), toVec4_(transform->b()),
+                   toVec4_(transform->c()), toVec4_(transform->d()));
+}
+
+/**
+ * Returns the world space bounding box of the given object space bounds.
+ */
+Bounds3f transformBounds_(const glm::mat4 &objectToWorld,
+                          const BVHNode &root) {
+  Bounds3f bounds;
+  for (int corner = 0; corner < 8; ++corner) {
+    const glm::vec4 point((corner & 1) ? root.maxPoint.x : root.minPoint.x,
+                          (corner & 2) ? root.maxPoint.y : root.minPoint.y,
+                          (corner & 4) ? root.maxPoint.z : root.minPoint.z,
+                          1.0f);
+    bounds += glm::vec3(objectToWorld * point);
+  }
+  return bounds;
+}
+
+/**
+ * Appends a bottom-level BVH to the two-level BVH, offsetting its nodes to
+ * their position in the arrays.
+ * @return the offset of the root of the appended BVH.
+ */
+uint32_t appendBottomLevel_(const BVHData &bvh, TwoLevelBVHData &twoLevel) {
+  const uint32_t nodeOffset = twoLevel.nodes.size();
+  const uint32_t triangleOffset = twoLevel.triangles.size();
+  for (BVHNode node : bvh.nodes) {
+    if (node.numTriangles) {
+      node.trianglesOffset += triangleOffset;
+    } else {
+      node.secondChildOffset += nodeOffset;
+    }
+    twoLevel.nodes.push_back(node);
+  }
+  twoLevel.triangles.insert(twoLevel.triangles.end(), bvh.triangles.begin(),
+                            bvh.triangles.end());
+  return nodeOffset;
+}
+
+}  // namespace
+
+bool hasInstances(const Scene *scene) {
+  return scene->instances() && scene->instances()->size() > 0;
+}
+
+TwoLevelBVHData buildTwoLevelBVH(const Scene *scene,
+                                 const BVHBuildOptions &options,
+                                 const std::string &cacheDirectory) {
+  const auto startTime = std::chrono::steady_clock::now();
+  TaskPool pool(options.numThreads);
+
+  // Scenes without instances place every mesh once, untransformed.
+  const bool placesEveryMesh = !hasInstances(scene);
+  const auto *sceneInstances = scene->instances();
+  CHECK(placesEveryMesh || scene->transforms())
+      << "The scene has instances but no transforms.";
+  const size_t numInstances =
+      placesEveryMesh ? scene->meshes()->size() : sceneInstances->size();
+  const auto instanceMeshID = [&](size_t instanceID) -> uint32_t {
+    if (placesEveryMesh) return instanceID;
+    return sceneInstances->Get(instanceID)->meshID();
+  };
+  const auto instanceObjectToWorld = [&](size_t instanceID) {
+    if (placesEveryMesh) return glm::mat4(1.0f);
+    const auto *instance = sceneInstances->Get(instanceID);
+    return objectToWorld_(scene, instance->transformID());
+  };
+
+  // Only the meshes with triangles that are instanced have a bottom level.
+  // Area lights are sampled in the space of their meshes, which is only where
+  // the instances with the identity transform are.
+  std::vector<bool> isInstanced(scene->meshes()->size(), false);
+  for (size_t i = 0; i < numInstances; ++i) {
+    const uint32_t meshID = instanceMeshID(i);
+    CHECK_LT(meshID, isInstanced.size()) << "Instance with an invalid meshID.";
+    const auto *mesh = scene->meshes()->Get(meshID);
+    isInstanced[meshID] = mesh->begin() < mesh->end();
+    CHECK(mesh->areaLightID() < 0 ||
+          instanceObjectToWorld(i) == glm::mat4(1.0f))
+        << "Instance " << i << " of the emissive mesh " << meshID
+        << " must use the identity transform.";
+  }
+
+  // The meshes are built as tasks of the same pool, so that scenes with many
+  // small meshes still use every thread. Meshes whose geometry is in the
+  // cache aren't rebuilt.
+  std::vector<BVHData> meshBVHs(isInstanced.size(), BVHData({}, {}));
+  std::atomic<size_t> numCachedMeshes(0);
+  pool.parallelFor(0, meshBVHs.size(), 1, [&](size_t begin, size_t end) {
+    for (size_t meshID = begin; meshID < end; ++meshID) {
+      if (!isInstanced[meshID]) continue;
+      if (!cacheDirectory.empty() &&
+          loadMeshBVHCache(cacheDirectory, scene, meshID, options,
+                           meshBVHs[meshID])) {
+        ++numCachedMeshes;
+        continue;
+      }
+      meshBVHs[meshID] = buildMeshBVH(pool, scene, meshID, options);
+      if (!cacheDirectory.empty()) {
+        saveMeshBVHCache(cacheDirectory, scene, meshID, options,
+                         meshBVHs[meshID]);
+      }
+    }
+  });
+
+  std::vector<uint32_t> builtInstances;
+  for (size_t i = 0; i < numInstances; ++i) {
+    if (isInstanced[instanceMeshID(i)]) builtInstances.push_back(i);
+  }
+  CHECK(!builtInstances.empty()) << "No instanced mesh has triangles.";
+
+  // The instance bounds are the transformed bounds of their mesh's root.
+  std::vector<Bounds3f> instanceBounds(builtInstances.size());
+  std::vector<glm::mat4> worldToObject(builtInstances.size());
+  pool.parallelFor(
+      0, builtInstances.size(), InstanceGrainSize,
+      [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+          const uint32_t instanceID = builtInstances[i];
+          const auto objectToWorld = instanceObjectToWorld(instanceID);
+          instanceBounds[i] = transformBounds_(
+              objectToWorld, meshBVHs[instanceMeshID(instanceID)].nodes[0]);
+          worldToObject[i] = glm::inverse(objectToWorld);
+        }
+      });
+
+  auto topLevel = buildBoundsBVH(pool, instanceBounds, options);
+  TwoLevelBVHData twoLevel;
+  twoLevel.numTopLevelNodes = topLevel.nodes.size();
+  twoLevel.nodes = std::move(topLevel.nodes);
+
+  std::vector<uint32_t> rootNodeOffsets(meshBVHs.size(), NoRootNode);
+  for (size_t meshID = 0; meshID < meshBVHs.size(); ++meshID) {
+    if (!isInstanced[meshID]) continue;
+    rootNodeOffsets[meshID] = appendBottomLevel_(meshBVHs[meshID], twoLevel);
+    meshBVHs[meshID] = BVHData({}, {});
+  }
+
+  twoLevel.instances.resize(topLevel.triangles.size());
+  for (size_t i = 0; i < topLevel.triangles.size(); ++i) {
+    const uint32_t index = topLevel.triangles[i].begin;
+    const uint32_t instanceID = builtInstances[index];
+    auto &instance = twoLevel.instances[i];
+    instance.worldToObject = worldToObject[index];
+    instance.rootNodeOffset = rootNodeOffsets[instanceMeshID(instanceID)];
+    instance.instanceID = instanceID;
+    instance.padding[0] = instance.padding[1] = 0;
+  }
+
+  const std::chrono::duration<double> seconds =
+      std::chrono::steady_clock::now() - startTime;
+  const size_t numBottomLevelNodes =
+      twoLevel.nodes.size() - twoLevel.numTopLevelNodes;
+  LOG(INFO) << "Built two-level BVH with " << twoLevel.numTopLevelNodes
+            << " top-level nodes over " << twoLevel.instances.size()
+            << " instances and " << numBottomLevelNodes
+            << " bottom-level nodes over " << twoLevel.triangles.size()
+            << " triangles in " << seconds.count() << "s";
+  if (!cacheDirectory.empty()) {
+    LOG(INFO) << "Loaded " << numCachedMeshes << " of "
+              << std::count(isInstanced.begin(), isInstanced.end(), true)
+              << " mesh BVHs from the cache " << cacheDirectory;
+  }
+
+  return twoLevel;
+}
+
+}  // namespace hk
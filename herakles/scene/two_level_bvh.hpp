@@ -0,0 +1,100 @@
+/*
+ * Copyright 2017 Renato Utsch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HERAKLES_HERAKLES_SCENE_TWO_LEVEL_BVH_HPP
+#define HERAKLES_HERAKLES_SCENE_TWO_LEVEL_BVH_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "herakles/scene/bvh.hpp"
+#include "herakles/scene/scene_generated.h"
+
+namespace hk {
+
+/**
+ * An instance of a mesh, as referenced by the leaves of the top-level BVH.
+ * Has the same layout as the BVHInstance struct of scene.glsl.
+ */
+struct BVHInstance {
+  /// Transforms world space rays into the space of the instanced mesh.
+  glm::mat4 worldToObject;
+
+  /// Offset of the root of the mesh's bottom-level BVH in the nodes array.
+  uint32_t rootNodeOffset;
+
+  /// Index of the instance in the Scene instances array.
+  uint32_t instanceID;
+
+  /// Pads the struct to the 16 bytes alignment of std430.
+  uint32_t padding[2];
+};
+
+static_assert(sizeof(BVHInstance) == 80,
+              "BVHInstance must match the std430 layout of scene.glsl");
+
+/**
+ * Struct that stores a two-level BVH: a top-level BVH over the bounds of the
+ * instances, whose leaves reference instances, and a bottom-level BVH for
+ * every instanced mesh, whose leaves reference triangles. Every instance of a
+ * mesh shares its bottom-level BVH and its triangles.
+ */
+struct TwoLevelBVHData {
+  /// The top-level BVH, starting at 0, followed by the bottom-level BVHs.
+  /// The offsets in the nodes of the bottom-level BVHs are relative to the
+  /// start of this array.
+  std::vector<BVHNode> nodes;
+
+  /// Triangles of the bottom-level BVHs, in the order they are referenced by
+  /// their leaves.
+  std::vector<BVHTriangle> triangles;
+
+  /// Instances in the order they are referenced by the top-level leaves.
+  std::vector<BVHInstance> instances;
+
+  /// Number of nodes of the top-level BVH.
+  uint32_t numTopLevelNodes = 0;
+};
+
+/**
+ * Returns if the scene places its meshes with instances, in which case it must
+ * be rendered with a two-level BVH.
+ */
+bool hasInstances(const hk::scene::Scene *scene);
+
+/**
+ * Builds a two-level BVH from the instances of the scene. Meshes without
+ * instances aren't in the BVH, and neither are the instances of meshes without
+ * triangles. If the scene has no instances, every mesh is instanced once with
+ * the identity transform, and the instance IDs are the mesh IDs.
+ * @param scene The scene.
+ * @param options Options that control how both levels are built. The top
+ *   level is built with the SAH if the method is the SBVH.
+ * @param cacheDirectory If not empty, an existing directory where the
+ *   bottom-level BVHs are cached by the hash of their mesh geometry. Only the
+ *   meshes that aren't in the cache are built, and then added to it. The top
+ *   level is always built.
+ */
+TwoLevelBVHData buildTwoLevelBVH(const hk::scene::Scene *scene,
+                                 const BVHBuildOptions &options = {},
+                                 const std::string &cacheDirectory = "");
+
+}  // namespace hk
+
+#endif  // !HERAKLES_HERAKLES_SCENE_TWO_LEVEL_BVH_HPP
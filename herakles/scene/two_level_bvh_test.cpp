@@ -0,0 +1,252 @@
+/*
+ * Copyright 2017 Renato Utsch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "herakles/scene/two_level_bvh.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "herakles/scene/bvh_traversal.hpp"
+
+namespace {
+using ::hk::BVHData;
+using ::hk::BVHHit;
+using ::hk::Ray;
+using ::hk::TwoLevelBVHData;
+using ::hk::buildBVH;
+using ::hk::buildTwoLevelBVH;
+using ::hk::intersectBVH;
+
+/// Number of triangles of each instanced mesh.
+constexpr size_t NumMeshTriangles = 200;
+
+/**
+ * Scene with a few meshes instanced many times, and the same scene with the
+ * instances flattened into world space triangles.
+ */
+class InstancedScene {
+ public:
+  explicit InstancedScene(size_t numInstances,
+                          size_t numMeshTriangles = NumMeshTriangles) {
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> local(-5.0f, 5.0f);
+    std::uniform_real_distribution<float> position(-100.0f, 100.0f);
+    std::uniform_real_distribution<float> scale(0.5f, 2.0f);
+    std::uniform_real_distribution<float> angle(0.0f, 6.28f);
+
+    // Meshes 0 and 1 are instanced, mesh 2 isn't and mesh 3 is empty.
+    std::vector<hk::scene::Mesh> meshes;
+    std::vector<uint32_t> indices;
+    std::vector<hk::scene::vec4> vertices;
+    for (int mesh = 0; mesh < 3; ++mesh) {
+      const uint32_t begin = indices.size();
+      for (size_t i = 0; i < 3 * numMeshTriangles; ++i) {
+        indices.push_back(vertices.size());
+        vertices.emplace_back(local(rng), local(rng), local(rng), 1.0f);
+      }
+      meshes.emplace_back(begin, indices.size(), 0, -1);
+    }
+    meshes.emplace_back(indices.size(), indices.size(), 0, -1);
+
+    std::vector<hk::scene::mat4> transforms;
+    std::vector<hk::scene::Instance> instances;
+    std::vector<uint32_t> flatIndices;
+    std::vector<hk::scene::vec4> flatVertices;
+    for (size_t i = 0; i < numInstances; ++i) {
+      const float s = scale(rng), a = angle(rng);
+      const glm::mat4 transform(
+          glm::vec4(s * std::cos(a), 0.0f, s * std::sin(a), 0.0f),
+          glm::vec4(0.0f, s, 0.0f, 0.0f),
+          glm::vec4(-s * std::sin(a), 0.0f, s * std::cos(a), 0.0f),
+          glm::vec4(position(rng), position(rng), position(rng), 1.0f));
+      transforms.emplace_back(toVec4(transform[0]), toVec4(transform[1]),
+                              toVec4(transform[2]), toVec4(transform[3]));
+
+      const uint32_t meshID = i % 2 ? 1 : 0;
+      instances.emplace_back(i == 0 ? 3 : meshID, i);
+      if (i == 0) continue;
+
+      const auto &mesh = meshes[meshID];
+      for (uint32_t index = mesh.begin(); index < mesh.end(); ++index) {
+        const auto &v = vertices[indices[index]];
+        const glm::vec4 p = transform * glm::vec4(v.x(), v.y(), v.z(), 1.0f);
+        flatIndices.push_back(flatVertices.size());
+        flatVertices.emplace_back(p.x, p.y, p.z, 1.0f);
+      }
+    }
+
+    const auto meshesOffset = builder_.CreateVectorOfStructs(meshes);
+    const auto indicesOffset = builder_.CreateVector(indices);
+    const auto verticesOffset = builder_.CreateVectorOfStructs(vertices);
+    const auto transformsOffset = builder_.CreateVectorOfStructs(transforms);
+    const auto instancesOffset = builder_.CreateVectorOfStructs(instances);
+    hk::scene::FinishSceneBuffer(
+        builder_,
+        hk::scene::CreateScene(builder_, nullptr, false, nullptr, {}, {},
+                               meshesOffset, {}, indicesOffset,
+                               verticesOffset, {}, {}, transformsOffset,
+                               instancesOffset));
+
+    const std::vector<hk::scene::Mesh> flatMeshes = {
+        hk::scene::Mesh(0, flatIndices.size(), 0, -1)};
+    const auto flatMeshesOffset =
+        flatBuilder_.CreateVectorOfStructs(flatMeshes);
+    const auto flatIndicesOffset = flatBuilder_.CreateVector(flatIndices);
+    const auto flatVerticesOffset =
+        flatBuilder_.CreateVectorOfStructs(flatVertices);
+    hk::scene::FinishSceneBuffer(
+        flatBuilder_,
+        hk::scene::CreateScene(flatBuilder_, nullptr, false, nullptr, {}, {},
+                               flatMeshesOffset, {}, flatIndicesOffset,
+                               flatVerticesOffset));
+  }
+
+  /// Returns the instanced scene.
+  const hk::scene::Scene *scene() const {
+    return hk::scene::GetScene(builder_.GetBufferPointer());
+  }
+
+  /// Returns the scene with every instance flattened.
+  const hk::scene::Scene *flatScene() const {
+    return hk::scene::GetScene(flatBuilder_.GetBufferPointer());
+  }
+
+ private:
+  static hk::scene::vec4 toVec4(const glm::vec4 &v) {
+    return hk::scene::vec4(v.x, v.y, v.z, v.w);
+  }
+
+  flatbuffers::FlatBufferBuilder builder_;
+  flatbuffers::FlatBufferBuilder flatBuilder_;
+};
+
+TEST(TwoLevelBVHTest, SharesTheBottomLevelOfEachMesh) {
+  const InstancedScene scene(100);
+  const TwoLevelBVHData bvh = buildTwoLevelBVH(scene.scene());
+
+  // The empty mesh isn't instanced, and neither is its instance.
+  EXPECT_EQ(99u, bvh.instances.size());
+  EXPECT_EQ(2 * NumMeshTriangles, bvh.triangles.size());
+  std::vector<uint32_t> instanceIDs;
+  for (const auto &instance : bvh.instances) {
+    instanceIDs.push_back(instance.instanceID);
+    EXPECT_GE(instance.rootNodeOffset, bvh.numTopLevelNodes);
+    EXPECT_LT(instance.rootNodeOffset, bvh.nodes.size());
+  }
+  std::sort(instanceIDs.begin(), instanceIDs.end());
+  for (size_t i = 0; i < instanceIDs.size(); ++i) {
+    EXPECT_EQ(i + 1, instanceIDs[i]);
+  }
+
+  for (size_t i = 0; i < bvh.numTopLevelNodes; ++i) {
+    const auto &node = bvh.nodes[i];
+    if (node.numTriangles) {
+      EXPECT_LE(node.trianglesOffset + node.numTriangles,
+                bvh.instances.size());
+    } else {
+      EXPECT_LT(node.secondChildOffset, bvh.numTopLevelNodes);
+    }
+  }
+}
+
+TEST(TwoLevelBVHTest, MatchesTheFlattenedScene) {
+  const InstancedScene scene(100);
+  const TwoLevelBVHData bvh = buildTwoLevelBVH(scene.scene());
+  const BVHData flatBVH = buildBVH(scene.flatScene());
+  const auto *flatScene = scene.flatScene();
+
+  // The rays are aimed at triangle centroids, far from their edges, where the
+  // transformed rays might round differently.
+  std::mt19937 rng(7);
+  std::uniform_real_distribution<float> position(-100.0f, 100.0f);
+  std::uniform_int_distribution<uint32_t> triangle(
+      0, flatScene->indices()->size() / 3 - 1);
+  size_t numHits = 0;
+  for (size_t i = 0; i < 2000; ++i) {
+    const glm::vec3 origin(position(rng), position(rng), position(rng));
+    const uint32_t begin = 3 * triangle(rng);
+    glm::vec3 centroid(0.0f);
+    for (uint32_t v = 0; v < 3; ++v) {
+      const auto *p =
+          flatScene->vertices()->Get(flatScene->indices()->Get(begin + v));
+      centroid += glm::vec3(p->x(), p->y(), p->z()) / 3.0f;
+    }
+    const Ray ray = {origin, centroid - origin};
+
+    BVHHit hit, flatHit;
+    const bool found = intersectBVH(scene.scene(), bvh, ray, hit);
+    ASSERT_EQ(intersectBVH(flatScene, flatBVH, ray, flatHit), found);
+    if (!found) continue;
+
+    ++numHits;
+    // The rays go up to the centroids, so t is relative to the scene size.
+    EXPECT_NEAR(flatHit.t, hit.t, 1e-5f);
+    EXPECT_LT(hit.instance, bvh.instances.size());
+  }
+  EXPECT_GT(numHits, 1000u);
+}
+
+TEST(TwoLevelBVHTest, BuildsLargeMeshesInParallel) {
+  // The meshes are big enough to split into subtree tasks, which the thread
+  // that waits for the meshes also runs while the workers build them.
+  const InstancedScene scene(10, 20000);
+  for (auto method : {hk::BVHBuildMethod::SAH, hk::BVHBuildMethod::SBVH}) {
+    hk::BVHBuildOptions options;
+    options.method = method;
+    options.numThreads = 1;
+    const TwoLevelBVHData serial = buildTwoLevelBVH(scene.scene(), options);
+    options.numThreads = 4;
+    const TwoLevelBVHData bvh = buildTwoLevelBVH(scene.scene(), options);
+    ASSERT_EQ(serial.nodes.size(), bvh.nodes.size());
+    ASSERT_EQ(serial.triangles.size(), bvh.triangles.size());
+    EXPECT_FALSE(memcmp(serial.nodes.data(), bvh.nodes.data(),
+                        bvh.nodes.size() * sizeof(bvh.nodes[0])));
+    EXPECT_FALSE(memcmp(serial.triangles.data(), bvh.triangles.data(),
+                        bvh.triangles.size() * sizeof(bvh.triangles[0])));
+  }
+}
+
+TEST(TwoLevelBVHTest, PlacesEveryMeshOfScenesWithoutInstances) {
+  const InstancedScene scene(10);
+  const TwoLevelBVHData bvh = buildTwoLevelBVH(scene.flatScene());
+  ASSERT_EQ(1u, bvh.instances.size());
+  EXPECT_EQ(0u, bvh.instances[0].instanceID);
+  EXPECT_EQ(scene.flatScene()->indices()->size() / 3, bvh.triangles.size());
+}
+
+TEST(TwoLevelBVHTest, LoadsTheBottomLevelsFromTheCache) {
+  const InstancedScene scene(100);
+  const TwoLevelBVHData bvh = buildTwoLevelBVH(scene.scene());
+  const std::string directory = ::testing::TempDir();
+  for (int build = 0; build < 2; ++build) {
+    const TwoLevelBVHData cached =
+        buildTwoLevelBVH(scene.scene(), {}, directory);
+    ASSERT_EQ(bvh.nodes.size(), cached.nodes.size());
+    ASSERT_EQ(bvh.triangles.size(), cached.triangles.size());
+    ASSERT_EQ(bvh.instances.size(), cached.instances.size());
+    EXPECT_FALSE(memcmp(bvh.nodes.data(), cached.nodes.data(),
+                        bvh.nodes.size() * sizeof(bvh.nodes[0])));
+    EXPECT_FALSE(memcmp(bvh.triangles.data(), cached.triangles.data(),
+                        bvh.triangles.size() * sizeof(bvh.triangles[0])));
+  }
+}
+
+}  // namespace
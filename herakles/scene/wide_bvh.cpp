@@ -0,0 +1,260 @@
+/*
+ * Copyright 2017 Renato Utsch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "herakles/scene/wide_bvh.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include <glog/logging.h>
+
+namespace hk {
+namespace {
+
+/// Returns the surface area of the node's bounding box.
+float surfaceArea_(const BVHNode &node) {
+  const glm::vec3 d = node.maxPoint - node.minPoint;
+  return 2.0f * (d.x * d.y + d.x * d.z + d.y * d.z);
+}
+
+/// Largest quantized offset.
+constexpr uint32_t MaxQuantizedOffset = 255;
+
+/// Range of the quantization exponents, which keeps the scales normal floats.
+constexpr int MinExponent = -126;
+constexpr int MaxExponent = 127;
+
+/// Decodes a quantized offset. q * scale is exact, so this rounds only once,
+/// the same way as in the GPU.
+float dequantize_(float origin, uint32_t q, float scale) {
+  return origin + (float)q * scale;
+}
+
+/// Returns the smallest exponent whose scale covers [minPoint, maxPoint] with
+/// MaxQuantizedOffset steps.
+int quantizationExponent_(float minPoint, float maxPoint) {
+  const float extent = maxPoint - minPoint;
+  int exponent = MinExponent;
+  if (extent > 0.0f) {
+    exponent = std::max(
+        exponent, (int)std::ceil(std::log2(extent / MaxQuantizedOffset)));
+  }
+  while (exponent < MaxExponent &&
+         dequantize_(minPoint, MaxQuantizedOffset,
+                     std::ldexp(1.0f, exponent)) < maxPoint) {
+    ++exponent;
+  }
+  return exponent;
+}
+
+/// Quantizes a minimum point, rounding down.
+uint32_t quantizeMin_(float origin, float scale, float value) {
+  uint32_t q = (uint32_t)std::min<float>(std::floor((value - origin) / scale),
+                                         MaxQuantizedOffset);
+  while (q > 0 && dequantize_(origin, q, scale) > value) --q;
+  return q;
+}
+
+/// Quantizes a maximum point, rounding up.
+uint32_t quantizeMax_(float origin, float scale, float value) {
+  uint32_t q = (uint32_t)std::min<float>(
+      std::max(std::ceil((value - origin) / scale), 0.0f), MaxQuantizedOffset);
+  while (q < MaxQuantizedOffset && dequantize_(origin, q, scale) < value) ++q;
+  return q;
+}
+
+/// Quantizes the children of a node.
+QuantizedBVH4Node quantizeNode_(const BVH4Node &node) {
+  QuantizedBVH4Node quantized = {};
+  quantized.childOffsets = node.childOffsets;
+  quantized.packedNumTriangles01 =
+      node.childNumTriangles[0] | node.childNumTriangles[1] << 16;
+  quantized.packedNumTriangles23 =
+      node.childNumTriangles[2] | node.childNumTriangles[3] << 16;
+
+  const glm::vec4 *minPoints[3] = {&node.minX, &node.minY, &node.minZ};
+  const glm::vec4 *maxPoints[3] = {&node.maxX, &node.maxY, &node.maxZ};
+  for (int axis = 0; axis < 3; ++axis) {
+    float minPoint = std::numeric_limits<float>::max();
+    float maxPoint = std::numeric_limits<float>::lowest();
+    for (int i = 0; i < BVH4Width; ++i) {
+      if (node.childOffsets[i] == BVH4EmptyChild) continue;
+      minPoint = std::min(minPoint, (*minPoints[axis])[i]);
+      maxPoint = std::max(maxPoint, (*maxPoints[axis])[i]);
+    }
+
+    const int exponent = quantizationExponent_(minPoint, maxPoint);
+    const float scale = std::ldexp(1.0f, exponent);
+    quantized.origin[axis] = minPoint;
+    quantized.exponents |= (uint32_t)(exponent + 127) << (8 * axis);
+    for (int i = 0; i < BVH4Width; ++i) {
+      if (node.childOffsets[i] == BVH4EmptyChild) continue;
+      quantized.quantizedMin[axis] |=
+          quantizeMin_(minPoint, scale, (*minPoints[axis])[i]) << (8 * i);
+      quantized.quantizedMax[axis] |=
+          quantizeMax_(minPoint, scale, (*maxPoints[axis])[i]) << (8 * i);
+    }
+  }
+
+  return quantized;
+}
+
+/**
+ * Returns the binary nodes that become the children of the BVH4 node of the
+ * given binary node. The largest internal children are replaced by their
+ * own children until there are BVH4Width of them or all of them are leaves.
+ */
+std::vector<uint32_t> collapsedChildren_(const BVHData &bvh,
+                                         uint32_t binaryNode) {
+  const BVHNode &node = bvh.nodes[binaryNode];
+  if (node.numTriangles > 0) return {binaryNode};  // Leaf root.
+
+  std::vector<uint32_t> children = {binaryNode + 1, node.secondChildOffset};
+  while (children.size() < BVH4Width) {
+    int largest = -1;
+    float largestArea = -1.0f;
+    for (size_t i = 0; i < children.size(); ++i) {
+      const BVHNode &child = bvh.nodes[children[i]];
+      if (child.numTriangles == 0 && surfaceArea_(child) > largestArea) {
+        largest = i;
+        largestArea = surfaceArea_(child);
+      }
+    }
+    if (largest < 0) break;
+
+    // Keep the children in the binary tree's order.
+    const uint32_t expanded = children[largest];
+    children[largest] = expanded + 1;
+    children.insert(children.begin() + largest + 1,
+                    bvh.nodes[expanded].secondChildOffset);
+  }
+
+  return children;
+}
+
+/**
+ * Collapses the subtree of the binary node into the BVH4 node at the given
+ * index, appending the BVH4 nodes of its internal children.
+ */
+void collapseNode_(const BVHData &bvh, uint32_t binaryNode,
+                   std::vector<BVH4Node> &nodes, size_t index) {
+  const auto children = collapsedChildren_(bvh, binaryNode);
+
+  BVH4Node node = {};
+  for (int i = 0; i < BVH4Width; ++i) {
+    if (i >= (int)children.size()) {
+      node.childOffsets[i] = BVH4EmptyChild;
+      continue;
+    }
+
+    const BVHNode &child = bvh.nodes[children[i]];
+    node.minX[i] = child.minPoint.x;
+    node.minY[i] = child.minPoint.y;
+    node.minZ[i] = child.minPoint.z;
+    node.maxX[i] = child.maxPoint.x;
+    node.maxY[i] = child.maxPoint.y;
+    node.maxZ[i] = child.maxPoint.z;
+    node.childNumTriangles[i] = child.numTriangles;
+    node.childOffsets[i] = child.trianglesOffset;
+  }
+  nodes[index] = node;
+
+  for (int i = 0; i < (int)children.size(); ++i) {
+    if (bvh.nodes[children[i]].numTriangles > 0) continue;
+
+    const size_t childIndex = nodes.size();
+    nodes.emplace_back();
+    nodes[index].childOffsets[i] = childIndex;
+    collapseNode_(bvh, children[i], nodes, childIndex);
+  }
+}
+
+/// Collapses the nodes of the given binary BVH into 4-wide nodes.
+std::vector<BVH4Node> collapseNodes_(const BVHData &bvh) {
+  CHECK(!bvh.nodes.empty()) << "Can't collapse an empty BVH.";
+
+  std::vector<BVH4Node> nodes(1);
+  nodes.reserve(bvh.nodes.size() / 2 + 1);
+  collapseNode_(bvh, 0, nodes, 0);
+
+  LOG(INFO) << "Collapsed " << bvh.nodes.size() << " BVH nodes into "
+            << nodes.size() << " BVH4 nodes";
+  return nodes;
+}
+
+/// Quantizes the nodes of the given 4-wide BVH.
+std::vector<QuantizedBVH4Node> quantizeNodes_(const BVH4Data &bvh) {
+  std::vector<QuantizedBVH4Node> nodes;
+  nodes.reserve(bvh.nodes.size());
+  for (const auto &node : bvh.nodes) {
+    nodes.push_back(quantizeNode_(node));
+  }
+
+  LOG(INFO) << "Quantized " << nodes.size() << " BVH4 nodes from "
+            << bvh.nodes.size() * sizeof(BVH4Node) << " to "
+            << nodes.size() * sizeof(QuantizedBVH4Node) << " bytes";
+  return nodes;
+}
+
+}  // namespace
+
+BVH4Data collapseBVH4(const BVHData &bvh) {
+  return BVH4Data(collapseNodes_(bvh),
+                  std::vector<BVHTriangle>(bvh.triangles));
+}
+
+BVH4Data collapseBVH4(BVHData &&bvh) {
+  auto nodes = collapseNodes_(bvh);
+  return BVH4Data(std::move(nodes), std::move(bvh.triangles));
+}
+
+QuantizedBVH4Data quantizeBVH4(const BVH4Data &bvh) {
+  return QuantizedBVH4Data(quantizeNodes_(bvh),
+                           std::vector<BVHTriangle>(bvh.triangles));
+}
+
+QuantizedBVH4Data quantizeBVH4(BVH4Data &&bvh) {
+  auto nodes = quantizeNodes_(bvh);
+  return QuantizedBVH4Data(std::move(nodes), std::move(bvh.triangles));
+}
+
+BVH4Node dequantizeBVH4Node(const QuantizedBVH4Node &node) {
+  BVH4Node decoded;
+  decoded.childOffsets = node.childOffsets;
+  decoded.childNumTriangles = glm::uvec4(
+      node.packedNumTriangles01 & 0xFFFF, node.packedNumTriangles01 >> 16,
+      node.packedNumTriangles23 & 0xFFFF, node.packedNumTriangles23 >> 16);
+
+  glm::vec4 *minPoints[3] = {&decoded.minX, &decoded.minY, &decoded.minZ};
+  glm::vec4 *maxPoints[3] = {&decoded.maxX, &decoded.maxY, &decoded.maxZ};
+  for (int axis = 0; axis < 3; ++axis) {
+    const int exponent = (int)((node.exponents >> (8 * axis)) & 0xFF) - 127;
+    const float scale = std::ldexp(1.0f, exponent);
+    for (int i = 0; i < BVH4Width; ++i) {
+      (*minPoints[axis])[i] = dequantize_(
+          node.origin[axis], (node.quantizedMin[axis] >> (8 * i)) & 0xFF,
+          scale);
+      (*maxPoints[axis])[i] = dequantize_(
+          node.origin[axis], (node.quantizedMax[axis] >> (8 * i)) & 0xFF,
+          scale);
+    }
+  }
+
+  return decoded;
+}
+
+}  // namespace hk
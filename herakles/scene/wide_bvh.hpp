@@ -0,0 +1,148 @@
+/*
+ * Copyright 2017 Renato Utsch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HERAKLES_HERAKLES_SCENE_WIDE_BVH_HPP
+#define HERAKLES_HERAKLES_SCENE_WIDE_BVH_HPP
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "herakles/scene/bvh.hpp"
+
+namespace hk {
+
+/// Number of children of a BVH4Node.
+constexpr int BVH4Width = 4;
+
+/// Value of BVH4Node::childOffsets for an unused child slot.
+constexpr uint32_t BVH4EmptyChild = 0xFFFFFFFF;
+
+/**
+ * A node of a 4-wide BVH, represented as an element in an array.
+ * The bounds of the children are stored in the node, one axis per vector, so
+ * that all of them can be tested with a single load of the node. Leaves are
+ * stored directly in their parent's child slots and have no node of their
+ * own.
+ * This struct has exactly 128 bytes, and matches BVH4Node in scene.glsl.
+ */
+struct BVH4Node {
+  /// Minimum and maximum points of the bounding boxes of the children.
+  glm::vec4 minX, minY, minZ;
+  glm::vec4 maxX, maxY, maxZ;
+
+  /// For an internal child, the index of its node. For a leaf child, the
+  /// offset into the triangles array. BVH4EmptyChild for an unused slot.
+  glm::uvec4 childOffsets;
+
+  /// Number of triangles of each child. If 0, the child is an internal node.
+  glm::uvec4 childNumTriangles;
+};
+
+/// Struct that stores the 4-wide BVH data.
+struct BVH4Data {
+  std::vector<BVH4Node> nodes;
+
+  /// Same triangles as the binary BVH the tree was collapsed from.
+  std::vector<BVHTriangle> triangles;
+
+  BVH4Data(std::vector<BVH4Node> &&nodes,
+           std::vector<BVHTriangle> &&triangles)
+      : nodes(std::move(nodes)), triangles(std::move(triangles)) {}
+};
+
+/**
+ * A BVH4Node compressed to 64 bytes, half of its size. The bounds of the
+ * children are stored as 8-bit offsets from the node's origin, in units of a
+ * power of two per axis. Offsets are rounded outwards, so the decoded boxes
+ * always contain the original ones and traversal stays watertight.
+ * This struct matches QuantizedBVH4Node in scene.glsl.
+ */
+struct QuantizedBVH4Node {
+  /// Minimum point of the union of the children's bounding boxes.
+  glm::vec3 origin;
+
+  /// Exponent of the scale of each axis plus 127, 8 bits per axis.
+  uint32_t exponents;
+
+  /// Quantized minimum points of the children, 8 bits per child.
+  glm::uvec3 quantizedMin;
+
+  /// Number of triangles of children 0 and 1, 16 bits each.
+  uint32_t packedNumTriangles01;
+
+  /// Quantized maximum points of the children, 8 bits per child.
+  glm::uvec3 quantizedMax;
+
+  /// Number of triangles of children 2 and 3, 16 bits each.
+  uint32_t packedNumTriangles23;
+
+  /// Same as BVH4Node::childOffsets.
+  glm::uvec4 childOffsets;
+};
+
+/// Struct that stores the quantized 4-wide BVH data.
+struct QuantizedBVH4Data {
+  std::vector<QuantizedBVH4Node> nodes;
+
+  /// Same triangles as the BVH the tree was quantized from.
+  std::vector<BVHTriangle> triangles;
+
+  QuantizedBVH4Data(std::vector<QuantizedBVH4Node> &&nodes,
+                    std::vector<BVHTriangle> &&triangles)
+      : nodes(std::move(nodes)), triangles(std::move(triangles)) {}
+};
+
+/**
+ * Collapses a binary BVH into a 4-wide BVH. Each node adopts the children of
+ * its largest internal children, by surface area, until it has four of them.
+ * The root is always node 0, and the children of a node are ordered from the
+ * binary tree's first to its last child.
+ * @param bvh The binary BVH, as returned by buildBVH().
+ * @return the 4-wide BVH, with the same triangles.
+ */
+BVH4Data collapseBVH4(const BVHData &bvh);
+
+/**
+ * Same as above, but moves the triangles of the binary BVH into the 4-wide
+ * one instead of copying them. The nodes of the binary BVH are left intact.
+ */
+BVH4Data collapseBVH4(BVHData &&bvh);
+
+/**
+ * Quantizes the nodes of a 4-wide BVH.
+ * @param bvh The 4-wide BVH, as returned by collapseBVH4().
+ * @return the quantized BVH, with the same node indices and triangles.
+ */
+QuantizedBVH4Data quantizeBVH4(const BVH4Data &bvh);
+
+/**
+ * Same as above, but moves the triangles of the 4-wide BVH into the quantized
+ * one instead of copying them. The nodes of the 4-wide BVH are left intact.
+ */
+QuantizedBVH4Data quantizeBVH4(BVH4Data &&bvh);
+
+/**
+ * Decodes a quantized node, exactly like dequantizeBVH4Node() in
+ * intersection.glsl. The children's boxes contain the original ones.
+ */
+BVH4Node dequantizeBVH4Node(const QuantizedBVH4Node &node);
+
+}  // namespace hk
+
+#endif  // !HERAKLES_HERAKLES_SCENE_WIDE_BVH_HPP
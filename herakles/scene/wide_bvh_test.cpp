@@ -0,0 +1,143 @@
+/*
+ * Copyright 2017 Renato Utsch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "herakles/scene/wide_bvh.hpp"
+
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "herakles/scene/random_scene.hpp"
+
+namespace {
+using ::hk::BVH4Data;
+using ::hk::BVH4EmptyChild;
+using ::hk::BVH4Width;
+using ::hk::RandomScene;
+using ::hk::buildBVH;
+using ::hk::collapseBVH4;
+using ::hk::dequantizeBVH4Node;
+using ::hk::quantizeBVH4;
+
+/// Checks that every triangle is in exactly one leaf and that every node is
+/// reached exactly once.
+void expectValidBVH4(const BVH4Data &bvh, size_t numTriangles) {
+  ASSERT_EQ(numTriangles, bvh.triangles.size());
+
+  std::vector<int> triangleCount(numTriangles, 0);
+  std::vector<int> parentCount(bvh.nodes.size(), 0);
+  for (const auto &node : bvh.nodes) {
+    for (int i = 0; i < BVH4Width; ++i) {
+      const uint32_t offset = node.childOffsets[i];
+      if (offset == BVH4EmptyChild) continue;
+
+      EXPECT_LE(node.minX[i], node.maxX[i]);
+      EXPECT_LE(node.minY[i], node.maxY[i]);
+      EXPECT_LE(node.minZ[i], node.maxZ[i]);
+      if (node.childNumTriangles[i] == 0) {
+        ASSERT_LT(offset, bvh.nodes.size());
+        ++parentCount[offset];
+        continue;
+      }
+
+      ASSERT_LE(offset + node.childNumTriangles[i], numTriangles);
+      for (uint32_t j = 0; j < node.childNumTriangles[i]; ++j) {
+        ++triangleCount[offset + j];
+      }
+    }
+  }
+
+  EXPECT_EQ(0, parentCount[0]);
+  for (size_t i = 1; i < parentCount.size(); ++i) {
+    EXPECT_EQ(1, parentCount[i]) << "node " << i;
+  }
+  for (size_t i = 0; i < triangleCount.size(); ++i) {
+    EXPECT_EQ(1, triangleCount[i]) << "triangle " << i;
+  }
+}
+
+TEST(CollapseBVH4Test, CollapsesIntoValidBVH4) {
+  const RandomScene scene(1000);
+  const auto bvh = buildBVH(scene.scene());
+  const auto bvh4 = collapseBVH4(bvh);
+
+  expectValidBVH4(bvh4, 1000);
+  EXPECT_LT(bvh4.nodes.size(), bvh.nodes.size() / 3);
+}
+
+TEST(CollapseBVH4Test, MovesTrianglesOfRvalueBVH) {
+  const RandomScene scene(1000);
+  auto bvh = buildBVH(scene.scene());
+  const size_t numNodes = bvh.nodes.size();
+  const auto copied = collapseBVH4(bvh);
+  const auto moved = collapseBVH4(std::move(bvh));
+
+  ASSERT_EQ(copied.triangles.size(), moved.triangles.size());
+  EXPECT_EQ(copied.nodes.size(), moved.nodes.size());
+  EXPECT_EQ(numNodes, bvh.nodes.size());
+  EXPECT_TRUE(bvh.triangles.empty());
+  expectValidBVH4(moved, 1000);
+}
+
+TEST(CollapseBVH4Test, CollapsesSingleLeaf) {
+  const RandomScene scene(1);
+  const auto bvh4 = collapseBVH4(buildBVH(scene.scene()));
+
+  ASSERT_EQ(1u, bvh4.nodes.size());
+  expectValidBVH4(bvh4, 1);
+}
+
+TEST(QuantizeBVH4Test, QuantizedBoundsContainOriginalBounds) {
+  const RandomScene scene(1000);
+  const auto bvh4 = collapseBVH4(buildBVH(scene.scene()));
+  const auto quantized = quantizeBVH4(bvh4);
+  ASSERT_EQ(bvh4.nodes.size(), quantized.nodes.size());
+  EXPECT_EQ(bvh4.triangles.size(), quantized.triangles.size());
+  EXPECT_EQ(64u, sizeof(quantized.nodes[0]));
+
+  for (size_t n = 0; n < bvh4.nodes.size(); ++n) {
+    const auto &node = bvh4.nodes[n];
+    const auto decoded = dequantizeBVH4Node(quantized.nodes[n]);
+    EXPECT_EQ(node.childOffsets, decoded.childOffsets);
+    EXPECT_EQ(node.childNumTriangles, decoded.childNumTriangles);
+
+    for (int i = 0; i < BVH4Width; ++i) {
+      if (node.childOffsets[i] == BVH4EmptyChild) continue;
+      EXPECT_LE(decoded.minX[i], node.minX[i]);
+      EXPECT_LE(decoded.minY[i], node.minY[i]);
+      EXPECT_LE(decoded.minZ[i], node.minZ[i]);
+      EXPECT_GE(decoded.maxX[i], node.maxX[i]);
+      EXPECT_GE(decoded.maxY[i], node.maxY[i]);
+      EXPECT_GE(decoded.maxZ[i], node.maxZ[i]);
+    }
+  }
+}
+
+TEST(QuantizeBVH4Test, MovesTrianglesOfRvalueBVH4) {
+  const RandomScene scene(1000);
+  auto bvh4 = collapseBVH4(buildBVH(scene.scene()));
+  const size_t numTriangles = bvh4.triangles.size();
+  const size_t numNodes = bvh4.nodes.size();
+  const auto quantized = quantizeBVH4(std::move(bvh4));
+
+  EXPECT_EQ(numTriangles, quantized.triangles.size());
+  EXPECT_EQ(numNodes, quantized.nodes.size());
+  EXPECT_EQ(numNodes, bvh4.nodes.size());
+  EXPECT_TRUE(bvh4.triangles.empty());
+}
+
+}  // namespace
@@ -88,16 +88,18 @@ LightInteraction generateLightSubpath() {
   const vec3 le = sampleLightEmission(lightIndex, ray, normal, pdfLight, pdfPos,
                                       pdfDir);
   if (le == vec3(0.0f)) {  // No lights to sample, return no contribution.
-    return LightInteraction(Interaction(vec3(0.0f), 0, vec3(0.0f), false, 0),
-                            lightIndex, 0, false, vec3(0.0f));
+    return LightInteraction(
+        Interaction(vec3(0.0f), 0, vec3(0.0f), false, 0, 0, -1, 0), lightIndex,
+        0, false, vec3(0.0f));
   }
 
   vec3 color = le * absDot(normal, ray.direction) / (pdfLight * pdfPos * pdfDir);
 
   uint s;
-  Interaction oldIsect = Interaction(ray.origin, 0, normal, false, 0);
+  Interaction oldIsect =
+      Interaction(ray.origin, 0, normal, false, 0, 0, -1, 0);
   bool perfectlySpecularBounce;
-  SkipTriangle skip = SkipTriangle(false, 0, 0);
+  SkipTriangle skip = SkipTriangle(false, 0, 0, 0);
   for (s = 1; s < LightPathLength; ++s) {
     Interaction isect;
     if (!intersectsScene(ray, skip, isect)) {
@@ -123,9 +125,8 @@ LightInteraction generateLightSubpath() {
     color *= f * absDot(wi, isect.normal) / (pdf * dist2);
 
     ray = Ray(isect.point, wi);
-    skip = SkipTriangle(true, isect.meshID, isect.begin);
-    oldIsect = Interaction(isect.point, isect.meshID, isect.normal,
-                           isect.backface, isect.begin);
+    skip = SkipTriangle(true, isect.meshID, isect.begin, isect.instanceID);
+    oldIsect = isect;
   }
 
   return LightInteraction(oldIsect, lightIndex, s, !perfectlySpecularBounce,
@@ -138,7 +139,7 @@ vec3 generateCameraSubpath(Ray ray, const LightInteraction lightIsect) {
   vec3 beta = vec3(1.0f);
   bool perfectlySpecularBounce = false;
   vec3 lightColor;
-  SkipTriangle skip = SkipTriangle(false, 0, 0);
+  SkipTriangle skip = SkipTriangle(false, 0, 0, 0);
 
   // TODO(renatoutsch): this doesn't work. The color needs to be splatted to the
   // correct pixel.
@@ -157,12 +158,11 @@ vec3 generateCameraSubpath(Ray ray, const LightInteraction lightIsect) {
       }
       break;
     }
-    skip = SkipTriangle(true, isect.meshID, isect.begin);
+    skip = SkipTriangle(true, isect.meshID, isect.begin, isect.instanceID);
 
-    const Mesh mesh = Meshes[isect.meshID];
-    if (mesh.areaLightID >= 0) {
+    if (isect.areaLightID >= 0) {
       // Area light. Assuming iteration doesn't continue after area lights.
-      color += beta * AreaLights[mesh.areaLightID].emission;
+      color += beta * AreaLights[isect.areaLightID].emission;
       break;
     }
 
@@ -101,7 +101,7 @@ vec3 sampleMirror(const Interaction isect, const Material material,
 
 vec3 sampleBSDF(const Interaction isect, const vec3 invWo, out vec3 wi,
                 out float pdf, out bool perfectlySpecular) {
-  const Material material = Materials[Meshes[isect.meshID].materialID];
+  const Material material = Materials[isect.materialID];
   if(material.type == MatteMaterial) {
     return sampleMatte(isect, material, invWo, wi, pdf, perfectlySpecular);
   } else if (material.type == GlassMaterial) {
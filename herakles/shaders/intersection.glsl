@@ -33,13 +33,11 @@ float triangleArea(const uint begin) {
   return 0.5 * length(cross(v1 - v0, v2 - v0));
 }
 
-/// Triangle intersection.
+/// Triangle intersection, from its first vertex and its two edges.
 /// Normal is not normalized and not oriented.
-bool intersectsTriangle(const Ray ray, const uint begin, out float t,
-                       out vec3 n, out vec2 st) {
-  const vec3 v0 = Vertices[Indices[begin]];
-  const vec3 v0v1 = Vertices[Indices[begin + 1]] - v0;
-  const vec3 v0v2 = Vertices[Indices[begin + 2]] - v0;
+bool intersectsTriangle(const Ray ray, const vec3 v0, const vec3 v0v1,
+                        const vec3 v0v2, out float t, out vec3 n,
+                        out vec2 st) {
   const vec3 pvec = cross(ray.direction, v0v2);
   const float det = dot(v0v1, pvec);
 
@@ -64,6 +62,189 @@ bool intersectsTriangle(const Ray ray, const uint begin, out float t,
   return true;
 }
 
+/// Triangle intersection.
+/// Normal is not normalized and not oriented.
+bool intersectsTriangle(const Ray ray, const uint begin, out float t,
+                       out vec3 n, out vec2 st) {
+  const vec3 v0 = Vertices[Indices[begin]];
+  return intersectsTriangle(ray, v0, Vertices[Indices[begin + 1]] - v0,
+                            Vertices[Indices[begin + 2]] - v0, t, n, st);
+}
+
+/// Distance, relative to the radius, that rays starting on a sphere must
+/// travel before hitting it again.
+const float SphereSelfHitRatio = 1e-3f;
+
+/// Ray-sphere intersection. Returns the closest hit in front of the ray
+/// origin. If the ray starts on the sphere, hits closer than a fraction of the
+/// radius are ignored.
+/// Normal is normalized and points outwards.
+bool intersectsSphere(const Ray ray, const uint sphereID,
+                      const bool startsOnSphere, out float t, out vec3 n) {
+  const Sphere sphere = Spheres[sphereID];
+  const vec3 oc =
+      ray.origin - vec3(sphere.centerX, sphere.centerY, sphere.centerZ);
+  const float a = dot(ray.direction, ray.direction);
+  const float halfB = dot(oc, ray.direction);
+
+  // The discriminant is computed from the distance between the center and
+  // the ray, which doesn't lose precision for small or far away spheres.
+  const vec3 perpendicular = oc - (halfB / a) * ray.direction;
+  const float radius2 = sphere.radius * sphere.radius;
+  const float discriminant =
+      a * (radius2 - dot(perpendicular, perpendicular));
+  if (discriminant < 0.0f) return false;
+
+  // Stable roots, so that t0 <= t1.
+  const float c = dot(oc, oc) - radius2;
+  const float q = -halfB - (halfB < 0.0f ? -1.0f : 1.0f) * sqrt(discriminant);
+  const float t0 = min(c / q, q / a);
+  const float t1 = max(c / q, q / a);
+  const float minT = startsOnSphere ? SphereSelfHitRatio * sphere.radius
+                                    : EPSILON;
+  t = t0 > minT ? t0 : t1;
+  if (t <= minT) return false;
+
+  n = normalize(oc + t * ray.direction);
+  return true;
+}
+
+/// Returns the mesh and beginning of the triangle at the given index of the
+/// BVH triangles.
+BVHTriangle loadBVHTriangle(const uint index) {
+#ifdef HERAKLES_PRECOMPUTED_TRIANGLES
+  const PrecomputedTriangle triangle = PrecomputedTriangles[index];
+  return BVHTriangle(triangle.meshID, triangle.begin);
+#else
+  return BVHTriangles[index];
+#endif // HERAKLES_PRECOMPUTED_TRIANGLES
+}
+
+/// Returns the mesh ID of the BVH triangle, without the bits of a pair.
+uint triangleMeshID(const BVHTriangle triangle) {
+#ifdef HERAKLES_TRIANGLE_PAIRS
+  if ((triangle.meshID & BVHTrianglePairBit) != 0u) {
+    return triangle.meshID & BVHTriangleMeshIDMask;
+  }
+#endif // HERAKLES_TRIANGLE_PAIRS
+  return triangle.meshID;
+}
+
+/// Returns the material and area light of the triangle at the given index of
+/// the BVH triangles, which belongs to the given mesh.
+void loadMaterialAndLight(const uint index, const uint meshID,
+                          out uint materialID, out int areaLightID) {
+#ifdef HERAKLES_PRECOMPUTED_TRIANGLES
+  const uint packed = PrecomputedTriangles[index].packedMaterialAndLight;
+  materialID = packed & 0xFFFFu;
+  areaLightID = int(packed) >> 16;  // Sign extends the ID.
+#else
+  if (meshID == BVHSphereMeshID) {
+    const Sphere sphere = Spheres[BVHTriangles[index].begin];
+    materialID = sphere.materialID;
+    areaLightID = sphere.areaLightID;
+    return;
+  }
+
+  const Mesh mesh = Meshes[meshID];
+  materialID = mesh.materialID;
+  areaLightID = mesh.areaLightID;
+#endif // HERAKLES_PRECOMPUTED_TRIANGLES
+}
+
+#ifdef HERAKLES_TRIANGLE_PAIRS
+/// Intersects both triangles of a pair, which share an edge, with four vertex
+/// fetches instead of six. The skipped triangle isn't intersected.
+/// Returns if any of them is hit in front of the ray origin, setting the
+/// closest hit and the beginning of its triangle.
+bool intersectsTrianglePair(const Ray ray, const BVHTriangle pair,
+                            const SkipTriangle skip, out float t, out vec3 n,
+                            out vec2 st, out uint begin) {
+  const uint code = pair.meshID >> BVHTrianglePairShift;
+  const uvec3 second = uvec3(code, code >> 2u, code >> 4u) & 3u;
+  const uint unshared = second.x == 3u ? 0u : (second.y == 3u ? 1u : 2u);
+
+  // The vertices of the first triangle, and the one only the second has.
+  vec3 quad[4];
+  quad[0] = Vertices[Indices[pair.begin]];
+  quad[1] = Vertices[Indices[pair.begin + 1u]];
+  quad[2] = Vertices[Indices[pair.begin + 2u]];
+  quad[3] = Vertices[Indices[pair.begin + 3u + unshared]];
+
+  const bool skipsMesh =
+      skip.skip && (pair.meshID & BVHTriangleMeshIDMask) == skip.meshID;
+  bool hit = false;
+  float currT;
+  vec3 currN;
+  vec2 currST;
+  t = INF;
+  if (!(skipsMesh && skip.begin == pair.begin) &&
+      intersectsTriangle(ray, quad[0], quad[1] - quad[0], quad[2] - quad[0],
+                         currT, currN, currST) &&
+      currT > EPSILON) {
+    hit = true;
+    t = currT;
+    n = currN;
+    st = currST;
+    begin = pair.begin;
+  }
+
+  // The second triangle keeps its winding, so its normal is the same.
+  const vec3 v0 = quad[second.x];
+  if (!(skipsMesh && skip.begin == pair.begin + 3u) &&
+      intersectsTriangle(ray, v0, quad[second.y] - v0, quad[second.z] - v0,
+                         currT, currN, currST) &&
+      currT > EPSILON && currT < t) {
+    hit = true;
+    t = currT;
+    n = currN;
+    st = currST;
+    begin = pair.begin + 3u;
+  }
+  return hit;
+}
+#endif // HERAKLES_TRIANGLE_PAIRS
+
+/// Intersects the triangle at the given index of the BVH triangles, unless it
+/// is the skipped triangle, setting the beginning of the hit triangle. With
+/// precomputed triangles, the triangle is read with a single load, and pairs
+/// of triangles are intersected with intersectsTrianglePair(). Spheres are
+/// intersected with intersectsSphere(), and can't be precomputed.
+bool intersectsBVHTriangle(const Ray ray, const uint index,
+                           const SkipTriangle skip, out float t, out vec3 n,
+                           out vec2 st, out uint begin) {
+#ifdef HERAKLES_PRECOMPUTED_TRIANGLES
+  const PrecomputedTriangle triangle = PrecomputedTriangles[index];
+#else
+  const BVHTriangle triangle = BVHTriangles[index];
+#endif // HERAKLES_PRECOMPUTED_TRIANGLES
+#ifdef HERAKLES_TRIANGLE_PAIRS
+  if ((triangle.meshID & BVHTrianglePairBit) != 0u) {
+    return intersectsTrianglePair(ray, triangle, skip, t, n, st, begin);
+  }
+#endif // HERAKLES_TRIANGLE_PAIRS
+  begin = triangle.begin;
+#ifndef HERAKLES_PRECOMPUTED_TRIANGLES
+  if (triangle.meshID == BVHSphereMeshID) {
+    st = vec2(0.0f);
+    return intersectsSphere(ray, triangle.begin,
+                            skip.skip && skip.meshID == BVHSphereMeshID &&
+                                skip.begin == triangle.begin,
+                            t, n);
+  }
+#endif // !HERAKLES_PRECOMPUTED_TRIANGLES
+  if (skip.skip && triangle.meshID == skip.meshID
+      && triangle.begin == skip.begin) {
+    return false;
+  }
+#ifdef HERAKLES_PRECOMPUTED_TRIANGLES
+  return intersectsTriangle(ray, triangle.v0, triangle.edge1, triangle.edge2,
+                            t, n, st);
+#else
+  return intersectsTriangle(ray, triangle.begin, t, n, st);
+#endif // HERAKLES_PRECOMPUTED_TRIANGLES
+}
+
 /*
  * Returns if the given bounding box is intersected by the given ray.
  */
@@ -84,6 +265,358 @@ bool intersectsBoundingBox(
   return tMin <= tMax;
 }
 
+#ifdef HERAKLES_BVH4
+#ifdef HERAKLES_QUANTIZED_BVH4
+/// Unpacks the four bytes of v.
+vec4 unpackBytes(const uint v) {
+  return vec4(uvec4(v, v >> 8u, v >> 16u, v >> 24u) & 0xFFu);
+}
+
+/// Decodes a quantized BVH4 node. q * scale is exact, so every bound is
+/// rounded only once, the same way as in the CPU.
+BVH4Node dequantizeBVH4Node(const QuantizedBVH4Node node) {
+  const vec3 scale = vec3(
+      ldexp(1.0f, int(node.exponents & 0xFFu) - 127),
+      ldexp(1.0f, int((node.exponents >> 8u) & 0xFFu) - 127),
+      ldexp(1.0f, int((node.exponents >> 16u) & 0xFFu) - 127));
+
+  BVH4Node decoded;
+  decoded.minX = node.origin.x + unpackBytes(node.quantizedMin.x) * scale.x;
+  decoded.minY = node.origin.y + unpackBytes(node.quantizedMin.y) * scale.y;
+  decoded.minZ = node.origin.z + unpackBytes(node.quantizedMin.z) * scale.z;
+  decoded.maxX = node.origin.x + unpackBytes(node.quantizedMax.x) * scale.x;
+  decoded.maxY = node.origin.y + unpackBytes(node.quantizedMax.y) * scale.y;
+  decoded.maxZ = node.origin.z + unpackBytes(node.quantizedMax.z) * scale.z;
+  decoded.childOffsets = node.childOffsets;
+  decoded.childNumTriangles = uvec4(
+      node.packedNumTriangles01 & 0xFFFFu, node.packedNumTriangles01 >> 16u,
+      node.packedNumTriangles23 & 0xFFFFu, node.packedNumTriangles23 >> 16u);
+  return decoded;
+}
+#endif // HERAKLES_QUANTIZED_BVH4
+
+/// Loads a BVH4 node, decoding it if the BVH is quantized.
+BVH4Node loadBVH4Node(const uint index) {
+#ifdef HERAKLES_QUANTIZED_BVH4
+  return dequantizeBVH4Node(QuantizedBVH4Nodes[index]);
+#else
+  return BVH4Nodes[index];
+#endif // HERAKLES_QUANTIZED_BVH4
+}
+
+/// Tests the ray against the bounding boxes of the four children of a BVH4
+/// node at once. Returns a mask with bit i set if the child i is hit, and sets
+/// tNear to the distances where the ray enters each box.
+uint intersectsChildBoundingBoxes(
+    const BVH4Node node, const float rayTMax, const vec3 invDir,
+    const vec3 origByDir, out vec4 tNear) {
+  const vec4 x0 = node.minX * invDir.x - origByDir.x;
+  const vec4 x1 = node.maxX * invDir.x - origByDir.x;
+  const vec4 y0 = node.minY * invDir.y - origByDir.y;
+  const vec4 y1 = node.maxY * invDir.y - origByDir.y;
+  const vec4 z0 = node.minZ * invDir.z - origByDir.z;
+  const vec4 z1 = node.maxZ * invDir.z - origByDir.z;
+
+  tNear = max(max(max(vec4(0.0f), min(x0, x1)), min(y0, y1)), min(z0, z1));
+  vec4 tMax =
+      min(min(min(vec4(rayTMax), max(x0, x1)), max(y0, y1)), max(z0, z1));
+
+  // Update tMax to ensure robust bounds intersection.
+  tMax *= 1.0f + 2.0f * GAMMA_3;
+
+  const bvec4 hit = lessThanEqual(tNear, tMax);
+  uint mask = 0u;
+  for (int i = 0; i < 4; ++i) {
+    if (hit[i] && node.childOffsets[i] != BVH4EmptyChild) {
+      mask |= 1u << i;
+    }
+  }
+  return mask;
+}
+#endif // HERAKLES_BVH4
+
+#ifdef HERAKLES_TWO_LEVEL_BVH
+/// Intersects the ray with the bottom-level BVH of the instance. The ray is
+/// transformed into the space of the instance's mesh without normalizing its
+/// direction, so that t is the same in both spaces. The skipped triangle is
+/// only skipped in its own instance, as the instances of a mesh share its
+/// triangles.
+/// Returns if an intersection closer than t was found, updating t, the index
+/// of the triangle in the BVH triangles, the beginning of the hit triangle,
+/// the instance ID and the world space normal. If anyHit is true, returns at
+/// the first such intersection without updating the normal.
+bool intersectsInstance(const Ray worldRay, const BVHInstance instance,
+                        const SkipTriangle worldSkip, const bool anyHit,
+                        inout float t, inout uint hitIndex,
+                        inout uint hitBegin, inout uint hitInstanceID,
+                        inout vec3 n) {
+  const Ray ray = Ray(
+      (instance.worldToObject * vec4(worldRay.origin, 1.0f)).xyz,
+      mat3(instance.worldToObject) * worldRay.direction);
+  const SkipTriangle skip = SkipTriangle(
+      worldSkip.skip && worldSkip.instanceID == instance.instanceID,
+      worldSkip.meshID, worldSkip.begin, worldSkip.instanceID);
+  const vec3 invDir = 1.0f / ray.direction;
+  const vec3 origByDir = ray.origin * invDir;
+  const bvec3 dirIsNeg = bvec3(invDir.x < 0, invDir.y < 0, invDir.z < 0);
+
+  bool hit = false;
+  uint nodesToVisit[64];
+  int toVisitOffset = 0;
+  nodesToVisit[0] = instance.rootNodeOffset;
+
+  float currT;
+  vec2 currST;
+  vec3 currN;
+  uint currBegin;
+  uint numTriangles, splitAxis;
+  while (toVisitOffset >= 0) {
+    const uint currentNode = nodesToVisit[toVisitOffset--];
+    const BVHNode node = BVHNodes[currentNode];
+    unpackNumTrianglesAndAxis(node, numTriangles, splitAxis);
+
+    if (intersectsBoundingBox(ray, t, node.minPoint, node.maxPoint, invDir,
+                              origByDir)) {
+      if (numTriangles == 0) {
+        if (dirIsNeg[splitAxis]) {
+          nodesToVisit[++toVisitOffset] = currentNode + 1;
+          nodesToVisit[++toVisitOffset] = node.trianglesOrSecondChildOffset;
+        } else {
+          nodesToVisit[++toVisitOffset] = node.trianglesOrSecondChildOffset;
+          nodesToVisit[++toVisitOffset] = currentNode + 1;
+        }
+      } else {
+        for (int i = 0; i < numTriangles; ++i) {
+          const uint index = node.trianglesOrSecondChildOffset + i;
+          if (intersectsBVHTriangle(ray, index, skip, currT, currN, currST,
+                                    currBegin) &&
+              currT <= t - EPSILON && currT > EPSILON) {
+            if (anyHit) return true;
+            hit = true;
+            t = currT;
+            hitIndex = index;
+            hitBegin = currBegin;
+            hitInstanceID = instance.instanceID;
+            n = currN;
+          }
+        }
+      }
+    }
+  }
+
+  // Normals transform with the inverse transpose of the object to world
+  // matrix.
+  if (hit) n = normalize(transpose(mat3(instance.worldToObject)) * n);
+  return hit;
+}
+#endif // HERAKLES_TWO_LEVEL_BVH
+
+#if defined(HERAKLES_SHARED_BVH_NODES)
+/// Number of top levels of the BVH cached in shared memory. Set by the
+/// renderer from the shared memory limit of the device.
+layout(constant_id = 0) const uint SharedBVHLevels = 8;
+
+/// Number of node slots of the cached levels, as if they were complete.
+const uint NumSharedBVHNodes = (1u << SharedBVHLevels) - 1u;
+
+/// Bit set in the node references of the traversal stack that are slots of
+/// SharedBVHNodes instead of indices of BVHNodes.
+const uint SharedBVHNodeBit = 0x80000000u;
+
+/// Index of a slot of the cached levels that has no node.
+const uint NoSharedBVHNode = 0xFFFFFFFFu;
+
+/**
+ * The top levels of the BVH in heap order: the children of the node in slot s
+ * are in slots 2s + 1 and 2s + 2, whatever the layout of BVHNodes. The slots
+ * under leaves are left empty.
+ */
+shared BVHNode SharedBVHNodes[NumSharedBVHNodes];
+
+/// Index in BVHNodes of the node of each slot of the cached levels and of the
+/// level right below them, where the traversal leaves the cache.
+shared uint SharedBVHNodeIndices[2u * NumSharedBVHNodes + 1u];
+
+/**
+ * Loads the top levels of the BVH into shared memory, one level at a time,
+ * with every invocation of the workgroup. Must be called in uniform control
+ * flow before any traversal.
+ */
+void loadSharedBVHNodes() {
+  const uint numInvocations =
+      gl_WorkGroupSize.x * gl_WorkGroupSize.y * gl_WorkGroupSize.z;
+  for (uint level = 0u; level <= SharedBVHLevels; ++level) {
+    const uint levelBegin = (1u << level) - 1u;
+    for (uint slot = levelBegin + gl_LocalInvocationIndex;
+         slot < 2u * levelBegin + 1u; slot += numInvocations) {
+      uint index = 0u;
+      if (slot > 0u) {
+        const uint parentSlot = (slot - 1u) / 2u;
+        const uint parentIndex = SharedBVHNodeIndices[parentSlot];
+        index = NoSharedBVHNode;
+        if (parentIndex != NoSharedBVHNode) {
+          const BVHNode parent = SharedBVHNodes[parentSlot];
+          uint numTriangles, splitAxis;
+          unpackNumTrianglesAndAxis(parent, numTriangles, splitAxis);
+          if (numTriangles == 0) {
+            index = (slot & 1u) != 0u ? parentIndex + 1u
+                                      : parent.trianglesOrSecondChildOffset;
+          }
+        }
+      }
+
+      SharedBVHNodeIndices[slot] = index;
+      if (slot < NumSharedBVHNodes && index != NoSharedBVHNode) {
+        SharedBVHNodes[slot] = BVHNodes[index];
+      }
+    }
+    memoryBarrierShared();
+    barrier();
+  }
+}
+
+/// Returns the reference to the root of the BVH.
+uint rootBVHNodeRef() { return SharedBVHNodeBit; }
+
+/// Returns the referenced node, from shared memory if it is cached.
+BVHNode loadBVHNode(const uint ref) {
+  if ((ref & SharedBVHNodeBit) != 0u) {
+    return SharedBVHNodes[ref & ~SharedBVHNodeBit];
+  }
+  return BVHNodes[ref];
+}
+
+/// Returns the reference to the first (0) or second (1) child of the
+/// referenced internal node.
+uint bvhChildRef(const uint ref, const BVHNode node, const uint child) {
+  if ((ref & SharedBVHNodeBit) == 0u) {
+    return child == 0u ? ref + 1u : node.trianglesOrSecondChildOffset;
+  }
+
+  const uint slot = 2u * (ref & ~SharedBVHNodeBit) + 1u + child;
+  return slot < NumSharedBVHNodes ? slot | SharedBVHNodeBit
+                                  : SharedBVHNodeIndices[slot];
+}
+#else
+/// Returns the reference to the root of the BVH. The references of the
+/// traversal are indices of the node buffer.
+uint rootBVHNodeRef() { return 0u; }
+
+#ifndef HERAKLES_BVH4
+/// Returns the referenced node.
+BVHNode loadBVHNode(const uint ref) { return BVHNodes[ref]; }
+
+/// Returns the reference to the first (0) or second (1) child of the
+/// referenced internal node.
+uint bvhChildRef(const uint ref, const BVHNode node, const uint child) {
+  return child == 0u ? ref + 1u : node.trianglesOrSecondChildOffset;
+}
+#endif // !HERAKLES_BVH4
+#endif // HERAKLES_SHARED_BVH_NODES
+
+#ifdef HERAKLES_SHORT_STACK_TRAVERSAL
+/// Number of nodes of the short stack of the restart trail traversal.
+const uint ShortStackSize = 4u;
+
+/**
+ * State of the restart trail traversal of a binary BVH. Instead of a stack
+ * with every far child still to visit, it keeps only the last few of them in
+ * a short stack, and a trail with a bit per level that is set if the path is
+ * on the far child of that level. When the short stack runs out, the traversal
+ * restarts from the root and follows the trail, so finished subtrees aren't
+ * visited again.
+ */
+struct ShortStackTraversal {
+  /// Node being visited.
+  uint node;
+
+  /// Depth of the node being visited, where the root is at depth 0.
+  int depth;
+
+  /// Bit 63 - depth is set if the path is on the far child at that depth, so
+  /// that a finished level carries into its parent. A 64 bit integer split in
+  /// its low (x) and high (y) halves, so that it doesn't need shaderInt64.
+  uvec2 trail;
+
+  /// Ring buffer with the last far children skipped. Older ones are
+  /// overwritten, and found again by restarting.
+  uint shortStack[ShortStackSize];
+
+  /// Number of pushes to the short stack, and how many of them are in it.
+  uint stackTop;
+  uint stackSize;
+};
+
+/// Returns the bit of the restart trail of the given depth, in the halves of
+/// the trail. The renderer rejects BVHs with leaves deeper than 63, so the
+/// bit always exists.
+uvec2 trailLevel(const int depth) {
+  const int bit = 63 - depth;
+  return bit < 32 ? uvec2(1u << uint(bit), 0u)
+                  : uvec2(0u, 1u << uint(bit - 32));
+}
+
+/// Returns if the bit of the given depth is set in the restart trail.
+bool hasTrailLevel(const uvec2 trail, const int depth) {
+  return any(notEqual(trail & trailLevel(depth), uvec2(0u)));
+}
+
+/// Starts the traversal at the root.
+ShortStackTraversal startShortStackTraversal() {
+  ShortStackTraversal traversal;
+  traversal.node = 0u;
+  traversal.depth = 0;
+  traversal.trail = uvec2(0u);
+  traversal.stackTop = 0u;
+  traversal.stackSize = 0u;
+  return traversal;
+}
+
+/// Descends into the near child of the current internal node, pushing the far
+/// one, or into the far child if the trail says the near one is finished.
+void descendShortStackTraversal(inout ShortStackTraversal traversal,
+                                const uint nearChild, const uint farChild) {
+  ++traversal.depth;
+  if (hasTrailLevel(traversal.trail, traversal.depth)) {
+    traversal.node = farChild;
+    return;
+  }
+
+  traversal.node = nearChild;
+  traversal.shortStack[traversal.stackTop++ % ShortStackSize] = farChild;
+  traversal.stackSize = min(traversal.stackSize + 1u, ShortStackSize);
+}
+
+/// Finishes the subtree of the current node and moves on to the far child of
+/// the deepest level still on its near child: from the short stack if it is
+/// there, or by restarting from the root otherwise. Returns false once the
+/// whole BVH is finished.
+bool popShortStackTraversal(inout ShortStackTraversal traversal) {
+  // trail = (trail & ~(level - 1)) + level, in 64 bits.
+  const uvec2 level = trailLevel(traversal.depth);
+  const uvec2 below = level.x != 0u ? uvec2(level.x - 1u, 0u)
+                                    : uvec2(~0u, level.y - 1u);
+  uvec2 trail = traversal.trail & ~below;
+  uint carry;
+  trail.x = uaddCarry(trail.x, level.x, carry);
+  trail.y += level.y + carry;
+  traversal.trail = trail;
+  if (hasTrailLevel(trail, 0)) return false;
+
+  traversal.depth =
+      63 - (trail.x != 0u ? findLSB(trail.x) : 32 + findLSB(trail.y));
+  if (traversal.stackSize > 0u) {
+    --traversal.stackSize;
+    traversal.node = traversal.shortStack[--traversal.stackTop %
+                                          ShortStackSize];
+  } else {
+    traversal.node = 0u;
+    traversal.depth = 0;
+  }
+  return true;
+}
+#endif // HERAKLES_SHORT_STACK_TRAVERSAL
+
 /// Ray-scene intersection.
 /// Returns the interaction at intersection point.
 bool intersectsScene(const Ray ray, const SkipTriangle skip,
@@ -94,27 +627,78 @@ bool intersectsScene(const Ray ray, const SkipTriangle skip,
 
   bool hit = false;
   float t = INF;
-  uint meshID = 0;
-  uint begin = 0;
+  uint hitIndex = 0;
+  uint hitBegin = 0;
+  uint hitInstanceID = 0;
   vec3 n;
   vec2 st;
 
+#ifndef HERAKLES_SHORT_STACK_TRAVERSAL
   uint nodesToVisit[64];
   int toVisitOffset = 0;
-  nodesToVisit[0] = 0;
+  nodesToVisit[0] = rootBVHNodeRef();
+#endif // !HERAKLES_SHORT_STACK_TRAVERSAL
 
   float currT;
   vec2 currST;
   vec3 currN;
-  uint numTriangles, splitAxis;
+  uint currBegin;
+#ifdef HERAKLES_BVH4
+  while (toVisitOffset >= 0) {
+    const BVH4Node node = loadBVH4Node(nodesToVisit[toVisitOffset--]);
+    vec4 tNear;
+    const uint hitMask =
+        intersectsChildBoundingBoxes(node, t, invDir, origByDir, tNear);
+
+    // Leaves are intersected right away, and the internal children that are
+    // hit are visited from the closest to the farthest.
+    uint hitChildren[4];
+    float hitDistances[4];
+    int numHitChildren = 0;
+    for (int c = 0; c < 4; ++c) {
+      if ((hitMask & (1u << c)) == 0u) continue;
+
+      if (node.childNumTriangles[c] == 0u) {
+        int j = numHitChildren++;
+        for (; j > 0 && hitDistances[j - 1] > tNear[c]; --j) {
+          hitChildren[j] = hitChildren[j - 1];
+          hitDistances[j] = hitDistances[j - 1];
+        }
+        hitChildren[j] = node.childOffsets[c];
+        hitDistances[j] = tNear[c];
+        continue;
+      }
+
+      for (uint i = 0u; i < node.childNumTriangles[c]; ++i) {
+        const uint index = node.childOffsets[c] + i;
+        if (intersectsBVHTriangle(ray, index, skip, currT, currN, currST,
+                                  currBegin) &&
+            currT <= t - EPSILON && currT > EPSILON) {
+          hit = true;
+          t = currT;
+          hitIndex = index;
+          hitBegin = currBegin;
+          n = currN;
+          st = currST;
+        }
+      }
+    }
+
+    for (int i = numHitChildren - 1; i >= 0; --i) {
+      nodesToVisit[++toVisitOffset] = hitChildren[i];
+    }
+  }
+#elif defined(HERAKLES_TWO_LEVEL_BVH)
+  // The leaves of the top level reference instances instead of triangles.
+  uint numInstances, splitAxis;
   while (toVisitOffset >= 0) {
     const uint currentNode = nodesToVisit[toVisitOffset--];
     const BVHNode node = BVHNodes[currentNode];
-    unpackNumTrianglesAndAxis(node, numTriangles, splitAxis);
+    unpackNumTrianglesAndAxis(node, numInstances, splitAxis);
 
     if (intersectsBoundingBox(ray, t, node.minPoint, node.maxPoint, invDir,
                               origByDir)) {
-      if (numTriangles == 0) {
+      if (numInstances == 0) {
         if (dirIsNeg[splitAxis]) {
           nodesToVisit[++toVisitOffset] = currentNode + 1;
           nodesToVisit[++toVisitOffset] = node.trianglesOrSecondChildOffset;
@@ -123,19 +707,81 @@ bool intersectsScene(const Ray ray, const SkipTriangle skip,
           nodesToVisit[++toVisitOffset] = currentNode + 1;
         }
       } else {
-        for (int i = 0; i < numTriangles; ++i) {
-          BVHTriangle triangle = BVHTriangles[node.trianglesOrSecondChildOffset
-                                              + i];
-          if (skip.skip && triangle.meshID == skip.meshID
-              && triangle.begin == skip.begin) {
-            continue;
+        for (uint i = 0u; i < numInstances; ++i) {
+          const BVHInstance instance =
+              BVHInstances[node.trianglesOrSecondChildOffset + i];
+          if (intersectsInstance(ray, instance, skip, false, t, hitIndex,
+                                 hitBegin, hitInstanceID, n)) {
+            hit = true;
           }
-          if (intersectsTriangle(ray, triangle.begin, currT, currN, currST) &&
+        }
+      }
+    }
+  }
+#elif defined(HERAKLES_SHORT_STACK_TRAVERSAL)
+  ShortStackTraversal traversal = startShortStackTraversal();
+  uint numTriangles, splitAxis;
+  while (true) {
+    const BVHNode node = BVHNodes[traversal.node];
+    unpackNumTrianglesAndAxis(node, numTriangles, splitAxis);
+
+    if (intersectsBoundingBox(ray, t, node.minPoint, node.maxPoint, invDir,
+                              origByDir)) {
+      if (numTriangles == 0) {
+        const uint firstChild = traversal.node + 1;
+        const uint secondChild = node.trianglesOrSecondChildOffset;
+        descendShortStackTraversal(
+            traversal, dirIsNeg[splitAxis] ? secondChild : firstChild,
+            dirIsNeg[splitAxis] ? firstChild : secondChild);
+        continue;
+      }
+
+      for (int i = 0; i < numTriangles; ++i) {
+        const uint index = node.trianglesOrSecondChildOffset + i;
+        if (intersectsBVHTriangle(ray, index, skip, currT, currN, currST,
+                                  currBegin) &&
+            currT <= t - EPSILON && currT > EPSILON) {
+          hit = true;
+          t = currT;
+          hitIndex = index;
+          hitBegin = currBegin;
+          n = currN;
+          st = currST;
+        }
+      }
+    }
+
+    if (!popShortStackTraversal(traversal)) break;
+  }
+#else
+  uint numTriangles, splitAxis;
+  while (toVisitOffset >= 0) {
+    const uint currentNode = nodesToVisit[toVisitOffset--];
+    const BVHNode node = loadBVHNode(currentNode);
+    unpackNumTrianglesAndAxis(node, numTriangles, splitAxis);
+
+    if (intersectsBoundingBox(ray, t, node.minPoint, node.maxPoint, invDir,
+                              origByDir)) {
+      if (numTriangles == 0) {
+        const uint firstChild = bvhChildRef(currentNode, node, 0u);
+        const uint secondChild = bvhChildRef(currentNode, node, 1u);
+        if (dirIsNeg[splitAxis]) {
+          nodesToVisit[++toVisitOffset] = firstChild;
+          nodesToVisit[++toVisitOffset] = secondChild;
+        } else {
+          nodesToVisit[++toVisitOffset] = secondChild;
+          nodesToVisit[++toVisitOffset] = firstChild;
+        }
+      } else {
+        for (int i = 0; i < numTriangles; ++i) {
+          const uint index = node.trianglesOrSecondChildOffset + i;
+          if (intersectsBVHTriangle(ray, index, skip, currT, currN, currST,
+                                    currBegin) &&
               currT <= t - EPSILON && currT > EPSILON) {
             hit = true;
             t = currT;
-            meshID = triangle.meshID;
-            begin = triangle.begin;
+            hitIndex = index;
+            hitBegin = currBegin;
             n = currN;
             st = currST;
           }
@@ -143,15 +789,22 @@ bool intersectsScene(const Ray ray, const SkipTriangle skip,
       }
     }
   }
+#endif // HERAKLES_BVH4
 
   if (!hit) {
     return false;
   }
 
+  // Only the closest triangle is loaded again, after the traversal.
+  const uint meshID = triangleMeshID(loadBVHTriangle(hitIndex));
+  uint materialID;
+  int areaLightID;
+  loadMaterialAndLight(hitIndex, meshID, materialID, areaLightID);
+
   // Shading normal disabled for now. Should not be used with Fresnel BSDFs.
-  /* n = Normals[Indices[begin]] * st.s */
-  /*   + Normals[Indices[begin + 1]] * st.t */
-  /*   + Normals[Indices[begin + 2]] * (1.0f - st.s - st.t); */
+  /* n = Normals[Indices[hitBegin]] * st.s */
+  /*   + Normals[Indices[hitBegin + 1]] * st.t */
+  /*   + Normals[Indices[hitBegin + 2]] * (1.0f - st.s - st.t); */
   const bool backface = dot(-1.0f * ray.direction, n) < 0.0f;
 
   isect = Interaction(
@@ -159,7 +812,10 @@ bool intersectsScene(const Ray ray, const SkipTriangle skip,
       meshID,
       backface ? n * -1.0f : n,
       backface,
-      begin);
+      hitBegin,
+      materialID,
+      areaLightID,
+      hitInstanceID);
 
   return true;
 }
@@ -175,22 +831,55 @@ bool unoccluded(const Ray ray, const float dist, const SkipTriangle skip) {
   const bvec3 dirIsNeg = bvec3(invDir.x < 0, invDir.y < 0, invDir.z < 0);
   const float minT = dist - 1e-4; // To prevent hitting objects at exactly dist.
 
+#ifndef HERAKLES_SHORT_STACK_TRAVERSAL
   uint nodesToVisit[64];
   int toVisitOffset = 0;
-  nodesToVisit[0] = 0;
+  nodesToVisit[0] = rootBVHNodeRef();
+#endif // !HERAKLES_SHORT_STACK_TRAVERSAL
 
   float currT;
   vec2 currST;
   vec3 currN;
-  uint numTriangles, splitAxis;
+  uint currBegin;
+#ifdef HERAKLES_BVH4
+  while (toVisitOffset >= 0) {
+    const BVH4Node node = loadBVH4Node(nodesToVisit[toVisitOffset--]);
+    vec4 tNear;
+    const uint hitMask =
+        intersectsChildBoundingBoxes(node, minT, invDir, origByDir, tNear);
+
+    for (int c = 0; c < 4; ++c) {
+      if ((hitMask & (1u << c)) == 0u) continue;
+
+      if (node.childNumTriangles[c] == 0u) {
+        nodesToVisit[++toVisitOffset] = node.childOffsets[c];
+        continue;
+      }
+
+      for (uint i = 0u; i < node.childNumTriangles[c]; ++i) {
+        const uint index = node.childOffsets[c] + i;
+        if (intersectsBVHTriangle(ray, index, skip, currT, currN, currST,
+                                  currBegin) &&
+            currT <= minT - EPSILON && currT > EPSILON) {
+          return false;
+        }
+      }
+    }
+  }
+#elif defined(HERAKLES_TWO_LEVEL_BVH)
+  uint numInstances, splitAxis;
+  uint hitIndex = 0;
+  uint hitBegin = 0;
+  uint hitInstanceID = 0;
+  float t = minT;
   while (toVisitOffset >= 0) {
     const uint currentNode = nodesToVisit[toVisitOffset--];
     const BVHNode node = BVHNodes[currentNode];
-    unpackNumTrianglesAndAxis(node, numTriangles, splitAxis);
+    unpackNumTrianglesAndAxis(node, numInstances, splitAxis);
 
     if (intersectsBoundingBox(ray, minT, node.minPoint, node.maxPoint, invDir,
                               origByDir)) {
-      if (numTriangles == 0) {
+      if (numInstances == 0) {
         if (dirIsNeg[splitAxis]) {
           nodesToVisit[++toVisitOffset] = currentNode + 1;
           nodesToVisit[++toVisitOffset] = node.trianglesOrSecondChildOffset;
@@ -199,14 +888,71 @@ bool unoccluded(const Ray ray, const float dist, const SkipTriangle skip) {
           nodesToVisit[++toVisitOffset] = currentNode + 1;
         }
       } else {
-        for (int i = 0; i < numTriangles; ++i) {
-          BVHTriangle triangle = BVHTriangles[node.trianglesOrSecondChildOffset
-                                              + i];
-          if (skip.skip && triangle.meshID == skip.meshID
-              && triangle.begin == skip.begin) {
-            continue;
+        for (uint i = 0u; i < numInstances; ++i) {
+          const BVHInstance instance =
+              BVHInstances[node.trianglesOrSecondChildOffset + i];
+          if (intersectsInstance(ray, instance, skip, true, t, hitIndex,
+                                 hitBegin, hitInstanceID, currN)) {
+            return false;
           }
-          if (intersectsTriangle(ray, triangle.begin, currT, currN, currST) &&
+        }
+      }
+    }
+  }
+#elif defined(HERAKLES_SHORT_STACK_TRAVERSAL)
+  ShortStackTraversal traversal = startShortStackTraversal();
+  uint numTriangles, splitAxis;
+  while (true) {
+    const BVHNode node = BVHNodes[traversal.node];
+    unpackNumTrianglesAndAxis(node, numTriangles, splitAxis);
+
+    if (intersectsBoundingBox(ray, minT, node.minPoint, node.maxPoint, invDir,
+                              origByDir)) {
+      if (numTriangles == 0) {
+        const uint firstChild = traversal.node + 1;
+        const uint secondChild = node.trianglesOrSecondChildOffset;
+        descendShortStackTraversal(
+            traversal, dirIsNeg[splitAxis] ? secondChild : firstChild,
+            dirIsNeg[splitAxis] ? firstChild : secondChild);
+        continue;
+      }
+
+      for (int i = 0; i < numTriangles; ++i) {
+        const uint index = node.trianglesOrSecondChildOffset + i;
+        if (intersectsBVHTriangle(ray, index, skip, currT, currN, currST,
+                                  currBegin) &&
+            currT <= minT - EPSILON && currT > EPSILON) {
+          return false;
+        }
+      }
+    }
+
+    if (!popShortStackTraversal(traversal)) break;
+  }
+#else
+  uint numTriangles, splitAxis;
+  while (toVisitOffset >= 0) {
+    const uint currentNode = nodesToVisit[toVisitOffset--];
+    const BVHNode node = loadBVHNode(currentNode);
+    unpackNumTrianglesAndAxis(node, numTriangles, splitAxis);
+
+    if (intersectsBoundingBox(ray, minT, node.minPoint, node.maxPoint, invDir,
+                              origByDir)) {
+      if (numTriangles == 0) {
+        const uint firstChild = bvhChildRef(currentNode, node, 0u);
+        const uint secondChild = bvhChildRef(currentNode, node, 1u);
+        if (dirIsNeg[splitAxis]) {
+          nodesToVisit[++toVisitOffset] = firstChild;
+          nodesToVisit[++toVisitOffset] = secondChild;
+        } else {
+          nodesToVisit[++toVisitOffset] = secondChild;
+          nodesToVisit[++toVisitOffset] = firstChild;
+        }
+      } else {
+        for (int i = 0; i < numTriangles; ++i) {
+          const uint index = node.trianglesOrSecondChildOffset + i;
+          if (intersectsBVHTriangle(ray, index, skip, currT, currN, currST,
+                                    currBegin) &&
               currT <= minT - EPSILON && currT > EPSILON) {
             return false;
           }
@@ -214,6 +960,7 @@ bool unoccluded(const Ray ray, const float dist, const SkipTriangle skip) {
       }
     }
   }
+#endif // HERAKLES_BVH4
 
   return true;
 }
@@ -0,0 +1,116 @@
+/*
+ * Copyright 2017 Renato Utsch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Structures and functions used to build a Linear BVH on the GPU.
+ *
+ * The pass constants and the size of LBVHBuildNode must match the ones in
+ * herakles/scene/gpu_bvh_builder.cpp.
+ */
+
+#ifndef HERAKLES_SHADERS_LBVH_GLSL
+#define HERAKLES_SHADERS_LBVH_GLSL
+
+#include "extensions.glsl"
+
+// Passes of the build, in the order they are dispatched.
+const uint LBVHInitPass = 0;
+const uint LBVHCentroidBoundsPass = 1;
+const uint LBVHMortonCodesPass = 2;
+const uint LBVHSortPass = 3;
+const uint LBVHHierarchyPass = 4;
+const uint LBVHBoundsPass = 5;
+const uint LBVHOutputPass = 6;
+
+/// Parent of the root node.
+const uint LBVHInvalidNode = 0xFFFFFFFFu;
+
+/// Morton code of the padding elements of the sort, after every valid code.
+const uint LBVHPaddingCode = 0xFFFFFFFFu;
+
+/**
+ * A node of the binary radix tree built by the GPU builder.
+ * Internal node i is at index i, and leaf i is at index NumTriangles - 1 + i,
+ * where leaf i is the i-th triangle in Morton code order.
+ * This struct has 64 bytes in std430.
+ */
+struct LBVHBuildNode {
+  /// Minimum point of the bounding box.
+  vec3 minPoint;
+
+  /// First leaf covered by the node.
+  uint first;
+
+  /// Maximum point of the bounding box.
+  vec3 maxPoint;
+
+  /// Last leaf covered by the node.
+  uint last;
+
+  /// Index of the children nodes. Only meaningful for internal nodes.
+  uint left;
+  uint right;
+
+  /// Index of the parent node, or LBVHInvalidNode for the root.
+  uint parent;
+
+  /// Number of children whose bounds are ready. Incremented atomically.
+  uint visits;
+
+  /// Last leaf of the left child. Only meaningful for internal nodes.
+  uint split;
+
+  /// Axis of the highest differing Morton code bit of the node's leaves.
+  uint splitAxis;
+};
+
+/// Maps a float to an uint with the same order, so that float bounds can be
+/// computed with integer atomics.
+uint floatToOrderedUint(const float f) {
+  const uint u = floatBitsToUint(f);
+  return (u & 0x80000000u) != 0u ? ~u : u | 0x80000000u;
+}
+
+/// Inverse of floatToOrderedUint().
+float orderedUintToFloat(const uint u) {
+  return uintBitsToFloat((u & 0x80000000u) != 0u ? u & 0x7FFFFFFFu : ~u);
+}
+
+/// Spreads the lower 10 bits of v so that there are two zero bits between
+/// each of them.
+uint expandMortonBits(uint v) {
+  v = (v * 0x00010001u) & 0xFF0000FFu;
+  v = (v * 0x00000101u) & 0x0F00F00Fu;
+  v = (v * 0x00000011u) & 0xC30C30C3u;
+  v = (v * 0x00000005u) & 0x49249249u;
+  return v;
+}
+
+/// Returns the 30-bit Morton code of a point in [0, 1]^3. The bits are
+/// interleaved in the same order as the CPU builder's codes, so bit b of the
+/// code belongs to axis 2 - b % 3.
+uint mortonCode(const vec3 p) {
+  const uvec3 q = uvec3(clamp(p * 1024.0f, 0.0f, 1023.0f));
+  return (expandMortonBits(q.x) << 2) | (expandMortonBits(q.y) << 1) |
+         expandMortonBits(q.z);
+}
+
+/// Returns the axis of the given Morton code bit.
+uint mortonBitAxis(const int bit) {
+  return 2u - uint(bit) % 3u;
+}
+
+#endif // !HERAKLES_SHADERS_LBVH_GLSL
@@ -29,56 +29,89 @@
 #include "sampling.glsl"
 #include "utils.glsl"
 
-/// Returns estimated radiance along ray.
-vec3 pathTracingRadiance(Ray ray) {
-  vec3 color = vec3(0.0f);
-  vec3 beta = vec3(1.0f);
-  bool perfectlySpecularBounce = false;
+/// A path being traced one bounce at a time by pathTracingStep().
+struct PathState {
+  /// Ray of the next bounce.
+  Ray ray;
+
+  /// Radiance gathered so far. The radiance along the path once it ends.
+  vec3 color;
+
+  /// Throughput of the path.
+  vec3 beta;
+
+  /// If the last bounce was perfectly specular.
+  bool perfectlySpecularBounce;
+
+  /// Triangle the ray starts on, which it must not hit.
+  SkipTriangle skip;
+
+  /// Number of bounces traced so far.
+  uint depth;
+};
+
+/// Returns a path that starts with the given camera ray.
+PathState startPath(const Ray ray) {
+  return PathState(ray, vec3(0.0f), vec3(1.0f), false,
+                   SkipTriangle(false, 0, 0, 0), 0);
+}
+
+/// Traces the next bounce of the path. Returns false if the path ended, in
+/// which case its color is the radiance along its camera ray.
+bool pathTracingStep(inout PathState path) {
+  if (path.depth >= CameraPathLength) return false;
+
   Interaction isect;
-  SkipTriangle skip = SkipTriangle(false, 0, 0);
-  for (uint depth = 0; depth < CameraPathLength; ++depth) {
-    if (!intersectsScene(ray, skip, isect)) {
-      // Poor man's excuse of an infinite area light.
-      if (HasAmbientLight) {
-        color += beta * AmbientLight;
-      } else {
-        color = vec3(0.0f);
-      }
-      return color;
+  if (!intersectsScene(path.ray, path.skip, isect)) {
+    // Poor man's excuse of an infinite area light.
+    if (HasAmbientLight) {
+      path.color += path.beta * AmbientLight;
+    } else {
+      path.color = vec3(0.0f);
     }
+    return false;
+  }
 
-    // Direct light sampling in the first iteration.
-    // Surfaces only emit light if they're being looked at from the front.
-    if ((depth == 0 || perfectlySpecularBounce) && !isect.backface) {
-      const int areaLightID = Meshes[isect.meshID].areaLightID;
-      if (areaLightID >= 0) { // Otherwise it doesn't emit.
-        color += beta * AreaLights[areaLightID].emission;
-        break;
-      }
+  // Direct light sampling in the first iteration.
+  // Surfaces only emit light if they're being looked at from the front.
+  if ((path.depth == 0 || path.perfectlySpecularBounce) && !isect.backface) {
+    if (isect.areaLightID >= 0) { // Otherwise it doesn't emit.
+      path.color += path.beta * AreaLights[isect.areaLightID].emission;
+      return false;
     }
+  }
 
-    // Sample BSDF to get a new path direction.
-    vec3 wi;
-    float pdf;
-    const vec3 f = sampleBSDF(isect, ray.direction, wi, pdf,
-                              perfectlySpecularBounce);
-
-    // Update the reflectance.
-    // TODO(renatoutsch): maybe this should be after explicit light sampling.
-    beta *= f * absDot(wi, isect.normal) / pdf;
-
-    // Explicit light source sampling.
-    // Don't do this for perfectly specular BSDFs.
-    vec3 lightContribution;
-    if (!perfectlySpecularBounce && sampleOneLight(isect, lightContribution)) {
-      color += beta * lightContribution;
-    }
+  // Sample BSDF to get a new path direction.
+  vec3 wi;
+  float pdf;
+  const vec3 f = sampleBSDF(isect, path.ray.direction, wi, pdf,
+                            path.perfectlySpecularBounce);
+
+  // Update the reflectance.
+  // TODO(renatoutsch): maybe this should be after explicit light sampling.
+  path.beta *= f * absDot(wi, isect.normal) / pdf;
 
-    ray = Ray(isect.point, wi);
-    skip = SkipTriangle(true, isect.meshID, isect.begin);
+  // Explicit light source sampling.
+  // Don't do this for perfectly specular BSDFs.
+  vec3 lightContribution;
+  if (!path.perfectlySpecularBounce &&
+      sampleOneLight(isect, lightContribution)) {
+    path.color += path.beta * lightContribution;
   }
 
-  return color;
+  path.ray = Ray(isect.point, wi);
+  path.skip =
+      SkipTriangle(true, isect.meshID, isect.begin, isect.instanceID);
+  ++path.depth;
+  return true;
+}
+
+/// Returns estimated radiance along ray.
+vec3 pathTracingRadiance(const Ray ray) {
+  PathState path = startPath(ray);
+  while (pathTracingStep(path)) {
+  }
+  return path.color;
 }
 
 
@@ -36,6 +36,22 @@ vec2 uniformTriangleST() {
   return vec2(1 - su0, u1 * su0);
 }
 
+/// Samples a ray from the camera through the given pixel, with a tent filter
+/// over the pixel.
+Ray sampleCameraRay(const vec2 pixelIndex, const vec2 resolution) {
+  const vec3 cx = Camera.right * Camera.fov * (resolution.x / resolution.y);
+  const vec3 cy = Camera.up * Camera.fov;
+
+  const float r1 = 2.0f * rand();
+  const float dx = r1 < 1.0f ? sqrt(r1) - 1.0f : 1.0f - sqrt(2.f - r1);
+  const float r2 = 2.0f * rand();
+  const float dy = r2 < 1.0f ? sqrt(r2) - 1.0f : 1.0f - sqrt(2.f - r2);
+  const vec3 direction = cx * ((pixelIndex.x + 0.5 + dx) / resolution.x - 0.5)
+                       - cy * ((pixelIndex.y + 0.5 + dy) / resolution.y - 0.5)
+                       + Camera.direction;
+  return Ray(Camera.position, normalize(direction));
+}
+
 /// PDF of an uniformly sampled cone.
 float uniformConePdf(float cosThetaMax) {
   return 1.0f / (2.0f * M_PI * (1.0f - cosThetaMax));
@@ -64,17 +80,68 @@ Interaction sampleTriangle(const uint meshID, const uint begin) {
                     + b.t * Normals[Indices[begin + 1]]
                     + p   * Normals[Indices[begin + 2]];
 
-  return Interaction(point, meshID, normal, false, begin);
+  const Mesh mesh = Meshes[meshID];
+  return Interaction(point, meshID, normal, false, begin, mesh.materialID,
+                     mesh.areaLightID, 0);
+}
+
+/**
+ * A light sample that contributes to an interaction if nothing occludes the
+ * shadow ray from the interaction to the light up to dist.
+ */
+struct LightSample {
+  Ray shadowRay;
+  float dist;
+  vec3 contribution;
+};
+
+/// Samples the area light of a sphere by uniformly sampling the cone of
+/// directions from isect to the sphere, or every direction if isect is inside
+/// it, so that no sample is on the side of the sphere isect can't see.
+/// Returns if the sample may contribute to isect, without testing occlusion.
+bool sampleSphereAreaLight(const AreaLight light, const uint sphereID,
+                           const Interaction isect, const float pdf,
+                           out LightSample lightSample) {
+  // The sphere doesn't light itself.
+  if (isect.meshID == BVHSphereMeshID && isect.begin == sphereID) {
+    return false;
+  }
+
+  const Sphere sphere = Spheres[sphereID];
+  const vec3 toCenter =
+      vec3(sphere.centerX, sphere.centerY, sphere.centerZ) - isect.point;
+  const float dist2 = dot(toCenter, toCenter);
+  const float radius2 = sphere.radius * sphere.radius;
+  const float cosThetaMax =
+      dist2 > radius2 ? sqrt(1.0f - radius2 / dist2) : -1.0f;
+  const vec3 z = toCenter * inversesqrt(dist2);
+  vec3 x, y;
+  coordinateSystem(z, x, y);
+  lightSample.shadowRay =
+      Ray(isect.point, uniformSampleCone(cosThetaMax, x, y, z));
+
+  vec3 normal;
+  if (!intersectsSphere(lightSample.shadowRay, sphereID, false,
+                        lightSample.dist, normal)) {
+    return false;
+  }
+  lightSample.contribution =
+      light.emission * absDot(isect.normal, lightSample.shadowRay.direction) /
+      (uniformConePdf(cosThetaMax) * pdf);
+  return true;
 }
 
 /// Uniformly samples one area light source. The area light source is chosen
 /// uniformly.
-/// Returns if there is any light contribution to isect or not. If there is, the
-/// contribution output is set to the light contribution to the intersection.
+/// Returns if the sample may contribute to isect, without testing occlusion.
 /// Be sure the number of area lights is > 1 when calling this.
 bool sampleOneAreaLight(const uint areaLightIndex, const Interaction isect,
-                        const float pdf, out vec3 contribution) {
+                        const float pdf, out LightSample lightSample) {
   const AreaLight light = AreaLights[areaLightIndex];
+  if ((light.meshID & AreaLightSphereBit) != 0u) {
+    return sampleSphereAreaLight(light, light.meshID & ~AreaLightSphereBit,
+                                 isect, pdf, lightSample);
+  }
   const Mesh mesh = Meshes[light.meshID];
 
   // Chooses a triangle from the mesh at random.
@@ -97,13 +164,10 @@ bool sampleOneAreaLight(const uint areaLightIndex, const Interaction isect,
   const float lightPdf = triangleArea(begin) * absDot(isect.normal, dir)
                        * absDot(triangleIt.normal, -1.0f * dir) / (pdf * dist2);
 
-  if (unoccluded(Ray(isect.point, dir), sqrt(dist2),
-                 SkipTriangle(true, isect.meshID, isect.begin))) {
-    contribution = light.emission * lightPdf;
-    return true;
-  }
-
-  return false;
+  lightSample.shadowRay = Ray(isect.point, dir);
+  lightSample.dist = sqrt(dist2);
+  lightSample.contribution = light.emission * lightPdf;
+  return true;
 }
 
 float spotLightFalloff(const SpotLight light, const vec3 invDir) {
@@ -119,29 +183,27 @@ float spotLightFalloff(const SpotLight light, const vec3 invDir) {
   return (delta * delta) * (delta * delta);
 } 
 
-/// Uniformly samples one spot light. Returns if there is any contribution to
-/// isect or not, with the potential contribution set in the contribution
-/// variable.
+/// Uniformly samples one spot light. Returns if the sample may contribute to
+/// isect, without testing occlusion.
 /// Be sure the number of spot lights is > 1 when calling this.
 bool sampleOneSpotLight(const uint spotLightIndex, const Interaction isect,
-                        const float pdf, out vec3 contribution) {
+                        const float pdf, out LightSample lightSample) {
   const SpotLight light = SpotLights[spotLightIndex];
   const vec3 unormDir = light.from - isect.point;
   const vec3 dir = normalize(unormDir);
   const float dist2 = dot(unormDir, unormDir);
 
-  if (unoccluded(Ray(isect.point, dir), sqrt(dist2),
-                 SkipTriangle(true, isect.meshID, isect.begin))) {
-    const float falloff = spotLightFalloff(light, -1.0f * dir);
-    contribution = light.emission * falloff * absDot(dir, isect.normal)
-                 / (pdf * dist2);
-    return true;
-  }
-
-  return false;
+  const float falloff = spotLightFalloff(light, -1.0f * dir);
+  lightSample.shadowRay = Ray(isect.point, dir);
+  lightSample.dist = sqrt(dist2);
+  lightSample.contribution = light.emission * falloff
+                           * absDot(dir, isect.normal) / (pdf * dist2);
+  return true;
 }
 
-bool sampleOneLight(const Interaction isect, out vec3 contribution) {
+/// Uniformly samples one light. Returns if the sample may contribute to isect,
+/// in which case it does if its shadow ray is unoccluded.
+bool sampleOneLight(const Interaction isect, out LightSample lightSample) {
   const uint numAreaLights = AreaLights.length();
   const uint numSpotLights = SpotLights.length();
   const uint numLights = numAreaLights + numSpotLights;
@@ -150,13 +212,29 @@ bool sampleOneLight(const Interaction isect, out vec3 contribution) {
   const uint lightIndex = urand(numLights);
   const float pdf = float(numLights) + (HasAmbientLight ? 1.0f : 0.0f);
   if (lightIndex < numAreaLights) {
-    return sampleOneAreaLight(lightIndex, isect, pdf, contribution);
+    return sampleOneAreaLight(lightIndex, isect, pdf, lightSample);
   } else {
     return sampleOneSpotLight(lightIndex - numAreaLights, isect, pdf,
-                              contribution);
+                              lightSample);
   }
 }
 
+/// Uniformly samples one light and traces its shadow ray. Returns if there is
+/// any light contribution to isect or not. If there is, the contribution
+/// output is set to the light contribution to the intersection.
+bool sampleOneLight(const Interaction isect, out vec3 contribution) {
+  LightSample lightSample;
+  if (!sampleOneLight(isect, lightSample) ||
+      !unoccluded(lightSample.shadowRay, lightSample.dist,
+                  SkipTriangle(true, isect.meshID, isect.begin,
+                               isect.instanceID))) {
+    return false;
+  }
+
+  contribution = lightSample.contribution;
+  return true;
+}
+
 /// Samples an area light source for emitted light.
 vec3 sampleAreaLightEmission(
     const uint areaLightIndex, out Ray ray, out vec3 normal, out float pdfPos,
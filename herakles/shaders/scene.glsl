@@ -35,7 +35,8 @@ const uint BDPTStrategy = 1;
 
 const uint RenderingStrategy = PathTracingStrategy;
 const uint NumSamples = 1;
-const uint CameraPathLength = 4;
+// Set by the renderer, which also records the wavefront passes from it.
+layout(constant_id = 2) const uint CameraPathLength = 4;
 const uint LightPathLength = 1;  // Only useful for BDPT.
 
 const float EPSILON = 1e-7;
@@ -72,9 +73,15 @@ struct PinholeCamera {
  */
 struct AreaLight {
   vec3 emission;
+
+  /// ID of the mesh of the light, or of its sphere if AreaLightSphereBit is
+  /// set.
   uint meshID;
 };
 
+/// Bit of AreaLight.meshID set if the light is a sphere.
+const uint AreaLightSphereBit = 0x80000000u;
+
 /**
  * Represents a single spot light.
  */
@@ -129,8 +136,32 @@ struct Material {
   float eta;
 };
 
+/**
+ * Represents an analytic sphere. The center is stored as scalars so that the
+ * struct has the same 24 bytes layout as in the scene file.
+ */
+struct Sphere {
+  /// Center of the sphere.
+  float centerX, centerY, centerZ;
+
+  /// Radius of the sphere.
+  float radius;
+
+  /// Index of the material of this sphere.
+  uint materialID;
+
+  /// Index of the area light of this sphere. If < 0, the sphere doesn't emit
+  /// light.
+  int areaLightID;
+};
+
 /**
  * Represents a triangle in the BVH.
+ * If the BVH pairs triangles, it might also be a pair of triangles of the same
+ * mesh that share an edge: the triangle at begin and the one right after it.
+ * Pairs are marked in the high bits of meshID.
+ * If meshID is BVHSphereMeshID, it is a sphere instead, and begin is its index
+ * in the Spheres array.
  */
 struct BVHTriangle {
   /// ID of the triangle's mesh.
@@ -140,6 +171,48 @@ struct BVHTriangle {
   uint begin;
 };
 
+/// BVHTriangle.meshID of the spheres.
+const uint BVHSphereMeshID = 0x7FFFFFFFu;
+
+/// Bit of BVHTriangle.meshID set if the BVHTriangle is a pair of triangles.
+const uint BVHTrianglePairBit = 0x80000000u;
+
+/// Bits of BVHTriangle.meshID that store the mesh ID of a pair.
+const uint BVHTriangleMeshIDMask = 0x01FFFFFFu;
+
+/// Shift of the 6 bits of BVHTriangle.meshID that store, 2 bits for each
+/// vertex of the second triangle of a pair, which vertex of the pair it is: 0
+/// to 2 for the vertices it shares with the first triangle and 3 for the one
+/// it doesn't share.
+const uint BVHTrianglePairShift = 25u;
+
+/**
+ * A triangle gathered from the scene buffers, stored in the same order as the
+ * BVH triangles. Used instead of BVHTriangle if HERAKLES_PRECOMPUTED_TRIANGLES
+ * is defined, so that traversal reads each triangle with a single load
+ * instead of going through the indices and vertices.
+ */
+struct PrecomputedTriangle {
+  /// First vertex of the triangle.
+  vec3 v0;
+
+  /// ID of the triangle's mesh.
+  uint meshID;
+
+  /// Second vertex minus the first one.
+  vec3 edge1;
+
+  /// Beginning of the triangle's indices.
+  uint begin;
+
+  /// Third vertex minus the first one.
+  vec3 edge2;
+
+  /// Material ID of the mesh in the low 16 bits and its area light ID, as a
+  /// signed 16 bit integer, in the high 16 bits.
+  uint packedMaterialAndLight;
+};
+
 /**
  * Represents a single BVH node in the GPU.
  */
@@ -177,13 +250,104 @@ void unpackNumTrianglesAndAxis(const BVHNode node, out uint numTriangles,
 }
 
 /**
- * Represents an interaction with a triangle point.
+ * Represents an instance of a mesh in a two-level BVH. Used if
+ * HERAKLES_TWO_LEVEL_BVH is defined, where the leaves of the top-level BVH
+ * reference instances instead of triangles.
+ */
+struct BVHInstance {
+  /// Transforms world space rays into the space of the instanced mesh.
+  mat4 worldToObject;
+
+  /// Index of the root of the mesh's bottom-level BVH in the BVHNodes array.
+  uint rootNodeOffset;
+
+  /// Index of the instance in the scene file.
+  uint instanceID;
+};
+
+/// Value of BVH4Node.childOffsets for an unused child slot.
+const uint BVH4EmptyChild = 0xFFFFFFFFu;
+
+/**
+ * Represents a single node of a 4-wide BVH in the GPU. Used instead of
+ * BVHNode if HERAKLES_BVH4 is defined.
+ * The bounds of the four children are stored in the node, one axis per
+ * vector, so that they can be tested at once. Leaves are stored directly in
+ * their parent's child slots.
+ */
+struct BVH4Node {
+  /// Minimum and maximum points of the children's bounding boxes.
+  vec4 minX, minY, minZ;
+  vec4 maxX, maxY, maxZ;
+
+  /// For an internal child, the index of its node. For a leaf child, the
+  /// index to its first triangle in the triangles array. BVH4EmptyChild if
+  /// the slot is unused.
+  uvec4 childOffsets;
+
+  /// Number of triangles of each child. If 0, the child is an internal node.
+  uvec4 childNumTriangles;
+};
+
+/**
+ * A BVH4Node compressed to 64 bytes. Used instead of BVH4Node if
+ * HERAKLES_QUANTIZED_BVH4 is defined. Use dequantizeBVH4Node() to decode it.
+ * The children's bounds are 8-bit offsets from the origin in units of a power
+ * of two per axis, rounded outwards so that they contain the real bounds.
+ */
+struct QuantizedBVH4Node {
+  /// Minimum point of the union of the children's bounding boxes.
+  vec3 origin;
+
+  /// Exponent of the scale of each axis plus 127, 8 bits per axis.
+  uint exponents;
+
+  /// Quantized minimum points of the children, 8 bits per child.
+  uvec3 quantizedMin;
+
+  /// Number of triangles of children 0 and 1, 16 bits each.
+  uint packedNumTriangles01;
+
+  /// Quantized maximum points of the children, 8 bits per child.
+  uvec3 quantizedMax;
+
+  /// Number of triangles of children 2 and 3, 16 bits each.
+  uint packedNumTriangles23;
+
+  /// Same as BVH4Node.childOffsets.
+  uvec4 childOffsets;
+};
+
+#if defined(HERAKLES_TRIANGLE_PAIRS) && defined(HERAKLES_PRECOMPUTED_TRIANGLES)
+#error "Triangle pairs can't be precomputed."
+#endif
+
+#if defined(HERAKLES_SHORT_STACK_TRAVERSAL) && \
+    (defined(HERAKLES_BVH4) || defined(HERAKLES_QUANTIZED_BVH4) || \
+     defined(HERAKLES_TWO_LEVEL_BVH))
+#error "The short stack traversal only traverses single-level binary BVHs."
+#endif
+
+#if defined(HERAKLES_SHARED_BVH_NODES) && \
+    (defined(HERAKLES_BVH4) || defined(HERAKLES_QUANTIZED_BVH4) || \
+     defined(HERAKLES_TWO_LEVEL_BVH) || \
+     defined(HERAKLES_SHORT_STACK_TRAVERSAL))
+#error "Only the stack traversal of binary BVHs reads shared BVH nodes."
+#endif
+
+// The quantized BVH4 uses the BVH4 traversal.
+#ifdef HERAKLES_QUANTIZED_BVH4
+#define HERAKLES_BVH4
+#endif // HERAKLES_QUANTIZED_BVH4
+
+/**
+ * Represents an interaction with a triangle or sphere point.
  */
 struct Interaction {
   /// Interaction point.
   vec3 point;
 
-  /// Mesh ID.
+  /// Mesh ID, or BVHSphereMeshID for spheres.
   uint meshID;
 
   /// Oriented intersection normal.
@@ -193,12 +357,22 @@ struct Interaction {
   /// has already been inverted automatically.
   bool backface;
 
-  /// Triangle beginning.
+  /// Triangle beginning, or the index of the sphere.
   uint begin;
+
+  /// Material ID of the mesh.
+  uint materialID;
+
+  /// Area light ID of the mesh. If < 0, the mesh doesn't emit light.
+  int areaLightID;
+
+  /// BVHInstance.instanceID of the hit instance in a two-level BVH, or 0.
+  uint instanceID;
 };
 
 /**
- * Represents a triangle to be skipped.
+ * Represents a triangle to be skipped. A skipped sphere is only skipped near
+ * the ray origin, so that rays refracted into it still hit its other side.
  */
 struct SkipTriangle {
   /// If should be skipped.
@@ -209,8 +383,16 @@ struct SkipTriangle {
 
   /// Beginning of the triangle.
   uint begin;
+
+  /// Instance of the triangle in a two-level BVH, as every instance of a mesh
+  /// shares its triangles. 0 in single-level BVHs.
+  uint instanceID;
 };
 
+// Shaders that only need the scene structures, like the GPU BVH builder, can
+// define HERAKLES_SCENE_NO_BINDINGS to declare their own bindings.
+#ifndef HERAKLES_SCENE_NO_BINDINGS
+
 layout(binding = 0, rgba32f) uniform restrict image2D Image;
 layout(binding = 1, rg32ui) uniform restrict uimage2D Seeds;
 layout(binding = 2, std140) uniform UBO {
@@ -220,13 +402,29 @@ layout(binding = 2, std140) uniform UBO {
   uint FrameCount;
 };
 
+#if defined(HERAKLES_QUANTIZED_BVH4)
+layout(std430, binding = 3) buffer BVHNodeBuffer {
+  QuantizedBVH4Node QuantizedBVH4Nodes[];
+};
+#elif defined(HERAKLES_BVH4)
+layout(std430, binding = 3) buffer BVHNodeBuffer {
+  BVH4Node BVH4Nodes[];
+};
+#else
 layout(std430, binding = 3) buffer BVHNodeBuffer {
   BVHNode BVHNodes[];
 };
+#endif // HERAKLES_BVH4
 
+#ifdef HERAKLES_PRECOMPUTED_TRIANGLES
+layout(std430, binding = 4) buffer BVHTriangleBuffer {
+  PrecomputedTriangle PrecomputedTriangles[];
+};
+#else
 layout(std430, binding = 4) buffer BVHTriangleBuffer {
   BVHTriangle BVHTriangles[];
 };
+#endif // HERAKLES_PRECOMPUTED_TRIANGLES
 
 layout(std430, binding = 5) buffer AreaLightBuffer {
   AreaLight AreaLights[];
@@ -260,8 +458,14 @@ layout(std430, binding = 12) buffer UVBuffer {
   vec2 UVs[];
 };
 
-/* layout(std430, binding = 13) buffer TransformsBuffer { */
-/*   mat4 Transforms[]; */
-/* }; */
+layout(std430, binding = 13) buffer BVHInstanceBuffer {
+  BVHInstance BVHInstances[];
+};
+
+layout(std430, binding = 14) buffer SphereBuffer {
+  Sphere Spheres[];
+};
+
+#endif // !HERAKLES_SCENE_NO_BINDINGS
 
 #endif // !HERAKLES_SHADERS_SCENE_GLSL
@@ -0,0 +1,402 @@
+/*
+ * Copyright 2017 Renato Utsch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Wavefront path tracer. Instead of tracing each path from start to end in a
+ * single invocation, the paths advance one stage at a time, each stage in its
+ * own dispatch: generating the camera rays, extending the paths to their
+ * closest hits, shading the hits of each material type and tracing the shadow
+ * rays. The stages read the paths to process from queues written by the
+ * previous stages, so the invocations of a dispatch run the same code and the
+ * terminated paths take no invocations. Traces one sample per pixel.
+ *
+ * The queues can also be sorted before the stage that reads them, so that
+ * neighbouring invocations trace similar rays or shade the same material. The
+ * sort is a counting sort over NumWavefrontSortBins keys in four stages:
+ * counting the keys, turning the counts into offsets, scattering the items to
+ * their offsets and copying the sorted items back over the queue.
+ */
+
+#ifndef HERAKLES_SHADERS_WAVEFRONT_GLSL
+#define HERAKLES_SHADERS_WAVEFRONT_GLSL
+
+#include "extensions.glsl"
+#include "bsdf.glsl"
+#include "intersection.glsl"
+#include "lbvh.glsl"
+#include "random.glsl"
+#include "sampling.glsl"
+#include "scene.glsl"
+#include "utils.glsl"
+
+/// Number of invocations of the workgroups of every stage.
+const uint WavefrontGroupSize = 256;
+
+// Queues of paths. Must match renderer.cpp.
+const uint ExtensionQueue = 0;
+const uint MatteQueue = 1;
+const uint GlassQueue = 2;
+const uint MirrorQueue = 3;
+const uint ShadowQueue = 4;
+
+/**
+ * A queue of path indices. Starts with the VkDispatchIndirectCommand that runs
+ * a stage over the queue, whose number of workgroups grows as paths are
+ * pushed.
+ */
+struct WavefrontQueue {
+  uint numGroupsX;
+  uint numGroupsY;
+  uint numGroupsZ;
+
+  /// Number of paths in the queue.
+  uint size;
+};
+
+/// Number of distinct sort keys. Must match renderer.cpp.
+const uint NumWavefrontSortBins = 4096;
+
+// Fields of the paths, each an array of a vec4 per path. Must match
+// renderer.cpp.
+const uint RayOriginField = 0;           // xyz origin.
+const uint RayDirectionField = 1;        // xyz direction, w 1 if specular.
+const uint BetaField = 2;                // rgb path throughput.
+const uint ColorField = 3;               // rgb radiance.
+const uint HitPointField = 4;            // xyz point, w meshID bits.
+const uint HitNormalField = 5;           // xyz normal, w begin bits.
+const uint HitMaterialField = 6;         // Material, area light and backface.
+const uint ShadowOriginField = 7;        // xyz origin, w distance to light.
+const uint ShadowDirectionField = 8;     // xyz direction.
+const uint ShadowContributionField = 9;  // rgb unoccluded contribution.
+
+/// Queues of paths.
+layout(std430, binding = 15) buffer WavefrontQueueBuffer {
+  WavefrontQueue WavefrontQueues[];
+};
+
+/// Paths in each queue, the ones of queue q starting at q * numPaths.
+layout(std430, binding = 16) buffer WavefrontQueueItemBuffer {
+  uint WavefrontQueueItems[];
+};
+
+/// State of the paths, the field f of path p at f * numPaths + p.
+layout(std430, binding = 17) buffer WavefrontPathBuffer {
+  vec4 WavefrontPaths[];
+};
+
+/// Bins of the sort of a queue, followed by the key of each of its items at
+/// [0, numPaths) and by the sorted items at [numPaths, 2 * numPaths).
+layout(std430, binding = 18) buffer WavefrontSortBuffer {
+  uint WavefrontSortBins[NumWavefrontSortBins];
+  uint WavefrontSortData[];
+};
+
+/// Sums of the bins of each invocation of the sort scan.
+shared uint WavefrontSortSums[WavefrontGroupSize];
+
+/// Returns the number of paths, one per pixel.
+uint numWavefrontPaths() {
+  const ivec2 size = imageSize(Image);
+  return uint(size.x * size.y);
+}
+
+/// Returns the pixel of the path.
+ivec2 wavefrontPixel(const uint path) {
+  const uint width = uint(imageSize(Image).x);
+  return ivec2(path % width, path / width);
+}
+
+vec4 loadPathField(const uint field, const uint path) {
+  return WavefrontPaths[field * numWavefrontPaths() + path];
+}
+
+void storePathField(const uint field, const uint path, const vec4 value) {
+  WavefrontPaths[field * numWavefrontPaths() + path] = value;
+}
+
+/// Pushes the path to the queue, adding a workgroup to its dispatch if the
+/// last one is full.
+void pushToWavefrontQueue(const uint queue, const uint path) {
+  const uint index = atomicAdd(WavefrontQueues[queue].size, 1u);
+  if (index % WavefrontGroupSize == 0u) {
+    atomicAdd(WavefrontQueues[queue].numGroupsX, 1u);
+  }
+  WavefrontQueueItems[queue * numWavefrontPaths() + index] = path;
+}
+
+/// Reads the path of the given item of the queue. Returns false if the item
+/// is past the end of the queue, in the last workgroup.
+bool wavefrontQueueItem(const uint queue, const uint item, out uint path) {
+  if (item >= WavefrontQueues[queue].size) return false;
+  path = WavefrontQueueItems[queue * numWavefrontPaths() + item];
+  return true;
+}
+
+/// Returns the last hit of the path.
+Interaction loadPathHit(const uint path) {
+  const vec4 point = loadPathField(HitPointField, path);
+  const vec4 normal = loadPathField(HitNormalField, path);
+  const uvec4 material = floatBitsToUint(loadPathField(HitMaterialField, path));
+  return Interaction(point.xyz, floatBitsToUint(point.w), normal.xyz,
+                     material.z != 0u, floatBitsToUint(normal.w), material.x,
+                     int(material.y), material.w);
+}
+
+void storePathHit(const uint path, const Interaction isect) {
+  storePathField(HitPointField, path,
+                 vec4(isect.point, uintBitsToFloat(isect.meshID)));
+  storePathField(HitNormalField, path,
+                 vec4(isect.normal, uintBitsToFloat(isect.begin)));
+  const uvec4 material = uvec4(isect.materialID, uint(isect.areaLightID),
+                               isect.backface ? 1u : 0u, isect.instanceID);
+  storePathField(HitMaterialField, path, uintBitsToFloat(material));
+}
+
+/// Starts the path of the pixel with a camera ray, and queues its extension.
+void wavefrontGenerate(const uint path) {
+  if (path >= numWavefrontPaths()) return;
+  const ivec2 pixel = wavefrontPixel(path);
+  randInit(imageLoad(Seeds, pixel).xy);
+
+  const Ray ray = sampleCameraRay(vec2(pixel), vec2(imageSize(Image)));
+  storePathField(RayOriginField, path, vec4(ray.origin, 0.0f));
+  storePathField(RayDirectionField, path, vec4(ray.direction, 0.0f));
+  storePathField(BetaField, path, vec4(1.0f));
+  storePathField(ColorField, path, vec4(0.0f));
+
+  imageStore(Seeds, pixel, uvec4(randState(), 0, 0));
+  pushToWavefrontQueue(ExtensionQueue, path);
+}
+
+/// Finds the closest hit of the path's ray, and queues the path for the
+/// shading of the hit's material unless the path ends there.
+void wavefrontExtend(const uint item, const uint depth) {
+  uint path;
+  if (!wavefrontQueueItem(ExtensionQueue, item, path)) return;
+
+  const vec4 direction = loadPathField(RayDirectionField, path);
+  const Ray ray = Ray(loadPathField(RayOriginField, path).xyz, direction.xyz);
+  SkipTriangle skip = SkipTriangle(false, 0, 0, 0);
+  if (depth > 0) {
+    const Interaction lastHit = loadPathHit(path);
+    skip = SkipTriangle(true, lastHit.meshID, lastHit.begin,
+                        lastHit.instanceID);
+  }
+
+  const vec3 beta = loadPathField(BetaField, path).rgb;
+  vec3 color = loadPathField(ColorField, path).rgb;
+  Interaction isect;
+  if (!intersectsScene(ray, skip, isect)) {
+    // Poor man's excuse of an infinite area light.
+    if (HasAmbientLight) {
+      color += beta * AmbientLight;
+    } else {
+      color = vec3(0.0f);
+    }
+    storePathField(ColorField, path, vec4(color, 0.0f));
+    return;
+  }
+
+  // Surfaces only emit light if they're being looked at from the front.
+  const bool perfectlySpecularBounce = direction.w != 0.0f;
+  if ((depth == 0 || perfectlySpecularBounce) && !isect.backface &&
+      isect.areaLightID >= 0) {
+    color += beta * AreaLights[isect.areaLightID].emission;
+    storePathField(ColorField, path, vec4(color, 0.0f));
+    return;
+  }
+
+  storePathHit(path, isect);
+  const uint materialType = Materials[isect.materialID].type;
+  if (materialType == MatteMaterial) {
+    pushToWavefrontQueue(MatteQueue, path);
+  } else if (materialType == GlassMaterial) {
+    pushToWavefrontQueue(GlassQueue, path);
+  } else if (materialType == MirrorMaterial) {
+    pushToWavefrontQueue(MirrorQueue, path);
+  }
+}
+
+/**
+ * Samples the BSDF of the path's hit to get a new path direction, and queues
+ * the extension of the path and the shadow ray of a light sample.
+ * @param queue The material queue of the stage, which selects the BSDF.
+ */
+void wavefrontShade(const uint queue, const uint item, const uint depth) {
+  uint path;
+  if (!wavefrontQueueItem(queue, item, path)) return;
+  const ivec2 pixel = wavefrontPixel(path);
+  randInit(imageLoad(Seeds, pixel).xy);
+
+  const Interaction isect = loadPathHit(path);
+  const vec3 invWo = loadPathField(RayDirectionField, path).xyz;
+  const Material material = Materials[isect.materialID];
+  vec3 wi, f;
+  float pdf;
+  bool perfectlySpecularBounce;
+  if (queue == MatteQueue) {
+    f = sampleMatte(isect, material, invWo, wi, pdf, perfectlySpecularBounce);
+  } else if (queue == GlassQueue) {
+    f = sampleGlass(isect, material, invWo, wi, pdf, perfectlySpecularBounce);
+  } else {
+    f = sampleMirror(isect, material, invWo, wi, pdf, perfectlySpecularBounce);
+  }
+
+  const vec3 beta =
+      loadPathField(BetaField, path).rgb * f * absDot(wi, isect.normal) / pdf;
+  storePathField(BetaField, path, vec4(beta, 0.0f));
+
+  // Explicit light source sampling, whose shadow ray is traced by the shadow
+  // stage. Don't do this for perfectly specular BSDFs.
+  LightSample lightSample;
+  if (!perfectlySpecularBounce && sampleOneLight(isect, lightSample)) {
+    storePathField(ShadowOriginField, path,
+                   vec4(lightSample.shadowRay.origin, lightSample.dist));
+    storePathField(ShadowDirectionField, path,
+                   vec4(lightSample.shadowRay.direction, 0.0f));
+    storePathField(ShadowContributionField, path,
+                   vec4(beta * lightSample.contribution, 0.0f));
+    pushToWavefrontQueue(ShadowQueue, path);
+  }
+  imageStore(Seeds, pixel, uvec4(randState(), 0, 0));
+
+  storePathField(RayOriginField, path, vec4(isect.point, 0.0f));
+  storePathField(RayDirectionField, path,
+                 vec4(wi, perfectlySpecularBounce ? 1.0f : 0.0f));
+  if (depth + 1 < CameraPathLength) {
+    pushToWavefrontQueue(ExtensionQueue, path);
+  }
+}
+
+/// Adds the light sample of the path to its radiance if its shadow ray is
+/// unoccluded.
+void wavefrontShadow(const uint item) {
+  uint path;
+  if (!wavefrontQueueItem(ShadowQueue, item, path)) return;
+
+  const vec4 origin = loadPathField(ShadowOriginField, path);
+  const vec3 direction = loadPathField(ShadowDirectionField, path).xyz;
+  const Interaction isect = loadPathHit(path);
+  if (unoccluded(Ray(origin.xyz, direction), origin.w,
+                 SkipTriangle(true, isect.meshID, isect.begin,
+                              isect.instanceID))) {
+    const vec3 color = loadPathField(ColorField, path).rgb +
+                       loadPathField(ShadowContributionField, path).rgb;
+    storePathField(ColorField, path, vec4(color, 0.0f));
+  }
+}
+
+/**
+ * Returns the sort key of the path in the queue. The rays to extend and the
+ * shadow rays are keyed by the octant of their direction and then by the
+ * Morton code of their origin in the scene bounds, so that rays that start
+ * close to each other and go the same way traverse the same nodes. The hits
+ * to shade are keyed by their material.
+ */
+uint wavefrontSortKey(const uint queue, const uint path) {
+  if (queue != ExtensionQueue && queue != ShadowQueue) {
+    const uint materialID =
+        floatBitsToUint(loadPathField(HitMaterialField, path).x);
+    return materialID % NumWavefrontSortBins;
+  }
+
+  const bool isShadowRay = queue == ShadowQueue;
+  const vec3 origin =
+      loadPathField(isShadowRay ? ShadowOriginField : RayOriginField, path).xyz;
+  const vec3 direction =
+      loadPathField(isShadowRay ? ShadowDirectionField : RayDirectionField,
+                    path).xyz;
+  const uint octant = (direction.x < 0.0f ? 4u : 0u) |
+                      (direction.y < 0.0f ? 2u : 0u) |
+                      (direction.z < 0.0f ? 1u : 0u);
+  const vec3 minPoint = BVHNodes[0].minPoint;
+  const vec3 extent = max(BVHNodes[0].maxPoint - minPoint, vec3(1e-6f));
+
+  // The 9 highest bits of the Morton code, 3 per axis.
+  return (octant << 9) | (mortonCode((origin - minPoint) / extent) >> 21);
+}
+
+/// Counts the sort key of the item of the queue.
+void wavefrontSortKeys(const uint queue, const uint item) {
+  uint path;
+  if (!wavefrontQueueItem(queue, item, path)) return;
+
+  const uint key = wavefrontSortKey(queue, path);
+  WavefrontSortData[item] = key;
+  atomicAdd(WavefrontSortBins[key], 1u);
+}
+
+/**
+ * Replaces the count of each sort bin by the offset of its first item, with an
+ * exclusive prefix sum. Must run in a single workgroup.
+ */
+void wavefrontSortScan(const uint invocation) {
+  const uint binsPerInvocation = NumWavefrontSortBins / WavefrontGroupSize;
+  const uint firstBin = invocation * binsPerInvocation;
+  uint sum = 0u;
+  for (uint i = 0u; i < binsPerInvocation; ++i) {
+    sum += WavefrontSortBins[firstBin + i];
+  }
+
+  // Inclusive scan of the sums of the invocations.
+  WavefrontSortSums[invocation] = sum;
+  barrier();
+  for (uint offset = 1u; offset < WavefrontGroupSize; offset <<= 1u) {
+    const uint previous =
+        invocation >= offset ? WavefrontSortSums[invocation - offset] : 0u;
+    barrier();
+    WavefrontSortSums[invocation] += previous;
+    barrier();
+  }
+
+  uint binOffset = WavefrontSortSums[invocation] - sum;
+  for (uint i = 0u; i < binsPerInvocation; ++i) {
+    const uint count = WavefrontSortBins[firstBin + i];
+    WavefrontSortBins[firstBin + i] = binOffset;
+    binOffset += count;
+  }
+}
+
+/// Moves the item of the queue to the next free slot of its sort bin. The
+/// order of the items of a bin is arbitrary.
+void wavefrontSortScatter(const uint queue, const uint item) {
+  uint path;
+  if (!wavefrontQueueItem(queue, item, path)) return;
+
+  const uint slot = atomicAdd(WavefrontSortBins[WavefrontSortData[item]], 1u);
+  WavefrontSortData[numWavefrontPaths() + slot] = path;
+}
+
+/// Copies the sorted item back over the item of the queue. Dispatched over the
+/// queue, so only its items are copied.
+void wavefrontSortCopy(const uint queue, const uint item) {
+  if (item >= WavefrontQueues[queue].size) return;
+  WavefrontQueueItems[queue * numWavefrontPaths() + item] =
+      WavefrontSortData[numWavefrontPaths() + item];
+}
+
+/// Writes the radiance of the path to its pixel.
+void wavefrontWrite(const uint path) {
+  if (path >= numWavefrontPaths()) return;
+
+  // gamma correction.
+  const vec3 color =
+      pow(loadPathField(ColorField, path).rgb, vec3(1.0f / 2.2f));
+  imageStore(Image, wavefrontPixel(path),
+             vec4(clamp(color, 0.0f, 1.0f), 1.0f));
+}
+
+#endif // !HERAKLES_SHADERS_WAVEFRONT_GLSL
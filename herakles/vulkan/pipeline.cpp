@@ -22,7 +22,8 @@ namespace hk {
 
 Pipeline::Pipeline(const Device &device, const Shader &shader,
                    const DescriptorSetLayout &descriptorSetLayout,
-                   const vk::PushConstantRange &pushConstantRange) {
+                   const vk::PushConstantRange &pushConstantRange,
+                   const std::vector<uint32_t> &specializationConstants) {
   vk::PipelineLayoutCreateInfo layoutCreateInfo;
   layoutCreateInfo.setSetLayoutCount(1).setPSetLayouts(
       &descriptorSetLayout.vkDescriptorSetLayout());
@@ -35,9 +36,22 @@ Pipeline::Pipeline(const Device &device, const Shader &shader,
   pipelineLayout_ =
       device.vkDevice().createPipelineLayoutUnique(layoutCreateInfo);
 
+  std::vector<vk::SpecializationMapEntry> mapEntries;
+  for (uint32_t i = 0; i < specializationConstants.size(); ++i) {
+    mapEntries.emplace_back(i, i * sizeof(uint32_t), sizeof(uint32_t));
+  }
+  const vk::SpecializationInfo specializationInfo(
+      mapEntries.size(), mapEntries.data(),
+      specializationConstants.size() * sizeof(uint32_t),
+      specializationConstants.data());
+
+  auto stage = shader.pipelineShaderStageCreateInfo();
+  if (!specializationConstants.empty()) {
+    stage.setPSpecializationInfo(&specializationInfo);
+  }
+
   vk::ComputePipelineCreateInfo pipelineCreateInfo;
-  pipelineCreateInfo.setStage(shader.pipelineShaderStageCreateInfo())
-      .setLayout(*pipelineLayout_);
+  pipelineCreateInfo.setStage(stage).setLayout(*pipelineLayout_);
 
   pipeline_ = device.vkDevice().createComputePipelineUnique(nullptr,
                                                             pipelineCreateInfo);
@@ -40,10 +40,14 @@ class Pipeline {
    *   TODO(renatoutsch): extend this to support multiple descriptor set
    *     layouts.
    *   TODO(renatoutsch): extend this to support multiple push constants.
+   * @param specializationConstants Values of the uint specialization
+   *   constants of the shader, where the value at index i is the one of
+   *   constant_id i. Constants the shader doesn't declare are ignored.
    */
   Pipeline(const Device &device, const Shader &shader,
            const DescriptorSetLayout &descriptorSetLayout,
-           const vk::PushConstantRange &pushConstantRange = {});
+           const vk::PushConstantRange &pushConstantRange = {},
+           const std::vector<uint32_t> &specializationConstants = {});
 
   /// Returns the vulkan pipeline layout.
   const vk::PipelineLayout &vkPipelineLayout() const {
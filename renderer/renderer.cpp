@@ -21,10 +21,13 @@
 #include <cstdint>
 #include <cstdlib>
 #include <fstream>
+#include <functional>
+#include <future>
 #include <iostream>
 #include <limits>
 #include <memory>
 #include <random>
+#include <sstream>
 #include <string>
 #include <vector>
 
@@ -34,7 +37,14 @@
 #include <vulkan/vulkan.hpp>
 
 #include "herakles/scene/bvh.hpp"
+#include "herakles/scene/bvh_cache.hpp"
+#include "herakles/scene/bvh_refit.hpp"
+#include "herakles/scene/bvh_traversal.hpp"
 #include "herakles/scene/camera.hpp"
+#include "herakles/scene/gpu_bvh_builder.hpp"
+#include "herakles/scene/precomputed_triangles.hpp"
+#include "herakles/scene/two_level_bvh.hpp"
+#include "herakles/scene/wide_bvh.hpp"
 #include "herakles/scene/scene_generated.h"
 #include "herakles/vulkan/allocator.hpp"
 #include "herakles/vulkan/buffer.hpp"
@@ -51,6 +61,14 @@
 #include "herakles/vulkan/surface_provider.hpp"
 #include "herakles/vulkan/swapchain.hpp"
 
+/// If the renderer is built without NDEBUG, in which case it validates the
+/// BVHs built on the GPU by default.
+#ifdef NDEBUG
+constexpr bool IsDebugBuild = false;
+#else
+constexpr bool IsDebugBuild = true;
+#endif
+
 // TODO(renatoutsch): validate these flags.
 DEFINE_string(output_file, "",
               "Output file of the rendered surface. Will replace any "
@@ -59,7 +77,10 @@ DEFINE_string(
     surface_type, "windowed",
     "Surface type. One of \"windowed\",\"fullscreen\" and \"headless\".");
 DEFINE_string(scene_file, "", "Binary .hks scene file to be rendered.");
-DEFINE_string(shader_file, "", "Shader binary to be executed.");
+DEFINE_string(shader_file, "",
+              "Shader binary to be executed. The main*.comp render shaders "
+              "must be the one of the BVH flags, such as main_bvh4 for "
+              "bvh_width 4.");
 DEFINE_string(shader_entry_point, "main", "Entry point of the shader binary.");
 DEFINE_int32(width, 800, "Width resolution of the surface.");
 DEFINE_int32(height, 600, "Height resolution of the surface.");
@@ -67,11 +88,210 @@ DEFINE_bool(enable_validation_layers, false,
             "If is to enable validation layers when running the program.");
 DEFINE_bool(unlock_camera, false,
             "If is to unlock the camera and allow movement.");
+DEFINE_int32(bvh_build_threads, 0,
+             "Number of threads used to build the BVH. If 0, uses the number "
+             "of hardware threads.");
+DEFINE_string(bvh_build_method, "sah",
+              "Algorithm used to build the BVH. One of \"sah\", \"lbvh\", "
+              "\"hlbvh\" and \"sbvh\".");
+DEFINE_int32(bvh_buckets, 12,
+             "Number of SAH buckets per axis used to build the BVH.");
+DEFINE_int32(bvh_max_triangles_in_node, 1,
+             "Maximum number of triangles in the BVH leaves built with the SAH "
+             "when a leaf is cheaper than a split.");
+DEFINE_double(bvh_intersection_cost, 1.0,
+              "Cost of intersecting a triangle in the SAH cost model.");
+DEFINE_double(bvh_traversal_cost, 1.0,
+              "Cost of traversing a BVH node in the SAH cost model.");
+DEFINE_double(bvh_spatial_split_budget, 0.3,
+              "Maximum number of triangle references added by the spatial "
+              "splits of the sbvh build method, relative to the number of "
+              "triangles.");
+DEFINE_int32(bvh_treelet_optimization_passes, 0,
+             "Number of treelet restructuring passes run over the built BVH "
+             "to reduce its SAH cost. 0 disables the optimization.");
+DEFINE_string(bvh_node_layout, "depth_first",
+              "Order of the BVH nodes in memory. One of \"depth_first\" and "
+              "\"clustered\". The fastest one depends on the scene, and "
+              "tune_bvh_output_file measures both.");
+DEFINE_string(bvh_cache_file, "",
+              "If set, the .hksbvh file where the BVH of the scene is cached. "
+              "The BVH is loaded from it if it was built for the same scene "
+              "geometry and BVH flags, and otherwise built and written to it.");
+DEFINE_string(bvh_mesh_cache_dir, "",
+              "If set, an existing directory where the BVH of each mesh is "
+              "cached by the hash of its geometry, so that only the meshes "
+              "that changed are rebuilt. The scene is then rendered with a "
+              "two-level BVH even if it has no instances, and must be used "
+              "with the main_instanced shader.");
+DEFINE_int32(bvh_width, 2,
+             "Number of children of each BVH node. One of 2 and 4. A width of "
+             "4 must be used with the main_bvh4 shader.");
+DEFINE_bool(quantize_bvh, false,
+            "If is to quantize the BVH nodes to half their size. Requires "
+            "bvh_width 4 and must be used with the main_qbvh4 shader.");
+DEFINE_bool(bvh_pair_triangles, false,
+            "If is to pair the consecutive triangles of each mesh that share "
+            "an edge into a single BVH triangle, which roughly halves the BVH "
+            "triangles of quad meshes. The SBVH is built with the SAH "
+            "instead. Must be used with the main_pairs shader.");
+DEFINE_bool(precompute_bvh_triangles, false,
+            "If is to store the vertices, material and area light of the BVH "
+            "triangles in BVH order, so that traversal doesn't go through the "
+            "indices and vertices. The triangle buffer becomes 6 times "
+            "bigger. Must be used with the main_precomputed shader.");
+DEFINE_string(gpu_bvh_shader_file, "",
+              "If set, the BVH is built on the GPU with this lbvh.comp shader "
+              "binary instead of on the CPU.");
+DEFINE_bool(validate_gpu_bvh, IsDebugBuild,
+            "If is to validate the BVH built on the GPU against the one built "
+            "on the CPU by tracing random rays through both, and warn about "
+            "the rays with a different closest hit. Enabled by default in "
+            "builds without NDEBUG.");
+DEFINE_bool(fail_gpu_bvh_validation, false,
+            "If validate_gpu_bvh aborts when any ray has a different closest "
+            "hit, instead of only warning.");
+DEFINE_string(tune_bvh_output_file, "",
+              "If set, instead of rendering, measures the GPU frame time of "
+              "the scene with BVHs built with different leaf sizes, buckets, "
+              "costs and node layouts, and writes the flags of the fastest one "
+              "to this file. The file can be read back with --flagfile.");
+DEFINE_int32(tune_bvh_frames, 16,
+             "Number of frames rendered to measure each BVH when tuning.");
+DEFINE_bool(progressive_bvh, false,
+            "If is to start rendering with a quickly built LBVH while the BVH "
+            "of the other BVH flags is built in the background, and to swap "
+            "to it between frames once it is built.");
+DEFINE_string(wavefront_shader_file, "",
+              "If set, renders with the wavefront path tracer of this "
+              "wavefront.comp shader binary instead of with the shader_file, "
+              "which advances the paths with a dispatch per stage over queues "
+              "of the paths that reach it. Requires a single-level binary "
+              "BVH, without bvh_pair_triangles or precompute_bvh_triangles.");
+DEFINE_bool(wavefront_sort_rays, false,
+            "If the wavefront path tracer sorts the secondary and shadow rays "
+            "by direction octant and origin Morton code before tracing them.");
+DEFINE_bool(wavefront_sort_hits, false,
+            "If the wavefront path tracer sorts the hits of each material "
+            "queue by material before shading them.");
+DEFINE_string(persistent_shader_file, "",
+              "If set, renders with this persistent threads shader binary, "
+              "such as main_persistent.comp, instead of with the shader_file. "
+              "Its threads take the pixels from a global counter and start a "
+              "new path as soon as their path ends. Requires a single-level "
+              "binary BVH, without bvh_pair_triangles or "
+              "precompute_bvh_triangles.");
+DEFINE_int32(persistent_workgroups, 256,
+             "Number of workgroups of the persistent_shader_file, which should "
+             "be enough to fill the device.");
+DEFINE_int32(bvh_shared_memory_levels, 0,
+             "Maximum number of top BVH levels the main_shared_nodes shader "
+             "caches in the shared memory of each workgroup. If 0, caches as "
+             "many levels as fit in the shared memory limit of the device.");
+DEFINE_string(benchmark_shader_files, "",
+              "If set, instead of rendering, measures the GPU frame time of "
+              "the shader_file, of each of these comma separated shader "
+              "binaries, which must use the same BVH flags, and of the "
+              "wavefront_shader_file and persistent_shader_file, if any, and "
+              "logs how much faster each one is than the shader_file.");
+DEFINE_int32(benchmark_frames, 16,
+             "Number of frames rendered to measure each benchmarked shader.");
+DEFINE_bool(benchmark_bvh, false,
+            "If is to log how fast a single CPU thread traverses the BVH with "
+            "random rays at startup, for each traversal the BVH supports. "
+            "Compares BVH layouts, but doesn't measure the device.");
 
 namespace {
 const char *RendererName = "Herakles Renderer";
 const uint32_t RendererVersion = VK_MAKE_VERSION(0, 0, 0);
 
+// Stages of the wavefront path tracer, in the order of their pipelines. Must
+// match wavefront.comp.
+constexpr uint32_t GenerateStage = 0;
+constexpr uint32_t ExtendStage = 1;
+constexpr uint32_t ShadeMatteStage = 2;
+constexpr uint32_t ShadeGlassStage = 3;
+constexpr uint32_t ShadeMirrorStage = 4;
+constexpr uint32_t ShadowStage = 5;
+constexpr uint32_t WriteStage = 6;
+constexpr uint32_t SortKeysStage = 7;
+constexpr uint32_t SortScanStage = 8;
+constexpr uint32_t SortScatterStage = 9;
+constexpr uint32_t SortCopyStage = 10;
+constexpr uint32_t NumWavefrontStages = 11;
+
+// Queues of paths of the wavefront path tracer. Must match wavefront.glsl.
+constexpr uint32_t ExtensionQueue = 0;
+constexpr uint32_t MatteQueue = 1;
+constexpr uint32_t GlassQueue = 2;
+constexpr uint32_t MirrorQueue = 3;
+constexpr uint32_t ShadowQueue = 4;
+constexpr uint32_t NumWavefrontQueues = 5;
+
+/// Number of vec4 fields of each path of the wavefront path tracer. Must match
+/// wavefront.glsl.
+constexpr uint32_t NumWavefrontPathFields = 10;
+
+/// Local size of wavefront.comp.
+constexpr uint32_t WavefrontGroupSize = 256;
+
+/// Number of distinct keys of the wavefront queue sort. Must match
+/// wavefront.glsl.
+constexpr uint32_t NumWavefrontSortBins = 4096;
+
+/// Number of bounces of the camera paths. Every render pipeline gets it as the
+/// CameraPathLength specialization constant of scene.glsl, and the wavefront
+/// path tracer records a round of stages per bounce.
+constexpr uint32_t CameraPathLength = 4;
+
+/// A queue of paths of the wavefront path tracer, starting with the indirect
+/// dispatch over it. Has the layout of WavefrontQueue in wavefront.glsl.
+struct WavefrontQueue {
+  uint32_t numGroupsX = 0;
+  uint32_t numGroupsY = 1;
+  uint32_t numGroupsZ = 1;
+  uint32_t size = 0;
+};
+
+/// Local size of main_persistent.comp.
+constexpr uint32_t PersistentGroupSize = 256;
+
+/// BVH a render shader binary of renderer/shaders traverses, which depends on
+/// the defines of its main*.comp source.
+struct RenderShaderBVH {
+  /// Name of the shader binary, without its directory and extension.
+  const char *name;
+
+  int width;
+  bool quantized;
+  bool twoLevel;
+  bool trianglePairs;
+  bool precomputedTriangles;
+};
+
+/// BVHs of the render shaders of renderer/shaders. Must match their defines.
+constexpr RenderShaderBVH RenderShaderBVHs[] = {
+    {"main", 2, false, false, false, false},
+    {"main_bvh4", 4, false, false, false, false},
+    {"main_qbvh4", 4, true, false, false, false},
+    {"main_instanced", 2, false, true, false, false},
+    {"main_pairs", 2, false, false, true, false},
+    {"main_precomputed", 2, false, false, false, true},
+    {"main_persistent", 2, false, false, false, false},
+    {"main_shared_nodes", 2, false, false, false, false},
+    {"main_short_stack", 2, false, false, false, false},
+};
+
+/// Push constants of wavefront.comp.
+struct WavefrontConstants {
+  uint32_t depth;
+  uint32_t queue;
+};
+
+static_assert(sizeof(WavefrontQueue) == sizeof(vk::DispatchIndirectCommand) +
+                                            sizeof(uint32_t),
+              "WavefrontQueue must start with a VkDispatchIndirectCommand");
+
 struct UniformBufferObject {
   hk::PinholeCamera camera;
   glm::vec3 ambientLight;
@@ -86,6 +306,13 @@ struct UniformBufferObject {
         hasAmbientLight(hasAmbientLight ? 1 : 0) {}
 };
 
+/// BVH built in the background by the progressive BVH mode, in every layout.
+struct RefinedBVH {
+  hk::BVHData bvh;
+  hk::BVH4Data bvh4;
+  hk::QuantizedBVH4Data quantizedBVH4;
+};
+
 std::vector<uint8_t> readFile(const std::string &filename) {
   std::ifstream file(filename, std::ios::binary | std::ios::ate);
   CHECK(file.is_open()) << "Couldn't open input scene file.";
@@ -118,13 +345,12 @@ class Renderer {
                   surfaceProvider_),
         surface_(surfaceProvider_, instance_, appName, width, height,
                  fullscreen),
-        pipeline_(device_,
-                  hk::Shader(shaderFilename, shaderEntryPoint, device_),
-                  descriptorSetLayout_),
+        pipeline_(createPipeline_(shaderFilename, shaderEntryPoint)),
         ubo_(scene_->camera(), scene_->hasAmbientLight(),
              scene_->ambientLight()) {
     logSceneStats_();
     initializeGPUData_();
+    if (refinesBVH_()) startBVHRefinement_();
     LOG(INFO) << "Renderer initialized";
   }
 
@@ -137,11 +363,113 @@ class Renderer {
       updateFPS_();
       updateUBO_();
       drawFrame_();
+      if (refinesBVH_() && !rendersRefinedBVH_) swapToRefinedBVHIfBuilt_();
     }
 
     device_.vkComputeQueue().waitIdle();
   }
 
+  /**
+   * Renders the scene with BVHs built with every combination of the tuned
+   * build options, and then with the fastest tree in every node layout. Writes
+   * the flags of the BVH with the smallest GPU frame time to the given file.
+   * The other BVH flags are kept as is.
+   */
+  void tuneBVH(const std::string &outputFilename) {
+    updateUBO_();
+
+    hk::BVHBuildOptions bestOptions;
+    double bestFrameTime = std::numeric_limits<double>::infinity();
+    for (size_t maxTrianglesInNode : {1, 2, 4, 8}) {
+      for (size_t numBuckets : {8, 12, 16, 32}) {
+        for (float traversalCost : {0.5f, 1.0f, 2.0f, 4.0f}) {
+          auto options = bvhBuildOptions_();
+          options.maxTrianglesInNode = maxTrianglesInNode;
+          options.numBuckets = numBuckets;
+          options.intersectionCost = 1.0f;
+          options.traversalCost = traversalCost;
+          rebuildBVH_(options);
+
+          const double frameTime =
+              gpuFrameTime_(frameRecorder_(), FLAGS_tune_bvh_frames);
+          LOG(INFO) << "maxTrianglesInNode " << maxTrianglesInNode
+                    << ", numBuckets " << numBuckets << ", traversalCost "
+                    << traversalCost << ": " << bvhData_.nodes.size()
+                    << " nodes, " << frameTime << "ms/frame";
+          if (frameTime < bestFrameTime) {
+            bestOptions = options;
+            bestFrameTime = frameTime;
+          }
+        }
+      }
+    }
+
+    // The layout doesn't change the tree, so it is measured only with the
+    // fastest tree.
+    const auto bestTreeOptions = bestOptions;
+    for (const auto layout : {hk::BVHNodeLayout::DepthFirst,
+                              hk::BVHNodeLayout::Clustered}) {
+      if (layout == bestTreeOptions.nodeLayout) continue;
+      auto options = bestTreeOptions;
+      options.nodeLayout = layout;
+      rebuildBVH_(options);
+
+      const double frameTime =
+          gpuFrameTime_(frameRecorder_(), FLAGS_tune_bvh_frames);
+      LOG(INFO) << "bvh_node_layout " << nodeLayoutName_(layout) << ": "
+                << frameTime << "ms/frame";
+      if (frameTime < bestFrameTime) {
+        bestOptions = options;
+        bestFrameTime = frameTime;
+      }
+    }
+
+    std::ofstream file(outputFilename);
+    CHECK(file.is_open()) << "Couldn't open the BVH tuning output file.";
+    file << "--bvh_max_triangles_in_node=" << bestOptions.maxTrianglesInNode
+         << "\n--bvh_buckets=" << bestOptions.numBuckets
+         << "\n--bvh_intersection_cost=" << bestOptions.intersectionCost
+         << "\n--bvh_traversal_cost=" << bestOptions.traversalCost
+         << "\n--bvh_node_layout=" << nodeLayoutName_(bestOptions.nodeLayout)
+         << "\n";
+    CHECK(file) << "Couldn't write the BVH tuning output file.";
+    LOG(INFO) << "Fastest BVH renders in " << bestFrameTime
+              << "ms/frame, written to " << outputFilename;
+  }
+
+  /**
+   * Renders the scene with the shader_file, then with each of the given
+   * shader binaries and then with the wavefront path tracer and the persistent
+   * threads, if enabled, and logs their GPU frame times. The shaders must read
+   * the buffers built by the current flags.
+   */
+  void benchmarkShaders(const std::vector<std::string> &shaderFilenames) {
+    updateUBO_();
+
+    const double baseFrameTime =
+        gpuFrameTime_(megakernelRecorder_(pipeline_), FLAGS_benchmark_frames);
+    LOG(INFO) << FLAGS_shader_file << ": " << baseFrameTime << "ms/frame";
+    const auto logFrameTime = [&](const std::string &name,
+                                  const FrameRecorder &recordFrame) {
+      const double frameTime =
+          gpuFrameTime_(recordFrame, FLAGS_benchmark_frames);
+      LOG(INFO) << name << ": " << frameTime << "ms/frame, "
+                << baseFrameTime / frameTime << "x the speed of "
+                << FLAGS_shader_file;
+    };
+    for (const auto &shaderFilename : shaderFilenames) {
+      const hk::Pipeline pipeline =
+          createPipeline_(shaderFilename, FLAGS_shader_entry_point);
+      logFrameTime(shaderFilename, megakernelRecorder_(pipeline));
+    }
+    if (rendersWavefront_()) {
+      logFrameTime(FLAGS_wavefront_shader_file, frameRecorder_());
+    }
+    if (rendersPersistent_()) {
+      logFrameTime(FLAGS_persistent_shader_file, frameRecorder_());
+    }
+  }
+
  private:
   void updateDeltaTime_() {
     static auto lastTime = timer_.now();
@@ -221,13 +549,16 @@ class Renderer {
     const auto &imageIndex = result.value;
     ensureSwapchainImageInitialized_(imageIndex);
 
-    computeQueue.submit(1, &swapchainSubmitInfos_[imageIndex], nullptr);
+    const auto &submitInfos = rendersRefinedBVH_
+                                  ? refinedSwapchainSubmitInfos_
+                                  : swapchainSubmitInfos_;
+    computeQueue.submit(1, &submitInfos[imageIndex], nullptr);
 
     swapchain_.presentImage(imageIndex, 1, &*renderFinishedSemaphore_);
   }
 
   hk::DescriptorSetLayout createDescriptorSetLayout_() {
-    const size_t numBindings = 13;
+    const size_t numBindings = 20;
     std::vector<vk::DescriptorSetLayoutBinding> bindings(numBindings);
     bindings[0]
         .setBinding(0)
@@ -252,9 +583,340 @@ class Renderer {
     return hk::DescriptorSetLayout(device_, bindings);
   }
 
+  /// Creates the pipeline of a render shader binary, with the specialization
+  /// constants of renderConstants_().
+  hk::Pipeline createPipeline_(const std::string &shaderFilename,
+                               const std::string &shaderEntryPoint) const {
+    checkShaderBVH_(shaderFilename);
+    return hk::Pipeline(device_,
+                        hk::Shader(shaderFilename, shaderEntryPoint, device_),
+                        descriptorSetLayout_, {}, renderConstants_());
+  }
+
+  /// Dies if the shader binary is a render shader of renderer/shaders that
+  /// traverses another BVH than the one of the flags, whose buffers it would
+  /// misread. Shaders with other names, such as smallpt, aren't checked.
+  void checkShaderBVH_(const std::string &shaderFilename) const {
+    std::string name =
+        shaderFilename.substr(shaderFilename.find_last_of('/') + 1);
+    name = name.substr(0, name.find('.'));
+    for (const auto &bvh : RenderShaderBVHs) {
+      if (name != bvh.name) continue;
+      if (bvh.width != bvhWidth_() || bvh.quantized != quantizesBVH_() ||
+          bvh.twoLevel != usesTwoLevelBVH_() ||
+          bvh.trianglePairs != pairsTriangles_() ||
+          bvh.precomputedTriangles != precomputesTriangles_()) {
+        LOG(FATAL) << shaderFilename << " requires bvh_width " << bvh.width
+                   << (bvh.quantized ? ", quantize_bvh" : "")
+                   << (bvh.twoLevel ? ", a two-level BVH"
+                                    : ", a single-level BVH")
+                   << (bvh.trianglePairs ? ", bvh_pair_triangles" : "")
+                   << (bvh.precomputedTriangles ? ", precompute_bvh_triangles"
+                                                : "")
+                   << " and no other BVH flags.";
+      }
+      return;
+    }
+    VLOG(1) << "Not checking the BVH flags of " << shaderFilename;
+  }
+
+  /// Returns the specialization constants of the render shaders, by
+  /// constant_id: the number of BVH levels cached in shared memory, the
+  /// wavefront stage and the camera path length. Shaders ignore the ones they
+  /// don't declare.
+  std::vector<uint32_t> renderConstants_(uint32_t wavefrontStage = 0) const {
+    return {sharedBVHLevels_(), wavefrontStage, CameraPathLength};
+  }
+
+  /// Returns how many top BVH levels the main_shared_nodes shader caches in
+  /// shared memory: as many as fit in the device's shared memory limit, up to
+  /// bvh_shared_memory_levels. Each cached level l takes 2^l node slots, and
+  /// the shader also keeps the node index of every slot and of the slots of
+  /// the level below.
+  uint32_t sharedBVHLevels_() const {
+    CHECK_GE(FLAGS_bvh_shared_memory_levels, 0)
+        << "bvh_shared_memory_levels can't be negative.";
+    const auto sharedMemorySize = [](uint32_t levels) {
+      const size_t numSlots = (size_t(1) << levels) - 1;
+      return numSlots * sizeof(hk::BVHNode) +
+             (2 * numSlots + 1) * sizeof(uint32_t);
+    };
+    const size_t limit = physicalDevice_.vkPhysicalDeviceProperties()
+                             .limits.maxComputeSharedMemorySize;
+    const uint32_t maxLevels = FLAGS_bvh_shared_memory_levels
+                                   ? FLAGS_bvh_shared_memory_levels
+                                   : 16;
+    uint32_t levels = 1;
+    while (levels < maxLevels && sharedMemorySize(levels + 1) <= limit) {
+      ++levels;
+    }
+    VLOG(1) << "Shared memory BVH cache of " << levels << " levels ("
+            << sharedMemorySize(levels) << " of " << limit << " bytes)";
+    return levels;
+  }
+
+  /// Creates a pipeline for each stage of the wavefront path tracer, if it
+  /// renders the frames.
+  std::vector<hk::Pipeline> createWavefrontPipelines_() const {
+    std::vector<hk::Pipeline> pipelines;
+    if (!rendersWavefront_()) return pipelines;
+
+    const hk::Shader shader(FLAGS_wavefront_shader_file,
+                            FLAGS_shader_entry_point, device_);
+    const vk::PushConstantRange constantRange(
+        vk::ShaderStageFlagBits::eCompute, 0, sizeof(WavefrontConstants));
+    pipelines.reserve(NumWavefrontStages);
+    for (uint32_t stage = 0; stage < NumWavefrontStages; ++stage) {
+      pipelines.emplace_back(device_, shader, descriptorSetLayout_,
+                             constantRange, renderConstants_(stage));
+    }
+    return pipelines;
+  }
+
+  /// Creates the pipeline of the persistent_shader_file, if it renders the
+  /// frames.
+  std::unique_ptr<hk::Pipeline> createPersistentPipeline_() const {
+    if (!rendersPersistent_()) return nullptr;
+    return std::make_unique<hk::Pipeline>(createPipeline_(
+        FLAGS_persistent_shader_file, FLAGS_shader_entry_point));
+  }
+
+  /// Records the commands that render a frame into frameImage_, which must be
+  /// in the general layout.
+  using FrameRecorder = std::function<void(const vk::CommandBuffer &)>;
+
+  /// Returns the recorder of a frame rendered with the given megakernel
+  /// pipeline and the frame descriptor set.
+  FrameRecorder megakernelRecorder_(const hk::Pipeline &pipeline) {
+    return [this, &pipeline](const vk::CommandBuffer &commandBuffer) {
+      recordRender_(commandBuffer, pipeline, frameDescriptorSet_);
+    };
+  }
+
+  /// Returns the recorder of a frame rendered as the flags say, with the frame
+  /// descriptor set.
+  FrameRecorder frameRecorder_() {
+    return [this](const vk::CommandBuffer &commandBuffer) {
+      recordFrame_(commandBuffer, frameDescriptorSet_);
+    };
+  }
+
+  /// Records the rendering of a frame into frameImage_, which must be in the
+  /// general layout, with the wavefront path tracer or the persistent threads
+  /// if they are enabled or with the shader_file otherwise.
+  void recordFrame_(const vk::CommandBuffer &commandBuffer,
+                    const hk::DescriptorSet &descriptorSet) {
+    if (rendersWavefront_()) {
+      recordWavefront_(commandBuffer, descriptorSet);
+    } else if (rendersPersistent_()) {
+      recordPersistent_(commandBuffer, descriptorSet);
+    } else {
+      recordRender_(commandBuffer, pipeline_, descriptorSet);
+    }
+  }
+
+  /// Makes the writes of the previous dispatches and transfers visible to the
+  /// next ones, including to their indirect dispatches.
+  static void computeBarrier_(const vk::CommandBuffer &commandBuffer) {
+    const vk::MemoryBarrier barrier(
+        vk::AccessFlagBits::eShaderWrite | vk::AccessFlagBits::eTransferWrite,
+        vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite |
+            vk::AccessFlagBits::eIndirectCommandRead |
+            vk::AccessFlagBits::eTransferWrite);
+    const auto stages = vk::PipelineStageFlagBits::eComputeShader |
+                        vk::PipelineStageFlagBits::eDrawIndirect |
+                        vk::PipelineStageFlagBits::eTransfer;
+    commandBuffer.pipelineBarrier(stages, stages, {}, 1, &barrier, 0, nullptr,
+                                  0, nullptr);
+  }
+
+  /// Records the stages of the wavefront path tracer that render a frame into
+  /// frameImage_, which must be in the general layout. Every bounce runs each
+  /// stage once with an indirect dispatch over its queue, so the stages no
+  /// path reaches dispatch no workgroups. The queues are sorted before the
+  /// stages that read them if the wavefront sort flags say so.
+  void recordWavefront_(const vk::CommandBuffer &commandBuffer,
+                        const hk::DescriptorSet &descriptorSet) {
+    const auto bindStage = [&](uint32_t stage, uint32_t queue,
+                               uint32_t depth) {
+      const WavefrontConstants constants = {depth, queue};
+      const auto &pipeline = wavefrontPipelines_[stage];
+      commandBuffer.bindPipeline(vk::PipelineBindPoint::eCompute,
+                                 pipeline.vkPipeline());
+      commandBuffer.bindDescriptorSets(
+          vk::PipelineBindPoint::eCompute, pipeline.vkPipelineLayout(), 0, 1,
+          &descriptorSet.vkDescriptorSet(), 0, nullptr);
+      commandBuffer.pushConstants(pipeline.vkPipelineLayout(),
+                                  vk::ShaderStageFlagBits::eCompute, 0,
+                                  sizeof(constants), &constants);
+    };
+    const auto dispatchQueue = [&](uint32_t stage, uint32_t queue,
+                                   uint32_t depth) {
+      bindStage(stage, queue, depth);
+      commandBuffer.dispatchIndirect(wavefrontQueueBuffer_.vkBuffer(),
+                                     queue * sizeof(WavefrontQueue));
+    };
+    const auto resetQueues = [&](uint32_t firstQueue, uint32_t numQueues) {
+      const std::vector<WavefrontQueue> queues(numQueues);
+      computeBarrier_(commandBuffer);
+      commandBuffer.updateBuffer(wavefrontQueueBuffer_.vkBuffer(),
+                                 firstQueue * sizeof(WavefrontQueue),
+                                 numQueues * sizeof(WavefrontQueue),
+                                 queues.data());
+      computeBarrier_(commandBuffer);
+    };
+    // Counting sort of the items of the queue by their keys, whose sorted
+    // items are copied back over the queue by a dispatch over the queue, so
+    // that only the queued items are copied.
+    const vk::DeviceSize sortBinsSize = NumWavefrontSortBins * sizeof(uint32_t);
+    const auto sortQueue = [&](uint32_t queue, uint32_t depth) {
+      computeBarrier_(commandBuffer);
+      commandBuffer.fillBuffer(wavefrontSortBuffer_.vkBuffer(), 0,
+                               sortBinsSize, 0);
+      computeBarrier_(commandBuffer);
+      dispatchQueue(SortKeysStage, queue, depth);
+      computeBarrier_(commandBuffer);
+      bindStage(SortScanStage, queue, depth);
+      commandBuffer.dispatch(1, 1, 1);
+      computeBarrier_(commandBuffer);
+      dispatchQueue(SortScatterStage, queue, depth);
+      computeBarrier_(commandBuffer);
+      dispatchQueue(SortCopyStage, queue, depth);
+      computeBarrier_(commandBuffer);
+    };
+    const uint32_t numPathGroups =
+        (numWavefrontPaths_() + WavefrontGroupSize - 1) / WavefrontGroupSize;
+
+    resetQueues(0, NumWavefrontQueues);
+    bindStage(GenerateStage, 0, 0);
+    commandBuffer.dispatch(numPathGroups, 1, 1);
+    for (uint32_t depth = 0; depth < CameraPathLength; ++depth) {
+      computeBarrier_(commandBuffer);
+      // The camera rays are already coherent, in pixel order.
+      if (FLAGS_wavefront_sort_rays && depth > 0) {
+        sortQueue(ExtensionQueue, depth);
+      }
+      dispatchQueue(ExtendStage, ExtensionQueue, depth);
+      resetQueues(ExtensionQueue, 1);
+      if (FLAGS_wavefront_sort_hits) {
+        for (const uint32_t queue : {MatteQueue, GlassQueue, MirrorQueue}) {
+          sortQueue(queue, depth);
+        }
+      }
+      dispatchQueue(ShadeMatteStage, MatteQueue, depth);
+      dispatchQueue(ShadeGlassStage, GlassQueue, depth);
+      dispatchQueue(ShadeMirrorStage, MirrorQueue, depth);
+      resetQueues(MatteQueue, 3);
+      if (FLAGS_wavefront_sort_rays) sortQueue(ShadowQueue, depth);
+      dispatchQueue(ShadowStage, ShadowQueue, depth);
+      resetQueues(ShadowQueue, 1);
+    }
+    bindStage(WriteStage, 0, 0);
+    commandBuffer.dispatch(numPathGroups, 1, 1);
+  }
+
+  /// Records the dispatch of the persistent threads that render a frame into
+  /// frameImage_, which must be in the general layout, after resetting the
+  /// counter they take the pixels from.
+  void recordPersistent_(const vk::CommandBuffer &commandBuffer,
+                         const hk::DescriptorSet &descriptorSet) {
+    computeBarrier_(commandBuffer);
+    commandBuffer.fillBuffer(persistentWorkBuffer_.vkBuffer(), 0,
+                             persistentWorkBuffer_.requestedSize(), 0);
+    computeBarrier_(commandBuffer);
+
+    const auto &pipeline = *persistentPipeline_;
+    commandBuffer.bindPipeline(vk::PipelineBindPoint::eCompute,
+                               pipeline.vkPipeline());
+    commandBuffer.bindDescriptorSets(
+        vk::PipelineBindPoint::eCompute, pipeline.vkPipelineLayout(), 0, 1,
+        &descriptorSet.vkDescriptorSet(), 0, nullptr);
+
+    // No more workgroups than there are pixels for.
+    const uint32_t numPixels = swapchain_.width() * swapchain_.height();
+    commandBuffer.dispatch(
+        std::min<uint32_t>(FLAGS_persistent_workgroups,
+                           (numPixels + PersistentGroupSize - 1) /
+                               PersistentGroupSize),
+        1, 1);
+  }
+
+  /// Records the dispatch that renders a frame into frameImage_, which must be
+  /// in the general layout, with the given pipeline and descriptor set.
+  void recordRender_(const vk::CommandBuffer &commandBuffer,
+                     const hk::Pipeline &pipeline,
+                     const hk::DescriptorSet &descriptorSet) {
+    commandBuffer.bindPipeline(vk::PipelineBindPoint::eCompute,
+                               pipeline.vkPipeline());
+
+    commandBuffer.bindDescriptorSets(
+        vk::PipelineBindPoint::eCompute, pipeline.vkPipelineLayout(), 0, 1,
+        &descriptorSet.vkDescriptorSet(), 0, nullptr);
+
+    commandBuffer.dispatch(ceil((float)swapchain_.width() / 32),
+                           ceil((float)swapchain_.height() / 32), 1);
+  }
+
+  /// Returns the average GPU time in milliseconds of rendering the given
+  /// number of frames back to back with the given recorder, measured with
+  /// timestamp queries.
+  double gpuFrameTime_(const FrameRecorder &recordFrame, int numFrames) {
+    const auto queryPool = device_.vkDevice().createQueryPoolUnique(
+        vk::QueryPoolCreateInfo()
+            .setQueryType(vk::QueryType::eTimestamp)
+            .setQueryCount(2));
+
+    device_.submitOneTimeComputeCommands(
+        [&](const vk::CommandBuffer &commandBuffer) {
+          commandBuffer.resetQueryPool(*queryPool, 0, 2);
+          frameImage_.layoutTransitionBarrier(
+              commandBuffer, vk::ImageLayout::eTransferSrcOptimal,
+              vk::ImageLayout::eGeneral, vk::AccessFlagBits::eTransferRead,
+              vk::AccessFlagBits::eShaderWrite,
+              vk::PipelineStageFlagBits::eTransfer,
+              vk::PipelineStageFlagBits::eComputeShader);
+
+          commandBuffer.writeTimestamp(vk::PipelineStageFlagBits::eTopOfPipe,
+                                       *queryPool, 0);
+          const vk::MemoryBarrier frameBarrier(
+              vk::AccessFlagBits::eShaderWrite,
+              vk::AccessFlagBits::eShaderRead |
+                  vk::AccessFlagBits::eShaderWrite);
+          for (int i = 0; i < numFrames; ++i) {
+            recordFrame(commandBuffer);
+            commandBuffer.pipelineBarrier(
+                vk::PipelineStageFlagBits::eComputeShader,
+                vk::PipelineStageFlagBits::eComputeShader, {}, 1,
+                &frameBarrier, 0, nullptr, 0, nullptr);
+          }
+          commandBuffer.writeTimestamp(
+              vk::PipelineStageFlagBits::eBottomOfPipe, *queryPool, 1);
+
+          frameImage_.layoutTransitionBarrier(
+              commandBuffer, vk::ImageLayout::eGeneral,
+              vk::ImageLayout::eTransferSrcOptimal,
+              vk::AccessFlagBits::eShaderWrite,
+              vk::AccessFlagBits::eTransferRead,
+              vk::PipelineStageFlagBits::eComputeShader,
+              vk::PipelineStageFlagBits::eTransfer);
+        });
+    device_.vkComputeQueue().waitIdle();
+
+    uint64_t timestamps[2];
+    device_.vkDevice().getQueryPoolResults(
+        *queryPool, 0, 2, sizeof(timestamps), timestamps,
+        sizeof(timestamps[0]),
+        vk::QueryResultFlagBits::e64 | vk::QueryResultFlagBits::eWait);
+    const double nanosecondsPerTick =
+        physicalDevice_.vkPhysicalDeviceProperties().limits.timestampPeriod;
+    return (timestamps[1] - timestamps[0]) * nanosecondsPerTick / 1e6 /
+           numFrames;
+  }
+
   /// Creates the command buffers used when rendering, one for each image in
   // the swapchain.
-  std::vector<vk::CommandBuffer> createSwapchainCommandBuffers_() {
+  std::vector<vk::CommandBuffer> createSwapchainCommandBuffers_(
+      const hk::DescriptorSet &descriptorSet) {
     std::vector<vk::CommandBuffer> commandBuffers =
         device_.allocateComputeCommandBuffers(swapchain_.numImages());
 
@@ -264,13 +926,6 @@ class Renderer {
 
       commandBuffer.begin({vk::CommandBufferUsageFlagBits::eSimultaneousUse});
 
-      commandBuffer.bindPipeline(vk::PipelineBindPoint::eCompute,
-                                 pipeline_.vkPipeline());
-
-      commandBuffer.bindDescriptorSets(
-          vk::PipelineBindPoint::eCompute, pipeline_.vkPipelineLayout(), 0, 1,
-          &frameDescriptorSet_.vkDescriptorSet(), 0, nullptr);
-
       frameImage_.layoutTransitionBarrier(
           commandBuffer, vk::ImageLayout::eTransferSrcOptimal,
           vk::ImageLayout::eGeneral, vk::AccessFlagBits::eTransferRead,
@@ -278,8 +933,7 @@ class Renderer {
           vk::PipelineStageFlagBits::eTransfer,
           vk::PipelineStageFlagBits::eComputeShader);
 
-      commandBuffer.dispatch(ceil((float)swapchain_.width() / 32),
-                             ceil((float)swapchain_.height() / 32), 1);
+      recordFrame_(commandBuffer, descriptorSet);
 
       frameImage_.layoutTransitionBarrier(
           commandBuffer, vk::ImageLayout::eGeneral,
@@ -311,15 +965,16 @@ class Renderer {
     return commandBuffers;
   }
 
-  std::vector<vk::SubmitInfo> createSwapchainSubmitInfos_() {
-    std::vector<vk::SubmitInfo> submitInfos(swapchain_.numImages());
-    for (uint32_t i = 0; i < swapchain_.numImages(); ++i) {
+  std::vector<vk::SubmitInfo> createSwapchainSubmitInfos_(
+      const std::vector<vk::CommandBuffer> &commandBuffers) {
+    std::vector<vk::SubmitInfo> submitInfos(commandBuffers.size());
+    for (uint32_t i = 0; i < commandBuffers.size(); ++i) {
       submitInfos[i]
           .setWaitSemaphoreCount(1)
           .setPWaitSemaphores(&*imageAvailableSemaphore_)
           .setPWaitDstStageMask(&swapchainWaitStage_)
           .setCommandBufferCount(1)
-          .setPCommandBuffers(&swapchainCommandBuffers_[i])
+          .setPCommandBuffers(&commandBuffers[i])
           .setSignalSemaphoreCount(1)
           .setPSignalSemaphores(&*renderFinishedSemaphore_);
     }
@@ -376,8 +1031,10 @@ class Renderer {
   }
 
   hk::Buffer createStorageBuffer_(vk::DeviceSize size) {
+    // Transfer source so that the GPU BVH can be read back for validation.
     return hk::Buffer(device_, std::max(size, 4ul),  // At least 4 bytes.
                       vk::BufferUsageFlagBits::eStorageBuffer |
+                          vk::BufferUsageFlagBits::eTransferSrc |
                           vk::BufferUsageFlagBits::eTransferDst);
   }
 
@@ -414,7 +1071,10 @@ class Renderer {
         device_, vk::MemoryPropertyFlagBits::eDeviceLocal,
         {uboBuffer_, bvhNodeBuffer_, bvhTriangleBuffer_, areaLightBuffer_,
          spotLightBuffer_, meshBuffer_, materialBuffer_, indexBuffer_,
-         vertexBuffer_, normalBuffer_, uvBuffer_});
+         vertexBuffer_, normalBuffer_, uvBuffer_, bvhInstanceBuffer_,
+         sphereBuffer_, refinedBVHNodeBuffer_, refinedBVHTriangleBuffer_,
+         wavefrontQueueBuffer_, wavefrontQueueItemBuffer_,
+         wavefrontPathBuffer_, wavefrontSortBuffer_, persistentWorkBuffer_});
   }
 
   hk::SharedDeviceMemory createStagingBufferMemory_() {
@@ -425,8 +1085,10 @@ class Renderer {
                               {uboStagingBuffer_});
   }
 
-  /// Creates a descriptor set for when the swapchain is not acquired.
-  hk::DescriptorSet createFrameDescriptorSet_() {
+  /// Creates a descriptor set for when the swapchain is not acquired, that
+  /// renders with the given BVH buffers.
+  hk::DescriptorSet createFrameDescriptorSet_(
+      const hk::Buffer &bvhNodeBuffer, const hk::Buffer &bvhTriangleBuffer) {
     return hk::DescriptorSet(
         descriptorPool_,
         {
@@ -436,10 +1098,10 @@ class Renderer {
                                     vk::ImageLayout::eGeneral),
             vk::DescriptorBufferInfo(uboBuffer_.vkBuffer(), 0,
                                      uboBuffer_.requestedSize()),
-            vk::DescriptorBufferInfo(bvhNodeBuffer_.vkBuffer(), 0,
-                                     bvhNodeBuffer_.requestedSize()),
-            vk::DescriptorBufferInfo(bvhTriangleBuffer_.vkBuffer(), 0,
-                                     bvhTriangleBuffer_.requestedSize()),
+            vk::DescriptorBufferInfo(bvhNodeBuffer.vkBuffer(), 0,
+                                     bvhNodeBuffer.requestedSize()),
+            vk::DescriptorBufferInfo(bvhTriangleBuffer.vkBuffer(), 0,
+                                     bvhTriangleBuffer.requestedSize()),
             vk::DescriptorBufferInfo(areaLightBuffer_.vkBuffer(), 0,
                                      areaLightBuffer_.requestedSize()),
             vk::DescriptorBufferInfo(spotLightBuffer_.vkBuffer(), 0,
@@ -456,14 +1118,32 @@ class Renderer {
                                      normalBuffer_.requestedSize()),
             vk::DescriptorBufferInfo(uvBuffer_.vkBuffer(), 0,
                                      uvBuffer_.requestedSize()),
+            vk::DescriptorBufferInfo(bvhInstanceBuffer_.vkBuffer(), 0,
+                                     bvhInstanceBuffer_.requestedSize()),
+            vk::DescriptorBufferInfo(sphereBuffer_.vkBuffer(), 0,
+                                     sphereBuffer_.requestedSize()),
+            vk::DescriptorBufferInfo(wavefrontQueueBuffer_.vkBuffer(), 0,
+                                     wavefrontQueueBuffer_.requestedSize()),
+            vk::DescriptorBufferInfo(wavefrontQueueItemBuffer_.vkBuffer(), 0,
+                                     wavefrontQueueItemBuffer_.requestedSize()),
+            vk::DescriptorBufferInfo(wavefrontPathBuffer_.vkBuffer(), 0,
+                                     wavefrontPathBuffer_.requestedSize()),
+            vk::DescriptorBufferInfo(wavefrontSortBuffer_.vkBuffer(), 0,
+                                     wavefrontSortBuffer_.requestedSize()),
+            vk::DescriptorBufferInfo(persistentWorkBuffer_.vkBuffer(), 0,
+                                     persistentWorkBuffer_.requestedSize()),
         });
   }
 
   void logSceneStats_() {
-    LOG(INFO) << "bvhNodes_.size(): " << bvhData_.nodes.size() << " ("
+    // Use the buffer sizes, as bvhData_ is empty if the BVH is built on the
+    // GPU.
+    LOG(INFO) << "bvhNodes_.size(): "
+              << bvhNodeBuffer_.requestedSize() / bvhNodeSize_() << " ("
               << bvhNodeBuffer_.requestedSize() << " bytes)";
-    LOG(INFO) << "bvhTriangles_.size(): " << bvhData_.triangles.size() << " ("
-              << bvhTriangleBuffer_.requestedSize() << " bytes)";
+    LOG(INFO) << "bvhTriangles_.size(): "
+              << bvhTriangleBuffer_.requestedSize() / bvhTriangleSize_()
+              << " (" << bvhTriangleBuffer_.requestedSize() << " bytes)";
     LOG(INFO) << "areaLights()->size(): " << scene_->areaLights()->size()
               << " (" << areaLightBuffer_.requestedSize() << " bytes)";
     LOG(INFO) << "spotLights()->size(): " << scene_->spotLights()->size()
@@ -480,6 +1160,693 @@ class Renderer {
               << normalBuffer_.requestedSize() << " bytes)";
     LOG(INFO) << "uvs()->size(): " << scene_->uvs()->size() << " ("
               << uvBuffer_.requestedSize() << " bytes)";
+    LOG(INFO) << "spheres()->size(): " << hk::numSpheres(scene_) << " ("
+              << sphereBuffer_.requestedSize() << " bytes)";
+    if (rendersWavefront_()) {
+      LOG(INFO) << "wavefrontPaths: " << numWavefrontPaths_() << " ("
+                << wavefrontPathBuffer_.requestedSize() +
+                       wavefrontQueueItemBuffer_.requestedSize()
+                << " bytes)";
+    }
+    if (!buildsBVHOnGPU_()) logBVHStats_();
+  }
+
+  /// Logs the size, depth and SAH cost of the BVH, and the memory used by its
+  /// nodes compared to a full precision binary BVH. Also logs how fast the CPU
+  /// traverses it if benchmark_bvh is set.
+  void logBVHStats_() {
+    if (usesTwoLevelBVH_()) {
+      LOG(INFO) << "bvhInstances_.size(): "
+                << twoLevelBVHData_.instances.size() << " ("
+                << bvhInstanceBuffer_.requestedSize() << " bytes)";
+      LOG(INFO) << "BVH nodes: " << twoLevelBVHData_.nodes.size() << " ("
+                << twoLevelBVHData_.numTopLevelNodes
+                << " top-level), top-level depth: "
+                << hk::bvhDepth(twoLevelBVHData_.nodes);
+      if (FLAGS_benchmark_bvh) benchmarkBVH_();
+      return;
+    }
+
+    LOG(INFO) << "BVH nodes: " << bvhData_.nodes.size()
+              << ", depth: " << hk::bvhDepth(bvhData_.nodes)
+              << ", SAH cost: "
+              << hk::computeSAHCost(bvhData_, bvhBuildOptions_());
+    if (bvhWidth_() == 4) {
+      LOG(INFO) << "BVH4 nodes: " << bvh4Data_.nodes.size()
+                << ", depth: " << hk::bvhDepth(bvh4Data_.nodes);
+    }
+    const size_t binarySize = bvhData_.nodes.size() * sizeof(hk::BVHNode);
+    LOG(INFO) << "BVH node memory: " << bvhNodeDataSize_() << " bytes, "
+              << 100.0 * bvhNodeDataSize_() / binarySize
+              << "% of the binary BVH (" << binarySize << " bytes)";
+    if (FLAGS_benchmark_bvh) benchmarkBVH_();
+  }
+
+  /// Logs how fast a single CPU thread traverses the BVH with random rays,
+  /// which compares BVH layouts without measuring the device.
+  void benchmarkBVH_() {
+    if (usesTwoLevelBVH_()) {
+      const auto rays = randomRays_(twoLevelBVHData_.nodes[0], 100000);
+      LOG(INFO) << "BVH CPU traversal speed: "
+                << traversalSpeed_(twoLevelBVHData_, rays)
+                << " Mrays/s (single thread)";
+      return;
+    }
+
+    const auto rays = randomRays_(bvhData_.nodes[0], 100000);
+    double mraysPerSecond;
+    if (quantizesBVH_()) {
+      mraysPerSecond = traversalSpeed_(quantizedBVH4Data_, rays);
+    } else if (bvhWidth_() == 4) {
+      mraysPerSecond = traversalSpeed_(bvh4Data_, rays);
+    } else {
+      mraysPerSecond = traversalSpeed_(bvhData_, rays);
+    }
+    LOG(INFO) << "BVH CPU traversal speed: " << mraysPerSecond
+              << " Mrays/s (single thread)";
+    if (quantizesBVH_() || bvhWidth_() != 2) return;
+
+    const double shortStackMraysPerSecond =
+        traversalSpeed_(rays, [&](const hk::Ray &ray, hk::BVHHit &hit) {
+          return hk::intersectBVHShortStack(scene_, bvhData_, ray, hit);
+        });
+    LOG(INFO) << "BVH CPU short stack traversal speed: "
+              << shortStackMraysPerSecond << " Mrays/s (single thread)";
+  }
+
+  /// Returns rays starting inside the given bounds, in random directions.
+  static std::vector<hk::Ray> randomRays_(const hk::BVHNode &root,
+                                          size_t numRays) {
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> distribution(0.0f, 1.0f);
+    std::vector<hk::Ray> rays(numRays);
+    for (auto &ray : rays) {
+      const glm::vec3 position(distribution(rng), distribution(rng),
+                               distribution(rng));
+      const glm::vec3 direction(distribution(rng), distribution(rng),
+                                distribution(rng));
+      ray = {root.minPoint + position * (root.maxPoint - root.minPoint),
+             direction * 2.0f - 1.0f};
+    }
+    return rays;
+  }
+
+  /// Returns how many millions of rays per second the CPU traverses through
+  /// the given BVH.
+  template <typename BVH>
+  double traversalSpeed_(const BVH &bvh, const std::vector<hk::Ray> &rays) {
+    return traversalSpeed_(rays, [&](const hk::Ray &ray, hk::BVHHit &hit) {
+      return hk::intersectBVH(scene_, bvh, ray, hit);
+    });
+  }
+
+  /// Returns how many millions of rays per second the CPU traverses with the
+  /// given intersect(ray, hit) function.
+  template <typename Intersect>
+  double traversalSpeed_(const std::vector<hk::Ray> &rays,
+                         const Intersect &intersect) {
+    const auto start = std::chrono::high_resolution_clock::now();
+    size_t numHits = 0;
+    for (const auto &ray : rays) {
+      hk::BVHHit hit;
+      numHits += intersect(ray, hit) ? 1 : 0;
+    }
+    const std::chrono::duration<double> elapsed =
+        std::chrono::high_resolution_clock::now() - start;
+    VLOG(1) << numHits << " of " << rays.size() << " rays hit the scene";
+    return rays.size() / elapsed.count() / 1e6;
+  }
+
+  /// Returns the BVH build options from the command line flags.
+  static hk::BVHBuildOptions bvhBuildOptions_() {
+    hk::BVHBuildOptions options;
+    const std::string method = FLAGS_bvh_build_method;
+    if (method == "sah") {
+      options.method = hk::BVHBuildMethod::SAH;
+    } else if (method == "lbvh") {
+      options.method = hk::BVHBuildMethod::LBVH;
+    } else if (method == "hlbvh") {
+      options.method = hk::BVHBuildMethod::HLBVH;
+    } else if (method == "sbvh") {
+      options.method = hk::BVHBuildMethod::SBVH;
+    } else {
+      LOG(FATAL) << "Invalid bvh_build_method flag.";
+    }
+    options.numThreads = std::max(FLAGS_bvh_build_threads, 0);
+    options.numBuckets = std::max(FLAGS_bvh_buckets, 2);
+    options.maxTrianglesInNode = std::max(FLAGS_bvh_max_triangles_in_node, 1);
+    options.intersectionCost = FLAGS_bvh_intersection_cost;
+    options.traversalCost = FLAGS_bvh_traversal_cost;
+    options.spatialSplitBudget = std::max(FLAGS_bvh_spatial_split_budget, 0.0);
+    options.treeletOptimizationPasses =
+        std::max(FLAGS_bvh_treelet_optimization_passes, 0);
+    const std::string layout = FLAGS_bvh_node_layout;
+    if (layout == "depth_first") {
+      options.nodeLayout = hk::BVHNodeLayout::DepthFirst;
+    } else if (layout == "clustered") {
+      options.nodeLayout = hk::BVHNodeLayout::Clustered;
+    } else {
+      LOG(FATAL) << "Invalid bvh_node_layout flag.";
+    }
+    options.pairTriangles = pairsTriangles_();
+    return options;
+  }
+
+  /// Returns the bvh_node_layout flag value of the layout.
+  static const char *nodeLayoutName_(hk::BVHNodeLayout layout) {
+    switch (layout) {
+      case hk::BVHNodeLayout::DepthFirst:
+        return "depth_first";
+      case hk::BVHNodeLayout::Clustered:
+        return "clustered";
+    }
+    return "unknown";
+  }
+
+  /// Returns if the BVH is built on the GPU instead of on the CPU.
+  static bool buildsBVHOnGPU_() { return !FLAGS_gpu_bvh_shader_file.empty(); }
+
+  /// Returns if the renderer tunes the BVH build options instead of
+  /// rendering.
+  static bool tunesBVH_() {
+    if (!FLAGS_tune_bvh_output_file.empty() && buildsBVHOnGPU_()) {
+      LOG(FATAL) << "Only BVHs built on the CPU can be tuned.";
+    }
+    return !FLAGS_tune_bvh_output_file.empty();
+  }
+
+  /// Returns if a quick LBVH is rendered while the BVH of the flags is built
+  /// in the background.
+  static bool refinesBVH_() {
+    if (FLAGS_progressive_bvh &&
+        (buildsBVHOnGPU_() || tunesBVH_() || !FLAGS_bvh_cache_file.empty())) {
+      LOG(FATAL) << "progressive_bvh requires a BVH built on the CPU, without "
+                    "tuning or the bvh_cache_file.";
+    }
+    return FLAGS_progressive_bvh;
+  }
+
+  /// Returns the BVH width from the command line flags.
+  static int bvhWidth_() {
+    if (FLAGS_bvh_width != 2 && FLAGS_bvh_width != 4) {
+      LOG(FATAL) << "Invalid bvh_width flag.";
+    }
+    if (FLAGS_bvh_width != 2 && buildsBVHOnGPU_()) {
+      LOG(FATAL) << "The GPU BVH builder only builds binary BVHs.";
+    }
+    return FLAGS_bvh_width;
+  }
+
+  /// Returns if the BVH nodes are quantized.
+  static bool quantizesBVH_() {
+    if (FLAGS_quantize_bvh && bvhWidth_() != 4) {
+      LOG(FATAL) << "quantize_bvh requires bvh_width 4.";
+    }
+    return FLAGS_quantize_bvh;
+  }
+
+  /// Returns if the scene is rendered with a two-level BVH, which is the case
+  /// if it has instances or if the mesh BVHs are cached.
+  bool usesTwoLevelBVH_() const {
+    if (!hk::hasInstances(scene_) && FLAGS_bvh_mesh_cache_dir.empty()) {
+      return false;
+    }
+    if (buildsBVHOnGPU_() || bvhWidth_() != 2 || tunesBVH_() ||
+        refinesBVH_() || !FLAGS_bvh_cache_file.empty()) {
+      LOG(FATAL) << "Two-level BVHs must be binary and built on the CPU, "
+                    "without tuning, progressive_bvh or the bvh_cache_file.";
+    }
+    return true;
+  }
+
+  /// Returns if the BVH pairs the triangles that share an edge.
+  static bool pairsTriangles_() {
+    if (FLAGS_bvh_pair_triangles && buildsBVHOnGPU_()) {
+      LOG(FATAL) << "bvh_pair_triangles requires a BVH built on the CPU.";
+    }
+    return FLAGS_bvh_pair_triangles;
+  }
+
+  /// Returns if the BVH triangles are uploaded as precomputed triangles.
+  static bool precomputesTriangles_() {
+    if (FLAGS_precompute_bvh_triangles &&
+        (buildsBVHOnGPU_() || pairsTriangles_())) {
+      LOG(FATAL) << "precompute_bvh_triangles requires a BVH built on the "
+                    "CPU, without bvh_pair_triangles.";
+    }
+    return FLAGS_precompute_bvh_triangles;
+  }
+
+  /// Returns if the scene has analytic spheres, which are only in the BVHs
+  /// built on the CPU over the whole scene.
+  bool hasSpheres_() const {
+    if (!hk::numSpheres(scene_)) return false;
+    if (buildsBVHOnGPU_() || usesTwoLevelBVH_() || precomputesTriangles_()) {
+      LOG(FATAL) << "Scenes with spheres require a BVH built on the CPU, "
+                    "without a two-level BVH or precompute_bvh_triangles.";
+    }
+    return true;
+  }
+
+  /// Returns if the frames are rendered with the wavefront path tracer, whose
+  /// shader only traverses single-level binary BVHs of unpaired triangles.
+  bool rendersWavefront_() const {
+    if (FLAGS_wavefront_shader_file.empty()) {
+      if (FLAGS_wavefront_sort_rays || FLAGS_wavefront_sort_hits) {
+        LOG(FATAL) << "wavefront_sort_rays and wavefront_sort_hits require "
+                      "the wavefront_shader_file.";
+      }
+      return false;
+    }
+    if (bvhWidth_() != 2 || usesTwoLevelBVH_() || pairsTriangles_() ||
+        precomputesTriangles_()) {
+      LOG(FATAL) << "wavefront_shader_file requires a single-level binary "
+                    "BVH, without bvh_pair_triangles or "
+                    "precompute_bvh_triangles.";
+    }
+    return true;
+  }
+
+  /// Returns if the frames are rendered with the persistent_shader_file,
+  /// whose main_persistent.comp shader only traverses single-level binary
+  /// BVHs of unpaired triangles.
+  bool rendersPersistent_() const {
+    if (FLAGS_persistent_shader_file.empty()) return false;
+    if (rendersWavefront_()) {
+      LOG(FATAL) << "persistent_shader_file can't be used with the "
+                    "wavefront_shader_file.";
+    }
+    if (bvhWidth_() != 2 || usesTwoLevelBVH_() || pairsTriangles_() ||
+        precomputesTriangles_()) {
+      LOG(FATAL) << "persistent_shader_file requires a single-level binary "
+                    "BVH, without bvh_pair_triangles or "
+                    "precompute_bvh_triangles.";
+    }
+    CHECK_GT(FLAGS_persistent_workgroups, 0)
+        << "persistent_workgroups must be positive.";
+    return true;
+  }
+
+  /// Returns the number of paths of the wavefront path tracer, one per pixel,
+  /// or 0 if it doesn't render the frames.
+  uint32_t numWavefrontPaths_() const {
+    if (!rendersWavefront_()) return 0;
+    return swapchain_.width() * swapchain_.height();
+  }
+
+  /// Creates the buffer of the wavefront queues, which is also read by their
+  /// indirect dispatches.
+  hk::Buffer createWavefrontQueueBuffer_() {
+    return hk::Buffer(device_, NumWavefrontQueues * sizeof(WavefrontQueue),
+                      vk::BufferUsageFlagBits::eStorageBuffer |
+                          vk::BufferUsageFlagBits::eIndirectBuffer |
+                          vk::BufferUsageFlagBits::eTransferDst);
+  }
+
+  /// Creates the buffer with the state of every wavefront path, each field
+  /// stored contiguously for all paths.
+  hk::Buffer createWavefrontPathBuffer_() {
+    const vk::DeviceSize size = vk::DeviceSize(NumWavefrontPathFields) *
+                                numWavefrontPaths_() * sizeof(glm::vec4);
+    CHECK_LE(size, physicalDevice_.vkPhysicalDeviceProperties()
+                       .limits.maxStorageBufferRange)
+        << "Too many pixels for the wavefront path buffer.";
+    return createStorageBuffer_(size);
+  }
+
+  /// Creates the buffer of the sort of the wavefront queues: the sort bins,
+  /// followed by the key of each item and by the sorted items.
+  hk::Buffer createWavefrontSortBuffer_() {
+    if (!rendersWavefront_()) return createStorageBuffer_(0);
+    return createStorageBuffer_(NumWavefrontSortBins * sizeof(uint32_t) +
+                                2 * numWavefrontPaths_() * sizeof(uint32_t));
+  }
+
+  /// Returns the size of the triangles in the triangle buffer.
+  static size_t bvhTriangleSize_() {
+    if (precomputesTriangles_()) return sizeof(hk::PrecomputedTriangle);
+    return sizeof(hk::BVHTriangle);
+  }
+
+  /// Returns the size of the BVH nodes in the node buffer.
+  static size_t bvhNodeSize_() {
+    if (quantizesBVH_()) return sizeof(hk::QuantizedBVH4Node);
+    if (bvhWidth_() == 4) return sizeof(hk::BVH4Node);
+    return sizeof(hk::BVHNode);
+  }
+
+  /// Builds the BVH on the CPU, or loads it from the BVH cache file, if any.
+  /// Returns an empty BVH if it is built on the GPU, and a quick LBVH if it
+  /// is refined in the background.
+  hk::BVHData buildCPUBVH_() const {
+    if (buildsBVHOnGPU_() || usesTwoLevelBVH_()) return hk::BVHData({}, {});
+
+    auto options = bvhBuildOptions_();
+    if (refinesBVH_()) {
+      options.method = hk::BVHBuildMethod::LBVH;
+      options.treeletOptimizationPasses = 0;
+      return hk::buildBVH(scene_, options);
+    }
+    if (FLAGS_bvh_cache_file.empty()) return hk::buildBVH(scene_, options);
+
+    hk::BVHData bvh({}, {});
+    if (hk::loadBVHCache(FLAGS_bvh_cache_file, scene_, options, bvh)) {
+      return bvh;
+    }
+    bvh = hk::buildBVH(scene_, options);
+    hk::saveBVHCache(FLAGS_bvh_cache_file, scene_, options, bvh);
+    return bvh;
+  }
+
+  /// Builds the two-level BVH, or returns an empty BVH if it isn't used.
+  hk::TwoLevelBVHData buildTwoLevelBVH_() const {
+    if (!usesTwoLevelBVH_()) return hk::TwoLevelBVHData();
+    return hk::buildTwoLevelBVH(scene_, bvhBuildOptions_(),
+                                FLAGS_bvh_mesh_cache_dir);
+  }
+
+  /// Collapses the CPU BVH into a 4-wide BVH, moving its triangles, or
+  /// returns an empty BVH if the BVH is binary.
+  hk::BVH4Data collapseBVH4_() {
+    if (bvhWidth_() != 4) return hk::BVH4Data({}, {});
+    return hk::collapseBVH4(std::move(bvhData_));
+  }
+
+  /// Quantizes the 4-wide BVH, moving its triangles, or returns an empty BVH
+  /// if the BVH isn't quantized.
+  hk::QuantizedBVH4Data quantizeBVH4_() {
+    if (!quantizesBVH_()) return hk::QuantizedBVH4Data({}, {});
+    return hk::quantizeBVH4(std::move(bvh4Data_));
+  }
+
+  /// Returns the BVH nodes uploaded to the node buffer.
+  const void *bvhNodeData_() const {
+    if (usesTwoLevelBVH_()) return twoLevelBVHData_.nodes.data();
+    if (quantizesBVH_()) return quantizedBVH4Data_.nodes.data();
+    if (bvhWidth_() == 4) return bvh4Data_.nodes.data();
+    return bvhData_.nodes.data();
+  }
+
+  /// Returns the BVH triangles uploaded to the triangle buffer. The wide
+  /// layouts own the triangles of the binary BVH they were built from.
+  const std::vector<hk::BVHTriangle> &bvhTriangles_() const {
+    if (usesTwoLevelBVH_()) return twoLevelBVHData_.triangles;
+    if (quantizesBVH_()) return quantizedBVH4Data_.triangles;
+    if (bvhWidth_() == 4) return bvh4Data_.triangles;
+    return bvhData_.triangles;
+  }
+
+  /// Returns the size in bytes of the BVH nodes uploaded to the node buffer.
+  vk::DeviceSize bvhNodeDataSize_() const {
+    if (usesTwoLevelBVH_()) {
+      return twoLevelBVHData_.nodes.size() * sizeof(hk::BVHNode);
+    }
+    if (quantizesBVH_()) {
+      return quantizedBVH4Data_.nodes.size() * sizeof(hk::QuantizedBVH4Node);
+    }
+    if (bvhWidth_() == 4) return bvh4Data_.nodes.size() * sizeof(hk::BVH4Node);
+    return bvhData_.nodes.size() * sizeof(hk::BVHNode);
+  }
+
+  /// Returns the maximum number of triangles of the BVHs built on the CPU
+  /// after the BVH buffers are created, while tuning or refining the BVH,
+  /// counting the ones duplicated by spatial splits. Spheres are counted as
+  /// triangles, and the SBVH doesn't split them.
+  size_t maxRebuiltBVHTriangles_() const {
+    const size_t numTriangles =
+        hk::GPUBVHBuilder::numTriangles(scene_) + hk::numSpheres(scene_);
+    const auto options = bvhBuildOptions_();
+    if (options.method != hk::BVHBuildMethod::SBVH) return numTriangles;
+    return numTriangles + size_t(options.spatialSplitBudget * numTriangles);
+  }
+
+  hk::Buffer createBVHNodeBuffer_() {
+    if (buildsBVHOnGPU_()) {
+      return createStorageBuffer_(hk::GPUBVHBuilder::nodeBufferSize(scene_));
+    }
+    if (tunesBVH_()) {
+      // Big enough for the BVH of any of the tuned options.
+      return createStorageBuffer_((2 * maxRebuiltBVHTriangles_() - 1) *
+                                  bvhNodeSize_());
+    }
+    if (quantizesBVH_()) {
+      return createStorageBuffer_(quantizedBVH4Data_.nodes);
+    }
+    if (bvhWidth_() == 4) return createStorageBuffer_(bvh4Data_.nodes);
+    if (usesTwoLevelBVH_()) return createStorageBuffer_(twoLevelBVHData_.nodes);
+    return createStorageBuffer_(bvhData_.nodes);
+  }
+
+  hk::Buffer createBVHTriangleBuffer_() {
+    if (buildsBVHOnGPU_()) {
+      return createStorageBuffer_(
+          hk::GPUBVHBuilder::triangleBufferSize(scene_));
+    }
+    if (tunesBVH_()) {
+      return createStorageBuffer_(maxRebuiltBVHTriangles_() *
+                                  bvhTriangleSize_());
+    }
+    return createStorageBuffer_(bvhTriangles_().size() * bvhTriangleSize_());
+  }
+
+  /// Creates the node buffer of the refined BVH, which is big enough for the
+  /// BVH of the flags in any layout.
+  hk::Buffer createRefinedBVHNodeBuffer_() {
+    if (!refinesBVH_()) return createStorageBuffer_(0);
+    return createStorageBuffer_((2 * maxRebuiltBVHTriangles_() - 1) *
+                                bvhNodeSize_());
+  }
+
+  hk::Buffer createRefinedBVHTriangleBuffer_() {
+    if (!refinesBVH_()) return createStorageBuffer_(0);
+    return createStorageBuffer_(maxRebuiltBVHTriangles_() *
+                                bvhTriangleSize_());
+  }
+
+  /// Copies the given data to the start of a device local buffer.
+  void uploadToBuffer_(const hk::Buffer &buffer, const void *data,
+                       vk::DeviceSize size) {
+    CHECK_LE(size, buffer.requestedSize());
+    hk::Buffer stagingBuffer(device_, std::max(size, 4ul),  // At least 4 bytes.
+                             vk::BufferUsageFlagBits::eTransferSrc);
+    const auto memory =
+        hk::allocateMemory(device_,
+                           vk::MemoryPropertyFlagBits::eHostVisible |
+                               vk::MemoryPropertyFlagBits::eHostCoherent,
+                           {stagingBuffer});
+    stagingBuffer.mapMemory([&](void *mapped) { memcpy(mapped, data, size); });
+
+    device_.submitOneTimeComputeCommands(
+        [&](const vk::CommandBuffer &commandBuffer) {
+          stagingBuffer.copyTo(commandBuffer, buffer);
+        });
+    device_.vkComputeQueue().waitIdle();
+  }
+
+  /// Uploads the given BVH triangles to the triangle buffer, precomputing
+  /// them first if they are uploaded as precomputed triangles.
+  void uploadBVHTriangles_(const hk::Buffer &triangleBuffer,
+                           const std::vector<hk::BVHTriangle> &triangles) {
+    if (!precomputesTriangles_()) {
+      uploadToBuffer_(triangleBuffer, triangles.data(),
+                      triangles.size() * sizeof(hk::BVHTriangle));
+      return;
+    }
+
+    const auto precomputed = hk::precomputeTriangles(scene_, triangles);
+    uploadToBuffer_(triangleBuffer, precomputed.data(),
+                    precomputed.size() * sizeof(hk::PrecomputedTriangle));
+  }
+
+  /// Dies if the CPU BVH is deeper than the traversal stacks and the restart
+  /// trail of intersection.glsl support. The 4-wide traversal pushes up to 3
+  /// more nodes per level, so its BVHs are checked on the collapsed tree.
+  void checkBVHDepth_() const {
+    if (bvhWidth_() == 4) {
+      const int depth = hk::bvhDepth(bvh4Data_.nodes);
+      if (depth > hk::MaxBVH4Depth) {
+        LOG(FATAL) << "The 4-wide BVH has nodes at depth " << depth
+                   << ", but the traversal only supports up to "
+                   << hk::MaxBVH4Depth << ".";
+      }
+      return;
+    }
+
+    const std::vector<hk::BVHNode> &nodes =
+        usesTwoLevelBVH_() ? twoLevelBVHData_.nodes : bvhData_.nodes;
+    std::vector<uint32_t> roots = {0};
+    if (usesTwoLevelBVH_()) {
+      for (const auto &instance : twoLevelBVHData_.instances) {
+        roots.push_back(instance.rootNodeOffset);
+      }
+      std::sort(roots.begin(), roots.end());
+      roots.erase(std::unique(roots.begin(), roots.end()), roots.end());
+    }
+
+    for (uint32_t root : roots) {
+      const int depth = hk::bvhDepth(nodes, root);
+      if (depth > hk::MaxBVHDepth) {
+        LOG(FATAL) << "The BVH rooted at node " << root << " has leaves at "
+                   << "depth " << depth << ", but the traversal only supports "
+                   << "up to " << hk::MaxBVHDepth << ".";
+      }
+    }
+  }
+
+  /// Uploads the CPU BVH to the given node and triangle buffers, and the
+  /// instances of a two-level BVH to the instance buffer.
+  void uploadBVH_(const hk::Buffer &nodeBuffer,
+                  const hk::Buffer &triangleBuffer) {
+    checkBVHDepth_();
+    uploadToBuffer_(nodeBuffer, bvhNodeData_(), bvhNodeDataSize_());
+    uploadBVHTriangles_(triangleBuffer, bvhTriangles_());
+    if (usesTwoLevelBVH_()) {
+      uploadToBuffer_(bvhInstanceBuffer_, twoLevelBVHData_.instances.data(),
+                      twoLevelBVHData_.instances.size() *
+                          sizeof(hk::BVHInstance));
+    }
+  }
+
+  /// Rebuilds the CPU BVH with the given options and uploads it.
+  void rebuildBVH_(const hk::BVHBuildOptions &options) {
+    bvhData_ = hk::buildBVH(scene_, options);
+    bvh4Data_ = collapseBVH4_();
+    quantizedBVH4Data_ = quantizeBVH4_();
+    uploadBVH_(bvhNodeBuffer_, bvhTriangleBuffer_);
+  }
+
+  /// Starts building the BVH of the flags in the background, in the layout
+  /// it is rendered with.
+  void startBVHRefinement_() {
+    refinementStartTime_ = std::chrono::steady_clock::now();
+    refinedBVH_ = std::async(std::launch::async, [this] {
+      RefinedBVH refined = {hk::buildBVH(scene_, bvhBuildOptions_()),
+                            hk::BVH4Data({}, {}),
+                            hk::QuantizedBVH4Data({}, {})};
+      if (bvhWidth_() == 4) {
+        refined.bvh4 = hk::collapseBVH4(std::move(refined.bvh));
+      }
+      if (quantizesBVH_()) {
+        refined.quantizedBVH4 = hk::quantizeBVH4(std::move(refined.bvh4));
+      }
+      return refined;
+    });
+  }
+
+  /**
+   * If the background build finished, uploads the refined BVH to its own
+   * buffers and renders the next frames with them. The frames accumulated
+   * with the quick BVH are kept, as both BVHs have the same geometry.
+   */
+  void swapToRefinedBVHIfBuilt_() {
+    if (refinedBVH_.wait_for(std::chrono::seconds(0)) !=
+        std::future_status::ready) {
+      return;
+    }
+
+    RefinedBVH refined = refinedBVH_.get();
+    bvhData_ = std::move(refined.bvh);
+    bvh4Data_ = std::move(refined.bvh4);
+    quantizedBVH4Data_ = std::move(refined.quantizedBVH4);
+    uploadBVH_(refinedBVHNodeBuffer_, refinedBVHTriangleBuffer_);
+    rendersRefinedBVH_ = true;
+
+    const std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - refinementStartTime_;
+    LOG(INFO) << "Swapped to the refined BVH with " << bvhData_.nodes.size()
+              << " nodes, built in " << elapsed.count() << "s";
+  }
+
+  /// Copies the contents of a device local buffer to the given memory.
+  void readBackBuffer_(const hk::Buffer &buffer, void *data,
+                       vk::DeviceSize size) {
+    hk::Buffer readBackBuffer(device_, buffer.requestedSize(),
+                              vk::BufferUsageFlagBits::eTransferDst);
+    const auto memory =
+        hk::allocateMemory(device_,
+                           vk::MemoryPropertyFlagBits::eHostVisible |
+                               vk::MemoryPropertyFlagBits::eHostCoherent,
+                           {readBackBuffer});
+
+    device_.submitOneTimeComputeCommands(
+        [&](const vk::CommandBuffer &commandBuffer) {
+          buffer.copyTo(commandBuffer, readBackBuffer);
+        });
+    device_.vkComputeQueue().waitIdle();
+
+    readBackBuffer.mapMemory([&](void *mapped) { memcpy(data, mapped, size); });
+  }
+
+  /// Validates the BVH built on the GPU by comparing the closest hits of
+  /// random rays with the ones of a BVH built on the CPU.
+  void validateGPUBVH_() {
+    const size_t numNodes = hk::GPUBVHBuilder::nodeBufferSize(scene_) /
+                            sizeof(hk::BVHNode);
+    const size_t numTriangles = hk::GPUBVHBuilder::numTriangles(scene_);
+    hk::BVHData gpuBVH(std::vector<hk::BVHNode>(numNodes),
+                       std::vector<hk::BVHTriangle>(numTriangles));
+    readBackBuffer_(bvhNodeBuffer_, gpuBVH.nodes.data(),
+                    numNodes * sizeof(hk::BVHNode));
+    readBackBuffer_(bvhTriangleBuffer_, gpuBVH.triangles.data(),
+                    numTriangles * sizeof(hk::BVHTriangle));
+    const hk::BVHData cpuBVH = hk::buildBVH(scene_, bvhBuildOptions_());
+
+    // The GPU may order float operations differently, so the hits are only
+    // compared up to a relative tolerance, and mismatches are only fatal if
+    // the flags ask for it.
+    const size_t numRays = 100000;
+    size_t numHits = 0, numMismatches = 0;
+    std::ostringstream firstMismatch;
+    for (const auto &ray : randomRays_(cpuBVH.nodes[0], numRays)) {
+      hk::BVHHit gpuHit, cpuHit;
+      const bool gpuFound = hk::intersectBVH(scene_, gpuBVH, ray, gpuHit);
+      const bool cpuFound = hk::intersectBVH(scene_, cpuBVH, ray, cpuHit);
+      numHits += cpuFound ? 1 : 0;
+      if (gpuFound == cpuFound &&
+          (!cpuFound || std::abs(gpuHit.t - cpuHit.t) <= 1e-4f * cpuHit.t)) {
+        continue;
+      }
+
+      if (numMismatches++ == 0) {
+        firstMismatch << "origin (" << ray.origin.x << ", " << ray.origin.y
+                      << ", " << ray.origin.z << "), direction ("
+                      << ray.direction.x << ", " << ray.direction.y << ", "
+                      << ray.direction.z << "): ";
+        firstMismatch << "GPU t = " << (gpuFound ? gpuHit.t : -1.0f)
+                      << ", CPU t = " << (cpuFound ? cpuHit.t : -1.0f);
+      }
+    }
+
+    if (numMismatches) {
+      LOG_IF(FATAL, FLAGS_fail_gpu_bvh_validation)
+          << "GPU BVH validation failed: " << numMismatches << " of "
+          << numRays << " rays have different closest hits. First one: "
+          << firstMismatch.str();
+      LOG(WARNING) << numMismatches << " of " << numRays
+                   << " rays have different closest hits in the GPU BVH "
+                      "than in the CPU one. First one: "
+                   << firstMismatch.str();
+      return;
+    }
+    LOG(INFO) << "GPU BVH matches the CPU one for " << numRays << " rays ("
+              << numHits << " hits)";
+  }
+
+  /// Builds the BVH on the GPU, from the scene buffers.
+  void buildGPUBVH_() {
+    const hk::GPUBVHBuilder builder(device_, FLAGS_gpu_bvh_shader_file);
+
+    const auto start = std::chrono::high_resolution_clock::now();
+    builder.build(scene_, meshBuffer_, indexBuffer_, vertexBuffer_,
+                  bvhNodeBuffer_, bvhTriangleBuffer_);
+    const std::chrono::duration<double> elapsed =
+        std::chrono::high_resolution_clock::now() - start;
+    LOG(INFO) << "GPU BVH build time: " << elapsed.count() << "s";
+
+    if (FLAGS_fail_gpu_bvh_validation && !FLAGS_validate_gpu_bvh) {
+      LOG(FATAL) << "fail_gpu_bvh_validation requires validate_gpu_bvh.";
+    }
+    if (FLAGS_validate_gpu_bvh) validateGPUBVH_();
   }
 
   /// Sets up a buffer with the given data accessor.
@@ -507,10 +1874,7 @@ class Renderer {
     hk::oneTimeSetup(seedImage_, [this](const hk::Buffer &stagingBuffer) {
       initializeSeeds_(stagingBuffer);
     });
-    setupBuffer_(bvhNodeBuffer_,
-                 [&]() { return (void *)bvhData_.nodes.data(); });
-    setupBuffer_(bvhTriangleBuffer_,
-                 [&]() { return (void *)bvhData_.triangles.data(); });
+    if (!buildsBVHOnGPU_()) uploadBVH_(bvhNodeBuffer_, bvhTriangleBuffer_);
     if (scene_->areaLights()->size() > 0) {
       setupBuffer_(areaLightBuffer_,
                    [&]() { return (void *)scene_->areaLights()->Data(); });
@@ -534,6 +1898,13 @@ class Renderer {
     if (scene_->uvs()->size() > 0) {
       setupBuffer_(uvBuffer_, [&]() { return (void *)scene_->uvs()->Data(); });
     }
+    if (hasSpheres_()) {
+      setupBuffer_(sphereBuffer_,
+                   [&]() { return (void *)scene_->spheres()->Data(); });
+    }
+
+    // The GPU builder reads the meshes, indices and vertices set up above.
+    if (buildsBVHOnGPU_()) buildGPUBVH_();
   }
 
   /// Initializes the frames used in rendering.
@@ -607,7 +1978,10 @@ class Renderer {
 
   const std::vector<uint8_t> sceneBuffer_;
   const hk::scene::Scene *scene_;
-  hk::BVHData bvhData_ = hk::buildBVH(scene_);
+  hk::BVHData bvhData_ = buildCPUBVH_();
+  hk::BVH4Data bvh4Data_ = collapseBVH4_();
+  hk::QuantizedBVH4Data quantizedBVH4Data_ = quantizeBVH4_();
+  hk::TwoLevelBVHData twoLevelBVHData_ = buildTwoLevelBVH_();
 
   hk::SurfaceProvider surfaceProvider_;
   hk::Instance instance_;
@@ -620,8 +1994,11 @@ class Renderer {
 
   hk::DescriptorSetLayout descriptorSetLayout_ = createDescriptorSetLayout_();
   hk::Pipeline pipeline_;
+  std::vector<hk::Pipeline> wavefrontPipelines_ = createWavefrontPipelines_();
+  std::unique_ptr<hk::Pipeline> persistentPipeline_ =
+      createPersistentPipeline_();
   hk::DescriptorPool descriptorPool_ =
-      hk::DescriptorPool(descriptorSetLayout_, 1);
+      hk::DescriptorPool(descriptorSetLayout_, 2);
 
   hk::Image frameImage_ = createFrameImage_();
   hk::Image seedImage_ = createSeedImage_();
@@ -629,8 +2006,8 @@ class Renderer {
   UniformBufferObject ubo_;
   hk::Buffer uboBuffer_ = createUniformBuffer_(sizeof(ubo_));
   hk::Buffer uboStagingBuffer_ = createStagingBuffer_(uboBuffer_);
-  hk::Buffer bvhNodeBuffer_ = createStorageBuffer_(bvhData_.nodes);
-  hk::Buffer bvhTriangleBuffer_ = createStorageBuffer_(bvhData_.triangles);
+  hk::Buffer bvhNodeBuffer_ = createBVHNodeBuffer_();
+  hk::Buffer bvhTriangleBuffer_ = createBVHTriangleBuffer_();
   hk::Buffer areaLightBuffer_ = createStorageBuffer_(scene_->areaLights());
   hk::Buffer spotLightBuffer_ = createStorageBuffer_(scene_->spotLights());
   hk::Buffer meshBuffer_ = createStorageBuffer_(scene_->meshes());
@@ -639,6 +2016,19 @@ class Renderer {
   hk::Buffer vertexBuffer_ = createStorageBuffer_(scene_->vertices());
   hk::Buffer normalBuffer_ = createStorageBuffer_(scene_->normals());
   hk::Buffer uvBuffer_ = createStorageBuffer_(scene_->uvs());
+  hk::Buffer bvhInstanceBuffer_ =
+      createStorageBuffer_(twoLevelBVHData_.instances);
+  hk::Buffer sphereBuffer_ = createStorageBuffer_(
+      hasSpheres_() ? scene_->spheres()->size() * sizeof(hk::scene::Sphere)
+                    : 0);
+  hk::Buffer refinedBVHNodeBuffer_ = createRefinedBVHNodeBuffer_();
+  hk::Buffer refinedBVHTriangleBuffer_ = createRefinedBVHTriangleBuffer_();
+  hk::Buffer wavefrontQueueBuffer_ = createWavefrontQueueBuffer_();
+  hk::Buffer wavefrontQueueItemBuffer_ = createStorageBuffer_(
+      NumWavefrontQueues * numWavefrontPaths_() * sizeof(uint32_t));
+  hk::Buffer wavefrontPathBuffer_ = createWavefrontPathBuffer_();
+  hk::Buffer wavefrontSortBuffer_ = createWavefrontSortBuffer_();
+  hk::Buffer persistentWorkBuffer_ = createStorageBuffer_(sizeof(uint32_t));
 
   hk::SharedDeviceMemory localImageMemory_ = createLocalImageMemory_();
   hk::SharedDeviceMemory localBufferMemory_ = createLocalBufferMemory_();
@@ -647,14 +2037,26 @@ class Renderer {
   vk::UniqueImageView frameImageView_ = frameImage_.createImageView();
   vk::UniqueImageView seedImageView_ = seedImage_.createImageView();
 
-  hk::DescriptorSet frameDescriptorSet_ = createFrameDescriptorSet_();
+  hk::DescriptorSet frameDescriptorSet_ =
+      createFrameDescriptorSet_(bvhNodeBuffer_, bvhTriangleBuffer_);
+  hk::DescriptorSet refinedFrameDescriptorSet_ = createFrameDescriptorSet_(
+      refinedBVHNodeBuffer_, refinedBVHTriangleBuffer_);
   std::vector<vk::CommandBuffer> swapchainCommandBuffers_ =
-      createSwapchainCommandBuffers_();
+      createSwapchainCommandBuffers_(frameDescriptorSet_);
+  std::vector<vk::CommandBuffer> refinedSwapchainCommandBuffers_ =
+      refinesBVH_() ? createSwapchainCommandBuffers_(refinedFrameDescriptorSet_)
+                    : std::vector<vk::CommandBuffer>();
   std::vector<vk::SubmitInfo> swapchainSubmitInfos_ =
-      createSwapchainSubmitInfos_();
+      createSwapchainSubmitInfos_(swapchainCommandBuffers_);
+  std::vector<vk::SubmitInfo> refinedSwapchainSubmitInfos_ =
+      createSwapchainSubmitInfos_(refinedSwapchainCommandBuffers_);
   std::vector<bool> swapchainImageInitialized_ =
       std::vector<bool>(swapchainSubmitInfos_.size(), false);
 
+  std::future<RefinedBVH> refinedBVH_;
+  std::chrono::steady_clock::time_point refinementStartTime_;
+  bool rendersRefinedBVH_ = false;
+
   vk::UniqueSemaphore imageAvailableSemaphore_ = device_.createSemaphore();
   vk::UniqueSemaphore renderFinishedSemaphore_ = device_.createSemaphore();
 
@@ -691,6 +2093,21 @@ int main(int argc, char **argv) {
                     FLAGS_height, fullscreen, FLAGS_enable_validation_layers);
   LOG(INFO) << "Created renderer";
 
+  if (!FLAGS_tune_bvh_output_file.empty()) {
+    renderer.tuneBVH(FLAGS_tune_bvh_output_file);
+    return 0;
+  }
+
+  if (!FLAGS_benchmark_shader_files.empty()) {
+    std::vector<std::string> shaderFilenames;
+    std::istringstream files(FLAGS_benchmark_shader_files);
+    for (std::string file; std::getline(files, file, ',');) {
+      if (!file.empty()) shaderFilenames.push_back(file);
+    }
+    renderer.benchmarkShaders(shaderFilenames);
+    return 0;
+  }
+
   renderer.run();
   return 0;
 }
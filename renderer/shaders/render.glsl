@@ -0,0 +1,142 @@
+/*
+ * Copyright 2017 Renato Utsch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Entry point to the Herakles renderer, shared by the main shader binaries.
+ * Define HERAKLES_BVH4 or HERAKLES_QUANTIZED_BVH4 before including this file
+ * to traverse a 4-wide or a quantized 4-wide BVH, or HERAKLES_TWO_LEVEL_BVH to
+ * traverse the two-level BVH of an instanced scene. Define
+ * HERAKLES_PERSISTENT_THREADS to render with persistent threads instead of
+ * with an invocation per pixel.
+ */
+
+#ifndef RENDERER_SHADERS_RENDER_GLSL
+#define RENDERER_SHADERS_RENDER_GLSL
+
+#include "herakles/shaders/bdpt.glsl"
+#include "herakles/shaders/path_tracer.glsl"
+#include "herakles/shaders/random.glsl"
+#include "herakles/shaders/sampling.glsl"
+#include "herakles/shaders/scene.glsl"
+
+#ifdef HERAKLES_PERSISTENT_THREADS
+
+// The renderer dispatches a fixed number of these workgroups, which render
+// every pixel. Must match renderer.cpp.
+layout(local_size_x = 256) in;
+
+/// Index of the next pixel to render, reset to 0 before every frame.
+layout(std430, binding = 19) buffer PersistentWorkBuffer {
+  uint NextPixel;
+};
+
+/// Takes the next pixel to render, and starts its first path. Returns false if
+/// every pixel is taken.
+bool startNextPixel(out ivec2 pixelPos, out PathState path) {
+  const ivec2 size = imageSize(Image);
+  const uint pixel = atomicAdd(NextPixel, 1u);
+  if (pixel >= uint(size.x * size.y)) return false;
+
+  pixelPos = ivec2(pixel % size.x, pixel / size.x);
+  randInit(imageLoad(Seeds, pixelPos).xy);
+  path = startPath(sampleCameraRay(vec2(pixelPos), vec2(size)));
+  return true;
+}
+
+/**
+ * Path traces the pixels taken from the global counter until every pixel is
+ * rendered. Each loop iteration traces a single bounce, and an invocation
+ * whose path ends starts the next sample or pixel in the next iteration, so
+ * the invocations of a subgroup don't wait for its longest path to end.
+ */
+void main() {
+#ifdef HERAKLES_SHARED_BVH_NODES
+  loadSharedBVHNodes();
+#endif // HERAKLES_SHARED_BVH_NODES
+
+  ivec2 pixelPos;
+  PathState path;
+  if (!startNextPixel(pixelPos, path)) return;
+
+  const vec2 resolution = imageSize(Image);
+  vec3 color = vec3(0.0f);
+  int sampleIndex = 0;
+  while (true) {
+    if (pathTracingStep(path)) continue;
+
+    color += path.color;
+    if (++sampleIndex < NumSamples) {
+      path = startPath(sampleCameraRay(vec2(pixelPos), resolution));
+      continue;
+    }
+
+    // gamma correction.
+    color = pow(color / NumSamples, vec3(1.0f / 2.2f));
+    imageStore(Image, pixelPos, vec4(clamp(color, 0.0f, 1.0f), 1.0f));
+    imageStore(Seeds, pixelPos, uvec4(randState(), 0, 0));
+
+    if (!startNextPixel(pixelPos, path)) return;
+    color = vec3(0.0f);
+    sampleIndex = 0;
+  }
+}
+
+#else
+
+layout(local_size_x = 32, local_size_y = 32) in;
+
+void main() {
+#ifdef HERAKLES_SHARED_BVH_NODES
+  loadSharedBVHNodes();
+#endif // HERAKLES_SHARED_BVH_NODES
+
+  const ivec2 pixelPos = ivec2(gl_GlobalInvocationID.xy);
+  randInit(imageLoad(Seeds, pixelPos).xy);
+
+  const vec2 resolution = imageSize(Image);
+  const vec2 pixelIndex = vec2(gl_GlobalInvocationID.xy);
+
+  vec3 color = vec3(0.0f);
+  for (int i = 0; i < NumSamples; ++i) {
+    const Ray ray = sampleCameraRay(pixelIndex, resolution);
+    if (RenderingStrategy == PathTracingStrategy) {
+      color += pathTracingRadiance(ray);
+    } else if (RenderingStrategy == BDPTStrategy) {
+      color += bdptRadiance(ray);
+    } else {
+      color = vec3(rand(), rand(), rand());  // Just random sampling.
+    }
+  }
+
+  // gamma correction.
+  color = pow(color / NumSamples, vec3(1.0f / 2.2f));
+
+  // Adding old color.
+  if (FrameCount > 0) {
+    /* const vec3 oldColor = imageLoad(Image, pixelPos).xyz; */
+    /* color = (oldColor * FrameCount * NumSamples + color * NumSamples) / */
+    /*         (FrameCount * NumSamples + NumSamples); */
+    /* color = oldColor; */
+  }
+
+  color = clamp(color, 0.0f, 1.0f);
+  imageStore(Image, pixelPos, vec4(color, 1.0f));
+  imageStore(Seeds, pixelPos, uvec4(randState(), 0, 0));
+}
+
+#endif // HERAKLES_PERSISTENT_THREADS
+
+#endif // !RENDERER_SHADERS_RENDER_GLSL